@@ -12,6 +12,84 @@ printf '%s\n' "$HELP_OUT" | rg -q 'TED - Termux Editor' || {
   exit 1
 }
 
+LOAD_OUT="$(./bin/ted --load-stats Makefile 2>&1)"
+printf '%s\n' "$LOAD_OUT" | rg -q 'GB/s' || {
+  echo 'load-stats output check failed' >&2
+  exit 1
+}
+! rg -q 'printf\(' src/main.c || {
+  echo 'stats output should go through sp_io_writer' >&2
+  exit 1
+}
+rg -q 'scan_count_byte' src/scan.c src/buffer.c || {
+  echo 'vectorized newline scan check failed' >&2
+  exit 1
+}
+rg -q 'buffer_map_file|buffer_ensure_rows' src/buffer.c || {
+  echo 'mapped lazy loading check failed' >&2
+  exit 1
+}
+rg -q 'writev' src/save.c && rg -q 'fsync' src/save.c || {
+  echo 'atomic background save check failed' >&2
+  exit 1
+}
+rg -q 'line_table_t' src/ted.h && rg -q 'table_find' src/buffer.c && ! rg -q 'line_capacity' src/ted.h || {
+  echo 'blocked line table check failed' >&2
+  exit 1
+}
+rg -q 'buffer_offset_to_point' src/buffer.c src/ted.h && rg -q 'buffer_point_to_offset' src/buffer.c src/ted.h || {
+  echo 'offset index check failed' >&2
+  exit 1
+}
+OFFSET_OUT="$(./bin/ted --offset-check src/buffer.c vendor/tree-sitter-c/examples/*.c 2>&1)" || {
+  printf '%s\n' "$OFFSET_OUT" >&2
+  echo 'offset-check differential check failed' >&2
+  exit 1
+}
+rg -q 'undo_begin' src/undo.c src/editor.c && rg -q 'undo_limit' src/ted.h || {
+  echo 'undo transaction log check failed' >&2
+  exit 1
+}
+UNDO_OUT="$(./bin/ted --undo-check src/buffer.c 2>&1)" || {
+  printf '%s\n' "$UNDO_OUT" >&2
+  echo 'undo-check round-trip check failed' >&2
+  exit 1
+}
+rg -q 'search_find' src/search.c src/ted.h && rg -q 'scan_find_byte2' src/scan.c src/search.c || {
+  echo 'substring search engine check failed' >&2
+  exit 1
+}
+rg -q 'search_count_narrow' src/search.c && rg -q 'search_poll' src/editor.c || {
+  echo 'incremental match count check failed' >&2
+  exit 1
+}
+rg -q 'regex_compile' src/regex.c src/search.c && rg -q '"regex"' src/command.c || {
+  echo 'regex search check failed' >&2
+  exit 1
+}
+rg -q 'search_line_matches' src/search.c src/display.c && rg -q 'search_cache_drop' src/search.c && rg -q 'bg_normal' src/display.c || {
+  echo 'viewport match highlight check failed' >&2
+  exit 1
+}
+SEARCH_OUT="$(./bin/ted --search-stats Makefile 'CFLAGS|LDFLAGS' 2>&1)"
+printf '%s\n' "$SEARCH_OUT" | rg -q 'regex +[1-9][0-9]* matches' || {
+  echo 'search-stats output check failed' >&2
+  exit 1
+}
+regex_check() {
+  REGEX_OUT="$(./bin/ted --regex-check src/buffer.c "$1" "$2" 2>&1)" || {
+    printf '%s\n' "$REGEX_OUT" >&2
+    echo "regex-check differential check failed for $1" >&2
+    exit 1
+  }
+}
+regex_check '(\w+)\s*\(([^)]*)\)' '\2:\1'
+regex_check '(\w+?)(_\w*)?$' '\2\1'
+regex_check '(a|ab)(c|bcd)(d*)' '<\3\2\1>'
+regex_check '\b(\d+)(?:\.(\d+))?' '\2.\1'
+regex_check '(?:(e)|(\w))+' '[\1\2]'
+regex_check 'x*' '-'
+
 printf '[3/5] agent command availability (source check)\n'
 rg -q 'cmd_agent|\"agent\"' src/command.c || {
   echo 'agent command check failed' >&2
@@ -131,10 +209,108 @@ rg -q 'treesitter_highlight_buffer|ts_parser_parse_string|tree_sitter_c|ts_parse
   echo 'tree-sitter runtime integration check failed' >&2
   exit 1
 }
+rg -q 'ts_tree_edit' src/treesitter.c && rg -q 'ts_tree_get_changed_ranges' src/treesitter.c && rg -q 'treesitter_buffer_edit' src/buffer.c || {
+  echo 'incremental tree-sitter reparse check failed' >&2
+  exit 1
+}
+REPARSE_OUT="$(./bin/ted --reparse-check src/*.c src/*.h vendor/tree-sitter-c/examples/*.c 2>&1)" || {
+  printf '%s\n' "$REPARSE_OUT" >&2
+  echo 'reparse-check differential check failed' >&2
+  exit 1
+}
+rg -q 'TSInput' src/treesitter.c && ! rg -q 'ts_buffer_text' src/treesitter.c || {
+  echo 'zero-copy tree-sitter input check failed' >&2
+  exit 1
+}
+rg -q 'ts_parser_parse_with_options' src/treesitter.c && rg -q 'treesitter_poll' src/editor.c || {
+  echo 'background tree-sitter parse check failed' >&2
+  exit 1
+}
+rg -q 'ts_query_cursor_set_point_range' src/treesitter.c && rg -q 'capture_kinds' src/treesitter.c || {
+  echo 'tree-sitter highlight query check failed' >&2
+  exit 1
+}
+rg -q 'ts_language_symbol_name' src/treesitter.c || {
+  echo 'tree-sitter symbol table check failed' >&2
+  exit 1
+}
+rg -q 'ts_nav_locate' src/treesitter.c && rg -q '"tree expand"' src/command.c && rg -q '"tree shrink"' src/command.c || {
+  echo 'tree-sitter structural navigation check failed' >&2
+  exit 1
+}
+rg -q 'ts_outline_refresh' src/treesitter.c && rg -q '"outline"' src/command.c && rg -q '"sym"' src/command.c || {
+  echo 'tree-sitter outline check failed' >&2
+  exit 1
+}
+rg -q 'ts_grammar_find' src/treesitter.c && ! rg -q 'ts_parser_set_language\(G_ts' src/treesitter.c &&
+  rg -q 'treesitter_has_grammar' src/tags.c && ! rg -q 'sp_str_lit\("c"\)' src/treesitter.c || {
+  echo 'tree-sitter grammar registry check failed' >&2
+  exit 1
+}
+OUTLINE_OUT="$(./bin/ted --outline-stats src/buffer.c buffer_init 2>&1)"
+printf '%s\n' "$OUTLINE_OUT" | rg -q 'lookup: +function buffer_init:' || {
+  echo 'outline-stats output check failed' >&2
+  exit 1
+}
+# The outline runs on the language the editor detects for the file, with
+# no override in the stats path.
+HEADER_OUT="$(./bin/ted --outline-stats src/ted.h buffer_t 2>&1)"
+! rg -q '\.lang = ' src/main.c && printf '%s\n' "$HEADER_OUT" | rg -q 'lookup: +typedef buffer_t:' || {
+  echo 'tree-sitter language detection check failed' >&2
+  exit 1
+}
+rg -q 'pool_run' src/tags.c && rg -q 'tags_poll' src/editor.c && rg -q '"tag"' src/command.c || {
+  echo 'project tag index check failed' >&2
+  exit 1
+}
+TAGS_DIR="$(mktemp -d)"
+trap 'rm -rf "$TAGS_DIR"' EXIT
+cp src/buffer.c src/ted.h "$TAGS_DIR"/
+./bin/ted --tag-stats "$TAGS_DIR" buffer_init >/dev/null 2>&1
+TAG_OUT="$(./bin/ted --tag-stats "$TAGS_DIR" buffer_init 2>&1)"
+printf '%s\n' "$TAG_OUT" | rg -q '\(0 parsed' && printf '%s\n' "$TAG_OUT" | rg -q 'lookup: +function buffer_init buffer.c:' || {
+  printf '%s\n' "$TAG_OUT" >&2
+  echo 'tag-stats warm index check failed' >&2
+  exit 1
+}
+rg -q 'syntax_words_find' src/syntax.c || {
+  echo 'keyword hash table check failed' >&2
+  exit 1
+}
+rg -q 'syntax_lex_table' src/syntax.c || {
+  echo 'table-driven lexer check failed' >&2
+  exit 1
+}
+SYNTAX_OUT="$(./bin/ted --syntax-check vendor/tree-sitter-c/examples/*.c 2>&1)" || {
+  printf '%s\n' "$SYNTAX_OUT" >&2
+  echo 'syntax-check differential check failed' >&2
+  exit 1
+}
 rg -q 'in_string' src/syntax.c || {
   echo 'cross-line string state check failed' >&2
   exit 1
 }
+rg -q 'syntax_state_equal' src/syntax.c && rg -q 'hl_state' src/ted.h src/buffer.c || {
+  echo 'incremental rehighlight check failed' >&2
+  exit 1
+}
+RELEX_OUT="$(./bin/ted --relex-check src/buffer.c vendor/tree-sitter-c/examples/*.c README.md 2>&1)" || {
+  printf '%s\n' "$RELEX_OUT" >&2
+  echo 'relex-check differential check failed' >&2
+  exit 1
+}
+rg -q 'buffer_keep_highlight' src/buffer.c src/syntax.c src/treesitter.c && rg -q 'hl_lookahead' src/display.c || {
+  echo 'viewport-bounded highlight check failed' >&2
+  exit 1
+}
+rg -q 'buffer_set_highlight' src/buffer.c src/syntax.c src/treesitter.c && rg -q 'buffer_line_spans' src/display.c || {
+  echo 'run-length highlight storage check failed' >&2
+  exit 1
+}
+rg -q 'pool_run' src/pool.c src/syntax.c && rg -q 'syntax_poll' src/editor.c || {
+  echo 'background highlight pass check failed' >&2
+  exit 1
+}
 rg -q 'syntax_highlight_buffer' src/display.c || {
   echo 'display rehighlight path check failed' >&2
   exit 1
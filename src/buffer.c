@@ -3,150 +3,992 @@
  */
 
 #include "ted.h"
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define LINE_MIN_CAP 16
+// Lines per block of the line table. A full block splits in half, and
+// neighbours that fit in half a block together are merged.
+#define LINE_BLOCK_MAX 256u
+
+// Files at least this large are memory-mapped and indexed lazily.
+#define BUFFER_MAP_THRESHOLD (64ull << 20)
+// Bytes the background indexer counts between progress updates.
+#define BUFFER_INDEX_CHUNK (8u << 20)
+// Lines between checkpoints of the background index. A jump far into a
+// mapped file covers the lines it skips with one span per checkpoint.
+#define BUFFER_CHECKPOINT_LINES 4096u
+// Bytes the indexer counts at a time; only windows holding a checkpoint
+// or a \r are walked line by line.
+#define BUFFER_CHECKPOINT_WINDOW 4096u
+// Largest window handed to a single scan call.
+#define BUFFER_SCAN_WINDOW (1u << 30)
+// Smallest span arena, and the slack of dead runs tolerated before the
+// arena is compacted.
+#define BUFFER_HL_ARENA_MIN 1024u
+
+// Start of every BUFFER_CHECKPOINT_LINES-th line of a mapped file: the
+// i-th is line (i + 1) * BUFFER_CHECKPOINT_LINES.
+typedef struct {
+    u64 offset;
+    u64 crlf;  // \r\n line ends before it
+} buffer_checkpoint_t;
+
+// Read-only mapping of a large file. Lines before `next` are in the line
+// table, as views or as spans; the rest only exist in the mapping until
+// something scrolls, moves or searches past them.
+struct buffer_map_t {
+    const c8 *data;
+    u64 size;
+    u64 next;
+    u32 source_lines;
+
+    // Line of a span read last, so walks over one step a line at a time
+    u64 peek_source;
+    u32 peek_rel;
+    u64 peek_at;    // its first byte in the mapping
+    u64 peek_end;   // and the newline ending it
+    u64 peek_text;  // bytes of the span's lines before it
+
+    // Background line counter. Fields below lock are guarded by it.
+    sp_thread_t indexer;
+    sp_atomic_s32 cancel;
+    sp_mutex_t lock;
+    u64 indexed_bytes;
+    u64 indexed_lines;
+    u64 crlf;
+    buffer_checkpoint_t *checkpoints;
+    u32 checkpoint_count;
+    u32 checkpoint_cap;
+    bool indexed;
+};
 
 void buffer_init(buffer_t *buf) {
-    buf->lines = SP_NULLPTR;
+    buf->table = (line_table_t){0};
     buf->line_count = 0;
-    buf->line_capacity = 0;
+    buf->backing = (sp_str_t){0};
     buf->filename = sp_str_lit("");
     buf->modified = false;
     buf->lang = sp_str_lit("text");
+    buf->load_stats = (buffer_load_stats_t){0};
+    buf->map = SP_NULLPTR;
+    buf->version = 0;
+    buf->hl_from = 0;
+    buf->hl_lang = SP_NULLPTR;
+    buf->hl_lo = 0;
+    buf->hl_hi = 0;
+    buf->hl_spans = SP_NULLPTR;
+    buf->hl_used = 0;
+    buf->hl_cap = 0;
+    buf->ts_tree = SP_NULLPTR;
+    buf->ts_stale = false;
+    buf->ts_outline = SP_NULLPTR;
+}
+
+static void buffer_unmap(buffer_t *buf) {
+    buffer_map_t *map = buf->map;
+    if (!map) return;
+
+    sp_atomic_s32_set(&map->cancel, 1);
+    sp_thread_join(&map->indexer);
+    sp_mutex_destroy(&map->lock);
+    if (map->checkpoints) sp_free(map->checkpoints);
+    munmap((void *)map->data, map->size);
+    sp_free(map);
+    buf->map = SP_NULLPTR;
+}
+
+// Storage that an outstanding snapshot may still read. It is freed when
+// the snapshot is released instead of when the line lets go of it.
+static c8 **G_retired = SP_NULLPTR;
+static u32 G_retired_count = 0;
+static u32 G_retired_cap = 0;
+// Snapshots outstanding; a save and a background highlight may overlap
+static u32 G_snapshots = 0;
+
+static void line_free_storage(line_t *line) {
+    if (line->cap == 0) return;
+
+    if (line->shared) {
+        if (G_retired_count >= G_retired_cap) {
+            u32 new_cap = G_retired_cap == 0 ? 64 : G_retired_cap * 2;
+            c8 **grown = sp_realloc(G_retired, sizeof(c8 *) * new_cap);
+            if (!grown) return; // leak rather than free under a reader
+            G_retired = grown;
+            G_retired_cap = new_cap;
+        }
+        G_retired[G_retired_count++] = (c8 *)line->text.data;
+    } else {
+        sp_free((void *)line->text.data);
+    }
+    line->cap = 0;
+    line->shared = false;
+}
+
+static void line_release(line_t *line) {
+    line->highlighted = false;
+    line->hl_count = 0;
+    line_free_storage(line);
+    line->text = sp_str_lit("");
 }
 
 void buffer_free(buffer_t *buf) {
     if (!buf) return;
 
-    for (u32 i = 0; i < buf->line_count; i++) {
-        if (buf->lines[i].hl) {
-            sp_free(buf->lines[i].hl);
+    line_table_t *t = &buf->table;
+    for (u32 b = 0; b < t->block_count; b++) {
+        if (!t->blocks[b].lines) continue;
+        for (u32 i = 0; i < t->blocks[b].count; i++) {
+            line_release(&t->blocks[b].lines[i]);
         }
+        sp_free(t->blocks[b].lines);
     }
+    if (t->blocks) sp_free(t->blocks);
+    if (t->rows) sp_free(t->rows);
+    if (t->bytes) sp_free(t->bytes);
+    *t = (line_table_t){0};
 
-    if (buf->lines) {
-        sp_free(buf->lines);
+    // An empty file still has an allocation behind it
+    if (buf->backing.data) {
+        sp_free((void *)buf->backing.data);
     }
+    buffer_unmap(buf);
+    buf->hl_from = 0;
+    buf->hl_lang = SP_NULLPTR;
+    buf->hl_lo = 0;
+    buf->hl_hi = 0;
+    if (buf->hl_spans) sp_free(buf->hl_spans);
+    buf->hl_spans = SP_NULLPTR;
+    buf->hl_used = 0;
+    buf->hl_cap = 0;
+    treesitter_buffer_release(buf);
+    buf->line_count = 0;
+    buf->backing = (sp_str_t){0};
 }
 
-void buffer_insert_line(buffer_t *buf, u32 at, sp_str_t text) {
-    if (at > buf->line_count) {
-        at = buf->line_count;
+// Make sure the line owns at least `need` writable bytes. Lines that still
+// view the backing storage, or whose storage a snapshot is reading, are
+// copied out on their first edit.
+static bool line_reserve(line_t *line, u32 need) {
+    if (line->cap >= need && line->cap > 0 && !line->shared) return true;
+
+    u32 new_cap = line->cap > 0 ? line->cap * 2 : LINE_MIN_CAP;
+    if (new_cap < need) new_cap = need;
+    if (new_cap < line->text.len) new_cap = line->text.len;
+
+    c8 *mem = sp_alloc(new_cap);
+    if (!mem) return false;
+    if (line->text.len > 0) {
+        memcpy(mem, line->text.data, line->text.len);
     }
+    line_free_storage(line);
+    line->text.data = mem;
+    line->cap = new_cap;
+    return true;
+}
+
+static u32 table_lowbit(u32 i) {
+    return i & (~i + 1);
+}
 
-    // Ensure capacity using dynamic array
-    if (buf->line_count >= buf->line_capacity) {
-        u32 new_cap = buf->line_capacity == 0 ? 16 : buf->line_capacity * 2;
-        line_t *new_lines = sp_alloc(sizeof(line_t) * new_cap);
-        if (!new_lines) return;
+// Room for `need` blocks in the block array and in both trees.
+static bool table_grow(line_table_t *t, u32 need) {
+    if (need <= t->block_cap) return true;
 
-        for (u32 i = 0; i < buf->line_count; i++) {
-            new_lines[i] = buf->lines[i];
+    // sp_realloc takes a u32 byte count, which bounds the table size.
+    const u32 max_cap = UINT32_MAX / sizeof(line_block_t) - 1;
+    if (need > max_cap) return false;
+
+    u32 new_cap = t->block_cap == 0 ? 16 : t->block_cap;
+    while (new_cap < need) new_cap = new_cap > max_cap / 2 ? max_cap : new_cap * 2;
+
+    line_block_t *blocks = sp_realloc(t->blocks, sizeof(line_block_t) * new_cap);
+    if (!blocks) return false;
+    t->blocks = blocks;
+    u32 *rows = sp_realloc(t->rows, sizeof(u32) * (new_cap + 1));
+    if (!rows) return false;
+    t->rows = rows;
+    u64 *bytes = sp_realloc(t->bytes, sizeof(u64) * (new_cap + 1));
+    if (!bytes) return false;
+    t->bytes = bytes;
+    t->block_cap = new_cap;
+    return true;
+}
+
+// Rebuild both trees in one linear pass after blocks were inserted,
+// removed or merged.
+static void table_rebuild(line_table_t *t) {
+    u32 n = t->block_count;
+    for (u32 i = 1; i <= n; i++) {
+        t->rows[i] = t->blocks[i - 1].count;
+        t->bytes[i] = t->blocks[i - 1].bytes;
+    }
+    for (u32 i = 1; i <= n; i++) {
+        u32 parent = i + table_lowbit(i);
+        if (parent > n) continue;
+        t->rows[parent] += t->rows[i];
+        t->bytes[parent] += t->bytes[i];
+    }
+    t->hint = 0;
+    t->hint_row = 0;
+}
+
+// Block b gained `rows` lines and `bytes` bytes; negative counts shrink it.
+static void table_add(line_table_t *t, u32 b, s64 rows, s64 bytes) {
+    t->blocks[b].count = (u32)((s64)t->blocks[b].count + rows);
+    t->blocks[b].bytes = (u64)((s64)t->blocks[b].bytes + bytes);
+    for (u32 i = b + 1; i <= t->block_count; i += table_lowbit(i)) {
+        t->rows[i] = (u32)((s64)t->rows[i] + rows);
+        t->bytes[i] = (u64)((s64)t->bytes[i] + bytes);
+    }
+    if (b < t->hint) t->hint_row = (u32)((s64)t->hint_row + rows);
+}
+
+// Bytes in the blocks before block b
+static u64 table_bytes_before(line_table_t *t, u32 b) {
+    u64 sum = 0;
+    for (u32 i = b; i > 0; i -= table_lowbit(i)) {
+        sum += t->bytes[i];
+    }
+    return sum;
+}
+
+// Insert `count` empty blocks before block `at`. The trees are stale
+// until table_rebuild.
+static bool table_insert_blocks(line_table_t *t, u32 at, u32 count) {
+    if (count > UINT32_MAX - t->block_count || !table_grow(t, t->block_count + count)) return false;
+
+    line_block_t *blocks = t->blocks;
+    u32 tail = t->block_count - at;
+    memmove(blocks + at + count, blocks + at, sizeof(line_block_t) * tail);
+    for (u32 i = 0; i < count; i++) {
+        line_t *lines = sp_alloc(sizeof(line_t) * LINE_BLOCK_MAX);
+        if (!lines) {
+            while (i > 0) sp_free(blocks[at + --i].lines);
+            memmove(blocks + at, blocks + at + count, sizeof(line_block_t) * tail);
+            return false;
         }
+        blocks[at + i] = (line_block_t){ .lines = lines };
+    }
+    t->block_count += count;
+    return true;
+}
+
+// Append blk, keeping both trees exact.
+static bool table_push(line_table_t *t, line_block_t blk) {
+    if (t->block_count == UINT32_MAX || !table_grow(t, t->block_count + 1)) return false;
+
+    u32 i = ++t->block_count;
+    t->blocks[i - 1] = blk;
+    t->rows[i] = blk.count;
+    t->bytes[i] = blk.bytes;
+    for (u32 j = i - 1; j > i - table_lowbit(i); j -= table_lowbit(j)) {
+        t->rows[i] += t->rows[j];
+        t->bytes[i] += t->bytes[j];
+    }
+    return true;
+}
+
+// Append an empty block of lines.
+static bool table_append_block(line_table_t *t) {
+    line_t *lines = sp_alloc(sizeof(line_t) * LINE_BLOCK_MAX);
+    if (!lines) return false;
+    if (table_push(t, (line_block_t){ .lines = lines })) return true;
+    sp_free(lines);
+    return false;
+}
+
+static void table_remove_block(line_table_t *t, u32 b) {
+    if (t->blocks[b].lines) sp_free(t->blocks[b].lines);
+    memmove(t->blocks + b, t->blocks + b + 1, sizeof(line_block_t) * (t->block_count - b - 1));
+    t->block_count--;
+}
 
-        if (buf->lines) {
-            sp_free(buf->lines);
+// Move the lines of src from `from` on into the empty block dst.
+static void table_move(line_block_t *src, u32 from, line_block_t *dst) {
+    u64 bytes = 0;
+    for (u32 i = from; i < src->count; i++) {
+        bytes += (u64)src->lines[i].text.len + 1;
+    }
+    memcpy(dst->lines, src->lines + from, sizeof(line_t) * (src->count - from));
+    dst->count = src->count - from;
+    dst->bytes = bytes;
+    src->count = from;
+    src->bytes -= bytes;
+}
+
+// Whether blocks b and b + 1 hold lines that fit in half a block together
+static bool table_mergeable(line_table_t *t, u32 b) {
+    const line_block_t *blk = &t->blocks[b];
+    return blk[0].lines && blk[1].lines && blk[0].count + blk[1].count <= LINE_BLOCK_MAX / 2;
+}
+
+// Append block b + 1 to block b and drop it. The trees go stale.
+static void table_merge(line_table_t *t, u32 b) {
+    line_block_t *dst = &t->blocks[b];
+    line_block_t *src = dst + 1;
+    memcpy(dst->lines + dst->count, src->lines, sizeof(line_t) * src->count);
+    dst->count += src->count;
+    dst->bytes += src->bytes;
+    table_remove_block(t, b + 1);
+}
+
+// Block holding row, which must exist, and the row it starts at. Lookups
+// in the block of the previous one or the block after it skip the search.
+static u32 table_find(line_table_t *t, u32 row, u32 *first) {
+    u32 b = t->hint;
+    if (b < t->block_count && row >= t->hint_row) {
+        u32 rel = row - t->hint_row;
+        if (rel < t->blocks[b].count) {
+            *first = t->hint_row;
+            return b;
+        }
+        rel -= t->blocks[b].count;
+        if (b + 1 < t->block_count && rel < t->blocks[b + 1].count) {
+            t->hint = b + 1;
+            t->hint_row = row - rel;
+            *first = t->hint_row;
+            return b + 1;
         }
-        buf->lines = new_lines;
-        buf->line_capacity = new_cap;
     }
 
-    // Shift lines
-    for (u32 i = buf->line_count; i > at; i--) {
-        buf->lines[i] = buf->lines[i - 1];
+    u32 n = t->block_count;
+    u32 pos = 0;
+    u32 rem = row;
+    u32 step = 1;
+    while (step <= n / 2) step <<= 1;
+    for (; step > 0; step >>= 1) {
+        if (pos + step <= n && t->rows[pos + step] <= rem) {
+            pos += step;
+            rem -= t->rows[pos];
+        }
     }
+    t->hint = pos;
+    t->hint_row = row - rem;
+    *first = t->hint_row;
+    return pos;
+}
 
-    // Insert new line
-    buf->lines[at].text = text;
-    buf->lines[at].hl = SP_NULLPTR;
-    buf->lines[at].hl_dirty = true;
-    buf->line_count++;
-    buf->modified = true;
+// Offset of the newline ending the line that starts at `start` in data,
+// or len when it is the last line and has none.
+static u64 text_line_end(const c8 *data, u64 len, u64 start) {
+    u64 end = start;
+    for (;;) {
+        u64 remaining = len - end;
+        u32 window = remaining > BUFFER_SCAN_WINDOW ? BUFFER_SCAN_WINDOW : (u32)remaining;
+        u32 rel = scan_find_byte(data + end, window, '\n');
+        end += rel;
+        if (rel < window || end >= len) return end;
+    }
 }
 
-void buffer_delete_line(buffer_t *buf, u32 at) {
-    if (at >= buf->line_count) return;
+// Start of the line whose newline is at `end`, looking no further back
+// than floor.
+static u64 text_line_start(const c8 *data, u64 floor, u64 end) {
+    u64 at = end;
+    while (at > floor) {
+        u64 remaining = at - floor;
+        u32 window = remaining > BUFFER_SCAN_WINDOW ? BUFFER_SCAN_WINDOW : (u32)remaining;
+        u32 rel = scan_rfind_byte(data + at - window, window, '\n');
+        if (rel < window) return at - window + rel + 1;
+        at -= window;
+    }
+    return floor;
+}
 
-    if (buf->lines[at].hl) {
-        sp_free(buf->lines[at].hl);
+// Text of the line in [start, end) of data, without the \r of a \r\n.
+static sp_str_t text_line(const c8 *data, u64 len, u64 start, u64 end) {
+    u64 line_len = end - start;
+    // Handle Windows \r\n
+    if (end < len && line_len > 0 && data[end - 1] == '\r') {
+        line_len--;
     }
+    if (line_len > UINT32_MAX) line_len = UINT32_MAX;
+    return (sp_str_t){ .data = data + start, .len = (u32)line_len };
+}
 
-    for (u32 i = at; i < buf->line_count - 1; i++) {
-        buf->lines[i] = buf->lines[i + 1];
+// A fresh line viewing text, to be lexed before it is drawn
+static void line_init_view(line_t *line, sp_str_t text) {
+    line->text = text;
+    line->hl_at = 0;
+    line->hl_count = 0;
+    line->highlighted = false;
+    line->cap = 0;
+    line->shared = false;
+    line->hl_dirty = true;
+    line->hl_state = (syntax_line_state_t){0};
+}
+
+// row was marked hl_dirty; keep hl_from at or before it.
+static void buffer_hl_stale(buffer_t *buf, u32 row) {
+    if (row < buf->hl_from) buf->hl_from = row;
+}
+
+// Read span b, which starts at row first, into blocks of lines in its
+// place. A row that exists has to be readable, so running out of memory
+// here is fatal.
+static void table_fill(buffer_t *buf, u32 b, u32 first) {
+    line_table_t *t = &buf->table;
+    const buffer_map_t *map = buf->map;
+    line_block_t span = t->blocks[b];
+    if (!table_insert_blocks(t, b + 1, (span.count + LINE_BLOCK_MAX - 1) / LINE_BLOCK_MAX)) {
+        die("out of memory reading mapped lines");
     }
 
-    buf->line_count--;
-    buf->modified = true;
+    u64 at = span.source;
+    for (u32 i = 0; i < span.count; i++) {
+        line_block_t *blk = &t->blocks[b + 1 + i / LINE_BLOCK_MAX];
+        u64 end = text_line_end(map->data, map->size, at);
+        line_t *line = &blk->lines[blk->count++];
+        line_init_view(line, text_line(map->data, map->size, at, end));
+        blk->bytes += (u64)line->text.len + 1;
+        at = end + 1;
+    }
+    table_remove_block(t, b);
+    table_rebuild(t);
+    buffer_hl_stale(buf, first);
 }
 
-void buffer_insert_char_at(buffer_t *buf, u32 row, u32 col, c8 c) {
-    if (row >= buf->line_count) return;
+// table_find for a row that has to be in a block of lines: a span holding
+// it is read in first.
+static u32 table_find_line(buffer_t *buf, u32 row, u32 *first) {
+    u32 b = table_find(&buf->table, row, first);
+    if (buf->table.blocks[b].lines) return b;
+    table_fill(buf, b, *first);
+    return table_find(&buf->table, row, first);
+}
 
-    line_t *line = &buf->lines[row];
-    sp_str_t old_text = line->text;
+// Line rel of span blk, straight from the mapping. *before gets the bytes
+// of the span's lines before it. Walks start from the line read last when
+// that is nearer than the start of the span, in either direction.
+static sp_str_t table_peek(buffer_t *buf, const line_block_t *blk, u32 rel, u64 *before) {
+    buffer_map_t *map = buf->map;
+    if (map->peek_source != blk->source || (rel < map->peek_rel && map->peek_rel - rel > rel)) {
+        map->peek_source = blk->source;
+        map->peek_rel = 0;
+        map->peek_at = blk->source;
+        map->peek_end = text_line_end(map->data, map->size, blk->source);
+        map->peek_text = 0;
+    }
+    while (map->peek_rel < rel) {
+        map->peek_text += (u64)text_line(map->data, map->size, map->peek_at, map->peek_end).len + 1;
+        map->peek_at = map->peek_end + 1;
+        map->peek_end = text_line_end(map->data, map->size, map->peek_at);
+        map->peek_rel++;
+    }
+    while (map->peek_rel > rel) {
+        map->peek_end = map->peek_at - 1;
+        map->peek_at = text_line_start(map->data, blk->source, map->peek_end);
+        map->peek_text -= (u64)text_line(map->data, map->size, map->peek_at, map->peek_end).len + 1;
+        map->peek_rel--;
+    }
+    if (before) *before = map->peek_text;
+    return text_line(map->data, map->size, map->peek_at, map->peek_end);
+}
 
-    u32 len = old_text.len;
-    if (col > len) col = len;
+// Line at row, which must be below buf->line_count. The pointer stays
+// good until lines are inserted or removed.
+line_t *buffer_line(buffer_t *buf, u32 row) {
+    u32 first;
+    u32 b = table_find_line(buf, row, &first);
+    return &buf->table.blocks[b].lines[row - first];
+}
 
-    // Use dyn_mem writer for string building
-    sp_io_writer_t writer = sp_io_writer_from_dyn_mem();
-    sp_str_builder_t builder = sp_str_builder_from_writer(&writer);
+// Add delta bytes to row's share of the byte counts.
+static void table_resize(buffer_t *buf, u32 row, s64 delta) {
+    u32 first;
+    u32 b = table_find(&buf->table, row, &first);
+    table_add(&buf->table, b, 0, delta);
+}
+
+// Open a gap of `count` uninitialized lines at `at`. They count as rows
+// but hold no bytes until table_resize adds theirs. Only the rest of one
+// block moves; a full block is split in half first, and runs that do not
+// fit get whole blocks of their own. A span the gap falls in is read in.
+static bool table_open(buffer_t *buf, u32 at, u32 count) {
+    line_table_t *t = &buf->table;
+    if (count > UINT32_MAX - buf->line_count) return false;
 
-    // Append part before insertion point
-    if (col > 0) {
-        sp_str_t before = sp_str_sub(old_text, 0, (s32)col);
-        sp_str_builder_append(&builder, before);
+    u32 b = 0;
+    u32 off = 0;
+    u32 have = 0;
+    if (t->block_count > 0) {
+        u32 first;
+        b = t->block_count - 1;
+        if (at >= buf->line_count && !t->blocks[b].lines) {
+            table_fill(buf, b, buf->line_count - t->blocks[b].count);
+            b = t->block_count - 1;
+        }
+        off = t->blocks[b].count;
+        if (at < buf->line_count) {
+            b = table_find_line(buf, at, &first);
+            off = at - first;
+            // A gap at the start of a block can go at the end of the one before
+            if (off == 0 && b > 0 && t->blocks[b - 1].lines &&
+                t->blocks[b - 1].count + count <= LINE_BLOCK_MAX) {
+                b--;
+                off = t->blocks[b].count;
+            }
+        }
+        have = t->blocks[b].count;
+    }
+
+    if (have + count > LINE_BLOCK_MAX && (count > LINE_BLOCK_MAX / 2 || off == have)) {
+        u32 fill = (count + LINE_BLOCK_MAX - 1) / LINE_BLOCK_MAX;
+        u32 split = off > 0 && off < have ? 1 : 0;
+        u32 into = off > 0 ? b + 1 : b;
+        if (!table_insert_blocks(t, into, fill + split)) return false;
+        if (split) table_move(&t->blocks[b], off, &t->blocks[into + fill]);
+        u32 left = count;
+        for (u32 i = 0; i < fill; i++) {
+            t->blocks[into + i].count = left > LINE_BLOCK_MAX ? LINE_BLOCK_MAX : left;
+            left -= t->blocks[into + i].count;
+        }
+        table_rebuild(t);
+        buf->line_count += count;
+        return true;
+    }
+
+    if (t->block_count == 0 && !table_append_block(t)) return false;
+    if (have + count > LINE_BLOCK_MAX) {
+        if (!table_insert_blocks(t, b + 1, 1)) return false;
+        u32 half = have / 2;
+        table_move(&t->blocks[b], half, &t->blocks[b + 1]);
+        table_rebuild(t);
+        if (off > half) {
+            b++;
+            off -= half;
+        }
     }
 
-    // Append new character
-    sp_str_builder_append_c8(&builder, c);
+    line_block_t *blk = &t->blocks[b];
+    memmove(blk->lines + off + count, blk->lines + off, sizeof(line_t) * (blk->count - off));
+    table_add(t, b, count, 0);
+    buf->line_count += count;
+    return true;
+}
 
-    // Append part after insertion point
-    if (col < len) {
-        sp_str_t after = sp_str_sub(old_text, (s32)col, (s32)(len - col));
-        sp_str_builder_append(&builder, after);
+// Release `count` lines from `at` on and close the gap. Emptied blocks
+// are dropped and a block left small is merged with a neighbour. Spans
+// that go whole are dropped unread; one that loses only some lines is
+// read in first.
+static void table_remove(buffer_t *buf, u32 at, u32 count) {
+    line_table_t *t = &buf->table;
+    u32 first;
+    u32 start = table_find(t, at, &first);
+    u32 off = at - first;
+    u32 b = start;
+    buf->line_count -= count;
+    while (count > 0) {
+        line_block_t *blk = &t->blocks[b];
+        u32 n = blk->count - off < count ? blk->count - off : count;
+        if (!blk->lines && n < blk->count) {
+            // The lines removed so far are gone, so the next one is at `at`
+            table_fill(buf, b, at - off);
+            b = table_find(t, at, &first);
+            off = at - first;
+            continue;
+        }
+        if (!blk->lines) {
+            table_add(t, b, -(s64)n, -(s64)blk->bytes);
+            count -= n;
+            b++;
+            continue;
+        }
+        u64 bytes = 0;
+        for (u32 i = off; i < off + n; i++) {
+            bytes += (u64)blk->lines[i].text.len + 1;
+            line_release(&blk->lines[i]);
+        }
+        memmove(blk->lines + off, blk->lines + off + n, sizeof(line_t) * (blk->count - off - n));
+        table_add(t, b, -(s64)n, -(s64)bytes);
+        count -= n;
+        off = 0;
+        b++;
     }
 
-    line->text = sp_str_builder_to_str(&builder);
+    bool reshaped = false;
+    for (u32 i = b; i > start; i--) {
+        if (t->blocks[i - 1].count > 0) continue;
+        table_remove_block(t, i - 1);
+        reshaped = true;
+    }
+    if (t->block_count > 0) {
+        u32 k = start < t->block_count ? start : t->block_count - 1;
+        if (k + 1 < t->block_count && table_mergeable(t, k)) {
+            table_merge(t, k);
+            reshaped = true;
+        }
+        if (k > 0 && table_mergeable(t, k - 1)) {
+            table_merge(t, k - 1);
+            reshaped = true;
+        }
+    }
+    if (reshaped) table_rebuild(t);
+}
+
+// row was edited in place and was old_len bytes long before.
+static void line_touch(buffer_t *buf, u32 row, u32 old_len) {
+    line_t *line = buffer_line(buf, row);
     line->hl_dirty = true;
     buf->modified = true;
+    buf->version++;
+    table_resize(buf, row, (s64)line->text.len - (s64)old_len);
+    buffer_hl_stale(buf, row);
+}
+
+// Tell tree-sitter that [start, old_end) became [start, new_end). Callers
+// skip the offset lookups for buffers it has not parsed.
+static void buffer_report_edit(buffer_t *buf, u64 start_byte, u64 removed, u64 added,
+                               u32 row, u32 col, u32 old_row, u32 old_col,
+                               u32 new_row, u32 new_col) {
+    buffer_edit_t edit = {
+        .start_byte = start_byte,
+        .old_end_byte = start_byte + removed,
+        .new_end_byte = start_byte + added,
+        .start_row = row, .start_col = col,
+        .old_end_row = old_row, .old_end_col = old_col,
+        .new_end_row = new_row, .new_end_col = new_col,
+    };
+    treesitter_buffer_edit(buf, &edit);
+}
+
+static void line_init_copy(line_t *line, sp_str_t text) {
+    line_init_view(line, sp_str_lit(""));
+    if (text.len > 0 && line_reserve(line, text.len)) {
+        memcpy((c8 *)line->text.data, text.data, text.len);
+        line->text.len = text.len;
+    }
+}
+
+static bool buffer_add_lines(buffer_t *buf, u32 at, const sp_str_t *texts, u32 count) {
+    if (at > buf->line_count) at = buf->line_count;
+    if (!table_open(buf, at, count)) return false;
+
+    // New lines claim the end state of the line above them: the line below
+    // was lexed from that state, so it stays valid if they end the same way.
+    syntax_line_state_t above = {0};
+    if (at > 0) above = buffer_line(buf, at - 1)->hl_state;
+    for (u32 i = 0; i < count; i++) {
+        line_t *line = buffer_line(buf, at + i);
+        line_init_copy(line, texts[i]);
+        line->hl_state = above;
+        table_resize(buf, at + i, (s64)line->text.len + 1);
+    }
+    if (at < buf->hl_hi) buf->hl_hi += count;
+    if (at <= buf->hl_lo) buf->hl_lo += count;
+    buf->modified = true;
+    buf->version++;
+    buffer_hl_stale(buf, at);
+    return true;
+}
+
+void buffer_insert_lines(buffer_t *buf, u32 at, const sp_str_t *texts, u32 count) {
+    if (count == 0) return;
+    if (at > buf->line_count) at = buf->line_count;
+    if (!buf->ts_tree) {
+        buffer_add_lines(buf, at, texts, count);
+        return;
+    }
+
+    // Each new line brings its own break: in front of row `at`, or after
+    // the end of the last line when appending.
+    u64 added = 0;
+    for (u32 i = 0; i < count; i++) added += (u64)texts[i].len + 1;
+    u32 n = buf->line_count;
+    u32 last_len = texts[count - 1].len;
+    if (at < n) {
+        u64 start = buffer_point_to_offset(buf, at, 0);
+        if (!buffer_add_lines(buf, at, texts, count)) return;
+        buffer_report_edit(buf, start, 0, added, at, 0, at, 0, at + count, 0);
+    } else if (n > 0) {
+        u32 col = buffer_get_line(buf, n - 1).len;
+        u64 start = buffer_byte_count(buf);
+        if (!buffer_add_lines(buf, at, texts, count)) return;
+        buffer_report_edit(buf, start, 0, added, n - 1, col, n - 1, col, n + count - 1, last_len);
+    } else {
+        if (!buffer_add_lines(buf, at, texts, count)) return;
+        buffer_report_edit(buf, 0, 0, added - 1, 0, 0, 0, 0, count - 1, last_len);
+    }
+}
+
+void buffer_insert_line(buffer_t *buf, u32 at, sp_str_t text) {
+    buffer_insert_lines(buf, at, &text, 1);
+}
+
+static void buffer_remove_lines(buffer_t *buf, u32 at, u32 count) {
+    table_remove(buf, at, count);
+    buf->modified = true;
+    buf->version++;
+    // The line that moved up now follows a different line
+    if (at < buf->line_count) buffer_line(buf, at)->hl_dirty = true;
+    buffer_hl_stale(buf, at);
+    if (at < buf->hl_lo) buf->hl_lo = buf->hl_lo - at > count ? buf->hl_lo - count : at;
+    if (at < buf->hl_hi) buf->hl_hi = buf->hl_hi - at > count ? buf->hl_hi - count : at;
+}
+
+void buffer_delete_lines(buffer_t *buf, u32 at, u32 count) {
+    if (at >= buf->line_count || count == 0) return;
+    if (count > buf->line_count - at) count = buf->line_count - at;
+    if (!buf->ts_tree) {
+        buffer_remove_lines(buf, at, count);
+        return;
+    }
+
+    // Lines leave with the break after them, or with the one before them
+    // when they run to the end of the text.
+    u32 n = buf->line_count;
+    u32 end = at + count;
+    if (end < n) {
+        u64 start = buffer_point_to_offset(buf, at, 0);
+        u64 stop = buffer_point_to_offset(buf, end, 0);
+        buffer_remove_lines(buf, at, count);
+        buffer_report_edit(buf, start, stop - start, 0, at, 0, end, 0, at, 0);
+        return;
+    }
+
+    u32 row = at > 0 ? at - 1 : 0;
+    u32 col = at > 0 ? buffer_get_line(buf, at - 1).len : 0;
+    u32 last_col = buffer_get_line(buf, n - 1).len;
+    u64 start = at > 0 ? buffer_point_to_offset(buf, row, col) : 0;
+    u64 stop = buffer_byte_count(buf);
+    buffer_remove_lines(buf, at, count);
+    buffer_report_edit(buf, start, stop - start, 0, row, col, n - 1, last_col, row, col);
+}
+
+void buffer_delete_line(buffer_t *buf, u32 at) {
+    buffer_delete_lines(buf, at, 1);
+}
+
+void buffer_set_line(buffer_t *buf, u32 row, sp_str_t text) {
+    if (row >= buf->line_count) return;
+
+    line_t *line = buffer_line(buf, row);
+    u32 old_len = line->text.len;
+    u64 start = buf->ts_tree ? buffer_point_to_offset(buf, row, 0) : 0;
+    if (text.len > 0) {
+        // text may alias the line's own storage, so resolve it first.
+        if (line->cap > 0 && !line->shared && text.data >= line->text.data &&
+            text.data < line->text.data + line->cap) {
+            u32 offset = (u32)(text.data - line->text.data);
+            memmove((c8 *)line->text.data, line->text.data + offset, text.len);
+        } else {
+            if (!line_reserve(line, text.len)) return;
+            memcpy((c8 *)line->text.data, text.data, text.len);
+        }
+    }
+    line->text.len = text.len;
+    line_touch(buf, row, old_len);
+    if (buf->ts_tree) {
+        buffer_report_edit(buf, start, old_len, text.len, row, 0, row, old_len, row, text.len);
+    }
+}
+
+void buffer_insert_char_at(buffer_t *buf, u32 row, u32 col, c8 c) {
+    if (row >= buf->line_count) return;
+
+    line_t *line = buffer_line(buf, row);
+    u32 len = line->text.len;
+    if (col > len) col = len;
+
+    if (!line_reserve(line, len + 1)) return;
+    u64 start = buf->ts_tree ? buffer_point_to_offset(buf, row, col) : 0;
+
+    c8 *data = (c8 *)line->text.data;
+    memmove(data + col + 1, data + col, len - col);
+    data[col] = c;
+    line->text.len = len + 1;
+    line_touch(buf, row, len);
+    if (buf->ts_tree) buffer_report_edit(buf, start, 0, 1, row, col, row, col, row, col + 1);
 }
 
 void buffer_delete_char_at(buffer_t *buf, u32 row, u32 col) {
     if (row >= buf->line_count) return;
 
-    line_t *line = &buf->lines[row];
+    line_t *line = buffer_line(buf, row);
     u32 len = line->text.len;
 
     if (col >= len) return;
+    u64 start = buf->ts_tree ? buffer_point_to_offset(buf, row, col) : 0;
 
-    sp_io_writer_t writer = sp_io_writer_from_dyn_mem();
-    sp_str_builder_t builder = sp_str_builder_from_writer(&writer);
+    if (line->cap == 0 && (col == 0 || col + 1 == len)) {
+        // Trimming either end of a view needs no copy.
+        if (col == 0) line->text.data++;
+        line->text.len--;
+    } else {
+        if (!line_reserve(line, len)) return;
+        c8 *data = (c8 *)line->text.data;
+        memmove(data + col, data + col + 1, len - col - 1);
+        line->text.len = len - 1;
+    }
+    line_touch(buf, row, len);
+    if (buf->ts_tree) buffer_report_edit(buf, start, 1, 0, row, col, row, col + 1, row, col);
+}
 
-    if (col > 0) {
-        sp_str_t before = sp_str_sub(line->text, 0, (s32)col);
-        sp_str_builder_append(&builder, before);
+// Splice `text` (which may contain newlines) in at (row, col). The position
+// just past the inserted text is reported through end_row/end_col.
+void buffer_insert_text(buffer_t *buf, u32 row, u32 col, sp_str_t text, u32 *end_row, u32 *end_col) {
+    if (row >= buf->line_count) return;
+
+    line_t *line = buffer_line(buf, row);
+    if (col > line->text.len) col = line->text.len;
+
+    u32 newlines = 0;
+    for (u32 i = 0; i < text.len; i++) {
+        if (text.data[i] == '\n') newlines++;
+    }
+    u64 start = buf->ts_tree ? buffer_point_to_offset(buf, row, col) : 0;
+
+    if (newlines == 0) {
+        u32 len = line->text.len;
+        if (text.len > 0) {
+            if (!line_reserve(line, len + text.len)) return;
+            c8 *data = (c8 *)line->text.data;
+            memmove(data + col + text.len, data + col, len - col);
+            memcpy(data + col, text.data, text.len);
+            line->text.len = len + text.len;
+            line_touch(buf, row, len);
+            if (buf->ts_tree) {
+                buffer_report_edit(buf, start, 0, text.len, row, col, row, col, row, col + text.len);
+            }
+        }
+        if (end_row) *end_row = row;
+        if (end_col) *end_col = col + text.len;
+        return;
     }
 
-    if (col + 1 < len) {
-        sp_str_t after = sp_str_sub(line->text, (s32)(col + 1), (s32)(len - col - 1));
-        sp_str_builder_append(&builder, after);
+    // Everything that can fail happens before the buffer changes: room for
+    // the first segment on this row, and the last row whole, its segment
+    // followed by the tail after col.
+    u32 seg_end = 0;
+    while (text.data[seg_end] != '\n') seg_end++;
+    u32 last_seg = 0;
+    for (u32 i = 0; i < text.len; i++) {
+        if (text.data[i] == '\n') last_seg = i + 1;
     }
+    u32 old_len = line->text.len;
+    u32 tail_len = old_len - col;
+    u32 last_len = text.len - last_seg;
+    if (last_len > UINT32_MAX - tail_len) return;
+    if (!line_reserve(line, col + seg_end)) return;
 
-    line->text = sp_str_builder_to_str(&builder);
-    line->hl_dirty = true;
-    buf->modified = true;
+    sp_str_t *middle = sp_alloc_n(sp_str_t, newlines);
+    if (!middle) return;
+    c8 *last_text = SP_NULLPTR;
+    if (last_len + tail_len > 0) {
+        last_text = sp_alloc(last_len + tail_len);
+        if (!last_text) {
+            sp_free(middle);
+            return;
+        }
+        memcpy(last_text, text.data + last_seg, last_len);
+        memcpy(last_text + last_len, line->text.data + col, tail_len);
+    }
+
+    // The last row is added empty and then handed last_text
+    u32 count = 0;
+    u32 seg_start = seg_end + 1;
+    for (u32 i = seg_start; i < last_seg; i++) {
+        if (text.data[i] != '\n') continue;
+        middle[count++] = sp_str_sub(text, (s32)seg_start, (s32)(i - seg_start));
+        seg_start = i + 1;
+    }
+    middle[count++] = sp_str_lit("");
+    bool added = buffer_add_lines(buf, row + 1, middle, count);
+    sp_free(middle);
+    if (!added) {
+        if (last_text) sp_free(last_text);
+        return;
+    }
+
+    u32 last_row = row + newlines;
+    if (last_text) {
+        line_t *last = buffer_line(buf, last_row);
+        last->text = (sp_str_t){ .data = last_text, .len = last_len + tail_len };
+        last->cap = last_len + tail_len;
+        table_resize(buf, last_row, last_len + tail_len);
+    }
+
+    // The table may have moved this row's line_t, though not its text
+    line = buffer_line(buf, row);
+    memcpy((c8 *)line->text.data + col, text.data, seg_end);
+    line->text.len = col + seg_end;
+    line_touch(buf, row, old_len);
+    if (buf->ts_tree) {
+        buffer_report_edit(buf, start, 0, text.len, row, col, row, col, last_row, last_len);
+    }
+
+    if (end_row) *end_row = last_row;
+    if (end_col) *end_col = last_len;
+}
+
+// Remove the text between (row, col) and (end_row, end_col), joining the
+// two boundary lines.
+void buffer_delete_text(buffer_t *buf, u32 row, u32 col, u32 end_row, u32 end_col) {
+    if (row >= buf->line_count) return;
+    if (end_row >= buf->line_count) {
+        end_row = buf->line_count - 1;
+        end_col = buffer_get_line(buf, end_row).len;
+    }
+    if (end_row < row || (end_row == row && end_col <= col)) return;
+
+    line_t *first = buffer_line(buf, row);
+    if (col > first->text.len) col = first->text.len;
+    u64 start = buf->ts_tree ? buffer_point_to_offset(buf, row, col) : 0;
+
+    if (end_row == row) {
+        u32 len = first->text.len;
+        if (end_col > len) end_col = len;
+        if (end_col <= col) return;
+        if (!line_reserve(first, len)) return;
+        c8 *data = (c8 *)first->text.data;
+        memmove(data + col, data + end_col, len - end_col);
+        first->text.len = len - (end_col - col);
+        line_touch(buf, row, len);
+        if (buf->ts_tree) {
+            buffer_report_edit(buf, start, end_col - col, 0, row, col, row, end_col, row, col);
+        }
+        return;
+    }
+
+    sp_str_t last = buffer_get_line(buf, end_row);
+    if (end_col > last.len) end_col = last.len;
+    u32 tail_len = last.len - end_col;
+    u64 stop = buf->ts_tree ? buffer_point_to_offset(buf, end_row, end_col) : 0;
+
+    if (!line_reserve(first, col + tail_len)) return;
+    // Re-read the last line: it is a different line_t, so reserving the
+    // first one cannot move it.
+    last = buffer_get_line(buf, end_row);
+    u32 first_len = first->text.len;
+    memcpy((c8 *)first->text.data + col, last.data + end_col, tail_len);
+    first->text.len = col + tail_len;
+    line_touch(buf, row, first_len);
+
+    buffer_remove_lines(buf, row + 1, end_row - row);
+    if (buf->ts_tree) {
+        buffer_report_edit(buf, start, stop - start, 0, row, col, end_row, end_col, row, col);
+    }
 }
 
 sp_str_t buffer_get_line(buffer_t *buf, u32 row) {
     if (row >= buf->line_count) {
         return sp_str_lit("");
     }
-    return buf->lines[row].text;
+    u32 first;
+    u32 b = table_find(&buf->table, row, &first);
+    const line_block_t *blk = &buf->table.blocks[b];
+    if (!blk->lines) return table_peek(buf, blk, row - first, SP_NULLPTR);
+    return blk->lines[row - first].text;
 }
 
 u32 buffer_row_to_render(buffer_t *buf, u32 row, u32 col) {
     if (row >= buf->line_count) return col;
 
-    sp_str_t line = buf->lines[row].text;
+    sp_str_t line = buffer_get_line(buf, row);
     u32 render_col = 0;
 
     for (u32 i = 0; i < col && i < line.len; i++) {
@@ -163,7 +1005,7 @@ u32 buffer_row_to_render(buffer_t *buf, u32 row, u32 col) {
 u32 buffer_render_to_row(buffer_t *buf, u32 row, u32 render_col) {
     if (row >= buf->line_count) return render_col;
 
-    sp_str_t line = buf->lines[row].text;
+    sp_str_t line = buffer_get_line(buf, row);
     u32 current_render = 0;
     u32 i;
 
@@ -186,11 +1028,483 @@ u32 buffer_render_to_row(buffer_t *buf, u32 row, u32 render_col) {
     return i;
 }
 
+static bool buffer_push_span(buffer_t *buf, line_t *line, u32 skip, u32 len, highlight_type_t kind) {
+    if (buf->hl_used == buf->hl_cap) {
+        u32 cap = buf->hl_cap ? buf->hl_cap * 2 : BUFFER_HL_ARENA_MIN;
+        hl_span_t *grown = sp_realloc(buf->hl_spans, sizeof(hl_span_t) * cap);
+        if (!grown) return false;
+        buf->hl_spans = grown;
+        buf->hl_cap = cap;
+    }
+    buf->hl_spans[buf->hl_used++] = (hl_span_t){ (u8)skip, (u8)len, (u8)kind };
+    line->hl_count++;
+    return true;
+}
+
+// Store the kind of each of row's len bytes as runs at the end of the
+// span arena. The runs row held before are left for buffer_keep_highlight
+// to reclaim.
+void buffer_set_highlight(buffer_t *buf, u32 row, const highlight_type_t *kinds, u32 len) {
+    line_t *line = buffer_line(buf, row);
+    line->highlighted = true;
+    line->hl_at = buf->hl_used;
+    line->hl_count = 0;
+
+    u32 skip = 0;
+    u32 i = 0;
+    while (i < len) {
+        highlight_type_t kind = kinds[i];
+        u32 j = i + 1;
+        while (j < len && kinds[j] == kind) j++;
+        u32 run = j - i;
+        i = j;
+        if (kind == HL_NORMAL) {
+            skip += run;
+            continue;
+        }
+
+        for (; skip > UINT8_MAX; skip -= UINT8_MAX) {
+            if (!buffer_push_span(buf, line, UINT8_MAX, 0, HL_NORMAL)) return;
+        }
+        for (; run > 0; skip = 0) {
+            u32 n = run > UINT8_MAX ? UINT8_MAX : run;
+            if (!buffer_push_span(buf, line, skip, n, kind)) return;
+            run -= n;
+        }
+    }
+}
+
+// The runs of row, or NULL when it has not been highlighted
+const hl_span_t *buffer_line_spans(buffer_t *buf, u32 row, u32 *count) {
+    line_t *line = buffer_line(buf, row);
+    if (!line->highlighted) return SP_NULLPTR;
+    if (count) *count = line->hl_count;
+    return buf->hl_spans + line->hl_at;
+}
+
+// Drop the highlight of rows outside [first, last). Highlighters call this
+// after filling the window so memory follows the viewport, not the file.
+// Runs left behind by rehighlighted rows are reclaimed here too: once they
+// outweigh the live ones, the window's runs move to a fresh arena.
+void buffer_keep_highlight(buffer_t *buf, u32 first, u32 last) {
+    if (last > buf->line_count) last = buf->line_count;
+    if (first > last) first = last;
+    u32 hi = buf->hl_hi < buf->line_count ? buf->hl_hi : buf->line_count;
+    for (u32 i = buf->hl_lo; i < hi; i++) {
+        if (i >= first && i < last) {
+            i = last - 1;
+            continue;
+        }
+        line_t *line = buffer_line(buf, i);
+        line->highlighted = false;
+        line->hl_count = 0;
+    }
+    buf->hl_lo = first;
+    buf->hl_hi = last;
+
+    u32 live = 0;
+    for (u32 i = first; i < last; i++) {
+        line_t *line = buffer_line(buf, i);
+        if (line->highlighted) live += line->hl_count;
+    }
+    if (buf->hl_used <= live * 2 + BUFFER_HL_ARENA_MIN) return;
+
+    u32 cap = BUFFER_HL_ARENA_MIN;
+    while (cap < live * 2) cap *= 2;
+    hl_span_t *spans = sp_alloc(sizeof(hl_span_t) * cap);
+    if (!spans) return;
+    u32 used = 0;
+    for (u32 i = first; i < last; i++) {
+        line_t *line = buffer_line(buf, i);
+        if (!line->highlighted) continue;
+        memcpy(spans + used, buf->hl_spans + line->hl_at, sizeof(hl_span_t) * line->hl_count);
+        line->hl_at = used;
+        used += line->hl_count;
+    }
+    sp_free(buf->hl_spans);
+    buf->hl_spans = spans;
+    buf->hl_used = used;
+    buf->hl_cap = cap;
+}
+
+// Live runs and the bytes of the rows they cover, for :syntax stats
+void buffer_highlight_stats(buffer_t *buf, u32 *spans, u64 *bytes) {
+    u32 count = 0;
+    u64 covered = 0;
+    u32 hi = buf->hl_hi < buf->line_count ? buf->hl_hi : buf->line_count;
+    for (u32 i = buf->hl_lo; i < hi; i++) {
+        line_t *line = buffer_line(buf, i);
+        if (!line->highlighted) continue;
+        count += line->hl_count;
+        covered += line->text.len;
+    }
+    if (spans) *spans = count;
+    if (bytes) *bytes = covered;
+}
+
+// Append up to max_lines views over data to the end of the line table.
+// Returns the number of bytes consumed, newlines included.
+static u64 buffer_index_range(buffer_t *buf, const c8 *data, u64 len, u32 max_lines) {
+    line_table_t *t = &buf->table;
+    u64 start = 0;
+    u32 added = 0;
+    buffer_hl_stale(buf, buf->line_count);
+    // Lines are written past the end of the last block and counted in
+    // once per block.
+    u32 rows = 0;
+    u64 bytes = 0;
+    while (start < len && added < max_lines) {
+        u64 end = text_line_end(data, len, start);
+        sp_str_t text = text_line(data, len, start, end);
+
+        line_block_t *last = t->block_count > 0 ? &t->blocks[t->block_count - 1] : SP_NULLPTR;
+        if (!last || !last->lines || last->count + rows == LINE_BLOCK_MAX) {
+            if (rows > 0) table_add(t, t->block_count - 1, rows, (s64)bytes);
+            rows = 0;
+            bytes = 0;
+            if (!table_append_block(t)) break;
+        }
+        line_block_t *blk = &t->blocks[t->block_count - 1];
+        line_init_view(&blk->lines[blk->count + rows], text);
+        rows++;
+        bytes += (u64)text.len + 1;
+        added++;
+        start = end + 1;
+    }
+    if (rows > 0) table_add(t, t->block_count - 1, rows, (s64)bytes);
+    buf->line_count += added;
+    return start < len ? start : len;
+}
+
+// Build the line table over content in one pass. The newline count sizes
+// the block array up front, then each line becomes a view between two
+// newlines.
+static void buffer_index_lines(buffer_t *buf, sp_str_t content) {
+    u32 newlines = scan_count_byte(content.data, content.len, '\n');
+    if (!table_grow(&buf->table, newlines / LINE_BLOCK_MAX + 1)) return;
+    buffer_index_range(buf, content.data, content.len, newlines + 1);
+}
+
+// Record that line `line` starts at offset, after crlf \r\n line ends.
+// Checkpoints stay in line order: one that cannot be stored ends the list.
+static void buffer_add_checkpoint(buffer_map_t *map, u64 line, u64 offset, u64 crlf) {
+    sp_mutex_lock(&map->lock);
+    if (line / BUFFER_CHECKPOINT_LINES == (u64)map->checkpoint_count + 1) {
+        if (map->checkpoint_count == map->checkpoint_cap && map->checkpoint_cap < UINT32_MAX / 2) {
+            u32 cap = map->checkpoint_cap > 0 ? map->checkpoint_cap * 2 : 256;
+            buffer_checkpoint_t *grown = sp_realloc(map->checkpoints, sizeof(buffer_checkpoint_t) * cap);
+            if (grown) {
+                map->checkpoints = grown;
+                map->checkpoint_cap = cap;
+            }
+        }
+        if (map->checkpoint_count < map->checkpoint_cap) {
+            map->checkpoints[map->checkpoint_count++] = (buffer_checkpoint_t){ offset, crlf };
+        }
+    }
+    sp_mutex_unlock(&map->lock);
+}
+
+// Count the lines of [off, off + len) into *lines and the \r\n line ends
+// into *crlf, and record a checkpoint at every BUFFER_CHECKPOINT_LINES-th
+// line start.
+static void buffer_index_chunk(buffer_map_t *map, u64 off, u32 len, u64 *lines, u64 *crlf) {
+    const c8 *data = map->data;
+    for (u32 at = 0; at < len;) {
+        u32 n = len - at > BUFFER_CHECKPOINT_WINDOW ? BUFFER_CHECKPOINT_WINDOW : len - at;
+        const c8 *window = data + off + at;
+        u32 count = scan_count_byte(window, n, '\n');
+        u64 next = (*lines / BUFFER_CHECKPOINT_LINES + 1) * BUFFER_CHECKPOINT_LINES;
+        bool cr = scan_find_byte(window, n, '\r') < n || (off + at > 0 && window[-1] == '\r');
+        if (*lines + count < next && !cr) {
+            *lines += count;
+            at += n;
+            continue;
+        }
+
+        for (u32 i = 0; i < n;) {
+            u32 rel = scan_find_byte(window + i, n - i, '\n');
+            if (rel == n - i) break;
+            u64 p = off + at + i + rel;
+            if (p > 0 && data[p - 1] == '\r') (*crlf)++;
+            (*lines)++;
+            if (*lines % BUFFER_CHECKPOINT_LINES == 0 && p + 1 < map->size) {
+                buffer_add_checkpoint(map, *lines, p + 1, *crlf);
+            }
+            i += rel + 1;
+        }
+        at += n;
+    }
+}
+
+static s32 buffer_indexer_main(void *userdata) {
+    buffer_map_t *map = userdata;
+    u64 off = 0;
+    u64 lines = 0;
+    u64 crlf = 0;
+
+    while (off < map->size) {
+        if (sp_atomic_s32_get(&map->cancel)) return 0;
+
+        u64 remaining = map->size - off;
+        u32 chunk = remaining > BUFFER_INDEX_CHUNK ? BUFFER_INDEX_CHUNK : (u32)remaining;
+        buffer_index_chunk(map, off, chunk, &lines, &crlf);
+        off += chunk;
+
+        sp_mutex_lock(&map->lock);
+        map->indexed_bytes = off;
+        map->indexed_lines = lines;
+        sp_mutex_unlock(&map->lock);
+    }
+
+    // A final line without a trailing newline still counts.
+    if (map->size > 0 && map->data[map->size - 1] != '\n') lines++;
+
+    sp_mutex_lock(&map->lock);
+    map->indexed_lines = lines;
+    map->crlf = crlf;
+    map->indexed = true;
+    sp_mutex_unlock(&map->lock);
+    return 0;
+}
+
+// Map path read-only if it is large enough to be worth it. Only the first
+// screenful is materialized here; the line count is finished in the
+// background so opening takes the same time regardless of file size.
+static bool buffer_map_file(buffer_t *buf, sp_str_t filename) {
+    c8 path[4096];
+    if (filename.len == 0 || filename.len >= sizeof(path)) return false;
+    memcpy(path, filename.data, filename.len);
+    path[filename.len] = '\0';
+
+    s32 fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+        (u64)st.st_size < BUFFER_MAP_THRESHOLD) {
+        close(fd);
+        return false;
+    }
+
+    void *data = mmap(SP_NULLPTR, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return false;
+    madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+
+    buffer_map_t *map = sp_alloc(sizeof(buffer_map_t));
+    if (!map) {
+        munmap(data, (size_t)st.st_size);
+        return false;
+    }
+    map->data = data;
+    map->size = (u64)st.st_size;
+    map->peek_source = UINT64_MAX;
+    sp_mutex_init(&map->lock, SP_MUTEX_PLAIN);
+    buf->map = map;
+
+    buffer_ensure_rows(buf, 256);
+    sp_thread_init(&map->indexer, buffer_indexer_main, map);
+    return true;
+}
+
+// Read up to `count` more lines of the mapping into the line table.
+static void buffer_map_read(buffer_t *buf, u32 count) {
+    buffer_map_t *map = buf->map;
+    if (!table_grow(&buf->table, buf->table.block_count + count / LINE_BLOCK_MAX + 1)) return;
+
+    u32 had = buf->line_count;
+    map->next += buffer_index_range(buf, map->data + map->next, map->size - map->next, count);
+    map->source_lines += buf->line_count - had;
+}
+
+// Cover the lines up to row `rows` with spans, one per interval between
+// the checkpoints the indexer has found so far, after reading lines up to
+// the first of them. The interval after the last checkpoint follows once
+// the count is done. Lines it cannot reach are left for buffer_map_read.
+static void buffer_map_spans(buffer_t *buf, u32 rows) {
+    buffer_map_t *map = buf->map;
+    line_table_t *t = &buf->table;
+    if (map->source_lines == 0) return;
+    u32 i = (map->source_lines - 1) / BUFFER_CHECKPOINT_LINES;
+    u64 line = (u64)(i + 1) * BUFFER_CHECKPOINT_LINES;
+
+    sp_mutex_lock(&map->lock);
+    bool known = i < map->checkpoint_count;
+    sp_mutex_unlock(&map->lock);
+    if (!known) return;
+    if (map->source_lines < line) buffer_map_read(buf, (u32)(line - map->source_lines));
+
+    sp_mutex_lock(&map->lock);
+    const buffer_checkpoint_t *cp = map->checkpoints;
+    while (buf->line_count < rows && map->source_lines == line && map->next == cp[i].offset) {
+        line_block_t span = { .source = cp[i].offset };
+        u64 end = 0;
+        if (i + 1 < map->checkpoint_count) {
+            end = cp[i + 1].offset;
+            span.count = BUFFER_CHECKPOINT_LINES;
+            span.bytes = end - span.source - (cp[i + 1].crlf - cp[i].crlf);
+        } else if (map->indexed) {
+            end = map->size;
+            span.count = (u32)(map->indexed_lines - line);
+            span.bytes = end - span.source - (map->crlf - cp[i].crlf);
+            // The last line counts a newline it does not have
+            if (map->data[end - 1] != '\n') span.bytes++;
+        } else {
+            break;
+        }
+        if (span.count > UINT32_MAX - buf->line_count || !table_push(t, span)) break;
+
+        buffer_hl_stale(buf, buf->line_count);
+        buf->line_count += span.count;
+        map->source_lines += span.count;
+        map->next = end;
+        line += span.count;
+        i++;
+    }
+    sp_mutex_unlock(&map->lock);
+}
+
+// Bring in mapped lines until at least `rows` lines exist or the mapping
+// is exhausted. Nearby lines are read in as views into the mapping; a
+// jump further than a checkpoint interval skips ahead with spans.
+void buffer_ensure_rows(buffer_t *buf, u32 rows) {
+    buffer_map_t *map = buf->map;
+    if (!map || map->next >= map->size || buf->line_count >= rows) return;
+
+    // Once the background count is done the blocks can be sized exactly,
+    // otherwise it grows in batches as lines are found.
+    sp_mutex_lock(&map->lock);
+    u64 pending = map->indexed ? map->indexed_lines - map->source_lines : 0;
+    sp_mutex_unlock(&map->lock);
+
+    // Appended lines are an edit at the end of the text to tree-sitter
+    u32 before = buf->line_count;
+    u64 before_bytes = buf->ts_tree ? buffer_byte_count(buf) : 0;
+    u32 before_col = before > 0 ? buffer_get_line(buf, before - 1).len : 0;
+
+    if (rows - buf->line_count > BUFFER_CHECKPOINT_LINES) {
+        buffer_map_spans(buf, rows);
+        sp_mutex_lock(&map->lock);
+        pending = map->indexed && map->indexed_lines > map->source_lines
+                      ? map->indexed_lines - map->source_lines : 0;
+        sp_mutex_unlock(&map->lock);
+    }
+    while (buf->line_count < rows && map->next < map->size) {
+        u32 want = rows - buf->line_count;
+        if (pending > 0 && want > pending) want = (u32)pending;
+        if (pending == 0 && want > 65536) want = 65536;
+
+        u32 had = buf->line_count;
+        buffer_map_read(buf, want);
+        if (buf->line_count == had) break;
+    }
+
+    u32 n = buf->line_count;
+    if (buf->ts_tree && n > before) {
+        u32 row = before > 0 ? before - 1 : 0;
+        u64 added = buffer_byte_count(buf) - before_bytes;
+        buffer_report_edit(buf, before_bytes, 0, added, row, before_col, row, before_col,
+                           n - 1, buffer_get_line(buf, n - 1).len);
+    }
+}
+
+// Give every line of a mapped file a row, waiting for the background
+// count to finish first. Lines past those read so far become spans, so
+// this costs a block per checkpoint interval, not a line each. Batch
+// callers only: the UI uses buffer_ensure_counted_rows.
+void buffer_ensure_all_rows(buffer_t *buf) {
+    if (!buffer_is_partial(buf)) return;
+    while (buffer_index_progress(buf) >= 0) {
+        usleep(1000);
+    }
+    buffer_ensure_rows(buf, UINT32_MAX);
+}
+
+// Give a row to every line the background count has found so far,
+// without waiting for it. False while it is still running and more lines
+// may follow.
+bool buffer_ensure_counted_rows(buffer_t *buf) {
+    if (!buffer_is_partial(buf)) return true;
+    bool exact = false;
+    u32 total = buffer_total_lines(buf, &exact);
+    buffer_ensure_rows(buf, exact ? UINT32_MAX : total);
+    return exact;
+}
+
+// Mark every row stale, as when the highlighter changes. Spans need
+// nothing: their lines are stale when read in.
+void buffer_mark_dirty(buffer_t *buf) {
+    line_table_t *t = &buf->table;
+    for (u32 b = 0; b < t->block_count; b++) {
+        if (!t->blocks[b].lines) continue;
+        for (u32 i = 0; i < t->blocks[b].count; i++) {
+            t->blocks[b].lines[i].hl_dirty = true;
+        }
+    }
+    buf->hl_from = 0;
+}
+
+// True while part of a mapped file has not been materialized yet.
+bool buffer_is_partial(buffer_t *buf) {
+    return buf->map && buf->map->next < buf->map->size;
+}
+
+// Line count including mapped lines not materialized yet. While the
+// background count is still running this is a lower bound and
+// *exact is set to false.
+u32 buffer_total_lines(buffer_t *buf, bool *exact) {
+    if (exact) *exact = true;
+    if (!buffer_is_partial(buf)) return buf->line_count;
+
+    buffer_map_t *map = buf->map;
+    sp_mutex_lock(&map->lock);
+    u64 indexed = map->indexed_lines;
+    bool done = map->indexed;
+    sp_mutex_unlock(&map->lock);
+
+    if (exact) *exact = done;
+    u64 pending = indexed > map->source_lines ? indexed - map->source_lines : 0;
+    u64 total = buf->line_count + pending;
+    return total > UINT32_MAX ? UINT32_MAX : (u32)total;
+}
+
+// Background indexing progress in percent, or -1 when nothing is running.
+s32 buffer_index_progress(buffer_t *buf) {
+    buffer_map_t *map = buf->map;
+    if (!map) return -1;
+
+    sp_mutex_lock(&map->lock);
+    u64 bytes = map->indexed_bytes;
+    bool done = map->indexed;
+    sp_mutex_unlock(&map->lock);
+    if (done) return -1;
+    return map->size > 0 ? (s32)(bytes * 100 / map->size) : 100;
+}
+
 void buffer_load_file(buffer_t *buf, sp_str_t filename) {
+    // Versions keep counting across loads, so state cached against the
+    // previous file never looks current.
+    u32 version = buf->version;
     buffer_free(buf);
     buffer_init(buf);
+    buf->version = version + 1;
 
     buf->filename = filename;
+    sp_tm_timer_t timer = sp_tm_start_timer();
+
+    if (buffer_map_file(buf, filename)) {
+        buf->load_stats.bytes = buf->map->size;
+        buf->load_stats.lines = buf->line_count;
+        buf->load_stats.index_ns = sp_tm_read_timer(&timer);
+        buf->modified = false;
+
+        language_t *lang = syntax_detect_language(filename);
+        if (lang) {
+            buf->lang = lang->name;
+        }
+        return;
+    }
 
     // Use sp_io_read_file to read entire file
     sp_str_t content = sp_io_read_file(filename);
@@ -201,26 +1515,16 @@ void buffer_load_file(buffer_t *buf, sp_str_t filename) {
         return;
     }
 
-    // Split content into lines
-    u32 start = 0;
-    for (u32 i = 0; i < content.len; i++) {
-        if (content.data[i] == '\n') {
-            u32 line_len = i - start;
-            // Handle Windows \r\n
-            if (line_len > 0 && content.data[i - 1] == '\r') {
-                line_len--;
-            }
-            sp_str_t line = sp_str_sub(content, (s32)start, (s32)line_len);
-            buffer_insert_line(buf, buf->line_count, line);
-            start = i + 1;
-        }
-    }
+    buf->load_stats.read_ns = sp_tm_read_timer(&timer);
+    sp_tm_reset_timer(&timer);
 
-    // Handle last line (may not end with newline)
-    if (start < content.len) {
-        sp_str_t line = sp_str_sub(content, (s32)start, (s32)(content.len - start));
-        buffer_insert_line(buf, buf->line_count, line);
-    }
+    // Lines view the file content; it stays alive as the buffer backing.
+    buf->backing = content;
+    buffer_index_lines(buf, content);
+
+    buf->load_stats.bytes = content.len;
+    buf->load_stats.lines = buf->line_count;
+    buf->load_stats.index_ns = sp_tm_read_timer(&timer);
 
     // Empty file
     if (buf->line_count == 0) {
@@ -236,31 +1540,170 @@ void buffer_load_file(buffer_t *buf, sp_str_t filename) {
     }
 }
 
-bool buffer_save_file(buffer_t *buf) {
-    if (!buf) return false;
-    sp_io_writer_t writer = sp_io_writer_from_file(buf->filename, SP_IO_WRITE_MODE_OVERWRITE);
-    sp_err_clear();
+// Byte offset of (row, col) in the materialized text, counting one byte
+// per line break. Positions past the end clamp to it. The blocks before
+// row's come from the byte tree, the rows before it in its block are summed.
+u64 buffer_point_to_offset(buffer_t *buf, u32 row, u32 col) {
+    if (buf->line_count == 0) return 0;
+    if (row >= buf->line_count) return buffer_byte_count(buf);
 
-    for (u32 i = 0; i < buf->line_count; i++) {
-        if (sp_io_write_str(&writer, buf->lines[i].text) != buf->lines[i].text.len) {
-            sp_io_writer_close(&writer);
-            return false;
-        }
-        if (sp_io_write_cstr(&writer, "\n") != 1) {
-            sp_io_writer_close(&writer);
-            return false;
-        }
+    line_table_t *t = &buf->table;
+    u32 first;
+    u32 b = table_find(t, row, &first);
+    const line_t *lines = t->blocks[b].lines;
+    u64 offset = table_bytes_before(t, b);
+    if (!lines) {
+        u64 before;
+        u32 len = table_peek(buf, &t->blocks[b], row - first, &before).len;
+        return offset + before + (col < len ? col : len);
+    }
+    for (u32 i = 0; i < row - first; i++) {
+        offset += (u64)lines[i].text.len + 1;
     }
+    u32 len = lines[row - first].text.len;
+    return offset + (col < len ? col : len);
+}
 
-    if (sp_io_flush(&writer) != SP_ERR_OK) {
-        sp_io_writer_close(&writer);
+// Inverse of buffer_point_to_offset in O(log n). Returns false and the
+// end position when offset lies past the end of the text.
+bool buffer_offset_to_point(buffer_t *buf, u64 offset, u32 *row, u32 *col) {
+    u32 n = buf->line_count;
+    if (n == 0) {
+        if (row) *row = 0;
+        if (col) *col = 0;
         return false;
     }
-    sp_io_writer_close(&writer);
-    if (sp_err_get() != SP_ERR_OK) {
+
+    line_table_t *t = &buf->table;
+    u32 pos = 0;
+    u32 first = 0;
+    u64 rem = offset;
+    u32 step = 1;
+    while (step <= t->block_count / 2) step <<= 1;
+    for (; step > 0; step >>= 1) {
+        if (pos + step <= t->block_count && t->bytes[pos + step] <= rem) {
+            pos += step;
+            rem -= t->bytes[pos];
+            first += t->rows[pos];
+        }
+    }
+
+    if (pos >= t->block_count) {
+        if (row) *row = n - 1;
+        if (col) *col = buffer_get_line(buf, n - 1).len;
         return false;
     }
+    const line_block_t *blk = &t->blocks[pos];
+    const line_t *lines = blk->lines;
+    u32 i = 0;
+    if (!lines) {
+        // Step through the span from the line read last
+        u64 before;
+        i = buf->map->peek_source == blk->source ? buf->map->peek_rel : 0;
+        sp_str_t text = table_peek(buf, blk, i, &before);
+        while (before > rem) text = table_peek(buf, blk, --i, &before);
+        while (before + text.len + 1 <= rem) text = table_peek(buf, blk, ++i, &before);
+        rem -= before;
+    }
+    while (lines && (u64)lines[i].text.len + 1 <= rem) {
+        rem -= (u64)lines[i].text.len + 1;
+        i++;
+    }
+    if (row) *row = first + i;
+    if (col) *col = (u32)rem;
+    return true;
+}
 
-    buf->modified = false;
+u64 buffer_byte_count(buffer_t *buf) {
+    if (buf->line_count == 0) return 0;
+    return table_bytes_before(&buf->table, buf->table.block_count) - 1;
+}
+
+// Copy of the text between two byte offsets, without materializing or
+// copying anything outside the range.
+sp_str_t buffer_get_range(buffer_t *buf, u64 start, u64 end) {
+    u64 total = buffer_byte_count(buf);
+    if (end > total) end = total;
+    if (start >= end || end - start >= UINT32_MAX) return sp_str_lit("");
+
+    u32 row = 0;
+    u32 col = 0;
+    buffer_offset_to_point(buf, start, &row, &col);
+
+    u32 len = (u32)(end - start);
+    c8 *out = sp_alloc(len);
+    if (!out) return sp_str_lit("");
+
+    u32 used = 0;
+    while (used < len) {
+        sp_str_t text = buffer_get_line(buf, row);
+        u32 take = text.len - col;
+        if (take > len - used) take = len - used;
+        memcpy(out + used, text.data + col, take);
+        used += take;
+        if (used < len) out[used++] = '\n';
+        row++;
+        col = 0;
+    }
+    return (sp_str_t){ .data = out, .len = len };
+}
+
+// Capture the buffer contents for a reader on another thread. The line
+// texts are borrowed: owned storage is marked shared so later edits copy
+// it out instead of changing it, and freed storage is parked until
+// buffer_snapshot_end.
+bool buffer_snapshot_begin(buffer_t *buf, buffer_snapshot_t *snap) {
+    *snap = (buffer_snapshot_t){0};
+    snap->lines = sp_alloc(sizeof(sp_str_t) * (buf->line_count > 0 ? buf->line_count : 1));
+    if (!snap->lines) return false;
+
+    // Spans are borrowed from the mapping as they are, without reading
+    // them into the line table
+    line_table_t *t = &buf->table;
+    u32 row = 0;
+    for (u32 b = 0; b < t->block_count; b++) {
+        const line_block_t *blk = &t->blocks[b];
+        for (u32 i = 0; i < blk->count; i++) {
+            sp_str_t text;
+            if (blk->lines) {
+                line_t *line = &blk->lines[i];
+                if (line->cap > 0) line->shared = true;
+                text = line->text;
+            } else {
+                text = table_peek(buf, blk, i, SP_NULLPTR);
+            }
+            snap->lines[row++] = text;
+            snap->bytes += (u64)text.len + 1;
+        }
+    }
+    snap->line_count = buf->line_count;
+
+    if (buffer_is_partial(buf)) {
+        snap->tail = buf->map->data + buf->map->next;
+        snap->tail_len = buf->map->size - buf->map->next;
+        snap->bytes += snap->tail_len;
+    }
+    snap->version = buf->version;
+    G_snapshots++;
     return true;
 }
+
+// Release snap. Storage stays shared until the last snapshot is released.
+void buffer_snapshot_end(buffer_t *buf, buffer_snapshot_t *snap) {
+    if (snap->lines) sp_free(snap->lines);
+    *snap = (buffer_snapshot_t){0};
+    if (G_snapshots > 0) G_snapshots--;
+    if (G_snapshots > 0) return;
+
+    line_table_t *t = &buf->table;
+    for (u32 b = 0; b < t->block_count; b++) {
+        if (!t->blocks[b].lines) continue;
+        for (u32 i = 0; i < t->blocks[b].count; i++) {
+            t->blocks[b].lines[i].shared = false;
+        }
+    }
+    for (u32 i = 0; i < G_retired_count; i++) {
+        sp_free(G_retired[i]);
+    }
+    G_retired_count = 0;
+}
@@ -0,0 +1,471 @@
+/**
+ * check.c - Self-checks behind the --*-check options
+ *
+ * Each check drives a buffer through a seeded stream of random edits and
+ * after every one compares what the incremental structure under test
+ * holds with a reference recomputed the slow way. The seed is fixed, so a
+ * failing run repeats exactly.
+ */
+
+#include "ted.h"
+
+#include <string.h>
+
+#define CHECK_SEED 0x9e3779b9u
+
+// xorshift32
+static u32 check_rand(u32 *state) {
+    u32 x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+static u32 check_below(u32 *state, u32 n) {
+    return n > 0 ? check_rand(state) % n : 0;
+}
+
+// Random insertions are strung together from these, weighted towards
+// what changes line structure and lexer or parser state
+static const c8 *CHECK_PIECES[] = {
+    "\n", "\n", " ", "x", "42", "int ", "/*", "*/", "//", "\"", "'", "\\",
+    "{", "}", "(", ")", ";", "#define y ", "\n\n",
+};
+
+#define CHECK_PIECE_COUNT (sizeof(CHECK_PIECES) / sizeof(CHECK_PIECES[0]))
+
+// Text of up to eight random pieces, in out
+static sp_str_t check_text(u32 *state, c8 *out, u32 cap) {
+    u32 len = 0;
+    u32 pieces = 1 + check_below(state, 8);
+    for (u32 i = 0; i < pieces; i++) {
+        const c8 *piece = CHECK_PIECES[check_below(state, CHECK_PIECE_COUNT)];
+        u32 n = (u32)strlen(piece);
+        if (len + n > cap) break;
+        memcpy(out + len, piece, n);
+        len += n;
+    }
+    return (sp_str_t){ .data = out, .len = len };
+}
+
+// Apply one random edit to buf: an insertion at a random point, a deletion
+// of a random range of up to three lines, or a whole line added or removed
+static void check_edit(buffer_t *buf, u32 *state) {
+    c8 text[128];
+    if (buf->line_count == 0) buffer_insert_line(buf, 0, sp_str_lit(""));
+
+    u32 row = check_below(state, buf->line_count);
+    u32 col = check_below(state, buffer_get_line(buf, row).len + 1);
+    switch (check_below(state, 6)) {
+        case 0:
+        case 1:
+        case 2:
+            buffer_insert_text(buf, row, col, check_text(state, text, sizeof(text)), SP_NULLPTR, SP_NULLPTR);
+            break;
+        case 3:
+        case 4: {
+            u32 end_row = row + check_below(state, 3);
+            if (end_row >= buf->line_count) end_row = buf->line_count - 1;
+            u32 end_col = check_below(state, buffer_get_line(buf, end_row).len + 1);
+            if (end_row == row && end_col < col) {
+                u32 tmp = col;
+                col = end_col;
+                end_col = tmp;
+            }
+            buffer_delete_text(buf, row, col, end_row, end_col);
+            break;
+        }
+        default:
+            if (buf->line_count > 1 && check_below(state, 2) == 0) {
+                buffer_delete_line(buf, row);
+            } else {
+                sp_str_t line = check_text(state, text, sizeof(text));
+                // A whole line holds no break of its own
+                for (u32 i = 0; i < line.len; i++) {
+                    if (text[i] == '\n') text[i] = ' ';
+                }
+                buffer_insert_line(buf, row, line);
+            }
+            break;
+    }
+}
+
+// Insert or delete a run of up to CHECK_RUN lines at a random row, enough
+// to split, add, drop and merge blocks of the line table
+#define CHECK_RUN 700u
+
+static void check_run_edit(buffer_t *buf, u32 *state) {
+    u32 row = check_below(state, buf->line_count);
+    u32 count = 1 + check_below(state, CHECK_RUN);
+    if (buf->line_count > count && check_below(state, 2) == 0) {
+        buffer_delete_lines(buf, row, count);
+        return;
+    }
+
+    sp_str_t *texts = sp_alloc_n(sp_str_t, count);
+    if (!texts) return;
+    c8 text[128];
+    sp_str_t line = check_text(state, text, sizeof(text));
+    for (u32 i = 0; i < line.len; i++) {
+        if (text[i] == '\n') text[i] = ' ';
+    }
+    for (u32 i = 0; i < count; i++) {
+        texts[i] = sp_str_sub(line, 0, (s32)check_below(state, line.len + 1));
+    }
+    buffer_insert_lines(buf, row, texts, count);
+    sp_free(texts);
+}
+
+// Compare the offset index with a running sum of the line lengths: the
+// start and end of every row both ways, and the total. Returns the number
+// of rows that disagree.
+static u32 check_offsets_rows(buffer_t *buf) {
+    u32 mismatches = 0;
+    u64 start = 0;
+    for (u32 row = 0; row < buf->line_count; row++) {
+        u32 len = buffer_get_line(buf, row).len;
+        u32 at_row = UINT32_MAX;
+        u32 at_col = UINT32_MAX;
+        bool ok = buffer_point_to_offset(buf, row, 0) == start &&
+                  buffer_point_to_offset(buf, row, len) == start + len &&
+                  buffer_point_to_offset(buf, row, len + 1) == start + len;
+        ok = ok && buffer_offset_to_point(buf, start + len / 2, &at_row, &at_col) &&
+             at_row == row && at_col == len / 2;
+        if (!ok) mismatches++;
+        start += (u64)len + 1;
+    }
+    if (buf->line_count > 0 && buffer_byte_count(buf) != start - 1) mismatches++;
+    return mismatches;
+}
+
+// Offset index (buffer.c) against a recount after each of `edits` edits,
+// every twentieth of them a run of lines
+u32 check_offsets(buffer_t *buf, u32 edits) {
+    u32 state = CHECK_SEED;
+    u32 mismatches = check_offsets_rows(buf);
+    for (u32 i = 0; i < edits; i++) {
+        if (i % 20 == 0) {
+            check_run_edit(buf, &state);
+        } else {
+            check_edit(buf, &state);
+        }
+        mismatches += check_offsets_rows(buf);
+    }
+    return mismatches;
+}
+
+// The whole text of buf, copied; free with check_text_free
+static sp_str_t check_buffer_text(buffer_t *buf) {
+    return buffer_get_range(buf, 0, buffer_byte_count(buf));
+}
+
+static void check_text_free(sp_str_t text) {
+    if (text.len > 0) sp_free((void *)text.data);
+}
+
+// Select from the cursor to a random point up to two rows further on
+static void check_select(u32 *state) {
+    buffer_t *buf = &E.buffer;
+    E.select_start = E.cursor;
+    E.has_selection = true;
+    u32 row = E.cursor.row + check_below(state, 3);
+    if (row >= buf->line_count) row = buf->line_count - 1;
+    E.cursor.row = row;
+    E.cursor.col = check_below(state, buffer_get_line(buf, row).len + 1);
+}
+
+// One random editing step through the editor, the way keys make it: a
+// typed run, a run of backspaces, a selection deleted, a paste (over a
+// selection or not) or a line deleted. Each should leave exactly one undo
+// step behind.
+static void check_undo_step(u32 *state) {
+    static const c8 TYPED[] = "ab {}/*\"\t";
+    c8 text[128];
+    buffer_t *buf = &E.buffer;
+    E.mode = MODE_INSERT;
+    E.has_selection = false;
+    E.cursor.row = check_below(state, buf->line_count);
+    E.cursor.col = check_below(state, buffer_get_line(buf, E.cursor.row).len + 1);
+
+    switch (check_below(state, 5)) {
+        case 0: {
+            u32 n = 1 + check_below(state, 12);
+            for (u32 i = 0; i < n; i++) {
+                if (check_below(state, 8) == 0) editor_insert_newline();
+                else editor_insert_char(TYPED[check_below(state, sizeof(TYPED) - 1)]);
+            }
+            break;
+        }
+        case 1: {
+            u32 n = 1 + check_below(state, 6);
+            for (u32 i = 0; i < n; i++) editor_delete_char();
+            break;
+        }
+        case 2:
+            check_select(state);
+            editor_delete_char();
+            break;
+        case 3:
+            if (check_below(state, 2) == 0) check_select(state);
+            E.clipboard = check_text(state, text, sizeof(text));
+            editor_paste();
+            E.clipboard = sp_str_lit("");
+            break;
+        default:
+            editor_delete_line(E.cursor.row);
+            break;
+    }
+    undo_break();
+}
+
+// Undo log (undo.c) against snapshots of the text: after `edits` editing
+// steps on E.buffer, undo them all and redo them all, comparing the text
+// with the snapshot for each step. A step that left other than one undo
+// step behind counts as a mismatch too.
+u32 check_undo(u32 edits) {
+    buffer_t *buf = &E.buffer;
+    sp_str_t *texts = sp_alloc(sizeof(sp_str_t) * (edits + 1));
+    if (!texts) return 1;
+
+    u32 state = CHECK_SEED;
+    u32 steps = 0;
+    u32 mismatches = 0;
+    texts[0] = check_buffer_text(buf);
+    for (u32 i = 0; i < edits; i++) {
+        u32 before = E.undo.count;
+        check_undo_step(&state);
+        sp_str_t text = check_buffer_text(buf);
+        if (E.undo.count == before) {
+            // Nothing to record means nothing may have changed
+            if (!sp_str_equal(text, texts[steps])) mismatches++;
+            check_text_free(text);
+            continue;
+        }
+        if (E.undo.count != before + 1) mismatches++;
+        texts[++steps] = text;
+    }
+
+    for (u32 i = steps; i > 0; i--) {
+        undo_perform();
+        sp_str_t text = check_buffer_text(buf);
+        if (!sp_str_equal(text, texts[i - 1])) mismatches++;
+        check_text_free(text);
+    }
+    for (u32 i = 1; i <= steps; i++) {
+        redo_perform();
+        sp_str_t text = check_buffer_text(buf);
+        if (!sp_str_equal(text, texts[i])) mismatches++;
+        check_text_free(text);
+    }
+
+    for (u32 i = 0; i <= steps; i++) check_text_free(texts[i]);
+    sp_free(texts);
+    return mismatches;
+}
+
+static bool check_match_equal(const regex_match_t *a, const regex_match_t *b, u32 groups) {
+    for (u32 g = 0; g < groups && g < REGEX_MAX_GROUPS; g++) {
+        if (a->start[g] != b->start[g] || a->end[g] != b->end[g]) return false;
+    }
+    return true;
+}
+
+// What search_replace_all should turn line into, from the reference
+// matcher: \0-\9 insert a group, \ takes the next byte literally, and an
+// empty match keeps the byte after it and moves past. Adds the matches
+// replaced to *count.
+static sp_str_t check_replace_line(regex_prog_t *re, sp_str_t line, sp_str_t replacement, u32 *count) {
+    sp_io_writer_t writer = sp_io_writer_from_dyn_mem();
+    sp_str_builder_t out = sp_str_builder_from_writer(&writer);
+    regex_match_t m;
+    u32 col = 0;
+    u32 from = 0;
+    while (regex_find_reference(re, line, from, &m)) {
+        (*count)++;
+        sp_str_builder_append(&out, sp_str_sub(line, (s32)col, (s32)(m.start[0] - col)));
+        for (u32 i = 0; i < replacement.len; i++) {
+            c8 c = replacement.data[i];
+            if (c == '\\' && i + 1 < replacement.len) {
+                c = replacement.data[++i];
+                if (c >= '0' && c <= '9') {
+                    u32 g = (u32)(c - '0');
+                    if (m.start[g] != UINT32_MAX) {
+                        sp_str_builder_append(&out, sp_str_sub(line, (s32)m.start[g], (s32)(m.end[g] - m.start[g])));
+                    }
+                    continue;
+                }
+            }
+            sp_str_builder_append_c8(&out, c);
+        }
+        col = m.end[0];
+        from = col;
+        if (m.start[0] == m.end[0]) {
+            if (col < line.len) sp_str_builder_append_c8(&out, line.data[col++]);
+            from = m.start[0] + 1;
+        }
+    }
+    sp_str_builder_append(&out, sp_str_sub(line, (s32)col, (s32)(line.len - col)));
+    return sp_str_builder_to_str(&out);
+}
+
+// Regex engine (regex.c) against the backtracking reference: the match
+// and groups from every start column of every row of E.buffer, then each
+// row search_replace_all rewrites with E.search.query. *matches gets the
+// number of matches replaced.
+u32 check_regex(regex_prog_t *re, sp_str_t replacement, u32 *matches) {
+    buffer_t *buf = &E.buffer;
+    u32 groups = regex_group_count(re);
+    u32 rows = buf->line_count;
+    u32 mismatches = 0;
+    u32 count = 0;
+
+    sp_str_t *expected = sp_alloc(sizeof(sp_str_t) * (rows > 0 ? rows : 1));
+    if (!expected) return 1;
+    for (u32 row = 0; row < rows; row++) {
+        sp_str_t line = buffer_get_line(buf, row);
+        for (u32 from = 0; from <= line.len; from++) {
+            regex_match_t a, b;
+            bool found = regex_find(re, line, from, &a);
+            if (found != regex_find_reference(re, line, from, &b) || (found && !check_match_equal(&a, &b, groups))) {
+                mismatches++;
+            }
+        }
+        expected[row] = check_replace_line(re, line, replacement, &count);
+    }
+
+    search_replace_all(replacement);
+    if (buf->line_count != rows) mismatches++;
+    for (u32 row = 0; row < rows; row++) {
+        if (row < buf->line_count && !sp_str_equal(buffer_get_line(buf, row), expected[row])) mismatches++;
+        if (expected[row].data) sp_free((void *)expected[row].data);
+    }
+    sp_free(expected);
+    if (matches) *matches = count;
+    return mismatches;
+}
+
+// Runs and end state of every row, to hold one highlight of a buffer
+// against another
+typedef struct {
+    hl_span_t *spans;
+    u32 *at;      // row i's runs are spans[at[i], at[i + 1])
+    syntax_line_state_t *states;
+    u32 rows;
+} check_hl_t;
+
+static void check_hl_free(check_hl_t *hl) {
+    if (hl->spans) sp_free(hl->spans);
+    if (hl->at) sp_free(hl->at);
+    if (hl->states) sp_free(hl->states);
+    *hl = (check_hl_t){0};
+}
+
+static bool check_hl_take(buffer_t *buf, check_hl_t *hl) {
+    *hl = (check_hl_t){0};
+    u32 total = 0;
+    for (u32 row = 0; row < buf->line_count; row++) {
+        u32 count = 0;
+        if (buffer_line_spans(buf, row, &count)) total += count;
+    }
+    hl->rows = buf->line_count;
+    hl->spans = sp_alloc(sizeof(hl_span_t) * (total > 0 ? total : 1));
+    hl->at = sp_alloc(sizeof(u32) * (hl->rows + 1));
+    hl->states = sp_alloc(sizeof(syntax_line_state_t) * (hl->rows > 0 ? hl->rows : 1));
+    if (!hl->spans || !hl->at || !hl->states) {
+        check_hl_free(hl);
+        return false;
+    }
+
+    u32 used = 0;
+    for (u32 row = 0; row < hl->rows; row++) {
+        u32 count = 0;
+        const hl_span_t *spans = buffer_line_spans(buf, row, &count);
+        hl->at[row] = used;
+        if (spans) memcpy(hl->spans + used, spans, sizeof(hl_span_t) * count);
+        if (spans) used += count;
+        hl->states[row] = buffer_line(buf, row)->hl_state;
+    }
+    hl->at[hl->rows] = used;
+    return true;
+}
+
+// Rows whose runs, or end states when states is set, differ between hl
+// and buf as highlighted now
+static u32 check_hl_diff(buffer_t *buf, const check_hl_t *hl, bool states) {
+    if (buf->line_count != hl->rows) return buf->line_count > hl->rows ? buf->line_count : hl->rows;
+    u32 rows = 0;
+    for (u32 row = 0; row < hl->rows; row++) {
+        u32 count = 0;
+        const hl_span_t *spans = buffer_line_spans(buf, row, &count);
+        if (!spans) count = 0;
+        bool same = count == hl->at[row + 1] - hl->at[row] &&
+                    (count == 0 || memcmp(spans, hl->spans + hl->at[row], sizeof(hl_span_t) * count) == 0);
+        if (states) same = same && syntax_state_equal(&buffer_line(buf, row)->hl_state, &hl->states[row]);
+        if (!same) rows++;
+    }
+    return rows;
+}
+
+// Incremental rehighlight (syntax.c) against a relex from the top: after
+// each of `edits` edits the whole of buf is highlighted the way the
+// display does it, then again with every row stale, and the runs and end
+// states of the two are compared. *relexed gets the rows the incremental
+// passes lexed.
+u32 check_relex(buffer_t *buf, u32 edits, u64 *relexed) {
+    u32 state = CHECK_SEED;
+    u32 mismatches = 0;
+    u64 total = 0;
+    syntax_highlight_buffer(buf, 0, buf->line_count);
+
+    for (u32 i = 0; i < edits; i++) {
+        check_edit(buf, &state);
+        syntax_highlight_buffer(buf, 0, buf->line_count);
+        u32 last = 0;
+        syntax_relex_stats(&last, SP_NULLPTR);
+        total += last;
+
+        check_hl_t hl;
+        if (!check_hl_take(buf, &hl)) return mismatches + 1;
+        // As after a language change: nothing cached is trusted
+        buf->hl_lang = SP_NULLPTR;
+        syntax_highlight_buffer(buf, 0, buf->line_count);
+        mismatches += check_hl_diff(buf, &hl, true);
+        check_hl_free(&hl);
+    }
+    if (relexed) *relexed = total;
+    return mismatches;
+}
+
+// Incremental reparse (treesitter.c) against a parse from scratch: after
+// each of `edits` edits the edited tree is reparsed and compared with a
+// fresh one, and the highlight limited to the rows it changed is compared
+// with one of every row from the same tree. *redone gets the rows the
+// incremental passes highlighted again.
+u32 check_reparse(buffer_t *buf, u32 edits, u64 *redone) {
+    u32 state = CHECK_SEED;
+    u32 mismatches = 0;
+    u64 total = 0;
+    if (!treesitter_check_reparse(buf, SP_NULLPTR)) return 1;
+    treesitter_highlight_buffer(buf, 0, buf->line_count);
+
+    for (u32 i = 0; i < edits; i++) {
+        check_edit(buf, &state);
+        u32 changed = 0;
+        if (!treesitter_check_reparse(buf, &changed)) mismatches++;
+        total += changed;
+        treesitter_highlight_buffer(buf, 0, buf->line_count);
+
+        check_hl_t hl;
+        if (!check_hl_take(buf, &hl)) return mismatches + 1;
+        // Every row again, from the same tree
+        for (u32 row = 0; row < buf->line_count; row++) {
+            buffer_line(buf, row)->hl_dirty = true;
+        }
+        treesitter_highlight_buffer(buf, 0, buf->line_count);
+        mismatches += check_hl_diff(buf, &hl, false);
+        check_hl_free(&hl);
+    }
+    if (redone) *redone = total;
+    return mismatches;
+}
@@ -9,6 +9,11 @@
 
 #include "ted.h"
 
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
 typedef bool (*command_handler_fn)(sp_str_t arg);
 
 typedef struct {
@@ -140,6 +145,7 @@ static bool cmd_write_quit(sp_str_t arg) {
 
 static bool cmd_force_quit(sp_str_t arg) {
     (void)arg;
+    save_wait();
     display_clear();
     exit(0);
 }
@@ -172,6 +178,26 @@ static bool cmd_set(sp_str_t arg) {
     } else if (sp_str_equal(arg, sp_str_lit("nowrap"))) {
         E.config.auto_wrap = false;
         editor_set_message("Auto wrap disabled");
+    } else if (sp_str_equal(arg, sp_str_lit("regex"))) {
+        E.search.regex = true;
+        if (E.search.query.len > 0) search_update_query(E.search.query);
+        editor_set_message("Regex search enabled");
+    } else if (sp_str_equal(arg, sp_str_lit("noregex"))) {
+        E.search.regex = false;
+        if (E.search.query.len > 0) search_update_query(E.search.query);
+        editor_set_message("Regex search disabled");
+    } else if (sp_str_starts_with(arg, sp_str_lit("lookahead="))) {
+        // Rows highlighted above and below the screen
+        u32 rows = parse_u32(sp_str_sub(arg, 10, (s32)arg.len - 10));
+        if (rows > 1000000) rows = 1000000;
+        E.config.hl_lookahead = rows;
+        editor_set_message("Highlight lookahead: %u rows", E.config.hl_lookahead);
+    } else if (sp_str_starts_with(arg, sp_str_lit("undomem="))) {
+        // Cap in MB for each of the undo and redo logs, 0 for no cap
+        u32 mb = parse_u32(sp_str_sub(arg, 8, (s32)arg.len - 8));
+        if (mb > 4095) mb = 4095;
+        E.config.undo_limit = mb << 20;
+        editor_set_message("Undo memory: %u MB cap, %u KB used", mb, undo_memory_used() / 1024);
     } else {
         editor_set_message("Unknown option: %.*s", (int)arg.len, arg.data);
     }
@@ -185,6 +211,24 @@ static bool cmd_syntax(sp_str_t arg) {
     } else if (sp_str_equal(arg, sp_str_lit("off"))) {
         E.config.syntax_enabled = false;
         editor_set_message("Syntax highlighting disabled");
+    } else if (sp_str_equal(arg, sp_str_lit("stats"))) {
+        u32 last = 0;
+        u64 total = 0;
+        syntax_relex_stats(&last, &total);
+        u32 spans = 0;
+        u64 bytes = 0;
+        buffer_highlight_stats(&E.buffer, &spans, &bytes);
+        editor_set_message("Syntax: last frame re-lexed %u of %u lines (%llu total), %u runs (%llu B) for %llu bytes",
+                           last, E.buffer.line_count, (unsigned long long)total, spans,
+                           (unsigned long long)spans * sizeof(hl_span_t), (unsigned long long)bytes);
+        u32 rows = 0;
+        u32 chunks = 0;
+        u32 fixed = 0;
+        f64 ms = 0.0;
+        if (syntax_background_stats(&rows, &chunks, &fixed, &ms)) {
+            editor_set_message("Syntax: re-lexed %u; background %u lines, %u chunks x %u threads, %u fixed, %.0f ms",
+                               last, rows, chunks, pool_threads(), fixed, ms);
+        }
     } else if (sp_str_equal(arg, sp_str_lit("tree on"))) {
         sp_str_t reason = sp_str_lit("");
         if (!treesitter_set_enabled(true, &reason)) {
@@ -202,12 +246,23 @@ static bool cmd_syntax(sp_str_t arg) {
     } else if (sp_str_equal(arg, sp_str_lit("tree inspect"))) {
         sp_str_t s = treesitter_describe_cursor(&E.buffer, E.cursor.row, E.cursor.col);
         editor_set_message("tree-sitter: %.*s", (int)s.len, s.data);
-    } else if (sp_str_equal(arg, sp_str_lit("tree select"))) {
+    } else if (sp_str_equal(arg, sp_str_lit("tree select")) ||
+               sp_str_equal(arg, sp_str_lit("tree expand")) ||
+               sp_str_equal(arg, sp_str_lit("tree shrink"))) {
         u32 start_row = 0, start_col = 0, end_row = 0, end_col = 0;
         sp_str_t summary = sp_str_lit("");
-        if (!treesitter_node_range_at_cursor(&E.buffer, E.cursor.row, E.cursor.col,
+        bool ok;
+        if (sp_str_equal(arg, sp_str_lit("tree select"))) {
+            ok = treesitter_node_range_at_cursor(&E.buffer, E.cursor.row, E.cursor.col,
+                                                 &start_row, &start_col, &end_row, &end_col,
+                                                 &summary);
+        } else {
+            ok = treesitter_resize_selection(&E.buffer, E.cursor.row, E.cursor.col,
+                                             sp_str_equal(arg, sp_str_lit("tree expand")),
                                              &start_row, &start_col, &end_row, &end_col,
-                                             &summary)) {
+                                             &summary);
+        }
+        if (!ok) {
             editor_set_message("tree-sitter: %.*s", (int)summary.len, summary.data);
             return true;
         }
@@ -218,7 +273,7 @@ static bool cmd_syntax(sp_str_t arg) {
         }
         if (end_row >= E.buffer.line_count) {
             end_row = E.buffer.line_count - 1;
-            end_col = E.buffer.lines[end_row].text.len;
+            end_col = buffer_get_line(&E.buffer, end_row).len;
         }
 
         E.select_start.row = start_row;
@@ -258,7 +313,7 @@ static bool cmd_syntax(sp_str_t arg) {
         command_reveal_cursor();
         editor_set_message("tree-sitter %s: %.*s", label, (int)summary.len, summary.data);
     } else {
-        editor_set_message("Usage: :syntax on|off|tree on|tree off|tree status|tree inspect|tree select|tree parent|tree prev|tree next");
+        editor_set_message("Usage: :syntax on|off|stats|tree on|tree off|tree status|tree inspect|tree select|tree expand|tree shrink|tree parent|tree prev|tree next");
     }
     return true;
 }
@@ -490,6 +545,129 @@ static bool cmd_recognizers(sp_str_t arg) {
     return true;
 }
 
+// Definitions from the cursor on, as many as fit the message bar
+static bool cmd_outline(sp_str_t arg) {
+    (void)arg;
+    u32 count = 0;
+    sp_str_t summary = sp_str_lit("");
+    if (!treesitter_outline_update(&E.buffer, &count, &summary)) {
+        editor_set_message("Outline: %.*s", (int)summary.len, summary.data);
+        return true;
+    }
+
+    outline_symbol_t syms[32];
+    u32 n = treesitter_outline_list(&E.buffer, E.cursor.row, syms, 32);
+    c8 line[256];
+    u32 width = E.screen_cols > 0 && E.screen_cols < sizeof(line) ? E.screen_cols : sizeof(line) - 1;
+    s32 used = snprintf(line, sizeof(line), "Outline: %u |", count);
+    for (u32 i = 0; i < n && used > 0 && (u32)used < width; i++) {
+        s32 more = snprintf(line + used, sizeof(line) - (u32)used, " %s %.*s:%u",
+                            treesitter_outline_kind_name(syms[i].kind),
+                            (int)syms[i].name.len, syms[i].name.data, syms[i].row + 1);
+        if (more < 0 || (u32)(used + more) > width) {
+            line[used] = '\0';
+            break;
+        }
+        used += more;
+    }
+    editor_set_message("%s", line);
+    return true;
+}
+
+// Jump to a definition by name, or by prefix when no name matches
+static bool cmd_sym(sp_str_t arg) {
+    if (arg.len == 0) {
+        editor_set_message("Usage: :sym <name>");
+        return true;
+    }
+
+    sp_str_t summary = sp_str_lit("");
+    if (!treesitter_outline_update(&E.buffer, SP_NULLPTR, &summary)) {
+        editor_set_message("Outline: %.*s", (int)summary.len, summary.data);
+        return true;
+    }
+    outline_symbol_t sym;
+    u32 matches = treesitter_outline_find(&E.buffer, arg, E.cursor.row, &sym);
+    if (matches == 0) {
+        editor_set_message("No definition of %.*s", (int)arg.len, arg.data);
+        return true;
+    }
+
+    E.cursor.row = sym.row;
+    E.cursor.col = sym.col;
+    E.cursor.render_col = buffer_row_to_render(&E.buffer, sym.row, sym.col);
+    E.has_selection = false;
+    command_reveal_cursor();
+    editor_set_message("%s %.*s:%u (%u match%s)", treesitter_outline_kind_name(sym.kind),
+                       (int)sym.name.len, sym.name.data, sym.row + 1, matches, matches == 1 ? "" : "es");
+    return true;
+}
+
+static bool command_is_open(const c8 *path) {
+    if (E.buffer.filename.len == 0 || E.buffer.filename.len >= PATH_MAX) return false;
+    c8 open_path[PATH_MAX];
+    c8 open_real[PATH_MAX];
+    c8 real[PATH_MAX];
+    memcpy(open_path, E.buffer.filename.data, E.buffer.filename.len);
+    open_path[E.buffer.filename.len] = '\0';
+    if (!realpath(open_path, open_real) || !realpath(path, real)) return strcmp(open_path, path) == 0;
+    return strcmp(open_real, real) == 0;
+}
+
+// Jump to a definition anywhere under the working directory. The first
+// :tag of a session refreshes the index in the background; lookups are
+// served from the last index written meanwhile. Repeating a name steps
+// through its matches, and :tag alone reindexes.
+static bool cmd_tag(sp_str_t arg) {
+    static bool refreshed = false;
+    static sp_str_t last = {0};
+    static u32 nth = 0;
+
+    if (arg.len == 0 || !refreshed) {
+        if (!tags_refresh(".") || arg.len == 0) {
+            editor_set_message("%s", tags_status());
+            return true;
+        }
+        refreshed = true;
+    }
+
+    bool again = sp_str_equal(arg, last);
+    nth = again ? nth + 1 : 0;
+    if (!again) {
+        if (last.data) sp_free((void *)last.data);
+        last = sp_str_copy(arg);
+    }
+
+    tag_match_t tag;
+    u32 matches = tags_find(arg, nth, &tag);
+    if (matches == 0) {
+        editor_set_message("No tag %.*s%s", (int)arg.len, arg.data, tags_busy() ? " yet (indexing...)" : "");
+        return true;
+    }
+
+    c8 path[PATH_MAX];
+    snprintf(path, sizeof(path), "%.*s", (int)tag.path.len, tag.path.data);
+    if (!command_is_open(path)) {
+        if (E.buffer.modified) {
+            editor_set_message("Unsaved changes! Use :w first or :e! to force");
+            return true;
+        }
+        editor_open(sp_str_from_cstr(path));
+    }
+
+    editor_goto_line(tag.row + 1);
+    if (E.cursor.row == tag.row) {
+        sp_str_t line = buffer_get_line(&E.buffer, tag.row);
+        E.cursor.col = tag.col <= line.len ? tag.col : line.len;
+        E.cursor.render_col = buffer_row_to_render(&E.buffer, tag.row, E.cursor.col);
+    }
+    E.has_selection = false;
+    command_reveal_cursor();
+    editor_set_message("%s %.*s %s:%u (%u/%u)", treesitter_outline_kind_name(tag.kind), (int)tag.name.len,
+                       tag.name.data, path, tag.row + 1, nth % matches + 1, matches);
+    return true;
+}
+
 static bool cmd_sketch(sp_str_t arg) {
     if (arg.len == 0 || sp_str_equal(arg, sp_str_lit("status"))) {
         sp_str_t s = sketch_status();
@@ -554,6 +732,9 @@ static const command_spec_t COMMANDS[] = {
     { "targets", cmd_targets },
     { "recognizers", cmd_recognizers },
     { "sketch", cmd_sketch },
+    { "outline", cmd_outline },
+    { "sym", cmd_sym },
+    { "tag", cmd_tag },
 };
 
 void command_execute(sp_str_t cmd) {
@@ -11,6 +11,8 @@ static const cui_theme_t CUI_THEME_JOBS = {
     .fg_accent = "\033[38;5;51m",
     .fg_warning = "\033[38;5;220m",
     .bg_elevated = "\033[48;5;234m",
+    .bg_match = "\033[48;5;94m",
+    .bg_normal = "\033[49m",
 };
 
 const cui_theme_t *cui_theme_jobs(void) {
@@ -14,6 +14,8 @@ typedef struct {
     const c8 *fg_accent;
     const c8 *fg_warning;
     const c8 *bg_elevated;
+    const c8 *bg_match;
+    const c8 *bg_normal;
 } cui_theme_t;
 
 const cui_theme_t *cui_theme_jobs(void);
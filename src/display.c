@@ -45,7 +45,7 @@ static const c8* display_context_hint(void) {
 static bool display_show_empty_state(void) {
     if (E.mode != MODE_NORMAL) return false;
     if (E.buffer.line_count != 1) return false;
-    if (E.buffer.lines[0].text.len != 0) return false;
+    if (buffer_get_line(&E.buffer, 0).len != 0) return false;
     return (E.buffer.filename.len == 0 ||
             sp_str_equal(E.buffer.filename, sp_str_lit("[No Name]")));
 }
@@ -218,18 +218,17 @@ void display_draw_rows(void) {
 
     u32 gutter_width = E.config.show_line_numbers ? 5 : 0;
     u32 text_width = E.screen_cols - gutter_width;
-    bool need_rehighlight = false;
 
+    buffer_ensure_rows(&E.buffer, E.row_offset + E.screen_rows);
+
+    // Highlight the screen plus a lookahead margin on either side, so
+    // scrolling a few rows finds them ready
     if (E.config.syntax_enabled) {
-        for (u32 i = 0; i < E.buffer.line_count; i++) {
-            if (!E.buffer.lines[i].hl_dirty) continue;
-            need_rehighlight = true;
-            break;
-        }
-    }
-    if (need_rehighlight) {
-        if (!treesitter_highlight_buffer(&E.buffer)) {
-            syntax_highlight_buffer(&E.buffer);
+        u32 margin = E.config.hl_lookahead;
+        u32 first = E.row_offset > margin ? E.row_offset - margin : 0;
+        u32 last = E.row_offset + E.screen_rows + margin;
+        if (!treesitter_highlight_buffer(&E.buffer, first, last)) {
+            syntax_highlight_buffer(&E.buffer, first, last);
         }
     }
 
@@ -254,31 +253,68 @@ void display_draw_rows(void) {
             // Get line content
             sp_str_t line = buffer_get_line(&E.buffer, file_row);
 
-            // line_info->hl is maintained by buffer-level rehighlight above.
-            line_t *line_info = &E.buffer.lines[file_row];
-
             // Handle horizontal scrolling
             u32 col_start = E.col_offset;
             u32 col_end = col_start + text_width;
             if (col_end > line.len) col_end = line.len;
 
-            // Render line with syntax highlighting and selection
+            // Search matches come from a cache keyed by row, so scrolling
+            // back over a row does not search it again until the text or
+            // query changes.
+            u32 match_count = 0;
+            const u32 *matches = search_line_matches(&E.buffer, file_row, &match_count);
+            u32 match_idx = 0;
+
+            // Syntax runs from the rehighlight above, walked alongside the
+            // columns
+            u32 run_count = 0;
+            const hl_span_t *runs = E.config.syntax_enabled
+                ? buffer_line_spans(&E.buffer, file_row, &run_count) : SP_NULLPTR;
+            u32 run_idx = 0;
+            u32 run_start = 0;
+            u32 run_end = 0;
+            highlight_type_t run_kind = HL_NORMAL;
+
+            // Render line with syntax highlighting, search matches and selection
             highlight_type_t current_hl = HL_NORMAL;
             bool in_selection = false;
+            bool in_match = false;
 
             for (u32 i = col_start; i < col_end; i++) {
                 c8 c = line.data[i];
                 bool selected = is_selected(file_row, i);
 
                 // Apply syntax color if enabled
-                if (E.config.syntax_enabled && line_info->hl && i < line.len) {
-                    highlight_type_t hl = line_info->hl[i];
+                if (runs) {
+                    while (run_end <= i && run_idx < run_count) {
+                        run_start = run_end + runs[run_idx].skip;
+                        run_end = run_start + runs[run_idx].len;
+                        run_kind = (highlight_type_t)runs[run_idx].kind;
+                        run_idx++;
+                    }
+                    highlight_type_t hl = (i >= run_start && i < run_end) ? run_kind : HL_NORMAL;
                     if (hl != current_hl) {
                         sp_io_write_cstr(&stdout_writer, syntax_color_to_ansi(hl));
                         current_hl = hl;
+                        // HL_NORMAL resets every attribute
+                        if (hl == HL_NORMAL) in_selection = in_match = false;
                     }
                 }
 
+                // Apply search match background
+                bool matched = false;
+                if (matches) {
+                    while (match_idx < match_count &&
+                           matches[match_idx * 2] + matches[match_idx * 2 + 1] <= i) {
+                        match_idx++;
+                    }
+                    matched = match_idx < match_count && matches[match_idx * 2] <= i;
+                }
+                if (matched != in_match) {
+                    sp_io_write_cstr(&stdout_writer, matched ? CUI->bg_match : CUI->bg_normal);
+                    in_match = matched;
+                }
+
                 // Apply selection highlight
                 if (selected != in_selection) {
                     if (selected) {
@@ -364,8 +400,9 @@ void display_draw_message_bar(void) {
             sp_io_write_cstr(&stdout_writer, "/");
             sp_io_write_str(&stdout_writer, E.command_buffer);
             sp_io_write_cstr(&stdout_writer, CUI->reset);
-            if (E.search.match_count > 0) {
-                sp_str_t count = sp_format(" ({} matches)", SP_FMT_U32(E.search.match_count));
+            if (E.search.match_count > 0 || E.search.counting) {
+                sp_str_t count = sp_format(E.search.counting ? " ({}+ matches)" : " ({} matches)",
+                                           SP_FMT_U32(E.search.match_count));
                 sp_io_write_cstr(&stdout_writer, CUI->fg_muted);
                 sp_io_write_str(&stdout_writer, count);
                 sp_io_write_cstr(&stdout_writer, CUI->reset);
@@ -38,6 +38,8 @@ void editor_init(void) {
     E.config.auto_wrap = false;
     E.config.show_whitespace = false;
     E.config.tab_width = TAB_WIDTH_DEFAULT;
+    E.config.undo_limit = UNDO_LIMIT_DEFAULT;
+    E.config.hl_lookahead = HL_LOOKAHEAD_DEFAULT;
 
     E.mode = MODE_NORMAL;
     E.has_selection = false;
@@ -60,12 +62,62 @@ void editor_init(void) {
 }
 
 void editor_open(sp_str_t filename) {
+    // A running save, highlight pass or parse still reads the current
+    // buffer's storage
+    save_wait();
+    syntax_cancel();
+    treesitter_cancel();
+    undo_break();
+    undo_clear(&E.undo);
+    undo_clear(&E.redo);
     buffer_load_file(&E.buffer, filename);
     E.cursor = (cursor_t){0, 0, 0};
     E.row_offset = 0;
     E.col_offset = 0;
+    E.end_pending = false;
 
-    editor_set_message("Opened - %u lines", E.buffer.line_count);
+    if (E.buffer.map) {
+        editor_set_message("Opened (mapped) - indexing lines...");
+    } else {
+        editor_set_message("Opened - %u lines", E.buffer.line_count);
+    }
+}
+
+// Called once per main loop iteration to surface background progress.
+void editor_poll_background(void) {
+    static s32 last_progress = -1;
+
+    save_poll();
+    search_poll();
+    syntax_poll();
+    treesitter_poll();
+    if (tags_poll()) editor_set_message("%s", tags_status());
+    u32 percent = 0;
+    f64 rate = 0.0;
+    if (save_progress(&percent, &rate)) {
+        editor_set_message("Saving: %u%% (%.0f MB/s)", percent, rate);
+    }
+
+    s32 progress = buffer_index_progress(&E.buffer);
+    // Finish a G made while indexing, unless the cursor has moved on
+    if (E.end_pending && progress < 0) {
+        E.end_pending = false;
+        if (E.mode == MODE_NORMAL && E.cursor.row == E.end_pending_row) editor_goto_end();
+    }
+    if (progress == last_progress) return;
+
+    bool exact = false;
+    u32 total = buffer_total_lines(&E.buffer, &exact);
+    if (progress >= 0) {
+        editor_set_message("Indexing: %d%% (%u+ lines)", progress, total);
+    } else if (last_progress >= 0) {
+        editor_set_message("Indexed %u lines", total);
+    }
+    last_progress = progress;
+}
+
+bool editor_background_busy(void) {
+    return save_in_progress() || tags_busy() || buffer_index_progress(&E.buffer) >= 0 || E.end_pending;
 }
 
 bool editor_save(void) {
@@ -76,15 +128,14 @@ bool editor_save(void) {
         return false;
     }
 
-    if (!buffer_save_file(&E.buffer)) {
-        editor_set_message("Save failed");
-        return false;
-    }
-    editor_set_message("Saved %u lines", E.buffer.line_count);
+    // Completion is reported by editor_poll_background
+    if (!save_start(&E.buffer)) return false;
+    editor_set_message("Saving...");
     return true;
 }
 
 void editor_quit(void) {
+    save_wait();
     if (E.buffer.modified) {
         editor_set_message("Warning: Unsaved changes will be lost. Use :w to save.");
         display_refresh();
@@ -97,6 +148,9 @@ void editor_move_cursor(u32 key) {
     cursor_t *c = &E.cursor;
     buffer_t *buf = &E.buffer;
 
+    // Moving down or right may step onto a line not materialized yet
+    buffer_ensure_rows(buf, c->row + 2);
+
     // Ensure buffer has at least one line
     if (buf->line_count == 0) {
         c->row = 0;
@@ -124,7 +178,7 @@ void editor_move_cursor(u32 key) {
             break;
 
         case KEY_RIGHT: // Right
-            if (c->col < buf->lines[c->row].text.len) {
+            if (c->col < buffer_get_line(buf, c->row).len) {
                 c->col++;
             } else if (c->row + 1 < buf->line_count) {
                 // Move to next line
@@ -139,7 +193,7 @@ void editor_move_cursor(u32 key) {
             } else if (c->row > 0) {
                 // Move to end of previous line
                 c->row--;
-                c->col = buf->lines[c->row].text.len;
+                c->col = buffer_get_line(buf, c->row).len;
             }
             break;
 
@@ -148,13 +202,13 @@ void editor_move_cursor(u32 key) {
             break;
 
         case KEY_END: // End
-            c->col = buf->lines[c->row].text.len;
+            c->col = buffer_get_line(buf, c->row).len;
             break;
     }
 
     // Adjust column if past end of line
-    if (c->row < buf->line_count && c->col > buf->lines[c->row].text.len) {
-        c->col = buf->lines[c->row].text.len;
+    if (c->row < buf->line_count && c->col > buffer_get_line(buf, c->row).len) {
+        c->col = buffer_get_line(buf, c->row).len;
     }
 
     // Update render column
@@ -207,26 +261,11 @@ void editor_insert_newline(void) {
         editor_delete_selection();
     }
 
-    sp_str_t current_line = buffer_get_line(&E.buffer, E.cursor.row);
-    sp_str_t new_line_text;
-
-    // Split line at cursor
-    if (E.cursor.col < current_line.len) {
-        new_line_text = sp_str_sub(current_line, (s32)E.cursor.col, (s32)(current_line.len - E.cursor.col));
-
-        // Truncate current line
-        sp_str_t truncated = sp_str_sub(current_line, 0, (s32)E.cursor.col);
-        E.buffer.lines[E.cursor.row].text = truncated;
-        E.buffer.lines[E.cursor.row].hl_dirty = true;
-    } else {
-        new_line_text = sp_str_lit("");
-    }
-
     // Record for undo
-    undo_record_insert_line(E.cursor.row + 1, new_line_text);
+    undo_record_insert(E.cursor.row, E.cursor.col, '\n');
 
-    // Insert new line
-    buffer_insert_line(&E.buffer, E.cursor.row + 1, new_line_text);
+    // Split line at cursor
+    buffer_insert_text(&E.buffer, E.cursor.row, E.cursor.col, sp_str_lit("\n"), SP_NULLPTR, SP_NULLPTR);
     E.cursor.row++;
     E.cursor.col = 0;
     E.cursor.render_col = 0;
@@ -253,29 +292,20 @@ void editor_delete_char(void) {
 
     if (c->col > 0) {
         // Delete char before cursor
-        c8 deleted = buf->lines[c->row].text.data[c->col - 1];
+        c8 deleted = buffer_get_line(buf, c->row).data[c->col - 1];
         undo_record_delete(c->row, c->col - 1, deleted);
 
         buffer_delete_char_at(buf, c->row, c->col - 1);
         c->col--;
     } else if (c->row > 0) {
         // Join with previous line
-        u32 prev_len = buf->lines[c->row - 1].text.len;
-        sp_str_t current = buf->lines[c->row].text;
+        u32 prev_len = buffer_get_line(buf, c->row - 1).len;
 
         // Record for undo
-        undo_record_delete_line(c->row, current);
+        undo_record_delete(c->row - 1, prev_len, '\n');
 
         // Append current line to previous
-        sp_io_writer_t writer = sp_io_writer_from_dyn_mem();
-        sp_str_builder_t builder = sp_str_builder_from_writer(&writer);
-        sp_str_builder_append(&builder, buf->lines[c->row - 1].text);
-        sp_str_builder_append(&builder, current);
-        buf->lines[c->row - 1].text = sp_str_builder_to_str(&builder);
-        buf->lines[c->row - 1].hl_dirty = true;
-
-        // Delete current line
-        buffer_delete_line(buf, c->row);
+        buffer_delete_text(buf, c->row - 1, prev_len, c->row, 0);
         c->row--;
         c->col = prev_len;
     }
@@ -287,17 +317,20 @@ void editor_delete_line(u32 row) {
     if (row >= E.buffer.line_count) return;
     if (E.buffer.line_count <= 1) {
         // Don't delete last line, just clear it
-        E.buffer.lines[0].text = sp_str_lit("");
-        E.buffer.lines[0].hl_dirty = true;
-        E.buffer.modified = true;
+        undo_record_splice(0, 0, buffer_get_line(&E.buffer, 0), sp_str_lit(""));
+        buffer_set_line(&E.buffer, 0, sp_str_lit(""));
         E.cursor.col = 0;
         E.cursor.render_col = 0;
         return;
     }
 
-    // Record for undo
-    sp_str_t line_text = E.buffer.lines[row].text;
-    undo_record_delete_line(row, line_text);
+    // Record for undo; the last line takes the break before it along
+    if (row + 1 < E.buffer.line_count) {
+        undo_record_delete_text(row, 0, row + 1, 0);
+    } else {
+        undo_record_delete_text(row - 1, buffer_get_line(&E.buffer, row - 1).len,
+                                row, buffer_get_line(&E.buffer, row).len);
+    }
 
     buffer_delete_line(&E.buffer, row);
 
@@ -309,8 +342,8 @@ void editor_delete_line(u32 row) {
         if (E.cursor.row >= E.buffer.line_count) {
             E.cursor.row = E.buffer.line_count - 1;
         }
-        if (E.cursor.col > E.buffer.lines[E.cursor.row].text.len) {
-            E.cursor.col = E.buffer.lines[E.cursor.row].text.len;
+        if (E.cursor.col > buffer_get_line(&E.buffer, E.cursor.row).len) {
+            E.cursor.col = buffer_get_line(&E.buffer, E.cursor.row).len;
         }
     }
 }
@@ -334,7 +367,7 @@ static sp_str_t editor_get_selection(void) {
     sp_str_builder_t builder = sp_str_builder_from_writer(&writer);
 
     for (u32 row = start_row; row <= end_row && row < E.buffer.line_count; row++) {
-        sp_str_t line = E.buffer.lines[row].text;
+        sp_str_t line = buffer_get_line(&E.buffer, row);
         u32 line_len = line.len;
 
         if (row == start_row && row == end_row) {
@@ -385,65 +418,17 @@ static sp_str_t editor_delete_selection(void) {
 
     sp_str_t deleted = editor_get_selection();
 
-    if (start_row == end_row) {
-        // Single line - just delete characters
-        sp_str_t line = E.buffer.lines[start_row].text;
-        sp_io_writer_t writer = sp_io_writer_from_dyn_mem();
-        sp_str_builder_t builder = sp_str_builder_from_writer(&writer);
-
-        // Part before selection
-        if (start_col > 0) {
-            sp_str_t before = sp_str_sub(line, 0, (s32)start_col);
-            sp_str_builder_append(&builder, before);
-        }
-        // Part after selection
-        u32 line_len = line.len;
-        if (end_col < line_len) {
-            sp_str_t after = sp_str_sub(line, (s32)end_col, (s32)(line_len - end_col));
-            sp_str_builder_append(&builder, after);
-        }
-
-        E.buffer.lines[start_row].text = sp_str_builder_to_str(&builder);
-        E.buffer.lines[start_row].hl_dirty = true;
-        E.buffer.modified = true;
-
-        // Move cursor to start of selection
-        E.cursor.row = start_row;
-        E.cursor.col = start_col;
-    } else {
-        // Multi-line selection
-        sp_io_writer_t writer = sp_io_writer_from_dyn_mem();
-        sp_str_builder_t builder = sp_str_builder_from_writer(&writer);
-
-        // Keep part of first line before selection
-        sp_str_t first_line = E.buffer.lines[start_row].text;
-        if (start_col > 0 && start_col <= first_line.len) {
-            sp_str_t before = sp_str_sub(first_line, 0, (s32)start_col);
-            sp_str_builder_append(&builder, before);
-        }
-
-        // Append part of last line after selection
-        sp_str_t last_line = E.buffer.lines[end_row].text;
-        u32 last_len = last_line.len;
-        if (end_col < last_len) {
-            sp_str_t after = sp_str_sub(last_line, (s32)end_col, (s32)(last_len - end_col));
-            sp_str_builder_append(&builder, after);
-        }
-
-        // Replace first line with combined content
-        E.buffer.lines[start_row].text = sp_str_builder_to_str(&builder);
-        E.buffer.lines[start_row].hl_dirty = true;
-
-        // Delete lines between start and end (inclusive of end)
-        for (u32 i = end_row; i > start_row; i--) {
-            buffer_delete_line(&E.buffer, i);
-        }
-
-        E.buffer.modified = true;
+    undo_record_delete_text(start_row, start_col, end_row, end_col);
+    buffer_delete_text(&E.buffer, start_row, start_col, end_row, end_col);
 
-        // Move cursor to start of selection
-        E.cursor.row = start_row;
-        E.cursor.col = start_col;
+    // Move cursor to start of selection
+    E.cursor.row = start_row;
+    E.cursor.col = start_col;
+    if (E.cursor.row >= E.buffer.line_count) {
+        E.cursor.row = E.buffer.line_count > 0 ? E.buffer.line_count - 1 : 0;
+    }
+    if (E.cursor.row < E.buffer.line_count && E.cursor.col > buffer_get_line(&E.buffer, E.cursor.row).len) {
+        E.cursor.col = buffer_get_line(&E.buffer, E.cursor.row).len;
     }
 
     E.cursor.render_col = buffer_row_to_render(&E.buffer, E.cursor.row, E.cursor.col);
@@ -459,7 +444,7 @@ void editor_copy_line(void) {
         editor_set_message("Selection copied");
     } else if (E.cursor.row < E.buffer.line_count) {
         // Copy entire line
-        E.clipboard = sp_str_copy(E.buffer.lines[E.cursor.row].text);
+        E.clipboard = sp_str_copy(buffer_get_line(&E.buffer, E.cursor.row));
         editor_set_message("Line copied to clipboard");
     }
 }
@@ -471,7 +456,7 @@ void editor_cut_line(void) {
         editor_set_message("Selection cut");
     } else if (E.cursor.row < E.buffer.line_count) {
         // Cut entire line
-        E.clipboard = sp_str_copy(E.buffer.lines[E.cursor.row].text);
+        E.clipboard = sp_str_copy(buffer_get_line(&E.buffer, E.cursor.row));
         editor_delete_line(E.cursor.row);
         editor_set_message("Line cut to clipboard");
     }
@@ -491,125 +476,31 @@ void editor_paste(void) {
         E.cursor.row = E.buffer.line_count - 1;
     }
 
+    // Replacing a selection and pasting undo as one step
+    undo_begin();
+
     // If there's a selection, delete it first
     if (E.has_selection) {
         editor_delete_selection();
     }
 
-    // Check if clipboard contains newlines
-    bool has_newlines = false;
-    for (u32 i = 0; i < E.clipboard.len; i++) {
-        if (E.clipboard.data[i] == '\n') {
-            has_newlines = true;
-            break;
-        }
+    u32 start_row = E.cursor.row;
+    u32 start_col = E.cursor.col;
+    if (start_col > buffer_get_line(&E.buffer, start_row).len) {
+        start_col = buffer_get_line(&E.buffer, start_row).len;
     }
 
-    if (has_newlines) {
-        // Multi-line paste: split clipboard and insert lines
-        u32 start_row = E.cursor.row;
-        u32 start_col = E.cursor.col;
-
-        sp_str_t current_line = E.buffer.lines[start_row].text;
+    undo_record_splice(start_row, start_col, sp_str_lit(""), E.clipboard);
 
-        // Split current line at cursor
-        sp_str_t before_cursor = sp_str_lit("");
-        sp_str_t after_cursor = sp_str_lit("");
+    // Splice clipboard into the buffer at cursor
+    u32 end_row = start_row;
+    u32 end_col = start_col;
+    buffer_insert_text(&E.buffer, start_row, start_col, E.clipboard, &end_row, &end_col);
+    undo_end();
 
-        if (start_col > 0 && start_col <= current_line.len) {
-            before_cursor = sp_str_sub(current_line, 0, (s32)start_col);
-        }
-        if (start_col < current_line.len) {
-            after_cursor = sp_str_sub(current_line, (s32)start_col, (s32)(current_line.len - start_col));
-        }
-
-        // Parse clipboard and insert lines
-        u32 line_start = 0;
-        u32 inserted_count = 0;
-        u32 last_line_len = 0;
-
-        for (u32 i = 0; i <= E.clipboard.len; i++) {
-            if (i == E.clipboard.len || E.clipboard.data[i] == '\n') {
-                u32 line_len = i - line_start;
-                sp_str_t line_text = sp_str_sub(E.clipboard, (s32)line_start, (s32)line_len);
-
-                if (inserted_count == 0) {
-                    // First line: prepend before_cursor
-                    sp_io_writer_t writer = sp_io_writer_from_dyn_mem();
-                    sp_str_builder_t builder = sp_str_builder_from_writer(&writer);
-                    sp_str_builder_append(&builder, before_cursor);
-                    sp_str_builder_append(&builder, line_text);
-                    sp_str_t combined = sp_str_builder_to_str(&builder);
-
-                    undo_record_delete_line(start_row, E.buffer.lines[start_row].text);
-                    E.buffer.lines[start_row].text = combined;
-                    E.buffer.lines[start_row].hl_dirty = true;
-                    last_line_len = combined.len;
-                } else {
-                    // Subsequent lines
-                    u32 insert_at = start_row + inserted_count;
-                    sp_str_t text_to_insert = line_text;
-
-                    if (i == E.clipboard.len || (i == E.clipboard.len - 1 && E.clipboard.data[i] == '\n')) {
-                        // Last line: append after_cursor
-                        sp_io_writer_t writer = sp_io_writer_from_dyn_mem();
-                        sp_str_builder_t builder = sp_str_builder_from_writer(&writer);
-                        sp_str_builder_append(&builder, line_text);
-                        sp_str_builder_append(&builder, after_cursor);
-                        text_to_insert = sp_str_builder_to_str(&builder);
-                    }
-
-                    undo_record_insert_line(insert_at, text_to_insert);
-                    buffer_insert_line(&E.buffer, insert_at, text_to_insert);
-                    last_line_len = text_to_insert.len;
-                }
-
-                line_start = i + 1;
-                inserted_count++;
-            }
-        }
-
-        E.buffer.modified = true;
-
-        // Move cursor to end of pasted content
-        if (inserted_count == 1) {
-            E.cursor.col = last_line_len;
-        } else {
-            E.cursor.row = start_row + inserted_count - 1;
-            E.cursor.col = last_line_len;
-        }
-    } else {
-        // Single-line paste: insert at cursor position
-        u32 row = E.cursor.row;
-        u32 col = E.cursor.col;
-
-        sp_str_t line = E.buffer.lines[row].text;
-        sp_io_writer_t writer = sp_io_writer_from_dyn_mem();
-        sp_str_builder_t builder = sp_str_builder_from_writer(&writer);
-
-        // Part before cursor
-        if (col > 0 && col <= line.len) {
-            sp_str_t before = sp_str_sub(line, 0, (s32)col);
-            sp_str_builder_append(&builder, before);
-        }
-
-        // Pasted text
-        sp_str_builder_append(&builder, E.clipboard);
-
-        // Part after cursor
-        if (col < line.len) {
-            sp_str_t after = sp_str_sub(line, (s32)col, (s32)(line.len - col));
-            sp_str_builder_append(&builder, after);
-        }
-
-        undo_record_delete_line(row, E.buffer.lines[row].text);
-        E.buffer.lines[row].text = sp_str_builder_to_str(&builder);
-        E.buffer.lines[row].hl_dirty = true;
-        E.buffer.modified = true;
-
-        // Move cursor to end of pasted text
-        E.cursor.col = col + E.clipboard.len;
-    }
+    // Move cursor to end of pasted content
+    E.cursor.row = end_row;
+    E.cursor.col = end_col;
 
     E.cursor.render_col = buffer_row_to_render(&E.buffer, E.cursor.row, E.cursor.col);
     E.has_selection = false;
@@ -617,8 +508,20 @@ void editor_paste(void) {
     editor_set_message("Pasted from clipboard");
 }
 
+// Move to the last row. While a mapped file is still being indexed that
+// is the last row counted so far, and editor_poll_background moves on to
+// the real one when the count is done.
+void editor_goto_end(void) {
+    bool done = buffer_ensure_counted_rows(&E.buffer);
+    editor_goto_line(E.buffer.line_count);
+    E.end_pending = !done;
+    E.end_pending_row = E.cursor.row;
+    if (!done) editor_set_message("Indexing... at line %u so far", E.cursor.row + 1);
+}
+
 void editor_goto_line(u32 line) {
     if (line == 0) line = 1;
+    buffer_ensure_rows(&E.buffer, line + E.screen_rows);
     if (line > E.buffer.line_count) line = E.buffer.line_count;
     if (E.buffer.line_count == 0) return;
 
@@ -47,6 +47,8 @@ typedef enum {
     TED_CFUNC_SKETCH_CLEAR,
     TED_CFUNC_SKETCH_STATUS,
     TED_CFUNC_SKETCH_SHAPES,
+    TED_CFUNC_POINT_TO_OFFSET,
+    TED_CFUNC_OFFSET_TO_POINT,
     TED_CFUNC_COUNT,
 } ted_cfunc_id_t;
 
@@ -84,43 +86,37 @@ static JSValue ted_js_sketch_mode(JSContext *ctx, JSValue *this_val, int argc, J
 static JSValue ted_js_sketch_clear(JSContext *ctx, JSValue *this_val, int argc, JSValue *argv);
 static JSValue ted_js_sketch_status(JSContext *ctx, JSValue *this_val, int argc, JSValue *argv);
 static JSValue ted_js_sketch_shapes(JSContext *ctx, JSValue *this_val, int argc, JSValue *argv);
+static JSValue ted_js_point_to_offset(JSContext *ctx, JSValue *this_val, int argc, JSValue *argv);
+static JSValue ted_js_offset_to_point(JSContext *ctx, JSValue *this_val, int argc, JSValue *argv);
 
 static sp_str_t ted_buffer_to_text(void) {
-    sp_io_writer_t writer = sp_io_writer_from_dyn_mem();
-    sp_str_builder_t b = sp_str_builder_from_writer(&writer);
-
-    for (u32 i = 0; i < E.buffer.line_count; i++) {
-        sp_str_builder_append(&b, E.buffer.lines[i].text);
-        if (i + 1 < E.buffer.line_count) {
-            sp_str_builder_append_c8(&b, '\n');
-        }
-    }
-    return sp_str_builder_to_str(&b);
+    buffer_ensure_all_rows(&E.buffer);
+    return buffer_get_range(&E.buffer, 0, buffer_byte_count(&E.buffer));
 }
 
-static void ted_replace_text(sp_str_t text) {
-    while (E.buffer.line_count > 0) {
-        buffer_delete_line(&E.buffer, 0);
+// Materialize mapped lines only as far as byte offset `end` reaches.
+static void ted_ensure_offset(u64 end) {
+    while (buffer_is_partial(&E.buffer) && buffer_byte_count(&E.buffer) < end) {
+        buffer_ensure_rows(&E.buffer, E.buffer.line_count + 65536);
     }
+}
 
-    u32 start = 0;
-    for (u32 i = 0; i < text.len; i++) {
-        if (text.data[i] != '\n') continue;
-        sp_str_t line = sp_str_sub(text, (s32)start, (s32)(i - start));
-        buffer_insert_line(&E.buffer, E.buffer.line_count, line);
-        start = i + 1;
-    }
+static bool ted_js_to_offset(JSContext *ctx, JSValue v, u64 *out) {
+    double d = 0;
+    if (JS_ToNumber(ctx, &d, v)) return false;
+    if (d >= 18446744073709551615.0) *out = UINT64_MAX;
+    else *out = d > 0 ? (u64)d : 0;
+    return true;
+}
 
-    if (start < text.len) {
-        sp_str_t line = sp_str_sub(text, (s32)start, (s32)(text.len - start));
-        buffer_insert_line(&E.buffer, E.buffer.line_count, line);
-    } else if (text.len > 0 && text.data[text.len - 1] == '\n') {
-        buffer_insert_line(&E.buffer, E.buffer.line_count, sp_str_lit(""));
-    }
+static void ted_replace_text(sp_str_t text) {
+    sp_str_t old = ted_buffer_to_text();
+    undo_record_splice(0, 0, old, text);
+    if (old.len > 0) sp_free((void *)old.data);
 
-    if (E.buffer.line_count == 0) {
-        buffer_insert_line(&E.buffer, 0, sp_str_lit(""));
-    }
+    buffer_delete_lines(&E.buffer, 0, E.buffer.line_count);
+    buffer_insert_line(&E.buffer, 0, sp_str_lit(""));
+    buffer_insert_text(&E.buffer, 0, 0, text, SP_NULLPTR, SP_NULLPTR);
 
     E.buffer.modified = true;
     E.cursor.row = 0;
@@ -137,12 +133,68 @@ static JSValue ted_js_version(JSContext *ctx, JSValue *this_val, int argc, JSVal
     return JS_NewString(ctx, TED_VERSION);
 }
 
+// ted.getText(start?, end?) - whole buffer, or the byte range [start, end)
 static JSValue ted_js_get_text(JSContext *ctx, JSValue *this_val, int argc, JSValue *argv) {
     (void)this_val;
-    (void)argc;
-    (void)argv;
-    sp_str_t text = ted_buffer_to_text();
-    return JS_NewStringLen(ctx, text.data, text.len);
+    sp_str_t text;
+    if (argc < 1 || JS_IsUndefined(argv[0])) {
+        text = ted_buffer_to_text();
+    } else {
+        u64 start = 0;
+        u64 end = UINT64_MAX;
+        if (!ted_js_to_offset(ctx, argv[0], &start)) {
+            return JS_ThrowTypeError(ctx, "ted.getText: invalid start offset");
+        }
+        if (argc >= 2 && !JS_IsUndefined(argv[1]) && !ted_js_to_offset(ctx, argv[1], &end)) {
+            return JS_ThrowTypeError(ctx, "ted.getText: invalid end offset");
+        }
+        ted_ensure_offset(end);
+        text = buffer_get_range(&E.buffer, start, end);
+    }
+
+    JSValue out = JS_NewStringLen(ctx, text.data, text.len);
+    if (text.len > 0) sp_free((void *)text.data);
+    return out;
+}
+
+// ted.pointToOffset(line, col) - 1-based line and column, like ted.goto
+static JSValue ted_js_point_to_offset(JSContext *ctx, JSValue *this_val, int argc, JSValue *argv) {
+    (void)this_val;
+    if (argc < 2) return JS_ThrowTypeError(ctx, "ted.pointToOffset: need (line, col)");
+
+    int line = 0;
+    int col = 0;
+    if (JS_ToInt32(ctx, &line, argv[0]) || JS_ToInt32(ctx, &col, argv[1])) {
+        return JS_ThrowTypeError(ctx, "ted.pointToOffset: line and col must be numbers");
+    }
+    if (line < 1) line = 1;
+    if (col < 1) col = 1;
+
+    buffer_ensure_rows(&E.buffer, (u32)line);
+    u64 offset = buffer_point_to_offset(&E.buffer, (u32)line - 1, (u32)col - 1);
+    return JS_NewInt64(ctx, (int64_t)offset);
+}
+
+// ted.offsetToPoint(offset) - [line, col], 1-based
+static JSValue ted_js_offset_to_point(JSContext *ctx, JSValue *this_val, int argc, JSValue *argv) {
+    (void)this_val;
+    if (argc < 1) return JS_ThrowTypeError(ctx, "ted.offsetToPoint: missing offset");
+
+    u64 offset = 0;
+    if (!ted_js_to_offset(ctx, argv[0], &offset)) {
+        return JS_ThrowTypeError(ctx, "ted.offsetToPoint: invalid offset");
+    }
+
+    ted_ensure_offset(offset);
+    u32 row = 0;
+    u32 col = 0;
+    buffer_offset_to_point(&E.buffer, offset, &row, &col);
+
+    JSValue point = JS_NewArray(ctx, 2);
+    if (JS_IsException(point)) return point;
+    JS_SetPropertyUint32(ctx, point, 0, JS_NewInt32(ctx, (int)(row + 1)));
+    JS_SetPropertyUint32(ctx, point, 1, JS_NewInt32(ctx, (int)(col + 1)));
+    return point;
 }
 
 static JSValue ted_js_set_text(JSContext *ctx, JSValue *this_val, int argc, JSValue *argv) {
@@ -521,6 +573,10 @@ static void ext_prepare_stdlib(void) {
         (JSCFunctionDef){ .func = { .generic = ted_js_sketch_status }, .name = JS_UNDEFINED, .def_type = JS_CFUNC_generic, .arg_count = 0, .magic = 0 };
     G_ext_cfunc_table[TED_CFUNC_INDEX(TED_CFUNC_SKETCH_SHAPES)] =
         (JSCFunctionDef){ .func = { .generic = ted_js_sketch_shapes }, .name = JS_UNDEFINED, .def_type = JS_CFUNC_generic, .arg_count = 0, .magic = 0 };
+    G_ext_cfunc_table[TED_CFUNC_INDEX(TED_CFUNC_POINT_TO_OFFSET)] =
+        (JSCFunctionDef){ .func = { .generic = ted_js_point_to_offset }, .name = JS_UNDEFINED, .def_type = JS_CFUNC_generic, .arg_count = 2, .magic = 0 };
+    G_ext_cfunc_table[TED_CFUNC_INDEX(TED_CFUNC_OFFSET_TO_POINT)] =
+        (JSCFunctionDef){ .func = { .generic = ted_js_offset_to_point }, .name = JS_UNDEFINED, .def_type = JS_CFUNC_generic, .arg_count = 1, .magic = 0 };
 
     G_ext_stdlib = js_stdlib;
     G_ext_stdlib.c_function_table = G_ext_cfunc_table;
@@ -547,6 +603,8 @@ static void ext_register_host_api(void) {
     JS_SetPropertyStr(G_ctx, ted, "sketchClear", JS_NewCFunctionParams(G_ctx, TED_CFUNC_INDEX(TED_CFUNC_SKETCH_CLEAR), JS_UNDEFINED));
     JS_SetPropertyStr(G_ctx, ted, "sketchStatus", JS_NewCFunctionParams(G_ctx, TED_CFUNC_INDEX(TED_CFUNC_SKETCH_STATUS), JS_UNDEFINED));
     JS_SetPropertyStr(G_ctx, ted, "sketchShapes", JS_NewCFunctionParams(G_ctx, TED_CFUNC_INDEX(TED_CFUNC_SKETCH_SHAPES), JS_UNDEFINED));
+    JS_SetPropertyStr(G_ctx, ted, "pointToOffset", JS_NewCFunctionParams(G_ctx, TED_CFUNC_INDEX(TED_CFUNC_POINT_TO_OFFSET), JS_UNDEFINED));
+    JS_SetPropertyStr(G_ctx, ted, "offsetToPoint", JS_NewCFunctionParams(G_ctx, TED_CFUNC_INDEX(TED_CFUNC_OFFSET_TO_POINT), JS_UNDEFINED));
 
     JS_SetPropertyStr(G_ctx, global, "ted", ted);
 }
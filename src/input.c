@@ -45,7 +45,7 @@ static const c8 *CMD_CANDIDATES[] = {
 static const c8 *SET_CANDIDATES[] = {
     "nu", "number", "nonu", "nonumber", "syntax", "nosyntax", "wrap", "nowrap"
 };
-static const c8 *SYNTAX_CANDIDATES[] = { "on", "off", "tree", "tree on", "tree off", "tree status" };
+static const c8 *SYNTAX_CANDIDATES[] = { "on", "off", "stats", "tree", "tree on", "tree off", "tree status" };
 
 typedef struct {
     sp_str_t seq;
@@ -370,6 +370,9 @@ static bool input_available(void) {
 }
 
 static void input_scroll_view(s32 delta_lines) {
+    if (delta_lines > 0) {
+        buffer_ensure_rows(&E.buffer, E.row_offset + (u32)delta_lines + E.screen_rows);
+    }
     if (E.buffer.line_count == 0 || E.screen_rows == 0) return;
 
     s32 max_offset = 0;
@@ -447,8 +450,13 @@ int input_read_key(void) {
     ssize_t nread;
 
     // Wait for input
+    u32 idle_ticks = 0;
     while (!input_available()) {
+        // A match count in progress runs between keystrokes
+        if (search_count_pending()) return 0;
         usleep(10000); // Sleep 10ms to avoid busy waiting
+        // Return periodically so background progress gets redrawn
+        if (++idle_ticks >= 20 && editor_background_busy()) return 0;
     }
 
     // Read one character
@@ -630,7 +638,7 @@ static void op_sync_cursor(void) {
     if (E.cursor.row >= E.buffer.line_count) {
         E.cursor.row = E.buffer.line_count - 1;
     }
-    sp_str_t line = E.buffer.lines[E.cursor.row].text;
+    sp_str_t line = buffer_get_line(&E.buffer, E.cursor.row);
     if (E.cursor.col > line.len) {
         E.cursor.col = line.len;
     }
@@ -672,7 +680,7 @@ static bool op_find_inner_word_bounds(sp_str_t line, u32 col, u32 *start, u32 *e
 
 static bool op_copy_range_current_line(u32 start, u32 end) {
     if (E.cursor.row >= E.buffer.line_count) return false;
-    sp_str_t line = E.buffer.lines[E.cursor.row].text;
+    sp_str_t line = buffer_get_line(&E.buffer, E.cursor.row);
     if (start > line.len) start = line.len;
     if (end > line.len) end = line.len;
     if (end <= start) return false;
@@ -682,24 +690,13 @@ static bool op_copy_range_current_line(u32 start, u32 end) {
 
 static bool op_delete_range_current_line(u32 start, u32 end) {
     if (E.cursor.row >= E.buffer.line_count) return false;
-    sp_str_t line = E.buffer.lines[E.cursor.row].text;
+    sp_str_t line = buffer_get_line(&E.buffer, E.cursor.row);
     if (start > line.len) start = line.len;
     if (end > line.len) end = line.len;
     if (end <= start) return false;
 
-    sp_io_writer_t writer = sp_io_writer_from_dyn_mem();
-    sp_str_builder_t b = sp_str_builder_from_writer(&writer);
-    if (start > 0) {
-        sp_str_builder_append(&b, sp_str_sub(line, 0, (s32)start));
-    }
-    if (end < line.len) {
-        sp_str_builder_append(&b, sp_str_sub(line, (s32)end, (s32)(line.len - end)));
-    }
-
-    undo_record_delete_line(E.cursor.row, line);
-    E.buffer.lines[E.cursor.row].text = sp_str_builder_to_str(&b);
-    E.buffer.lines[E.cursor.row].hl_dirty = true;
-    E.buffer.modified = true;
+    undo_record_delete_text(E.cursor.row, start, E.cursor.row, end);
+    buffer_delete_text(&E.buffer, E.cursor.row, start, E.cursor.row, end);
     E.cursor.col = start;
     op_sync_cursor();
     return true;
@@ -866,7 +863,7 @@ static void op_apply_text_object_builtin(c8 op, bool around, c8 obj) {
     }
     E.cursor.row = E.pending_origin_row;
     op_sync_cursor();
-    sp_str_t line = E.buffer.lines[E.cursor.row].text;
+    sp_str_t line = buffer_get_line(&E.buffer, E.cursor.row);
     u32 origin = E.pending_origin_col > line.len ? line.len : E.pending_origin_col;
     u32 left = 0;
     u32 right = 0;
@@ -906,7 +903,7 @@ static void op_apply_motion_builtin(c8 op, c8 motion) {
     }
     E.cursor.row = E.pending_origin_row;
     op_sync_cursor();
-    sp_str_t line = E.buffer.lines[E.cursor.row].text;
+    sp_str_t line = buffer_get_line(&E.buffer, E.cursor.row);
     u32 origin = E.pending_origin_col > line.len ? line.len : E.pending_origin_col;
 
     if (motion == '0') {
@@ -995,7 +992,7 @@ static void op_apply_linewise(c8 op) {
         sp_str_builder_t b = sp_str_builder_from_writer(&writer);
         for (u32 i = row; i <= last; i++) {
             if (i > row) sp_str_builder_append_c8(&b, '\n');
-            sp_str_builder_append(&b, E.buffer.lines[i].text);
+            sp_str_builder_append(&b, buffer_get_line(&E.buffer, i));
         }
         E.clipboard = sp_str_builder_to_str(&b);
         editor_set_message(last > row ? "Yanked %u lines" : "Yanked current line", (last - row + 1));
@@ -1008,7 +1005,7 @@ static void op_apply_linewise(c8 op) {
         sp_str_builder_t b = sp_str_builder_from_writer(&writer);
         for (u32 i = row; i <= last; i++) {
             if (i > row) sp_str_builder_append_c8(&b, '\n');
-            sp_str_builder_append(&b, E.buffer.lines[i].text);
+            sp_str_builder_append(&b, buffer_get_line(&E.buffer, i));
         }
         E.clipboard = sp_str_builder_to_str(&b);
     }
@@ -1044,7 +1041,7 @@ static void op_apply_to_eol(c8 op) {
         op_finish_pending();
         return;
     }
-    sp_str_t line = E.buffer.lines[E.cursor.row].text;
+    sp_str_t line = buffer_get_line(&E.buffer, E.cursor.row);
     u32 start = E.cursor.col;
     if (start > line.len) start = line.len;
     u32 end = line.len;
@@ -1080,7 +1077,7 @@ static void op_apply_inner_word(c8 op) {
         op_finish_pending();
         return;
     }
-    sp_str_t line = E.buffer.lines[E.cursor.row].text;
+    sp_str_t line = buffer_get_line(&E.buffer, E.cursor.row);
     u32 start = 0;
     u32 end = 0;
     if (!op_find_inner_word_bounds(line, E.cursor.col, &start, &end)) {
@@ -1171,7 +1168,7 @@ void input_handle_normal(int c) {
         case 'i':
         case 'a':
             E.mode = MODE_INSERT;
-            if (c == 'a' && E.cursor.col < E.buffer.lines[E.cursor.row].text.len) {
+            if (c == 'a' && E.cursor.col < buffer_get_line(&E.buffer, E.cursor.row).len) {
                 E.cursor.col++;
             }
             editor_set_message("-- INSERT --");
@@ -1179,7 +1176,7 @@ void input_handle_normal(int c) {
 
         case 'A': // Insert at end of line
             E.mode = MODE_INSERT;
-            E.cursor.col = E.buffer.lines[E.cursor.row].text.len;
+            E.cursor.col = buffer_get_line(&E.buffer, E.cursor.row).len;
             editor_set_message("-- INSERT --");
             break;
 
@@ -1216,15 +1213,13 @@ void input_handle_normal(int c) {
             break;
 
         case 'G':
-            if (E.buffer.line_count > 0) {
-                E.cursor.row = E.buffer.line_count - 1;
-            }
-            E.cursor.col = 0;
+            editor_goto_end();
             break;
 
         // Page scroll
         case ' ':
         case KEY_PAGE_DOWN: // Page Down
+            buffer_ensure_rows(&E.buffer, E.row_offset + 2 * E.screen_rows);
             if (E.buffer.line_count > 0) {
                 E.row_offset += E.screen_rows;
                 if (E.row_offset >= E.buffer.line_count) {
@@ -1245,7 +1240,9 @@ void input_handle_normal(int c) {
 
         // Delete
         case 'x':
-            if (E.cursor.col < E.buffer.lines[E.cursor.row].text.len) {
+            if (E.cursor.col < buffer_get_line(&E.buffer, E.cursor.row).len) {
+                undo_record_delete(E.cursor.row, E.cursor.col,
+                                   buffer_get_line(&E.buffer, E.cursor.row).data[E.cursor.col]);
                 buffer_delete_char_at(&E.buffer, E.cursor.row, E.cursor.col);
             }
             break;
@@ -1415,9 +1412,10 @@ void input_handle_insert(int c) {
         // Escape - return to normal mode
         case '\033':
             E.mode = MODE_NORMAL;
+            undo_break();
             editor_set_message("");
             if (E.cursor.col > 0 && 
-                E.cursor.col == E.buffer.lines[E.cursor.row].text.len) {
+                E.cursor.col == buffer_get_line(&E.buffer, E.cursor.row).len) {
                 E.cursor.col--;
             }
             break;
@@ -1500,20 +1498,15 @@ void input_handle_insert(int c) {
 
         // Delete key
         case KEY_DELETE:
-            if (E.cursor.col < E.buffer.lines[E.cursor.row].text.len) {
+            if (E.cursor.col < buffer_get_line(&E.buffer, E.cursor.row).len) {
+                undo_record_delete(E.cursor.row, E.cursor.col,
+                                   buffer_get_line(&E.buffer, E.cursor.row).data[E.cursor.col]);
                 buffer_delete_char_at(&E.buffer, E.cursor.row, E.cursor.col);
             } else if (E.cursor.row + 1 < E.buffer.line_count) {
                 // Join with next line
-                sp_str_t current = E.buffer.lines[E.cursor.row].text;
-                sp_str_t next = E.buffer.lines[E.cursor.row + 1].text;
-                
-                sp_io_writer_t writer = sp_io_writer_from_dyn_mem();
-                sp_str_builder_t builder = sp_str_builder_from_writer(&writer);
-                sp_str_builder_append(&builder, current);
-                sp_str_builder_append(&builder, next);
-                E.buffer.lines[E.cursor.row].text = sp_str_builder_to_str(&builder);
-                
-                buffer_delete_line(&E.buffer, E.cursor.row + 1);
+                undo_record_delete(E.cursor.row, buffer_get_line(&E.buffer, E.cursor.row).len, '\n');
+                buffer_delete_text(&E.buffer, E.cursor.row, buffer_get_line(&E.buffer, E.cursor.row).len,
+                                   E.cursor.row + 1, 0);
             }
             break;
 
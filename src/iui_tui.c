@@ -796,9 +796,7 @@ static void tui_toggle_line_numbers(void) {
 
 static void tui_toggle_syntax(void) {
     E.config.syntax_enabled = !E.config.syntax_enabled;
-    for (u32 i = 0; i < E.buffer.line_count; i++) {
-        E.buffer.lines[i].hl_dirty = true;
-    }
+    buffer_mark_dirty(&E.buffer);
     editor_set_message("Syntax %s", E.config.syntax_enabled ? "enabled" : "disabled");
 }
 
@@ -960,6 +958,12 @@ static void make_deck_summary(c8 *buf, u32 cap) {
 
 static void make_file_state_summary(c8 *buf, u32 cap) {
     if (!buf || cap == 0) return;
+    u32 percent = 0;
+    f64 rate = 0.0;
+    if (save_progress(&percent, &rate)) {
+        snprintf(buf, cap, "saving %u%% %.0fMB/s", percent, rate);
+        return;
+    }
     snprintf(buf, cap, "%s", E.buffer.modified ? "dirty" : "saved");
 }
 
@@ -173,24 +173,35 @@ static sp_str_t build_llm_status_text(bool ready, const c8 *provider, const c8 *
     return sp_str_builder_to_str(&b);
 }
 
+// Up to max_bytes of the buffer around the cursor. The window is located
+// through the offset index, so only the window itself is copied.
 static sp_str_t buffer_to_text_limited(u32 max_bytes) {
+    buffer_t *buf = &E.buffer;
+    u64 total = buffer_byte_count(buf);
+    u64 cursor = buffer_point_to_offset(buf, E.cursor.row, E.cursor.col);
+
+    u64 start = cursor > max_bytes / 2 ? cursor - max_bytes / 2 : 0;
+    u64 end = start + max_bytes;
+    if (end > total) {
+        end = total;
+        start = end > max_bytes ? end - max_bytes : 0;
+    }
+
+    // Begin on a whole line.
+    u32 row = 0;
+    u32 col = 0;
+    if (start > 0 && buffer_offset_to_point(buf, start, &row, &col) && col > 0) {
+        start = buffer_point_to_offset(buf, row + 1, 0);
+        if (start > end) start = end;
+    }
+
     sp_io_writer_t writer = sp_io_writer_from_dyn_mem();
     sp_str_builder_t b = sp_str_builder_from_writer(&writer);
-    u32 used = 0;
-    for (u32 i = 0; i < E.buffer.line_count; i++) {
-        sp_str_t line = E.buffer.lines[i].text;
-        if (used + line.len + 1 > max_bytes) {
-            u32 keep = (used < max_bytes) ? (max_bytes - used) : 0;
-            if (keep > 0 && keep <= line.len) {
-                sp_str_builder_append(&b, sp_str_sub(line, 0, (s32)keep));
-            }
-            sp_str_builder_append_cstr(&b, "\n...[truncated]");
-            break;
-        }
-        sp_str_builder_append(&b, line);
-        if (i + 1 < E.buffer.line_count) sp_str_builder_append_c8(&b, '\n');
-        used += line.len + 1;
-    }
+    if (start > 0) sp_str_builder_append_cstr(&b, "...[truncated]\n");
+    sp_str_t window = buffer_get_range(buf, start, end);
+    sp_str_builder_append(&b, window);
+    if (window.len > 0) sp_free((void *)window.data);
+    if (end < total || buffer_is_partial(buf)) sp_str_builder_append_cstr(&b, "\n...[truncated]");
     return sp_str_builder_to_str(&b);
 }
 
@@ -18,6 +18,26 @@ static void print_usage(const c8 *prog) {
     sp_io_write_cstr(&stderr_writer, " [filename]\n\n");
     sp_io_write_cstr(&stderr_writer, "TED - Termux Editor v" TED_VERSION "\n");
     sp_io_write_cstr(&stderr_writer, "A modern, touch-friendly code editor for Termux\n\n");
+    sp_io_write_cstr(&stderr_writer, "Options:\n");
+    sp_io_write_cstr(&stderr_writer, "  -h, --help         Show this help\n");
+    sp_io_write_cstr(&stderr_writer, "  --load-stats FILE  Load FILE, report line indexing throughput and exit\n");
+    sp_io_write_cstr(&stderr_writer, "  --search-stats FILE PATTERN\n");
+    sp_io_write_cstr(&stderr_writer, "                     Time literal and regex search for PATTERN in FILE\n");
+    sp_io_write_cstr(&stderr_writer, "  --outline-stats FILE NAME\n");
+    sp_io_write_cstr(&stderr_writer, "                     Time building FILE's outline and looking up NAME\n");
+    sp_io_write_cstr(&stderr_writer, "  --tag-stats DIR NAME\n");
+    sp_io_write_cstr(&stderr_writer, "                     Index the definitions under DIR and time looking up NAME\n");
+    sp_io_write_cstr(&stderr_writer, "  --syntax-check FILE...\n");
+    sp_io_write_cstr(&stderr_writer, "                     Compare the table-driven lexer with the reference rules\n");
+    sp_io_write_cstr(&stderr_writer, "  --offset-check FILE...\n");
+    sp_io_write_cstr(&stderr_writer, "                     Check byte offset lookups against a recount across edits\n");
+    sp_io_write_cstr(&stderr_writer, "  --undo-check FILE  Edit FILE at random, then check every undo and redo step\n");
+    sp_io_write_cstr(&stderr_writer, "  --regex-check FILE PATTERN REPLACEMENT\n");
+    sp_io_write_cstr(&stderr_writer, "                     Check regex matches and replace against a backtracking reference\n");
+    sp_io_write_cstr(&stderr_writer, "  --relex-check FILE...\n");
+    sp_io_write_cstr(&stderr_writer, "                     Check incremental rehighlighting against a full relex across edits\n");
+    sp_io_write_cstr(&stderr_writer, "  --reparse-check FILE...\n");
+    sp_io_write_cstr(&stderr_writer, "                     Check incremental tree-sitter reparses against full parses across edits\n\n");
     sp_io_write_cstr(&stderr_writer, "Controls:\n");
     sp_io_write_cstr(&stderr_writer, "  Ctrl+S  Save file\n");
     sp_io_write_cstr(&stderr_writer, "  Ctrl+Q  Quit\n");
@@ -55,8 +75,468 @@ void die(const c8 *msg) {
     exit(1);
 }
 
+// Load a file without starting the UI and report how fast it was indexed.
+static s32 run_load_stats(const c8 *path) {
+    sp_io_writer_t out = sp_io_writer_from_fd(STDOUT_FILENO, SP_IO_CLOSE_MODE_NONE);
+    sp_io_writer_t err = sp_io_writer_from_fd(STDERR_FILENO, SP_IO_CLOSE_MODE_NONE);
+    buffer_t buf;
+    buffer_init(&buf);
+    buffer_load_file(&buf, sp_str_from_cstr(path));
+
+    buffer_load_stats_t *st = &buf.load_stats;
+    if (st->bytes == 0) {
+        sp_io_write_str(&err, sp_format("load-stats: cannot read {} (or file is empty)\n", SP_FMT_CSTR(path)));
+        buffer_free(&buf);
+        return 1;
+    }
+
+    f64 index_s = (f64)st->index_ns / 1e9;
+    f64 total_s = (f64)(st->read_ns + st->index_ns) / 1e9;
+    if (index_s <= 0.0) index_s = 1e-9;
+    if (total_s <= 0.0) total_s = 1e-9;
+
+    sp_io_write_str(&out, sp_format("file:    {}\n", SP_FMT_CSTR(path)));
+    sp_io_write_str(&out, sp_format("bytes:   {}\n", SP_FMT_U64(st->bytes)));
+
+    if (buf.map) {
+        // Only the first screen is indexed up front; time the background
+        // line count separately.
+        sp_io_write_cstr(&out, "mode:    mapped\n");
+        sp_io_write_str(&out, sp_format("open:    {} ms ({} lines materialized)\n",
+                                        SP_FMT_F64((f64)st->index_ns / 1e6), SP_FMT_U32(st->lines)));
+
+        sp_tm_timer_t timer = sp_tm_start_timer();
+        while (buffer_index_progress(&buf) >= 0) {
+            usleep(1000);
+        }
+        f64 count_s = (f64)sp_tm_read_timer(&timer) / 1e9;
+        if (count_s <= 0.0) count_s = 1e-9;
+        u32 total = buffer_total_lines(&buf, SP_NULLPTR);
+        sp_io_write_str(&out, sp_format("lines:   {}\n", SP_FMT_U32(total)));
+        sp_io_write_str(&out, sp_format("kernel:  {}\n", SP_FMT_CSTR(scan_kernel_name())));
+        sp_io_write_str(&out, sp_format("count:   {} ms, {} lines/s, {} GB/s (background)\n",
+                                        SP_FMT_F64(count_s * 1e3), SP_FMT_U64((u64)((f64)total / count_s)),
+                                        SP_FMT_F64((f64)st->bytes / count_s / 1e9)));
+        sp_io_flush(&out);
+
+        buffer_free(&buf);
+        return 0;
+    }
+
+    sp_io_write_str(&out, sp_format("lines:   {}\n", SP_FMT_U32(st->lines)));
+    sp_io_write_str(&out, sp_format("kernel:  {}\n", SP_FMT_CSTR(scan_kernel_name())));
+    sp_io_write_str(&out, sp_format("read:    {} ms\n", SP_FMT_F64((f64)st->read_ns / 1e6)));
+    sp_io_write_str(&out, sp_format("index:   {} ms, {} lines/s, {} GB/s\n",
+                                    SP_FMT_F64(index_s * 1e3), SP_FMT_U64((u64)((f64)st->lines / index_s)),
+                                    SP_FMT_F64((f64)st->bytes / index_s / 1e9)));
+    sp_io_write_str(&out, sp_format("total:   {} ms, {} lines/s, {} GB/s\n",
+                                    SP_FMT_F64(total_s * 1e3), SP_FMT_U64((u64)((f64)st->lines / total_s)),
+                                    SP_FMT_F64((f64)st->bytes / total_s / 1e9)));
+    sp_io_flush(&out);
+
+    buffer_free(&buf);
+    return 0;
+}
+
+// Count every match of pattern, resuming after each one.
+static u32 search_stats_count(sp_str_t pattern) {
+    u32 count = 0;
+    search_pos_t pos = { 0, 0 };
+    search_match_t hit;
+    while (search_find(&E.buffer, pattern, pos, SEARCH_FORWARD, &hit)) {
+        count++;
+        pos.row = hit.row;
+        pos.col = hit.col + (hit.len > 0 ? hit.len : 1);
+    }
+    return count;
+}
+
+// Search FILE for pattern with the literal engine and then as a regex, and
+// report the throughput of each.
+static s32 run_search_stats(const c8 *path, const c8 *pattern) {
+    buffer_init(&E.buffer);
+    buffer_load_file(&E.buffer, sp_str_from_cstr(path));
+    buffer_ensure_all_rows(&E.buffer);
+    sp_io_writer_t out = sp_io_writer_from_fd(STDOUT_FILENO, SP_IO_CLOSE_MODE_NONE);
+    sp_io_writer_t err = sp_io_writer_from_fd(STDERR_FILENO, SP_IO_CLOSE_MODE_NONE);
+    u64 bytes = buffer_byte_count(&E.buffer);
+    if (bytes == 0) {
+        sp_io_write_str(&err, sp_format("search-stats: cannot read {} (or file is empty)\n", SP_FMT_CSTR(path)));
+        return 1;
+    }
+
+    sp_str_t query = sp_str_from_cstr(pattern);
+    search_init();
+    const c8 *error = SP_NULLPTR;
+    regex_prog_t *re = regex_compile(query, E.search.case_sensitive, &error);
+    if (!re) {
+        sp_io_write_str(&err, sp_format("search-stats: bad regex: {}\n", SP_FMT_CSTR(error)));
+        return 1;
+    }
+    regex_free(re);
+
+    sp_io_write_str(&out, sp_format("file:    {}\n", SP_FMT_CSTR(path)));
+    sp_io_write_str(&out, sp_format("bytes:   {}\n", SP_FMT_U64(bytes)));
+    sp_io_write_str(&out, sp_format("lines:   {}\n", SP_FMT_U32(E.buffer.line_count)));
+    sp_io_write_str(&out, sp_format("kernel:  {}\n", SP_FMT_CSTR(scan_kernel_name())));
+
+    static const c8 *names[] = { "literal", "regex" };
+    for (u32 mode = 0; mode < 2; mode++) {
+        E.search.regex = mode == 1;
+        sp_tm_timer_t timer = sp_tm_start_timer();
+        u32 count = search_stats_count(query);
+        f64 secs = (f64)sp_tm_read_timer(&timer) / 1e9;
+        if (secs <= 0.0) secs = 1e-9;
+        sp_io_write_str(&out, sp_format("{:pad 8} {} matches, {} ms, {} GB/s\n", SP_FMT_CSTR(names[mode]),
+                                        SP_FMT_U32(count), SP_FMT_F64(secs * 1e3),
+                                        SP_FMT_F64((f64)bytes / secs / 1e9)));
+    }
+    sp_io_flush(&out);
+
+    buffer_free(&E.buffer);
+    return 0;
+}
+
+// Build the outline of a C file, look a name up in it, then time keeping
+// it current across an edit.
+static s32 run_outline_stats(const c8 *path, const c8 *name) {
+    buffer_t buf;
+    buffer_init(&buf);
+    buffer_load_file(&buf, sp_str_from_cstr(path));
+    buffer_ensure_all_rows(&buf);
+    sp_io_writer_t out = sp_io_writer_from_fd(STDOUT_FILENO, SP_IO_CLOSE_MODE_NONE);
+    sp_io_writer_t err = sp_io_writer_from_fd(STDERR_FILENO, SP_IO_CLOSE_MODE_NONE);
+    if (buffer_byte_count(&buf) == 0) {
+        sp_io_write_str(&err, sp_format("outline-stats: cannot read {} (or file is empty)\n", SP_FMT_CSTR(path)));
+        buffer_free(&buf);
+        return 1;
+    }
+    treesitter_init();
+    treesitter_set_enabled(true, SP_NULLPTR);
+
+    u32 count = 0;
+    sp_str_t summary = sp_str_lit("");
+    sp_tm_timer_t timer = sp_tm_start_timer();
+    if (!treesitter_outline_update(&buf, &count, &summary)) {
+        sp_io_write_str(&err, sp_format("outline-stats: {}\n", SP_FMT_STR(summary)));
+        buffer_free(&buf);
+        return 1;
+    }
+    f64 build_ms = (f64)sp_tm_read_timer(&timer) / 1e6;
+
+    sp_io_write_str(&out, sp_format("file:    {}\n", SP_FMT_CSTR(path)));
+    sp_io_write_str(&out, sp_format("lines:   {}\n", SP_FMT_U32(buf.line_count)));
+    sp_io_write_str(&out, sp_format("build:   {} definitions, {} ms (parse included)\n",
+                                    SP_FMT_U32(count), SP_FMT_F64(build_ms)));
+
+    static const u32 rounds = 1000;
+    sp_str_t query = sp_str_from_cstr(name);
+    outline_symbol_t sym = {0};
+    u32 matches = 0;
+    timer = sp_tm_start_timer();
+    for (u32 i = 0; i < rounds; i++) {
+        matches = treesitter_outline_find(&buf, query, i % buf.line_count, &sym);
+    }
+    f64 lookup_us = (f64)sp_tm_read_timer(&timer) / 1e3 / rounds;
+    if (matches > 0) {
+        sp_io_write_str(&out, sp_format("lookup:  {} {}:{}, {} matches, {} us\n",
+                                        SP_FMT_CSTR(treesitter_outline_kind_name(sym.kind)), SP_FMT_STR(sym.name),
+                                        SP_FMT_U32(sym.row + 1), SP_FMT_U32(matches), SP_FMT_F64(lookup_us)));
+    } else {
+        sp_io_write_str(&out, sp_format("lookup:  no definition of {}, {} us\n", SP_FMT_CSTR(name),
+                                        SP_FMT_F64(lookup_us)));
+    }
+
+    // A line break in the middle of the file, as typed
+    u32 row = buf.line_count / 2;
+    buffer_insert_text(&buf, row, 0, sp_str_lit("\n"), SP_NULLPTR, SP_NULLPTR);
+    timer = sp_tm_start_timer();
+    treesitter_outline_update(&buf, &count, &summary);
+    sp_io_write_str(&out, sp_format("update:  {}, {} ms (reparse included)\n", SP_FMT_STR(summary),
+                                    SP_FMT_F64((f64)sp_tm_read_timer(&timer) / 1e6)));
+    sp_io_flush(&out);
+
+    buffer_free(&buf);
+    return 0;
+}
+
+static s32 run_tag_stats(const c8 *root, const c8 *name) {
+    sp_io_writer_t out = sp_io_writer_from_fd(STDOUT_FILENO, SP_IO_CLOSE_MODE_NONE);
+    sp_io_writer_t err = sp_io_writer_from_fd(STDERR_FILENO, SP_IO_CLOSE_MODE_NONE);
+    treesitter_init();
+    if (!tags_refresh(root) || !tags_wait()) {
+        sp_io_write_str(&err, sp_format("tag-stats: {}\n", SP_FMT_CSTR(tags_status())));
+        return 1;
+    }
+    sp_io_write_str(&out, sp_format("root:    {}\n", SP_FMT_CSTR(root)));
+    sp_io_write_str(&out, sp_format("index:   {}\n", SP_FMT_CSTR(tags_status())));
+
+    static const u32 rounds = 1000;
+    sp_str_t query = sp_str_from_cstr(name);
+    tag_match_t tag = {0};
+    u32 matches = 0;
+    sp_tm_timer_t timer = sp_tm_start_timer();
+    for (u32 i = 0; i < rounds; i++) {
+        matches = tags_find(query, i, &tag);
+    }
+    f64 lookup_us = (f64)sp_tm_read_timer(&timer) / 1e3 / rounds;
+    if (matches > 0) {
+        tags_find(query, 0, &tag);
+        sp_io_write_str(&out, sp_format("lookup:  {} {} {}:{}, {} matches, {} us\n",
+                                        SP_FMT_CSTR(treesitter_outline_kind_name(tag.kind)), SP_FMT_STR(tag.name),
+                                        SP_FMT_STR(tag.path), SP_FMT_U32(tag.row + 1), SP_FMT_U32(matches),
+                                        SP_FMT_F64(lookup_us)));
+    } else {
+        sp_io_write_str(&out, sp_format("lookup:  no definition of {}, {} us\n", SP_FMT_CSTR(name),
+                                        SP_FMT_F64(lookup_us)));
+    }
+    sp_io_flush(&out);
+    return 0;
+}
+
+// Highlight each file with the compiled lexer and the reference rules and
+// report any line where they disagree.
+static s32 run_syntax_check(s32 count, c8 **paths) {
+    sp_io_writer_t out = sp_io_writer_from_fd(STDOUT_FILENO, SP_IO_CLOSE_MODE_NONE);
+    sp_io_writer_t err = sp_io_writer_from_fd(STDERR_FILENO, SP_IO_CLOSE_MODE_NONE);
+    u32 failed = 0;
+    u64 total_bytes = 0;
+    u64 total_ref_ns = 0;
+    u64 total_table_ns = 0;
+
+    for (s32 i = 0; i < count; i++) {
+        buffer_t buf;
+        buffer_init(&buf);
+        buffer_load_file(&buf, sp_str_from_cstr(paths[i]));
+        buffer_ensure_all_rows(&buf);
+        u64 bytes = buffer_byte_count(&buf);
+        if (bytes == 0) {
+            sp_io_write_str(&err, sp_format("syntax-check: cannot read {} (or file is empty)\n",
+                                            SP_FMT_CSTR(paths[i])));
+            buffer_free(&buf);
+            failed++;
+            continue;
+        }
+
+        u64 ref_ns = 0;
+        u64 table_ns = 0;
+        u32 mismatches = syntax_check_buffer(&buf, &ref_ns, &table_ns);
+        sp_io_write_str(&out, sp_format("{}: {} lines, {} mismatches\n", SP_FMT_CSTR(paths[i]),
+                                        SP_FMT_U32(buf.line_count), SP_FMT_U32(mismatches)));
+        if (mismatches > 0) failed++;
+
+        total_bytes += bytes;
+        total_ref_ns += ref_ns;
+        total_table_ns += table_ns;
+        buffer_free(&buf);
+    }
+
+    f64 ref_s = total_ref_ns > 0 ? (f64)total_ref_ns / 1e9 : 1e-9;
+    f64 table_s = total_table_ns > 0 ? (f64)total_table_ns / 1e9 : 1e-9;
+    sp_io_write_str(&out, sp_format("reference {} MB/s, table {} MB/s, {} of {} files differ\n",
+                                    SP_FMT_F64((f64)total_bytes / ref_s / 1e6),
+                                    SP_FMT_F64((f64)total_bytes / table_s / 1e6), SP_FMT_U32(failed),
+                                    SP_FMT_S32(count)));
+    sp_io_flush(&out);
+    return failed > 0 ? 1 : 0;
+}
+
+// Edit each file at random and check the offset index against a recount
+// of the line lengths after every edit.
+static s32 run_offset_check(s32 count, c8 **paths) {
+    sp_io_writer_t out = sp_io_writer_from_fd(STDOUT_FILENO, SP_IO_CLOSE_MODE_NONE);
+    sp_io_writer_t err = sp_io_writer_from_fd(STDERR_FILENO, SP_IO_CLOSE_MODE_NONE);
+    static const u32 edits = 500;
+    u32 failed = 0;
+
+    for (s32 i = 0; i < count; i++) {
+        buffer_t buf;
+        buffer_init(&buf);
+        buffer_load_file(&buf, sp_str_from_cstr(paths[i]));
+        buffer_ensure_all_rows(&buf);
+        if (buffer_byte_count(&buf) == 0) {
+            sp_io_write_str(&err, sp_format("offset-check: cannot read {} (or file is empty)\n",
+                                            SP_FMT_CSTR(paths[i])));
+            buffer_free(&buf);
+            failed++;
+            continue;
+        }
+
+        u32 mismatches = check_offsets(&buf, edits);
+        sp_io_write_str(&out, sp_format("{}: {} edits, {} mismatches\n", SP_FMT_CSTR(paths[i]),
+                                        SP_FMT_U32(edits), SP_FMT_U32(mismatches)));
+        if (mismatches > 0) failed++;
+        buffer_free(&buf);
+    }
+    sp_io_flush(&out);
+    return failed > 0 ? 1 : 0;
+}
+
+// Edit FILE at random through the editor, then undo every step and redo
+// it, checking the text against a snapshot after each.
+static s32 run_undo_check(const c8 *path) {
+    sp_io_writer_t out = sp_io_writer_from_fd(STDOUT_FILENO, SP_IO_CLOSE_MODE_NONE);
+    sp_io_writer_t err = sp_io_writer_from_fd(STDERR_FILENO, SP_IO_CLOSE_MODE_NONE);
+    static const u32 edits = 500;
+    buffer_init(&E.buffer);
+    buffer_load_file(&E.buffer, sp_str_from_cstr(path));
+    buffer_ensure_all_rows(&E.buffer);
+    if (buffer_byte_count(&E.buffer) == 0) {
+        sp_io_write_str(&err, sp_format("undo-check: cannot read {} (or file is empty)\n", SP_FMT_CSTR(path)));
+        return 1;
+    }
+    undo_init(&E.undo);
+    undo_init(&E.redo);
+    E.config.tab_width = TAB_WIDTH_DEFAULT;
+    // Unlimited, so every step stays undoable
+    E.config.undo_limit = 0;
+
+    u32 mismatches = check_undo(edits);
+    sp_io_write_str(&out, sp_format("{}: {} edits, {} bytes of undo log, {} mismatches\n", SP_FMT_CSTR(path),
+                                    SP_FMT_U32(edits), SP_FMT_U32(undo_memory_used()), SP_FMT_U32(mismatches)));
+    sp_io_flush(&out);
+    buffer_free(&E.buffer);
+    return mismatches > 0 ? 1 : 0;
+}
+
+// Check the regex engine against the backtracking reference on every line
+// of FILE, then replace all matches and check the result as well.
+static s32 run_regex_check(const c8 *path, const c8 *pattern, const c8 *replacement) {
+    sp_io_writer_t out = sp_io_writer_from_fd(STDOUT_FILENO, SP_IO_CLOSE_MODE_NONE);
+    sp_io_writer_t err = sp_io_writer_from_fd(STDERR_FILENO, SP_IO_CLOSE_MODE_NONE);
+    buffer_init(&E.buffer);
+    buffer_load_file(&E.buffer, sp_str_from_cstr(path));
+    buffer_ensure_all_rows(&E.buffer);
+    if (buffer_byte_count(&E.buffer) == 0) {
+        sp_io_write_str(&err, sp_format("regex-check: cannot read {} (or file is empty)\n", SP_FMT_CSTR(path)));
+        return 1;
+    }
+
+    search_init();
+    undo_init(&E.undo);
+    undo_init(&E.redo);
+    E.search.query = sp_str_from_cstr(pattern);
+    E.search.regex = true;
+    const c8 *error = SP_NULLPTR;
+    regex_prog_t *re = regex_compile(E.search.query, E.search.case_sensitive, &error);
+    if (!re) {
+        sp_io_write_str(&err, sp_format("regex-check: bad regex: {}\n", SP_FMT_CSTR(error)));
+        return 1;
+    }
+
+    u32 matches = 0;
+    u32 mismatches = check_regex(re, sp_str_from_cstr(replacement), &matches);
+    sp_io_write_str(&out, sp_format("{}: {} lines, {} matches, {} mismatches\n", SP_FMT_CSTR(path),
+                                    SP_FMT_U32(E.buffer.line_count), SP_FMT_U32(matches),
+                                    SP_FMT_U32(mismatches)));
+    sp_io_flush(&out);
+    regex_free(re);
+    buffer_free(&E.buffer);
+    return mismatches > 0 ? 1 : 0;
+}
+
+// Edit each file at random and check the incremental rehighlight against
+// a relex from the top after every edit.
+static s32 run_relex_check(s32 count, c8 **paths) {
+    sp_io_writer_t out = sp_io_writer_from_fd(STDOUT_FILENO, SP_IO_CLOSE_MODE_NONE);
+    sp_io_writer_t err = sp_io_writer_from_fd(STDERR_FILENO, SP_IO_CLOSE_MODE_NONE);
+    static const u32 edits = 200;
+    u32 failed = 0;
+
+    for (s32 i = 0; i < count; i++) {
+        buffer_t buf;
+        buffer_init(&buf);
+        buffer_load_file(&buf, sp_str_from_cstr(paths[i]));
+        buffer_ensure_all_rows(&buf);
+        if (buffer_byte_count(&buf) == 0) {
+            sp_io_write_str(&err, sp_format("relex-check: cannot read {} (or file is empty)\n",
+                                            SP_FMT_CSTR(paths[i])));
+            buffer_free(&buf);
+            failed++;
+            continue;
+        }
+
+        u64 relexed = 0;
+        u32 mismatches = check_relex(&buf, edits, &relexed);
+        sp_io_write_str(&out, sp_format("{}: {} lines, {} edits, {} rows relexed per edit, {} mismatches\n",
+                                        SP_FMT_CSTR(paths[i]), SP_FMT_U32(buf.line_count), SP_FMT_U32(edits),
+                                        SP_FMT_U64(relexed / edits), SP_FMT_U32(mismatches)));
+        if (mismatches > 0) failed++;
+        buffer_free(&buf);
+    }
+    sp_io_flush(&out);
+    return failed > 0 ? 1 : 0;
+}
+
+// Edit each file at random and check the incremental reparse and the
+// rows it rehighlights against a parse and highlight of everything.
+static s32 run_reparse_check(s32 count, c8 **paths) {
+    sp_io_writer_t out = sp_io_writer_from_fd(STDOUT_FILENO, SP_IO_CLOSE_MODE_NONE);
+    sp_io_writer_t err = sp_io_writer_from_fd(STDERR_FILENO, SP_IO_CLOSE_MODE_NONE);
+    static const u32 edits = 50;
+    u32 failed = 0;
+    treesitter_init();
+    treesitter_set_enabled(true, SP_NULLPTR);
+
+    for (s32 i = 0; i < count; i++) {
+        buffer_t buf;
+        buffer_init(&buf);
+        buffer_load_file(&buf, sp_str_from_cstr(paths[i]));
+        buffer_ensure_all_rows(&buf);
+        if (buffer_byte_count(&buf) == 0 || !treesitter_has_grammar(buf.filename)) {
+            sp_io_write_str(&err, sp_format("reparse-check: cannot read {} (or file is empty, or has no grammar)\n",
+                                            SP_FMT_CSTR(paths[i])));
+            buffer_free(&buf);
+            failed++;
+            continue;
+        }
+
+        u64 redone = 0;
+        u32 mismatches = check_reparse(&buf, edits, &redone);
+        sp_io_write_str(&out, sp_format("{}: {} lines, {} edits, {} rows redone per edit, {} mismatches\n",
+                                        SP_FMT_CSTR(paths[i]), SP_FMT_U32(buf.line_count), SP_FMT_U32(edits),
+                                        SP_FMT_U64(redone / edits), SP_FMT_U32(mismatches)));
+        if (mismatches > 0) failed++;
+        treesitter_buffer_release(&buf);
+        buffer_free(&buf);
+    }
+    sp_io_flush(&out);
+    return failed > 0 ? 1 : 0;
+}
+
 s32 main(s32 argc, c8 **argv) {
     // Parse arguments
+    if (argc == 3 && sp_cstr_equal(argv[1], "--load-stats")) {
+        return run_load_stats(argv[2]);
+    }
+    if (argc == 4 && sp_cstr_equal(argv[1], "--search-stats")) {
+        return run_search_stats(argv[2], argv[3]);
+    }
+    if (argc == 4 && sp_cstr_equal(argv[1], "--outline-stats")) {
+        return run_outline_stats(argv[2], argv[3]);
+    }
+    if (argc == 4 && sp_cstr_equal(argv[1], "--tag-stats")) {
+        return run_tag_stats(argv[2], argv[3]);
+    }
+    if (argc >= 3 && sp_cstr_equal(argv[1], "--syntax-check")) {
+        return run_syntax_check(argc - 2, argv + 2);
+    }
+    if (argc >= 3 && sp_cstr_equal(argv[1], "--offset-check")) {
+        return run_offset_check(argc - 2, argv + 2);
+    }
+    if (argc == 3 && sp_cstr_equal(argv[1], "--undo-check")) {
+        return run_undo_check(argv[2]);
+    }
+    if (argc == 5 && sp_cstr_equal(argv[1], "--regex-check")) {
+        return run_regex_check(argv[2], argv[3], argv[4]);
+    }
+    if (argc >= 3 && sp_cstr_equal(argv[1], "--relex-check")) {
+        return run_relex_check(argc - 2, argv + 2);
+    }
+    if (argc >= 3 && sp_cstr_equal(argv[1], "--reparse-check")) {
+        return run_reparse_check(argc - 2, argv + 2);
+    }
+
     if (argc > 2) {
         print_usage(argv[0]);
         return 1;
@@ -104,6 +584,7 @@ s32 main(s32 argc, c8 **argv) {
 
     // Main loop
     while (true) {
+        editor_poll_background();
         display_refresh();
         editor_process_keypress();
     }
@@ -0,0 +1,59 @@
+/**
+ * pool.c - Worker threads for jobs that split into independent tasks
+ *
+ * pool_run hands out task indices to one worker per core, the calling
+ * thread included, and returns once every task has run. Jobs call it from
+ * a background thread of their own, so the UI never waits on a pool.
+ */
+
+#include "ted.h"
+
+#include <unistd.h>
+
+// Upper bound on workers, however many cores the machine reports
+#define POOL_MAX_THREADS 16
+
+typedef struct {
+    pool_task_fn_t fn;
+    void *ctx;
+    s32 count;
+    sp_atomic_s32 next;
+} pool_run_t;
+
+// Workers available to pool_run, the calling thread counted
+u32 pool_threads(void) {
+    static u32 threads = 0;
+    if (threads == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cores < 1 ? 1 : cores > POOL_MAX_THREADS ? POOL_MAX_THREADS : (u32)cores;
+    }
+    return threads;
+}
+
+static s32 pool_worker_main(void *userdata) {
+    pool_run_t *run = userdata;
+    for (;;) {
+        s32 index = sp_atomic_s32_add(&run->next, 1);
+        if (index >= run->count) return 0;
+        run->fn(run->ctx, (u32)index);
+    }
+}
+
+// Run fn(ctx, i) for every i in [0, count). Tasks are claimed in index
+// order, so earlier tasks tend to finish first.
+void pool_run(u32 count, pool_task_fn_t fn, void *ctx) {
+    if (count == 0) return;
+
+    pool_run_t run = { fn, ctx, (s32)count, 0 };
+    sp_thread_t workers[POOL_MAX_THREADS];
+    u32 spawn = pool_threads() - 1;
+    if (spawn > count - 1) spawn = count - 1;
+
+    for (u32 i = 0; i < spawn; i++) {
+        sp_thread_init(&workers[i], pool_worker_main, &run);
+    }
+    pool_worker_main(&run);
+    for (u32 i = 0; i < spawn; i++) {
+        sp_thread_join(&workers[i]);
+    }
+}
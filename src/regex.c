@@ -0,0 +1,1134 @@
+/**
+ * regex.c - Linear-time regular expressions
+ *
+ * Patterns are parsed into a small syntax tree and compiled to a Thompson
+ * NFA program. A line is first run through a DFA built lazily from that
+ * program, which only answers whether a match exists at or after the start
+ * column; most lines are rejected there at one table lookup per byte. Lines
+ * that pass run through a Pike VM for the leftmost-first match and its
+ * capture groups. Both step every NFA state at most once per byte, so no
+ * pattern can backtrack exponentially.
+ *
+ * Supported: literals, ., [...] and [^...] with ranges, \d \w \s and their
+ * negations, \t \n \r, \b \B, ^ $, (...) (?:...), |, * + ? {n} {n,} {n,m}
+ * and lazy variants of the repeats.
+ */
+
+#include "ted.h"
+
+#include <string.h>
+
+#define RE_MAX_INSTS 16384
+#define RE_MAX_DEPTH 200
+#define RE_MAX_REPEAT 1000
+#define RE_REPEAT_INF UINT32_MAX
+#define RE_UNSET UINT32_MAX
+// Transition table budget; the state limit follows from the class count.
+#define RE_DFA_TABLE_BYTES (1u << 20)
+
+typedef enum {
+    RE_CLASS,
+    RE_MATCH,
+    RE_JMP,
+    RE_SPLIT,
+    RE_SAVE,
+    RE_BOL,
+    RE_EOL,
+    RE_WORDB,
+    RE_NWORDB
+} re_op_t;
+
+typedef struct {
+    u8 op;
+    u32 x;
+    u32 y;
+} re_inst_t;
+
+typedef enum {
+    RN_EMPTY,
+    RN_CLASS,
+    RN_CAT,
+    RN_ALT,
+    RN_REPEAT,
+    RN_GROUP,
+    RN_ASSERT
+} re_node_kind_t;
+
+typedef struct {
+    u8 kind;
+    u8 op;        // RN_ASSERT
+    bool greedy;  // RN_REPEAT
+    s32 a;
+    s32 b;
+    u32 min;
+    u32 max;
+    u32 index;    // class for RN_CLASS, group for RN_GROUP
+} re_node_t;
+
+typedef struct {
+    u8 bits[32];
+} re_set_t;
+
+typedef struct {
+    const c8 *p;
+    const c8 *end;
+    bool fold;
+    u32 depth;
+    const c8 *error;
+
+    re_node_t *nodes;
+    u32 node_count;
+    u32 node_cap;
+    re_set_t *sets;
+    u32 set_count;
+    u32 set_cap;
+    u32 groups;
+
+    re_inst_t *insts;
+    u32 inst_count;
+    u32 inst_cap;
+} re_parser_t;
+
+// Thread list for the Pike VM: a sparse set over program counters, in
+// priority order, with a capture vector for every entry.
+typedef struct {
+    u32 *sparse;
+    u32 *dense;
+    u32 *caps;
+    u32 count;
+} re_list_t;
+
+typedef struct {
+    u32 pc;
+    u32 slot;
+    u32 value;
+} re_frame_t;
+
+typedef struct {
+    u32 set_start;
+    u32 set_len;
+    u32 hash;
+    bool match;
+    s8 eol;
+} re_dstate_t;
+
+typedef struct {
+    re_dstate_t *states;
+    u32 count;
+    u32 max_states;
+    s32 *trans;
+    s32 *table;
+    u32 table_mask;
+    u32 *pool;
+    u32 pool_len;
+    u32 pool_cap;
+    s32 start[2];
+    u32 *mark;
+    u32 gen;
+    u32 *work;
+    u32 *stack;
+    u32 flushes;
+    bool broken;
+} re_dfa_t;
+
+struct regex_prog_t {
+    re_inst_t *insts;
+    u32 count;
+    re_set_t *sets;
+    u32 groups;
+    u32 ncap;
+
+    u8 byte_class[256];
+    u8 class_rep[256];
+    u32 nclasses;
+
+    re_list_t lists[2];
+    re_frame_t *frames;
+    u32 *scratch;
+    re_dfa_t dfa;
+};
+
+static bool re_is_word(u8 c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+}
+
+static inline bool re_set_has(const re_set_t *s, u8 c) {
+    return (s->bits[c >> 3] >> (c & 7)) & 1;
+}
+
+static inline void re_set_add(re_set_t *s, u8 c) {
+    s->bits[c >> 3] |= (u8)(1u << (c & 7));
+}
+
+static void re_set_add_range(re_set_t *s, u8 lo, u8 hi) {
+    for (u32 c = lo; c <= hi; c++) re_set_add(s, (u8)c);
+}
+
+static void re_set_add_named(re_set_t *s, c8 name) {
+    switch (name) {
+        case 'd': case 'D':
+            re_set_add_range(s, '0', '9');
+            break;
+        case 'w': case 'W':
+            re_set_add_range(s, 'a', 'z');
+            re_set_add_range(s, 'A', 'Z');
+            re_set_add_range(s, '0', '9');
+            re_set_add(s, '_');
+            break;
+        case 's': case 'S':
+            re_set_add(s, ' ');
+            re_set_add_range(s, '\t', '\r');
+            break;
+    }
+    if (name == 'D' || name == 'W' || name == 'S') {
+        for (u32 i = 0; i < 32; i++) s->bits[i] = (u8)~s->bits[i];
+    }
+}
+
+static void re_set_fold(re_set_t *s) {
+    for (u32 c = 'a'; c <= 'z'; c++) {
+        if (re_set_has(s, (u8)c) || re_set_has(s, (u8)(c - 32))) {
+            re_set_add(s, (u8)c);
+            re_set_add(s, (u8)(c - 32));
+        }
+    }
+}
+
+static c8 re_escape_byte(c8 c) {
+    switch (c) {
+        case 't': return '\t';
+        case 'n': return '\n';
+        case 'r': return '\r';
+        case 'f': return '\f';
+        case 'v': return '\v';
+        default: return c;
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Parser
+
+static s32 re_node(re_parser_t *ps, u8 kind) {
+    if (ps->node_count == ps->node_cap) {
+        u32 cap = ps->node_cap ? ps->node_cap * 2 : 64;
+        re_node_t *grown = sp_realloc(ps->nodes, sizeof(re_node_t) * cap);
+        if (!grown) {
+            ps->error = "out of memory";
+            return -1;
+        }
+        ps->nodes = grown;
+        ps->node_cap = cap;
+    }
+    re_node_t *n = &ps->nodes[ps->node_count];
+    memset(n, 0, sizeof(*n));
+    n->kind = kind;
+    n->a = n->b = -1;
+    return (s32)ps->node_count++;
+}
+
+static s32 re_pair(re_parser_t *ps, u8 kind, s32 a, s32 b) {
+    s32 n = re_node(ps, kind);
+    if (n < 0) return -1;
+    ps->nodes[n].a = a;
+    ps->nodes[n].b = b;
+    return n;
+}
+
+// Node for a character set, folding case when the pattern is insensitive.
+static s32 re_class_node(re_parser_t *ps, const re_set_t *set) {
+    if (ps->set_count == ps->set_cap) {
+        u32 cap = ps->set_cap ? ps->set_cap * 2 : 16;
+        re_set_t *grown = sp_realloc(ps->sets, sizeof(re_set_t) * cap);
+        if (!grown) {
+            ps->error = "out of memory";
+            return -1;
+        }
+        ps->sets = grown;
+        ps->set_cap = cap;
+    }
+    s32 n = re_node(ps, RN_CLASS);
+    if (n < 0) return -1;
+    ps->sets[ps->set_count] = *set;
+    ps->nodes[n].index = ps->set_count++;
+    return n;
+}
+
+static s32 re_parse_alt(re_parser_t *ps);
+
+static s32 re_parse_class(re_parser_t *ps) {
+    re_set_t set;
+    memset(&set, 0, sizeof(set));
+    bool negate = false;
+    if (ps->p < ps->end && *ps->p == '^') {
+        negate = true;
+        ps->p++;
+    }
+
+    bool first = true;
+    while (ps->p < ps->end && (*ps->p != ']' || first)) {
+        first = false;
+        c8 lo = *ps->p++;
+        if (lo == '\\') {
+            if (ps->p >= ps->end) break;
+            c8 e = *ps->p++;
+            if (e && strchr("dDwWsS", e)) {
+                re_set_add_named(&set, e);
+                continue;
+            }
+            lo = re_escape_byte(e);
+        }
+
+        c8 hi = lo;
+        if (ps->p + 1 < ps->end && ps->p[0] == '-' && ps->p[1] != ']') {
+            ps->p++;
+            hi = *ps->p++;
+            if (hi == '\\') {
+                if (ps->p >= ps->end) break;
+                hi = re_escape_byte(*ps->p++);
+            }
+            if ((u8)hi < (u8)lo) {
+                ps->error = "invalid range in []";
+                return -1;
+            }
+        }
+        re_set_add_range(&set, (u8)lo, (u8)hi);
+    }
+    if (ps->p >= ps->end) {
+        ps->error = "missing ]";
+        return -1;
+    }
+    ps->p++;
+
+    if (ps->fold) re_set_fold(&set);
+    if (negate) {
+        for (u32 i = 0; i < 32; i++) set.bits[i] = (u8)~set.bits[i];
+    }
+    return re_class_node(ps, &set);
+}
+
+static s32 re_parse_atom(re_parser_t *ps) {
+    c8 c = *ps->p++;
+    re_set_t set;
+    memset(&set, 0, sizeof(set));
+
+    switch (c) {
+        case '(': {
+            s32 group = -1;
+            if (ps->end - ps->p >= 2 && ps->p[0] == '?' && ps->p[1] == ':') {
+                ps->p += 2;
+            } else {
+                if (ps->groups + 1 >= REGEX_MAX_GROUPS) {
+                    ps->error = "too many groups";
+                    return -1;
+                }
+                group = (s32)++ps->groups;
+            }
+            if (++ps->depth > RE_MAX_DEPTH) {
+                ps->error = "nesting too deep";
+                return -1;
+            }
+            s32 inner = re_parse_alt(ps);
+            ps->depth--;
+            if (inner < 0) return -1;
+            if (ps->p >= ps->end || *ps->p != ')') {
+                ps->error = "missing )";
+                return -1;
+            }
+            ps->p++;
+            if (group < 0) return inner;
+            s32 n = re_pair(ps, RN_GROUP, inner, -1);
+            if (n >= 0) ps->nodes[n].index = (u32)group;
+            return n;
+        }
+        case '[':
+            return re_parse_class(ps);
+        case '.':
+            re_set_add_range(&set, 0, 255);
+            return re_class_node(ps, &set);
+        case '^':
+        case '$': {
+            s32 n = re_node(ps, RN_ASSERT);
+            if (n >= 0) ps->nodes[n].op = c == '^' ? RE_BOL : RE_EOL;
+            return n;
+        }
+        case '*':
+        case '+':
+        case '?':
+            ps->error = "nothing to repeat";
+            return -1;
+        case '\\': {
+            if (ps->p >= ps->end) {
+                ps->error = "trailing \\";
+                return -1;
+            }
+            c8 e = *ps->p++;
+            if (e == 'b' || e == 'B') {
+                s32 n = re_node(ps, RN_ASSERT);
+                if (n >= 0) ps->nodes[n].op = e == 'b' ? RE_WORDB : RE_NWORDB;
+                return n;
+            }
+            if (e && strchr("dDwWsS", e)) {
+                re_set_add_named(&set, e);
+                return re_class_node(ps, &set);
+            }
+            c = re_escape_byte(e);
+            break;
+        }
+    }
+
+    re_set_add(&set, (u8)c);
+    if (ps->fold) re_set_fold(&set);
+    return re_class_node(ps, &set);
+}
+
+static bool re_parse_number(re_parser_t *ps, u32 *out) {
+    const c8 *start = ps->p;
+    u32 n = 0;
+    while (ps->p < ps->end && *ps->p >= '0' && *ps->p <= '9') {
+        if (n <= RE_MAX_REPEAT) n = n * 10 + (u32)(*ps->p - '0');
+        ps->p++;
+    }
+    *out = n;
+    return ps->p > start;
+}
+
+// Parse {n}, {n,} or {n,m}. Anything else leaves p alone and the brace is
+// taken literally.
+static bool re_parse_bounds(re_parser_t *ps, u32 *min, u32 *max) {
+    const c8 *save = ps->p;
+    ps->p++;
+    if (!re_parse_number(ps, min)) goto literal;
+    *max = *min;
+    if (ps->p < ps->end && *ps->p == ',') {
+        ps->p++;
+        if (!re_parse_number(ps, max)) *max = RE_REPEAT_INF;
+    }
+    if (ps->p >= ps->end || *ps->p != '}') goto literal;
+    ps->p++;
+    return true;
+
+literal:
+    ps->p = save;
+    return false;
+}
+
+static s32 re_parse_repeat(re_parser_t *ps) {
+    s32 atom = re_parse_atom(ps);
+    while (atom >= 0 && ps->p < ps->end) {
+        c8 c = *ps->p;
+        u32 min, max;
+        if (c == '*') {
+            min = 0;
+            max = RE_REPEAT_INF;
+            ps->p++;
+        } else if (c == '+') {
+            min = 1;
+            max = RE_REPEAT_INF;
+            ps->p++;
+        } else if (c == '?') {
+            min = 0;
+            max = 1;
+            ps->p++;
+        } else if (c == '{' && re_parse_bounds(ps, &min, &max)) {
+            if ((max != RE_REPEAT_INF && max > RE_MAX_REPEAT) || min > RE_MAX_REPEAT || min > max) {
+                ps->error = "bad repeat count";
+                return -1;
+            }
+        } else {
+            break;
+        }
+
+        bool greedy = true;
+        if (ps->p < ps->end && *ps->p == '?') {
+            greedy = false;
+            ps->p++;
+        }
+        s32 n = re_pair(ps, RN_REPEAT, atom, -1);
+        if (n < 0) return -1;
+        ps->nodes[n].min = min;
+        ps->nodes[n].max = max;
+        ps->nodes[n].greedy = greedy;
+        atom = n;
+    }
+    return atom;
+}
+
+static s32 re_parse_cat(re_parser_t *ps) {
+    s32 node = -1;
+    while (ps->p < ps->end && *ps->p != '|' && *ps->p != ')') {
+        s32 next = re_parse_repeat(ps);
+        if (next < 0) return -1;
+        node = node < 0 ? next : re_pair(ps, RN_CAT, node, next);
+        if (node < 0) return -1;
+    }
+    return node < 0 ? re_node(ps, RN_EMPTY) : node;
+}
+
+static s32 re_parse_alt(re_parser_t *ps) {
+    s32 node = re_parse_cat(ps);
+    while (node >= 0 && ps->p < ps->end && *ps->p == '|') {
+        ps->p++;
+        s32 right = re_parse_cat(ps);
+        if (right < 0) return -1;
+        node = re_pair(ps, RN_ALT, node, right);
+    }
+    return node;
+}
+
+// ---------------------------------------------------------------------------
+// Code generation
+
+static s32 re_inst(re_parser_t *ps, u8 op, u32 x, u32 y) {
+    if (ps->inst_count >= RE_MAX_INSTS) {
+        ps->error = "pattern too large";
+        return -1;
+    }
+    if (ps->inst_count == ps->inst_cap) {
+        u32 cap = ps->inst_cap ? ps->inst_cap * 2 : 64;
+        re_inst_t *grown = sp_realloc(ps->insts, sizeof(re_inst_t) * cap);
+        if (!grown) {
+            ps->error = "out of memory";
+            return -1;
+        }
+        ps->insts = grown;
+        ps->inst_cap = cap;
+    }
+    ps->insts[ps->inst_count] = (re_inst_t){ op, x, y };
+    return (s32)ps->inst_count++;
+}
+
+static bool re_emit(re_parser_t *ps, s32 index) {
+    re_node_t n = ps->nodes[index];
+    switch (n.kind) {
+        case RN_EMPTY:
+            return true;
+        case RN_CLASS:
+            return re_inst(ps, RE_CLASS, n.index, 0) >= 0;
+        case RN_ASSERT:
+            return re_inst(ps, n.op, 0, 0) >= 0;
+        case RN_CAT:
+            return re_emit(ps, n.a) && re_emit(ps, n.b);
+        case RN_GROUP:
+            return re_inst(ps, RE_SAVE, n.index * 2, 0) >= 0 && re_emit(ps, n.a) &&
+                   re_inst(ps, RE_SAVE, n.index * 2 + 1, 0) >= 0;
+        case RN_ALT: {
+            s32 split = re_inst(ps, RE_SPLIT, 0, 0);
+            if (split < 0) return false;
+            ps->insts[split].x = ps->inst_count;
+            if (!re_emit(ps, n.a)) return false;
+            s32 jmp = re_inst(ps, RE_JMP, 0, 0);
+            if (jmp < 0) return false;
+            ps->insts[split].y = ps->inst_count;
+            if (!re_emit(ps, n.b)) return false;
+            ps->insts[jmp].x = ps->inst_count;
+            return true;
+        }
+        case RN_REPEAT: {
+            for (u32 i = 0; i < n.min; i++) {
+                if (!re_emit(ps, n.a)) return false;
+            }
+            if (n.max == RE_REPEAT_INF) {
+                // loop: split body, out; body; jmp loop
+                s32 loop = re_inst(ps, RE_SPLIT, 0, 0);
+                if (loop < 0) return false;
+                u32 body = ps->inst_count;
+                if (!re_emit(ps, n.a)) return false;
+                if (re_inst(ps, RE_JMP, (u32)loop, 0) < 0) return false;
+                ps->insts[loop].x = n.greedy ? body : ps->inst_count;
+                ps->insts[loop].y = n.greedy ? ps->inst_count : body;
+                return true;
+            }
+            // Optional copies nest: (x(x(x)?)?)?, each split exiting to the end
+            u32 first_split = ps->inst_count;
+            for (u32 i = n.min; i < n.max; i++) {
+                s32 split = re_inst(ps, RE_SPLIT, 0, 0);
+                if (split < 0) return false;
+                ps->insts[split].x = ps->inst_count;
+                if (!re_emit(ps, n.a)) return false;
+            }
+            u32 end = ps->inst_count;
+            for (u32 pc = first_split; pc < end; pc++) {
+                // The splits emitted above are the only ones still unpatched
+                re_inst_t *in = &ps->insts[pc];
+                if (in->op != RE_SPLIT || in->x != pc + 1 || in->y != 0) continue;
+                if (n.greedy) {
+                    in->y = end;
+                } else {
+                    in->y = in->x;
+                    in->x = end;
+                }
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+// ---------------------------------------------------------------------------
+// Pike VM
+
+static bool re_list_has(const re_list_t *l, u32 pc) {
+    u32 i = l->sparse[pc];
+    return i < l->count && l->dense[i] == pc;
+}
+
+// Add pc and everything reachable from it without consuming a byte to the
+// list, in priority order. caps is updated for SAVE and restored on return.
+static void re_add_thread(regex_prog_t *re, re_list_t *l, u32 pc, u32 *caps, sp_str_t line, u32 pos) {
+    re_frame_t *stack = re->frames;
+    u32 sp = 0;
+    stack[sp++] = (re_frame_t){ pc, 0, 0 };
+
+    while (sp > 0) {
+        re_frame_t f = stack[--sp];
+        if (f.pc == RE_UNSET) {
+            caps[f.slot] = f.value;
+            continue;
+        }
+        if (re_list_has(l, f.pc)) continue;
+
+        u32 i = l->count++;
+        l->sparse[f.pc] = i;
+        l->dense[i] = f.pc;
+
+        const re_inst_t *in = &re->insts[f.pc];
+        switch (in->op) {
+            case RE_JMP:
+                stack[sp++] = (re_frame_t){ in->x, 0, 0 };
+                break;
+            case RE_SPLIT:
+                stack[sp++] = (re_frame_t){ in->y, 0, 0 };
+                stack[sp++] = (re_frame_t){ in->x, 0, 0 };
+                break;
+            case RE_SAVE:
+                stack[sp++] = (re_frame_t){ RE_UNSET, in->x, caps[in->x] };
+                caps[in->x] = pos;
+                stack[sp++] = (re_frame_t){ f.pc + 1, 0, 0 };
+                break;
+            case RE_BOL:
+                if (pos == 0) stack[sp++] = (re_frame_t){ f.pc + 1, 0, 0 };
+                break;
+            case RE_EOL:
+                if (pos == line.len) stack[sp++] = (re_frame_t){ f.pc + 1, 0, 0 };
+                break;
+            case RE_WORDB:
+            case RE_NWORDB: {
+                bool before = pos > 0 && re_is_word((u8)line.data[pos - 1]);
+                bool after = pos < line.len && re_is_word((u8)line.data[pos]);
+                if ((before != after) == (in->op == RE_WORDB)) {
+                    stack[sp++] = (re_frame_t){ f.pc + 1, 0, 0 };
+                }
+                break;
+            }
+            default:
+                memcpy(l->caps + (u64)i * re->ncap, caps, sizeof(u32) * re->ncap);
+                break;
+        }
+    }
+}
+
+static bool re_pike(regex_prog_t *re, sp_str_t line, u32 from, regex_match_t *out) {
+    re_list_t *clist = &re->lists[0];
+    re_list_t *nlist = &re->lists[1];
+    u32 *caps = re->scratch;
+    bool matched = false;
+    clist->count = 0;
+
+    for (u32 pos = from; pos <= line.len; pos++) {
+        if (!matched) {
+            // Unanchored: a new lowest-priority thread starts at each column
+            for (u32 i = 0; i < re->ncap; i++) caps[i] = RE_UNSET;
+            re_add_thread(re, clist, 0, caps, line, pos);
+        }
+        if (clist->count == 0) break;
+
+        nlist->count = 0;
+        for (u32 i = 0; i < clist->count; i++) {
+            u32 pc = clist->dense[i];
+            const re_inst_t *in = &re->insts[pc];
+            u32 *tcaps = clist->caps + (u64)i * re->ncap;
+            if (in->op == RE_MATCH) {
+                // Lower-priority threads can no longer win
+                matched = true;
+                for (u32 g = 0; g < REGEX_MAX_GROUPS; g++) {
+                    bool set = g < re->groups && tcaps[g * 2] != RE_UNSET && tcaps[g * 2 + 1] != RE_UNSET;
+                    out->start[g] = set ? tcaps[g * 2] : RE_UNSET;
+                    out->end[g] = set ? tcaps[g * 2 + 1] : RE_UNSET;
+                }
+                break;
+            }
+            if (in->op == RE_CLASS && pos < line.len && re_set_has(&re->sets[in->x], (u8)line.data[pos])) {
+                re_add_thread(re, nlist, pc + 1, tcaps, line, pos + 1);
+            }
+        }
+
+        re_list_t *tmp = clist;
+        clist = nlist;
+        nlist = tmp;
+    }
+    return matched;
+}
+
+// ---------------------------------------------------------------------------
+// Lazy DFA
+//
+// A DFA state is the set of NFA instructions a search could be waiting on:
+// byte consumers, MATCH, and EOL assertions still to be checked at the end
+// of the line. Captures and priorities are ignored and \b/\B are treated as
+// always passing, so the DFA can only say yes too often, never too rarely.
+
+static u32 re_hash_set(const u32 *set, u32 len) {
+    u32 h = 2166136261u;
+    for (u32 i = 0; i < len; i++) {
+        h = (h ^ set[i]) * 16777619u;
+    }
+    return h;
+}
+
+static int re_cmp_u32(const void *a, const void *b) {
+    u32 x = *(const u32 *)a;
+    u32 y = *(const u32 *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Add the closure of pc to work[], skipping instructions already marked in
+// this generation. EOL edges are followed only when at_eol is set.
+static u32 re_dfa_closure(regex_prog_t *re, u32 pc, bool at_bol, bool at_eol, u32 n) {
+    re_dfa_t *d = &re->dfa;
+    u32 sp = 0;
+    d->stack[sp++] = pc;
+    while (sp > 0) {
+        u32 cur = d->stack[--sp];
+        if (d->mark[cur] == d->gen) continue;
+        d->mark[cur] = d->gen;
+
+        const re_inst_t *in = &re->insts[cur];
+        switch (in->op) {
+            case RE_JMP:
+                d->stack[sp++] = in->x;
+                break;
+            case RE_SPLIT:
+                d->stack[sp++] = in->y;
+                d->stack[sp++] = in->x;
+                break;
+            case RE_SAVE:
+            case RE_WORDB:
+            case RE_NWORDB:
+                d->stack[sp++] = cur + 1;
+                break;
+            case RE_BOL:
+                if (at_bol) d->stack[sp++] = cur + 1;
+                break;
+            case RE_EOL:
+                if (at_eol) {
+                    d->stack[sp++] = cur + 1;
+                } else {
+                    d->work[n++] = cur;
+                }
+                break;
+            default:
+                d->work[n++] = cur;
+                break;
+        }
+    }
+    return n;
+}
+
+static void re_dfa_flush(re_dfa_t *d) {
+    d->flushes++;
+    d->count = 0;
+    d->pool_len = 0;
+    d->start[0] = d->start[1] = -1;
+    memset(d->table, 0xff, sizeof(s32) * (d->table_mask + 1));
+}
+
+// Find or create the state for the n instructions in work[]. Returns -1 if
+// memory ran out.
+static s32 re_dfa_state(regex_prog_t *re, u32 n) {
+    re_dfa_t *d = &re->dfa;
+    qsort(d->work, n, sizeof(u32), re_cmp_u32);
+    u32 hash = re_hash_set(d->work, n);
+
+    u32 slot = hash & d->table_mask;
+    for (; d->table[slot] >= 0; slot = (slot + 1) & d->table_mask) {
+        re_dstate_t *s = &d->states[d->table[slot]];
+        if (s->hash == hash && s->set_len == n &&
+            memcmp(d->pool + s->set_start, d->work, sizeof(u32) * n) == 0) {
+            return d->table[slot];
+        }
+    }
+
+    if (d->count == d->max_states) {
+        // Start over rather than grow; the caller's state index is stale
+        re_dfa_flush(d);
+        return re_dfa_state(re, n);
+    }
+    if (d->pool_len + n > d->pool_cap) {
+        u32 cap = d->pool_cap * 2;
+        while (cap < d->pool_len + n) cap *= 2;
+        u32 *grown = sp_realloc(d->pool, sizeof(u32) * cap);
+        if (!grown) return -1;
+        d->pool = grown;
+        d->pool_cap = cap;
+    }
+
+    u32 index = d->count++;
+    re_dstate_t *s = &d->states[index];
+    s->set_start = d->pool_len;
+    s->set_len = n;
+    s->hash = hash;
+    s->eol = -1;
+    s->match = false;
+    memcpy(d->pool + d->pool_len, d->work, sizeof(u32) * n);
+    d->pool_len += n;
+    for (u32 i = 0; i < n; i++) {
+        if (re->insts[d->work[i]].op == RE_MATCH) s->match = true;
+    }
+    memset(d->trans + (u64)index * re->nclasses, 0xff, sizeof(s32) * re->nclasses);
+    d->table[slot] = (s32)index;
+    return (s32)index;
+}
+
+static s32 re_dfa_start(regex_prog_t *re, bool at_bol) {
+    re_dfa_t *d = &re->dfa;
+    if (d->start[at_bol] >= 0) return d->start[at_bol];
+    d->gen++;
+    u32 n = re_dfa_closure(re, 0, at_bol, false, 0);
+    s32 s = re_dfa_state(re, n);
+    d->start[at_bol] = s;
+    return s;
+}
+
+static s32 re_dfa_step(regex_prog_t *re, s32 from, u32 cls) {
+    re_dfa_t *d = &re->dfa;
+    re_dstate_t *s = &d->states[from];
+    u8 byte = re->class_rep[cls];
+
+    d->gen++;
+    u32 n = 0;
+    for (u32 i = 0; i < s->set_len; i++) {
+        u32 pc = d->pool[s->set_start + i];
+        const re_inst_t *in = &re->insts[pc];
+        if (in->op == RE_CLASS && re_set_has(&re->sets[in->x], byte)) {
+            n = re_dfa_closure(re, pc + 1, false, false, n);
+        }
+    }
+    // Unanchored search restarts at every column
+    n = re_dfa_closure(re, 0, false, false, n);
+
+    u32 flushes = d->flushes;
+    s32 next = re_dfa_state(re, n);
+    // A flush while adding the state also dropped `from`
+    if (next >= 0 && d->flushes == flushes) {
+        d->trans[(u64)from * re->nclasses + cls] = next;
+    }
+    return next;
+}
+
+static bool re_dfa_eol(regex_prog_t *re, s32 state) {
+    re_dfa_t *d = &re->dfa;
+    re_dstate_t *s = &d->states[state];
+    if (s->eol >= 0) return s->eol;
+
+    d->gen++;
+    bool match = s->match;
+    for (u32 i = 0; i < s->set_len && !match; i++) {
+        u32 pc = d->pool[s->set_start + i];
+        if (re->insts[pc].op != RE_EOL) continue;
+        u32 n = re_dfa_closure(re, pc + 1, false, true, 0);
+        for (u32 k = 0; k < n; k++) {
+            if (re->insts[d->work[k]].op == RE_MATCH) match = true;
+        }
+    }
+    s->eol = match;
+    return match;
+}
+
+// True if the line may contain a match starting at or after from.
+static bool re_dfa_may_match(regex_prog_t *re, sp_str_t line, u32 from) {
+    re_dfa_t *d = &re->dfa;
+    if (d->broken) return true;
+
+    s32 s = re_dfa_start(re, from == 0);
+    if (s < 0) goto broken;
+    if (d->states[s].match) return true;
+
+    const u8 *p = (const u8 *)line.data;
+    for (u32 i = from; i < line.len; i++) {
+        u32 cls = re->byte_class[p[i]];
+        s32 next = d->trans[(u64)s * re->nclasses + cls];
+        if (next < 0) {
+            next = re_dfa_step(re, s, cls);
+            if (next < 0) goto broken;
+        }
+        s = next;
+        if (d->states[s].match) return true;
+    }
+    return re_dfa_eol(re, s);
+
+broken:
+    d->broken = true;
+    return true;
+}
+
+// ---------------------------------------------------------------------------
+// Reference matcher
+//
+// A backtracking search over the same program, for the self-check: the
+// branches of a split are tried in priority order, so the first match it
+// reaches is the leftmost-first one. Whether (pc, position) leads to a
+// match does not depend on the captures, so each pair is tried once and a
+// search takes at most count * (len + 1) steps.
+
+typedef struct {
+    u32 pc;       // RE_UNSET: restore caps[slot] to value
+    u32 pos;
+    u32 slot;
+    u32 value;
+} re_bt_frame_t;
+
+static bool re_backtrack(regex_prog_t *re, sp_str_t line, u32 start, u8 *visited,
+                         re_bt_frame_t **stack, u32 *cap, u32 *caps) {
+    u32 sp = 0;
+    (*stack)[sp++] = (re_bt_frame_t){ 0, start, 0, 0 };
+
+    while (sp > 0) {
+        re_bt_frame_t f = (*stack)[--sp];
+        if (f.pc == RE_UNSET) {
+            caps[f.slot] = f.value;
+            continue;
+        }
+        u32 pc = f.pc;
+        u32 pos = f.pos;
+        while (true) {
+            u64 bit = (u64)pc * (line.len + 1) + pos;
+            if (visited[bit / 8] & (1u << (bit % 8))) break;
+            visited[bit / 8] |= (u8)(1u << (bit % 8));
+
+            // A split pushes one frame and a save two
+            if (sp + 2 > *cap) {
+                re_bt_frame_t *grown = sp_realloc(*stack, sizeof(re_bt_frame_t) * *cap * 2);
+                if (!grown) return false;
+                *stack = grown;
+                *cap *= 2;
+            }
+
+            const re_inst_t *in = &re->insts[pc];
+            bool ok = true;
+            switch (in->op) {
+                case RE_CLASS:
+                    ok = pos < line.len && re_set_has(&re->sets[in->x], (u8)line.data[pos]);
+                    pos++;
+                    pc++;
+                    break;
+                case RE_MATCH:
+                    return true;
+                case RE_JMP:
+                    pc = in->x;
+                    break;
+                case RE_SPLIT:
+                    (*stack)[sp++] = (re_bt_frame_t){ in->y, pos, 0, 0 };
+                    pc = in->x;
+                    break;
+                case RE_SAVE:
+                    (*stack)[sp++] = (re_bt_frame_t){ RE_UNSET, 0, in->x, caps[in->x] };
+                    caps[in->x] = pos;
+                    pc++;
+                    break;
+                case RE_BOL:
+                    ok = pos == 0;
+                    pc++;
+                    break;
+                case RE_EOL:
+                    ok = pos == line.len;
+                    pc++;
+                    break;
+                default: {
+                    bool before = pos > 0 && re_is_word((u8)line.data[pos - 1]);
+                    bool after = pos < line.len && re_is_word((u8)line.data[pos]);
+                    ok = (before != after) == (in->op == RE_WORDB);
+                    pc++;
+                    break;
+                }
+            }
+            if (!ok) break;
+        }
+    }
+    return false;
+}
+
+// regex_find by backtracking instead of the DFA and Pike VM; what
+// --regex-check compares them with. Slow, and uses count * (len + 1)
+// bits of memory.
+bool regex_find_reference(regex_prog_t *re, sp_str_t line, u32 from, regex_match_t *match) {
+    if (from > line.len) return false;
+    u64 bits = (u64)re->count * (line.len + 1);
+    u8 *visited = sp_alloc(bits / 8 + 1);
+    u32 cap = 64;
+    re_bt_frame_t *stack = sp_alloc(sizeof(re_bt_frame_t) * cap);
+    u32 *caps = sp_alloc(sizeof(u32) * re->ncap);
+    bool matched = false;
+
+    if (visited && stack && caps) {
+        // The failures of one start column still fail from the next
+        for (u32 start = from; start <= line.len && !matched; start++) {
+            for (u32 i = 0; i < re->ncap; i++) caps[i] = RE_UNSET;
+            matched = re_backtrack(re, line, start, visited, &stack, &cap, caps);
+        }
+    }
+    if (matched) {
+        for (u32 g = 0; g < REGEX_MAX_GROUPS; g++) {
+            bool set = g < re->groups && caps[g * 2] != RE_UNSET && caps[g * 2 + 1] != RE_UNSET;
+            match->start[g] = set ? caps[g * 2] : RE_UNSET;
+            match->end[g] = set ? caps[g * 2 + 1] : RE_UNSET;
+        }
+    }
+
+    if (visited) sp_free(visited);
+    if (stack) sp_free(stack);
+    if (caps) sp_free(caps);
+    return matched;
+}
+
+// ---------------------------------------------------------------------------
+// Public API
+
+static void re_parser_free(re_parser_t *ps) {
+    if (ps->nodes) sp_free(ps->nodes);
+    if (ps->sets) sp_free(ps->sets);
+    if (ps->insts) sp_free(ps->insts);
+}
+
+// Map bytes to equivalence classes: bytes no instruction tells apart share
+// a class, which keeps DFA rows short.
+static void re_build_byte_classes(regex_prog_t *re) {
+    bool boundary[256] = { false };
+    for (u32 pc = 0; pc < re->count; pc++) {
+        if (re->insts[pc].op != RE_CLASS) continue;
+        const re_set_t *s = &re->sets[re->insts[pc].x];
+        for (u32 c = 1; c < 256; c++) {
+            if (re_set_has(s, (u8)c) != re_set_has(s, (u8)(c - 1))) boundary[c] = true;
+        }
+    }
+    u32 cls = 0;
+    re->class_rep[0] = 0;
+    for (u32 c = 0; c < 256; c++) {
+        if (c > 0 && boundary[c]) {
+            cls++;
+            re->class_rep[cls] = (u8)c;
+        }
+        re->byte_class[c] = (u8)cls;
+    }
+    re->nclasses = cls + 1;
+}
+
+static bool re_alloc_runtime(regex_prog_t *re) {
+    u32 n = re->count;
+    for (u32 i = 0; i < 2; i++) {
+        re->lists[i].sparse = sp_alloc(sizeof(u32) * n);
+        re->lists[i].dense = sp_alloc(sizeof(u32) * n);
+        re->lists[i].caps = sp_alloc(sizeof(u32) * n * re->ncap);
+        if (!re->lists[i].sparse || !re->lists[i].dense || !re->lists[i].caps) return false;
+    }
+    re->frames = sp_alloc(sizeof(re_frame_t) * (2 * n + 2));
+    re->scratch = sp_alloc(sizeof(u32) * re->ncap);
+    if (!re->frames || !re->scratch) return false;
+
+    re_dfa_t *d = &re->dfa;
+    d->max_states = RE_DFA_TABLE_BYTES / (sizeof(s32) * re->nclasses);
+    if (d->max_states < 16) d->max_states = 16;
+    u32 table_size = 1;
+    while (table_size < d->max_states * 2) table_size <<= 1;
+    d->table_mask = table_size - 1;
+    d->states = sp_alloc(sizeof(re_dstate_t) * d->max_states);
+    d->trans = sp_alloc(sizeof(s32) * d->max_states * re->nclasses);
+    d->table = sp_alloc(sizeof(s32) * table_size);
+    d->pool_cap = 1024;
+    d->pool = sp_alloc(sizeof(u32) * d->pool_cap);
+    d->mark = sp_alloc(sizeof(u32) * n);
+    d->work = sp_alloc(sizeof(u32) * n);
+    d->stack = sp_alloc(sizeof(u32) * (2 * n + 2));
+    if (!d->states || !d->trans || !d->table || !d->pool || !d->mark || !d->work || !d->stack) {
+        // The DFA is an accelerator; without it every line goes to the VM
+        d->broken = true;
+        return true;
+    }
+    re_dfa_flush(d);
+    return true;
+}
+
+// Compile pattern. On failure returns NULL and points *error at a static
+// description.
+regex_prog_t *regex_compile(sp_str_t pattern, bool case_sensitive, const c8 **error) {
+    re_parser_t ps;
+    memset(&ps, 0, sizeof(ps));
+    ps.p = pattern.data;
+    ps.end = pattern.data + pattern.len;
+    ps.fold = !case_sensitive;
+
+    s32 root = re_parse_alt(&ps);
+    if (root >= 0 && ps.p < ps.end) ps.error = "unmatched )";
+
+    // Whole match is group 0: save 0; pattern; save 1; match
+    if (!ps.error && re_inst(&ps, RE_SAVE, 0, 0) >= 0 && re_emit(&ps, root)) {
+        re_inst(&ps, RE_SAVE, 1, 0);
+        re_inst(&ps, RE_MATCH, 0, 0);
+    }
+    if (ps.error || root < 0) {
+        if (error) *error = ps.error ? ps.error : "invalid pattern";
+        re_parser_free(&ps);
+        return SP_NULLPTR;
+    }
+
+    regex_prog_t *re = sp_alloc(sizeof(regex_prog_t));
+    if (!re) {
+        if (error) *error = "out of memory";
+        re_parser_free(&ps);
+        return SP_NULLPTR;
+    }
+    re->insts = ps.insts;
+    re->count = ps.inst_count;
+    re->sets = ps.sets;
+    re->groups = ps.groups + 1;
+    re->ncap = re->groups * 2;
+    ps.insts = SP_NULLPTR;
+    ps.sets = SP_NULLPTR;
+    re_parser_free(&ps);
+
+    re_build_byte_classes(re);
+    if (!re_alloc_runtime(re)) {
+        regex_free(re);
+        if (error) *error = "out of memory";
+        return SP_NULLPTR;
+    }
+    return re;
+}
+
+void regex_free(regex_prog_t *re) {
+    if (!re) return;
+    void *blocks[] = {
+        re->insts, re->sets, re->frames, re->scratch,
+        re->lists[0].sparse, re->lists[0].dense, re->lists[0].caps,
+        re->lists[1].sparse, re->lists[1].dense, re->lists[1].caps,
+        re->dfa.states, re->dfa.trans, re->dfa.table, re->dfa.pool,
+        re->dfa.mark, re->dfa.work, re->dfa.stack,
+    };
+    for (u32 i = 0; i < sizeof(blocks) / sizeof(blocks[0]); i++) {
+        if (blocks[i]) sp_free(blocks[i]);
+    }
+    sp_free(re);
+}
+
+// Number of groups including the whole match.
+u32 regex_group_count(regex_prog_t *re) {
+    return re->groups;
+}
+
+// Leftmost-first match in line starting at or after from. Group g of the
+// match spans [start[g], end[g]); groups that did not take part are
+// RE_UNSET (UINT32_MAX).
+bool regex_find(regex_prog_t *re, sp_str_t line, u32 from, regex_match_t *match) {
+    if (from > line.len) return false;
+    if (!re_dfa_may_match(re, line, from)) return false;
+    return re_pike(re, line, from, match);
+}
@@ -0,0 +1,397 @@
+/**
+ * save.c - Background atomic saves
+ *
+ * A save snapshots the buffer's line views, then a worker thread gathers
+ * them into writev batches on a temp file next to the target, fsyncs it and
+ * renames it over the target. The original file is untouched until the
+ * rename, so a crash mid-save cannot truncate it. Files that cannot be
+ * replaced that way, in a directory the user may not write to or with an
+ * owner the temp file cannot be given, are written in place instead.
+ */
+
+#include "ted.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// iovecs gathered per writev call
+#define SAVE_IOV_BATCH 512
+// Mapped tails are written in slices this large so progress keeps moving.
+#define SAVE_TAIL_SLICE (8u << 20)
+
+typedef struct {
+    buffer_t *buf;
+    buffer_snapshot_t snap;
+    c8 path[PATH_MAX];
+    c8 tmp_path[PATH_MAX];
+    bool replace;
+    bool mapped;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    sp_thread_t thread;
+    sp_tm_timer_t timer;
+    bool active;
+    // Lines in the mapped tail, counted by the worker as it writes them
+    // and read once it has been joined
+    u64 tail_lines;
+
+    // Written by the worker, guarded by lock.
+    sp_mutex_t lock;
+    u64 written;
+    bool done;
+    bool ok;
+    c8 error[96];
+} save_job_t;
+
+typedef struct {
+    struct iovec iov[SAVE_IOV_BATCH];
+    u32 count;
+    s32 fd;
+    save_job_t *job;
+} save_batch_t;
+
+static save_job_t G_save;
+static bool G_save_lock_ready = false;
+
+static void save_fail(save_job_t *job, const c8 *what) {
+    sp_mutex_lock(&job->lock);
+    snprintf(job->error, sizeof(job->error), "%s: %s", what, strerror(errno));
+    sp_mutex_unlock(&job->lock);
+}
+
+// Write out every gathered iovec, resuming after short writes.
+static bool save_flush(save_batch_t *b) {
+    struct iovec *iov = b->iov;
+    u32 count = b->count;
+
+    while (count > 0) {
+        ssize_t n = writev(b->fd, iov, (int)count);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            save_fail(b->job, "write");
+            return false;
+        }
+
+        sp_mutex_lock(&b->job->lock);
+        b->job->written += (u64)n;
+        sp_mutex_unlock(&b->job->lock);
+
+        size_t left = (size_t)n;
+        while (count > 0 && left >= iov->iov_len) {
+            left -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (c8 *)iov->iov_base + left;
+            iov->iov_len -= left;
+        }
+    }
+
+    b->count = 0;
+    return true;
+}
+
+static bool save_push(save_batch_t *b, const void *data, size_t len) {
+    if (len == 0) return true;
+    if (b->count == SAVE_IOV_BATCH && !save_flush(b)) return false;
+    b->iov[b->count].iov_base = (void *)data;
+    b->iov[b->count].iov_len = len;
+    b->count++;
+    return true;
+}
+
+// Queue a slice of the mapped tail, counting the lines it ends
+static bool save_push_slice(save_batch_t *b, const c8 *data, u64 len) {
+    b->job->tail_lines += scan_count_byte(data, (u32)len, '\n');
+    return save_push(b, data, (size_t)len);
+}
+
+// Queue raw mapped bytes, dropping the \r of each \r\n pair the same way
+// loaded lines do.
+static bool save_push_tail(save_batch_t *b, const c8 *data, u64 len) {
+    u64 start = 0;
+    u64 pos = 0;
+    while (pos < len) {
+        u64 remaining = len - pos;
+        u32 window = remaining > SAVE_TAIL_SLICE ? SAVE_TAIL_SLICE : (u32)remaining;
+        u32 rel = scan_find_byte(data + pos, window, '\r');
+        pos += rel;
+
+        bool split = rel < window && pos + 1 < len && data[pos + 1] == '\n';
+        if (split || pos - start >= SAVE_TAIL_SLICE) {
+            if (!save_push_slice(b, data + start, pos - start)) return false;
+            start = split ? pos + 1 : pos;
+        }
+        if (rel < window) pos++;
+    }
+    // A last line without a newline still counts
+    if (len > 0 && data[len - 1] != '\n') b->job->tail_lines++;
+    return save_push_slice(b, data + start, len - start);
+}
+
+// Write the snapshot to fd and fsync it.
+static bool save_write_fd(save_job_t *job, s32 fd) {
+    static const c8 newline = '\n';
+
+    save_batch_t *b = sp_alloc(sizeof(save_batch_t));
+    if (!b) {
+        errno = ENOMEM;
+        save_fail(job, "alloc");
+        return false;
+    }
+    b->fd = fd;
+    b->job = job;
+    job->tail_lines = 0;
+
+    bool ok = true;
+    for (u32 i = 0; i < job->snap.line_count && ok; i++) {
+        ok = save_push(b, job->snap.lines[i].data, job->snap.lines[i].len) &&
+             save_push(b, &newline, 1);
+    }
+    if (ok && job->snap.tail_len > 0) {
+        ok = save_push_tail(b, job->snap.tail, job->snap.tail_len);
+    }
+    if (ok) ok = save_flush(b);
+    sp_free(b);
+
+    if (ok && fsync(fd) != 0) {
+        save_fail(job, "fsync");
+        ok = false;
+    }
+    return ok;
+}
+
+// Make a rename or a new name in the target's directory durable.
+static void save_sync_dir(save_job_t *job) {
+    c8 dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", job->path);
+    c8 *slash = strrchr(dir, '/');
+    if (slash) {
+        if (slash == dir) slash[1] = '\0';
+        else *slash = '\0';
+    } else {
+        snprintf(dir, sizeof(dir), ".");
+    }
+    s32 dir_fd = open(dir, O_RDONLY);
+    if (dir_fd >= 0) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+}
+
+// Write the target itself, opened with `flags` on top of O_WRONLY. A file
+// it created is removed again when the write fails.
+static bool save_write_direct(save_job_t *job, s32 flags) {
+    s32 fd = open(job->path, O_WRONLY | flags, 0666);
+    if (fd < 0) {
+        save_fail(job, "open");
+        return false;
+    }
+    bool ok = save_write_fd(job, fd);
+    if (close(fd) != 0 && ok) {
+        save_fail(job, "close");
+        ok = false;
+    }
+    if (!ok && (flags & O_CREAT)) unlink(job->path);
+    return ok;
+}
+
+// The file cannot be replaced by a new one; `what` failed with errno.
+// Write over it instead, which keeps its owner, at the cost of a
+// truncated file if the editor dies mid-write. A mapped buffer reads its
+// text from that very file, so it has to keep the original error.
+static bool save_in_place(save_job_t *job, const c8 *what) {
+    if (job->mapped) {
+        save_fail(job, what);
+        return false;
+    }
+    return save_write_direct(job, O_TRUNC);
+}
+
+static bool save_write_snapshot(save_job_t *job) {
+    // Nothing to protect yet: a new file is written where it goes
+    if (!job->replace) {
+        if (!save_write_direct(job, O_CREAT | O_EXCL)) return false;
+        save_sync_dir(job);
+        return true;
+    }
+
+    // mkstemp picks a name nobody else has and never follows a link, so a
+    // planted symlink cannot redirect the write.
+    s32 fd = mkstemp(job->tmp_path);
+    if (fd < 0) {
+        if (errno == EACCES || errno == EPERM) return save_in_place(job, "create");
+        save_fail(job, "create");
+        return false;
+    }
+    // Keep the owner and permissions of the file being replaced. Ownership
+    // goes first because chown can clear the setuid and setgid bits.
+    if (fchown(fd, job->uid, job->gid) != 0) {
+        s32 err = errno;
+        close(fd);
+        unlink(job->tmp_path);
+        errno = err;
+        if (err == EPERM) return save_in_place(job, "chown");
+        save_fail(job, "chown");
+        return false;
+    }
+    bool ok = true;
+    if (fchmod(fd, job->mode) != 0) {
+        save_fail(job, "chmod");
+        ok = false;
+    }
+
+    if (ok) ok = save_write_fd(job, fd);
+    if (close(fd) != 0 && ok) {
+        save_fail(job, "close");
+        ok = false;
+    }
+    if (ok && rename(job->tmp_path, job->path) != 0) {
+        save_fail(job, "rename");
+        ok = false;
+    }
+    if (!ok) {
+        unlink(job->tmp_path);
+        return false;
+    }
+    save_sync_dir(job);
+    return true;
+}
+
+static s32 save_thread_main(void *userdata) {
+    save_job_t *job = userdata;
+    bool ok = save_write_snapshot(job);
+
+    sp_mutex_lock(&job->lock);
+    job->ok = ok;
+    job->done = true;
+    sp_mutex_unlock(&job->lock);
+    return 0;
+}
+
+// Start saving buf in the background. Returns false if the save could not
+// be started; the reason is left in the message bar.
+bool save_start(buffer_t *buf) {
+    save_job_t *job = &G_save;
+    if (job->active) {
+        editor_set_message("Save already in progress");
+        return false;
+    }
+    if (buf->filename.len == 0 || buf->filename.len + 16 >= PATH_MAX) {
+        editor_set_message("Save failed: invalid filename");
+        return false;
+    }
+
+    if (!G_save_lock_ready) {
+        sp_mutex_init(&job->lock, SP_MUTEX_PLAIN);
+        G_save_lock_ready = true;
+    }
+
+    // Save through symlinks: the temp file goes next to the real target and
+    // the rename replaces it, leaving the link itself in place.
+    static const c8 suffix[] = ".ted-save.XXXXXX";
+    c8 name[PATH_MAX];
+    memcpy(name, buf->filename.data, buf->filename.len);
+    name[buf->filename.len] = '\0';
+    if (!realpath(name, job->path)) memcpy(job->path, name, buf->filename.len + 1);
+    u32 path_len = (u32)strlen(job->path);
+    if (path_len + sizeof(suffix) > PATH_MAX) {
+        editor_set_message("Save failed: invalid filename");
+        return false;
+    }
+    memcpy(job->tmp_path, job->path, path_len);
+    memcpy(job->tmp_path + path_len, suffix, sizeof(suffix));
+
+    struct stat st;
+    job->replace = stat(job->path, &st) == 0;
+    job->mode = job->replace ? (st.st_mode & 07777) : 0;
+    job->uid = job->replace ? st.st_uid : 0;
+    job->gid = job->replace ? st.st_gid : 0;
+    job->mapped = buf->map != SP_NULLPTR;
+
+    if (!buffer_snapshot_begin(buf, &job->snap)) {
+        editor_set_message("Save failed: out of memory");
+        return false;
+    }
+
+    job->buf = buf;
+    job->written = 0;
+    job->done = false;
+    job->ok = false;
+    job->error[0] = '\0';
+    job->timer = sp_tm_start_timer();
+    job->active = true;
+    sp_thread_init(&job->thread, save_thread_main, job);
+    return true;
+}
+
+bool save_in_progress(void) {
+    return G_save.active;
+}
+
+// Bytes written so far as a percentage, plus throughput since the start.
+bool save_progress(u32 *percent, f64 *mb_per_s) {
+    save_job_t *job = &G_save;
+    if (!job->active) return false;
+
+    sp_mutex_lock(&job->lock);
+    u64 written = job->written;
+    sp_mutex_unlock(&job->lock);
+
+    f64 secs = (f64)sp_tm_read_timer(&job->timer) / 1e9;
+    if (percent) {
+        *percent = job->snap.bytes > 0 ? (u32)(written * 100 / job->snap.bytes) : 100;
+        if (*percent > 100) *percent = 100;
+    }
+    if (mb_per_s) *mb_per_s = secs > 0.0 ? (f64)written / secs / 1e6 : 0.0;
+    return true;
+}
+
+static void save_finish(save_job_t *job) {
+    sp_thread_join(&job->thread);
+
+    f64 secs = (f64)sp_tm_read_timer(&job->timer) / 1e9;
+    f64 mb = (f64)job->written / 1e6;
+    buffer_t *buf = job->buf;
+
+    if (job->ok) {
+        // Edits made while the save ran keep the buffer dirty.
+        if (buf->version == job->snap.version) buf->modified = false;
+        // What went to disk, not what the buffer has grown to since
+        editor_set_message("Saved %llu lines (%.1f MB, %.0f MB/s)",
+                           (unsigned long long)(job->snap.line_count + job->tail_lines), mb,
+                           secs > 0.0 ? mb / secs : 0.0);
+    } else {
+        editor_set_message("Save failed: %s", job->error);
+    }
+
+    buffer_snapshot_end(buf, &job->snap);
+    job->active = false;
+}
+
+// Reap a finished save. Called from the main loop.
+void save_poll(void) {
+    save_job_t *job = &G_save;
+    if (!job->active) return;
+
+    sp_mutex_lock(&job->lock);
+    bool done = job->done;
+    sp_mutex_unlock(&job->lock);
+    if (done) save_finish(job);
+}
+
+// Block until the running save, if any, has finished.
+void save_wait(void) {
+    save_job_t *job = &G_save;
+    if (!job->active) return;
+    save_finish(job);
+}
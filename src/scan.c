@@ -0,0 +1,316 @@
+/**
+ * scan.c - Vectorized byte scanning kernels
+ */
+
+#include "ted.h"
+
+#if defined(__x86_64__) || defined(__SSE2__)
+#include <immintrin.h>
+#define SCAN_X86 1
+// vaddlvq_u8 and vmaxvq_u8 are AArch64-only, so 32-bit ARM stays scalar.
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define SCAN_NEON 1
+#endif
+
+// Scalar kernels, also used for the tails the vector loops leave behind.
+static u32 scan_count_scalar(const c8 *data, u32 len, c8 byte) {
+    u32 count = 0;
+    for (u32 i = 0; i < len; i++) {
+        count += data[i] == byte;
+    }
+    return count;
+}
+
+static u32 scan_find_scalar(const c8 *data, u32 len, c8 byte) {
+    for (u32 i = 0; i < len; i++) {
+        if (data[i] == byte) return i;
+    }
+    return len;
+}
+
+static u32 scan_rfind_scalar(const c8 *data, u32 len, c8 byte) {
+    for (u32 i = len; i > 0; i--) {
+        if (data[i - 1] == byte) return i - 1;
+    }
+    return len;
+}
+
+static u32 scan_find2_scalar(const c8 *data, u32 len, c8 a, c8 b) {
+    for (u32 i = 0; i < len; i++) {
+        if (data[i] == a || data[i] == b) return i;
+    }
+    return len;
+}
+
+static u32 scan_rfind2_scalar(const c8 *data, u32 len, c8 a, c8 b) {
+    for (u32 i = len; i > 0; i--) {
+        if (data[i - 1] == a || data[i - 1] == b) return i - 1;
+    }
+    return len;
+}
+
+#if defined(SCAN_X86)
+
+__attribute__((target("avx2")))
+static u32 scan_count_avx2(const c8 *data, u32 len, c8 byte) {
+    __m256i needle = _mm256_set1_epi8(byte);
+    u32 count = 0;
+    u32 i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)(data + i));
+        u32 mask = (u32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle));
+        count += (u32)__builtin_popcount(mask);
+    }
+    return count + scan_count_scalar(data + i, len - i, byte);
+}
+
+__attribute__((target("avx2")))
+static u32 scan_find_avx2(const c8 *data, u32 len, c8 byte) {
+    __m256i needle = _mm256_set1_epi8(byte);
+    u32 i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)(data + i));
+        u32 mask = (u32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle));
+        if (mask) return i + (u32)__builtin_ctz(mask);
+    }
+    return i + scan_find_scalar(data + i, len - i, byte);
+}
+
+__attribute__((target("avx2")))
+static u32 scan_find2_avx2(const c8 *data, u32 len, c8 a, c8 b) {
+    __m256i va = _mm256_set1_epi8(a);
+    __m256i vb = _mm256_set1_epi8(b);
+    u32 i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)(data + i));
+        __m256i eq = _mm256_or_si256(_mm256_cmpeq_epi8(chunk, va), _mm256_cmpeq_epi8(chunk, vb));
+        u32 mask = (u32)_mm256_movemask_epi8(eq);
+        if (mask) return i + (u32)__builtin_ctz(mask);
+    }
+    return i + scan_find2_scalar(data + i, len - i, a, b);
+}
+
+static u32 scan_count_sse2(const c8 *data, u32 len, c8 byte) {
+    __m128i needle = _mm_set1_epi8(byte);
+    u32 count = 0;
+    u32 i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(data + i));
+        u32 mask = (u32)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+        count += (u32)__builtin_popcount(mask);
+    }
+    return count + scan_count_scalar(data + i, len - i, byte);
+}
+
+static u32 scan_find_sse2(const c8 *data, u32 len, c8 byte) {
+    __m128i needle = _mm_set1_epi8(byte);
+    u32 i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(data + i));
+        u32 mask = (u32)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+        if (mask) return i + (u32)__builtin_ctz(mask);
+    }
+    return i + scan_find_scalar(data + i, len - i, byte);
+}
+
+static u32 scan_rfind_sse2(const c8 *data, u32 len, c8 byte) {
+    __m128i needle = _mm_set1_epi8(byte);
+    u32 end = len;
+    while (end >= 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(data + end - 16));
+        u32 mask = (u32)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+        if (mask) return end - 16 + (31 - (u32)__builtin_clz(mask));
+        end -= 16;
+    }
+    u32 hit = scan_rfind_scalar(data, end, byte);
+    return hit < end ? hit : len;
+}
+
+static u32 scan_find2_sse2(const c8 *data, u32 len, c8 a, c8 b) {
+    __m128i va = _mm_set1_epi8(a);
+    __m128i vb = _mm_set1_epi8(b);
+    u32 i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i eq = _mm_or_si128(_mm_cmpeq_epi8(chunk, va), _mm_cmpeq_epi8(chunk, vb));
+        u32 mask = (u32)_mm_movemask_epi8(eq);
+        if (mask) return i + (u32)__builtin_ctz(mask);
+    }
+    return i + scan_find2_scalar(data + i, len - i, a, b);
+}
+
+static u32 scan_rfind2_sse2(const c8 *data, u32 len, c8 a, c8 b) {
+    __m128i va = _mm_set1_epi8(a);
+    __m128i vb = _mm_set1_epi8(b);
+    u32 end = len;
+    while (end >= 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(data + end - 16));
+        __m128i eq = _mm_or_si128(_mm_cmpeq_epi8(chunk, va), _mm_cmpeq_epi8(chunk, vb));
+        u32 mask = (u32)_mm_movemask_epi8(eq);
+        if (mask) return end - 16 + (31 - (u32)__builtin_clz(mask));
+        end -= 16;
+    }
+    u32 hit = scan_rfind2_scalar(data, end, a, b);
+    return hit < end ? hit : len;
+}
+
+typedef struct {
+    u32 (*count)(const c8 *data, u32 len, c8 byte);
+    u32 (*find)(const c8 *data, u32 len, c8 byte);
+    u32 (*find2)(const c8 *data, u32 len, c8 a, c8 b);
+    const c8 *name;
+} scan_kernels_t;
+
+static const scan_kernels_t SCAN_AVX2 = { scan_count_avx2, scan_find_avx2, scan_find2_avx2, "avx2" };
+static const scan_kernels_t SCAN_SSE2 = { scan_count_sse2, scan_find_sse2, scan_find2_sse2, "sse2" };
+static const scan_kernels_t *scan_kernels;
+
+// CPU detection runs once; callers racing the first lookup store the same table.
+static const scan_kernels_t *scan_x86(void) {
+    const scan_kernels_t *k = __atomic_load_n(&scan_kernels, __ATOMIC_ACQUIRE);
+    if (!k) {
+        __builtin_cpu_init();
+        k = __builtin_cpu_supports("avx2") ? &SCAN_AVX2 : &SCAN_SSE2;
+        __atomic_store_n(&scan_kernels, k, __ATOMIC_RELEASE);
+    }
+    return k;
+}
+
+#elif defined(SCAN_NEON)
+
+static u32 scan_count_neon(const c8 *data, u32 len, c8 byte) {
+    uint8x16_t needle = vdupq_n_u8((u8)byte);
+    u32 count = 0;
+    u32 i = 0;
+    while (i + 16 <= len) {
+        // Per-lane counters are u8, so flush them before they can wrap.
+        uint8x16_t acc = vdupq_n_u8(0);
+        u32 blocks = (len - i) / 16;
+        if (blocks > 255) blocks = 255;
+        for (u32 b = 0; b < blocks; b++, i += 16) {
+            uint8x16_t eq = vceqq_u8(vld1q_u8((const u8 *)(data + i)), needle);
+            acc = vsubq_u8(acc, eq);
+        }
+        count += vaddlvq_u8(acc);
+    }
+    return count + scan_count_scalar(data + i, len - i, byte);
+}
+
+static u32 scan_find_neon(const c8 *data, u32 len, c8 byte) {
+    uint8x16_t needle = vdupq_n_u8((u8)byte);
+    u32 i = 0;
+    for (; i + 16 <= len; i += 16) {
+        uint8x16_t eq = vceqq_u8(vld1q_u8((const u8 *)(data + i)), needle);
+        if (vmaxvq_u8(eq)) return i + scan_find_scalar(data + i, 16, byte);
+    }
+    return i + scan_find_scalar(data + i, len - i, byte);
+}
+
+static u32 scan_rfind_neon(const c8 *data, u32 len, c8 byte) {
+    uint8x16_t needle = vdupq_n_u8((u8)byte);
+    u32 end = len;
+    while (end >= 16) {
+        uint8x16_t eq = vceqq_u8(vld1q_u8((const u8 *)(data + end - 16)), needle);
+        if (vmaxvq_u8(eq)) return end - 16 + scan_rfind_scalar(data + end - 16, 16, byte);
+        end -= 16;
+    }
+    u32 hit = scan_rfind_scalar(data, end, byte);
+    return hit < end ? hit : len;
+}
+
+static u32 scan_find2_neon(const c8 *data, u32 len, c8 a, c8 b) {
+    uint8x16_t va = vdupq_n_u8((u8)a);
+    uint8x16_t vb = vdupq_n_u8((u8)b);
+    u32 i = 0;
+    for (; i + 16 <= len; i += 16) {
+        uint8x16_t chunk = vld1q_u8((const u8 *)(data + i));
+        uint8x16_t eq = vorrq_u8(vceqq_u8(chunk, va), vceqq_u8(chunk, vb));
+        if (vmaxvq_u8(eq)) return i + scan_find2_scalar(data + i, 16, a, b);
+    }
+    return i + scan_find2_scalar(data + i, len - i, a, b);
+}
+
+static u32 scan_rfind2_neon(const c8 *data, u32 len, c8 a, c8 b) {
+    uint8x16_t va = vdupq_n_u8((u8)a);
+    uint8x16_t vb = vdupq_n_u8((u8)b);
+    u32 end = len;
+    while (end >= 16) {
+        uint8x16_t chunk = vld1q_u8((const u8 *)(data + end - 16));
+        uint8x16_t eq = vorrq_u8(vceqq_u8(chunk, va), vceqq_u8(chunk, vb));
+        if (vmaxvq_u8(eq)) return end - 16 + scan_rfind2_scalar(data + end - 16, 16, a, b);
+        end -= 16;
+    }
+    u32 hit = scan_rfind2_scalar(data, end, a, b);
+    return hit < end ? hit : len;
+}
+
+#endif
+
+// Count occurrences of byte in data.
+u32 scan_count_byte(const c8 *data, u32 len, c8 byte) {
+#if defined(SCAN_X86)
+    return scan_x86()->count(data, len, byte);
+#elif defined(SCAN_NEON)
+    return scan_count_neon(data, len, byte);
+#else
+    return scan_count_scalar(data, len, byte);
+#endif
+}
+
+// Offset of the first byte in data, or len if absent.
+u32 scan_find_byte(const c8 *data, u32 len, c8 byte) {
+#if defined(SCAN_X86)
+    return scan_x86()->find(data, len, byte);
+#elif defined(SCAN_NEON)
+    return scan_find_neon(data, len, byte);
+#else
+    return scan_find_scalar(data, len, byte);
+#endif
+}
+
+// Offset of the last byte in data, or len if absent.
+u32 scan_rfind_byte(const c8 *data, u32 len, c8 byte) {
+#if defined(SCAN_X86)
+    return scan_rfind_sse2(data, len, byte);
+#elif defined(SCAN_NEON)
+    return scan_rfind_neon(data, len, byte);
+#else
+    return scan_rfind_scalar(data, len, byte);
+#endif
+}
+
+// Offset of the first byte equal to a or b, or len if neither occurs.
+// Case-insensitive search uses this with both cases of a letter.
+u32 scan_find_byte2(const c8 *data, u32 len, c8 a, c8 b) {
+    if (a == b) return scan_find_byte(data, len, a);
+#if defined(SCAN_X86)
+    return scan_x86()->find2(data, len, a, b);
+#elif defined(SCAN_NEON)
+    return scan_find2_neon(data, len, a, b);
+#else
+    return scan_find2_scalar(data, len, a, b);
+#endif
+}
+
+// Offset of the last byte equal to a or b, or len if neither occurs.
+u32 scan_rfind_byte2(const c8 *data, u32 len, c8 a, c8 b) {
+    if (a == b) return scan_rfind_byte(data, len, a);
+#if defined(SCAN_X86)
+    return scan_rfind2_sse2(data, len, a, b);
+#elif defined(SCAN_NEON)
+    return scan_rfind2_neon(data, len, a, b);
+#else
+    return scan_rfind2_scalar(data, len, a, b);
+#endif
+}
+
+const c8 *scan_kernel_name(void) {
+#if defined(SCAN_X86)
+    return scan_x86()->name;
+#elif defined(SCAN_NEON)
+    return "neon";
+#else
+    return "scalar";
+#endif
+}
@@ -4,26 +4,472 @@
 
 #include "ted.h"
 
-static c8 normalize_char(c8 c) {
-    if (c >= 'A' && c <= 'Z') return c + 32;
-    return c;
+#include <string.h>
+
+// Needles at least this long are matched with Two-Way, which stays linear
+// in the line length. Shorter ones verify each prefilter hit directly.
+#define SEARCH_TWO_WAY_MIN 16
+// Rows of a mapped file materialized at a time while searching forward.
+#define SEARCH_MAP_STEP 65536
+// Match positions kept for narrowing; past this the next query rescans.
+#define SEARCH_HIT_CAP (1u << 20)
+// Time spent counting per main loop iteration before yielding to input.
+#define SEARCH_COUNT_SLICE_NS 8000000ull
+// Rows whose matches the display cache holds; it starts over at half full.
+#define SEARCH_CACHE_SLOTS 1024
+
+// Critical factorization of a needle for Two-Way.
+typedef struct {
+    s32 ell;
+    s32 per;
+    bool periodic;
+} search_factor_t;
+
+// A query compiled for matching: case-folded once, plus a reversed copy
+// so backward search runs the same algorithm from the end of the line.
+typedef struct {
+    c8 *key;
+    c8 *fwd;
+    c8 *rev;
+    u32 len;
+    u32 cap;
+    bool fold;
+    search_factor_t fwd_factor;
+    search_factor_t rev_factor;
+} search_needle_t;
+
+// A line viewed through the fold table, optionally back to front.
+typedef struct {
+    const c8 *data;
+    s64 len;
+    bool rev;
+    const u8 *fold;
+} search_hay_t;
+
+// Running match count for E.search.query. Every match start is recorded,
+// overlapping ones included, so a query that extends the previous one is
+// counted by filtering this list instead of rescanning the buffer.
+typedef struct {
+    search_pos_t *hits;
+    u32 hit_count;
+    u32 hit_cap;
+    bool overflow;
+    c8 *query;
+    u32 query_len;
+    u32 query_cap;
+    bool case_sensitive;
+    u32 version;
+    u32 count;
+    search_pos_t last_end;
+    search_pos_t next;
+    bool pending;
+} search_count_t;
+
+static search_needle_t G_needle;
+static search_count_t G_count;
+
+// Bumped whenever the query or how it matches changes; a match cache from
+// an older generation is stale. Starts at 1 so 0 never looks current.
+static u32 G_match_gen = 1;
+
+// Matches on one row the display asked about, as count (col, len) pairs
+// from spans[at]. key is row + 1, with 0 marking a free slot.
+typedef struct {
+    u32 key;
+    u32 count;
+    u32 at;
+} search_row_hits_t;
+
+// Match cache for drawing. Rows without matches get a slot but no span
+// storage, and everything is dropped once the buffer or query moves on.
+static struct {
+    const buffer_t *buf;
+    u32 version;
+    u32 gen;
+    search_row_hits_t *slots;
+    u32 used;
+    u32 *spans;
+    u32 span_len;
+    u32 span_cap;
+} G_match_cache;
+
+// Last compiled regex and the pattern it came from
+static struct {
+    regex_prog_t *prog;
+    c8 *key;
+    u32 key_len;
+    u32 key_cap;
+    bool case_sensitive;
+    const c8 *error;
+} G_regex;
+static u8 G_fold_none[256];
+static u8 G_fold_case[256];
+static bool G_fold_ready = false;
+
+static void search_init_fold(void) {
+    if (G_fold_ready) return;
+    for (u32 i = 0; i < 256; i++) {
+        G_fold_none[i] = (u8)i;
+        G_fold_case[i] = (i >= 'A' && i <= 'Z') ? (u8)(i + 32) : (u8)i;
+    }
+    G_fold_ready = true;
+}
+
+static inline u8 hay_at(const search_hay_t *h, s64 i) {
+    return h->fold[(u8)h->data[h->rev ? h->len - 1 - i : i]];
+}
+
+static s32 search_max_suffix(const c8 *x, s32 m, s32 *period, bool invert) {
+    s32 ms = -1;
+    s32 j = 0;
+    s32 k = 1;
+    s32 p = 1;
+    while (j + k < m) {
+        u8 a = (u8)x[j + k];
+        u8 b = (u8)x[ms + k];
+        if (invert ? a > b : a < b) {
+            j += k;
+            k = 1;
+            p = j - ms;
+        } else if (a == b) {
+            if (k != p) {
+                k++;
+            } else {
+                j += p;
+                k = 1;
+            }
+        } else {
+            ms = j;
+            j = ms + 1;
+            k = p = 1;
+        }
+    }
+    *period = p;
+    return ms;
+}
+
+static search_factor_t search_factorize(const c8 *x, s32 m) {
+    s32 p, q;
+    s32 i = search_max_suffix(x, m, &p, false);
+    s32 j = search_max_suffix(x, m, &q, true);
+
+    search_factor_t f;
+    f.ell = i > j ? i : j;
+    f.per = i > j ? p : q;
+    f.periodic = f.per < m && memcmp(x, x + f.per, (size_t)(f.ell + 1)) == 0;
+    if (!f.periodic) {
+        s32 left = f.ell + 1;
+        s32 right = m - f.ell - 1;
+        f.per = (left > right ? left : right) + 1;
+    }
+    return f;
+}
+
+// Smallest j >= from, j <= limit, whose byte at j + k folds to c. The scan
+// runs on raw bytes, so case-folded needles look for both cases of c.
+static s64 search_prefilter(const search_hay_t *h, s64 from, s64 limit, s32 k, u8 c) {
+    if (from > limit) return -1;
+    c8 lo = (c8)c;
+    c8 up = (h->fold == G_fold_case && c >= 'a' && c <= 'z') ? (c8)(c - 32) : lo;
+    u32 window = (u32)(limit - from + 1);
+
+    if (!h->rev) {
+        u32 hit = scan_find_byte2(h->data + from + k, window, lo, up);
+        return hit < window ? from + hit : -1;
+    }
+    // Reversed index i is byte len - 1 - i, so scan backwards in memory.
+    s64 low = h->len - 1 - (limit + k);
+    u32 hit = scan_rfind_byte2(h->data + low, window, lo, up);
+    if (hit >= window) return -1;
+    return h->len - 1 - (low + hit) - k;
 }
 
-static bool search_match_at(sp_str_t line, u32 col, sp_str_t query, bool case_sensitive) {
-    if (col + query.len > line.len) return false;
+static s64 search_short(const c8 *x, s32 m, const search_hay_t *h, s64 from) {
+    s64 limit = h->len - m;
+    s64 j = from;
+    while ((j = search_prefilter(h, j, limit, 0, (u8)x[0])) >= 0) {
+        s32 i = 1;
+        while (i < m && (u8)x[i] == hay_at(h, j + i)) i++;
+        if (i == m) return j;
+        j++;
+    }
+    return -1;
+}
 
+// Crochemore-Perrin Two-Way. Whenever no prefix of the needle is known to
+// match, jump straight to the next place the critical byte can line up.
+static s64 search_two_way(const c8 *x, s32 m, const search_factor_t *f,
+                          const search_hay_t *h, s64 from) {
+    s64 limit = h->len - m;
+    s32 ell = f->ell;
+    s64 j = from;
+
+    if (f->periodic) {
+        s32 memory = -1;
+        while (j <= limit) {
+            if (memory < 0) {
+                j = search_prefilter(h, j, limit, ell + 1, (u8)x[ell + 1]);
+                if (j < 0) return -1;
+            }
+            s32 i = (ell > memory ? ell : memory) + 1;
+            while (i < m && (u8)x[i] == hay_at(h, j + i)) i++;
+            if (i >= m) {
+                i = ell;
+                while (i > memory && (u8)x[i] == hay_at(h, j + i)) i--;
+                if (i <= memory) return j;
+                j += f->per;
+                memory = m - f->per - 1;
+            } else {
+                j += i - ell;
+                memory = -1;
+            }
+        }
+        return -1;
+    }
+
+    while (j <= limit) {
+        j = search_prefilter(h, j, limit, ell + 1, (u8)x[ell + 1]);
+        if (j < 0) return -1;
+        s32 i = ell + 1;
+        while (i < m && (u8)x[i] == hay_at(h, j + i)) i++;
+        if (i >= m) {
+            i = ell;
+            while (i >= 0 && (u8)x[i] == hay_at(h, j + i)) i--;
+            if (i < 0) return j;
+            j += f->per;
+        } else {
+            j += i - ell;
+        }
+    }
+    return -1;
+}
+
+// Compile query, reusing the previous compilation when nothing changed.
+static const search_needle_t *search_needle(sp_str_t query, bool case_sensitive) {
+    search_needle_t *nd = &G_needle;
+    bool fold = !case_sensitive;
+    if (nd->key && nd->len == query.len && nd->fold == fold &&
+        memcmp(nd->key, query.data, query.len) == 0) {
+        return nd;
+    }
+
+    search_init_fold();
+    if (query.len > nd->cap) {
+        if (nd->key) sp_free(nd->key);
+        nd->key = sp_alloc(query.len * 3);
+        if (!nd->key) {
+            nd->cap = 0;
+            return SP_NULLPTR;
+        }
+        nd->cap = query.len;
+    }
+    nd->fwd = nd->key + nd->cap;
+    nd->rev = nd->fwd + nd->cap;
+    nd->len = query.len;
+    nd->fold = fold;
+
+    const u8 *table = fold ? G_fold_case : G_fold_none;
+    memcpy(nd->key, query.data, query.len);
     for (u32 i = 0; i < query.len; i++) {
-        c8 lc = line.data[col + i];
-        c8 qc = query.data[i];
-        if (!case_sensitive) {
-            lc = normalize_char(lc);
-            qc = normalize_char(qc);
+        nd->fwd[i] = (c8)table[(u8)query.data[i]];
+        nd->rev[query.len - 1 - i] = nd->fwd[i];
+    }
+    if (query.len >= SEARCH_TWO_WAY_MIN) {
+        nd->fwd_factor = search_factorize(nd->fwd, (s32)query.len);
+        nd->rev_factor = search_factorize(nd->rev, (s32)query.len);
+    }
+    return nd;
+}
+
+static bool search_match_at(const search_needle_t *nd, sp_str_t line, u32 col) {
+    if ((u64)col + nd->len > line.len) return false;
+    const u8 *fold = nd->fold ? G_fold_case : G_fold_none;
+    for (u32 i = 0; i < nd->len; i++) {
+        if (fold[(u8)line.data[col + i]] != (u8)nd->fwd[i]) return false;
+    }
+    return true;
+}
+
+// First match in line starting at or after from, or -1.
+static s64 search_line_find(const search_needle_t *nd, sp_str_t line, u32 from) {
+    if ((u64)from + nd->len > line.len) return -1;
+    search_hay_t h = { line.data, line.len, false, nd->fold ? G_fold_case : G_fold_none };
+    if (nd->len < SEARCH_TWO_WAY_MIN) return search_short(nd->fwd, (s32)nd->len, &h, from);
+    return search_two_way(nd->fwd, (s32)nd->len, &nd->fwd_factor, &h, from);
+}
+
+// Last match in line starting at or before max_start, or -1. Runs the
+// forward matcher over the reversed line prefix that could hold it.
+static s64 search_line_rfind(const search_needle_t *nd, sp_str_t line, u32 max_start) {
+    u64 end = (u64)max_start + nd->len;
+    if (end > line.len) end = line.len;
+    if (end < nd->len) return -1;
+
+    search_hay_t h = { line.data, (s64)end, true, nd->fold ? G_fold_case : G_fold_none };
+    s64 hit = nd->len < SEARCH_TWO_WAY_MIN
+        ? search_short(nd->rev, (s32)nd->len, &h, 0)
+        : search_two_way(nd->rev, (s32)nd->len, &nd->rev_factor, &h, 0);
+    return hit < 0 ? -1 : (s64)end - hit - nd->len;
+}
+
+// The current query compiled for matching: a literal needle, or a regex
+// when E.search.regex is set.
+typedef struct {
+    const search_needle_t *needle;
+    regex_prog_t *re;
+} search_matcher_t;
+
+static search_matcher_t search_matcher(sp_str_t query) {
+    search_matcher_t m = { SP_NULLPTR, SP_NULLPTR };
+    if (!E.search.regex) {
+        m.needle = search_needle(query, E.search.case_sensitive);
+        return m;
+    }
+
+    // Recompile only when the pattern or case setting changed
+    if (G_regex.key_len != query.len || G_regex.case_sensitive != E.search.case_sensitive ||
+        G_regex.key_len == 0 || memcmp(G_regex.key, query.data, query.len) != 0) {
+        regex_free(G_regex.prog);
+        G_regex.prog = regex_compile(query, E.search.case_sensitive, &G_regex.error);
+        G_regex.key_len = 0;
+        if (query.len > G_regex.key_cap) {
+            c8 *grown = sp_realloc(G_regex.key, query.len);
+            if (!grown) return m;
+            G_regex.key = grown;
+            G_regex.key_cap = query.len;
         }
-        if (lc != qc) return false;
+        memcpy(G_regex.key, query.data, query.len);
+        G_regex.key_len = query.len;
+        G_regex.case_sensitive = E.search.case_sensitive;
     }
+    m.re = G_regex.prog;
+    return m;
+}
+
+static bool search_matcher_ok(const search_matcher_t *m) {
+    return m->needle || m->re;
+}
+
+// First match in line starting at or after from. Regex captures are
+// written to caps when it is not NULL.
+static bool search_line_next(const search_matcher_t *m, sp_str_t line, u32 from,
+                             u32 *col, u32 *len, regex_match_t *caps) {
+    if (m->re) {
+        regex_match_t local;
+        regex_match_t *out = caps ? caps : &local;
+        if (!regex_find(m->re, line, from, out)) return false;
+        *col = out->start[0];
+        *len = out->end[0] - out->start[0];
+        return true;
+    }
+    s64 hit = search_line_find(m->needle, line, from);
+    if (hit < 0) return false;
+    *col = (u32)hit;
+    *len = m->needle->len;
     return true;
 }
 
+// Last match in line starting at or before max_start.
+static bool search_line_prev(const search_matcher_t *m, sp_str_t line, u32 max_start,
+                             u32 *col, u32 *len, regex_match_t *caps) {
+    if (!m->re) {
+        s64 hit = search_line_rfind(m->needle, line, max_start);
+        if (hit < 0) return false;
+        *col = (u32)hit;
+        *len = m->needle->len;
+        return true;
+    }
+
+    // Regexes only run forward: walk the line's matches and keep the last
+    // one that starts in range.
+    bool found = false;
+    u32 from = 0;
+    u32 hit_col, hit_len;
+    regex_match_t local;
+    while (from <= max_start && search_line_next(m, line, from, &hit_col, &hit_len, &local)) {
+        if (hit_col > max_start) break;
+        found = true;
+        *col = hit_col;
+        *len = hit_len;
+        if (caps) *caps = local;
+        from = hit_len > 0 ? hit_col + hit_len : hit_col + 1;
+    }
+    return found;
+}
+
+static bool search_find_with(const search_matcher_t *m, buffer_t *buf, search_pos_t from,
+                             search_dir_t dir, search_match_t *match, regex_match_t *caps) {
+    if (dir == SEARCH_FORWARD) {
+        for (u32 row = from.row;; row++) {
+            if (row >= buf->line_count) {
+                buffer_ensure_rows(buf, row + SEARCH_MAP_STEP);
+                if (row >= buf->line_count) return false;
+            }
+            u32 col = row == from.row ? from.col : 0;
+            if (search_line_next(m, buffer_get_line(buf, row), col, &match->col, &match->len, caps)) {
+                match->row = row;
+                return true;
+            }
+        }
+    }
+
+    // Without waiting on the background count: a file still being indexed
+    // is searched from the last line found so far
+    if (from.row >= buf->line_count) {
+        buffer_ensure_counted_rows(buf);
+        if (buf->line_count == 0) return false;
+        if (from.row >= buf->line_count) {
+            from.row = buf->line_count - 1;
+            from.col = UINT32_MAX;
+        }
+    }
+    for (s64 row = from.row; row >= 0; row--) {
+        u32 max_start = row == from.row ? from.col : UINT32_MAX;
+        if (search_line_prev(m, buffer_get_line(buf, row), max_start, &match->col, &match->len, caps)) {
+            match->row = (u32)row;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Find the nearest match of query at or after `from` (forward) or starting
+// at or before it (backward), honoring the search case and regex settings.
+// Does not wrap. A backward search from past the last row starts at the end.
+bool search_find(buffer_t *buf, sp_str_t query, search_pos_t from, search_dir_t dir, search_match_t *match) {
+    if (query.len == 0) return false;
+    search_matcher_t m = search_matcher(query);
+    if (!search_matcher_ok(&m)) return false;
+    return search_find_with(&m, buf, from, dir, match, SP_NULLPTR);
+}
+
+// Append replacement for one match. With regex search \0-\9 insert capture
+// groups and \\ a backslash; literal search inserts it verbatim.
+static void search_append_replacement(sp_str_builder_t *b, sp_str_t replacement, sp_str_t line,
+                                      const regex_match_t *caps) {
+    if (!E.search.regex || !caps) {
+        sp_str_builder_append(b, replacement);
+        return;
+    }
+    for (u32 i = 0; i < replacement.len; i++) {
+        c8 c = replacement.data[i];
+        if (c != '\\' || i + 1 >= replacement.len) {
+            sp_str_builder_append_c8(b, c);
+            continue;
+        }
+        c8 next = replacement.data[++i];
+        if (next >= '0' && next <= '9') {
+            u32 g = (u32)(next - '0');
+            if (caps->start[g] != UINT32_MAX) {
+                sp_str_builder_append(b, sp_str_sub(line, (s32)caps->start[g],
+                                                    (s32)(caps->end[g] - caps->start[g])));
+            }
+        } else {
+            sp_str_builder_append_c8(b, next);
+        }
+    }
+}
+
 void search_init(void) {
     E.search.query = sp_str_lit("");
     E.search.current_match = 0;
@@ -32,82 +478,279 @@ void search_init(void) {
     E.search.forward = true;
 }
 
+// Record a match start. The count itself is non-overlapping, taking
+// matches greedily from the top of the file.
+static void search_count_hit(search_count_t *sc, u32 row, u32 col, u32 len) {
+    if (row != sc->last_end.row || col >= sc->last_end.col) {
+        sc->count++;
+        sc->last_end.row = row;
+        sc->last_end.col = col + len;
+    }
+    if (sc->overflow) return;
+
+    if (sc->hit_count == sc->hit_cap) {
+        u32 new_cap = sc->hit_cap ? sc->hit_cap * 2 : 1024;
+        search_pos_t *grown = new_cap <= SEARCH_HIT_CAP
+            ? sp_realloc(sc->hits, sizeof(search_pos_t) * new_cap)
+            : SP_NULLPTR;
+        if (!grown) {
+            sc->overflow = true;
+            return;
+        }
+        sc->hits = grown;
+        sc->hit_cap = new_cap;
+    }
+    sc->hits[sc->hit_count].row = row;
+    sc->hits[sc->hit_count].col = col;
+    sc->hit_count++;
+}
+
+static void search_count_reset(search_count_t *sc) {
+    sc->hit_count = 0;
+    // Extending a regex does not narrow its matches, so none are kept
+    sc->overflow = E.search.regex;
+    sc->count = 0;
+    sc->last_end.row = UINT32_MAX;
+    sc->last_end.col = 0;
+    sc->next.row = 0;
+    sc->next.col = 0;
+    sc->pending = false;
+}
+
+static bool search_count_remember(search_count_t *sc, sp_str_t query) {
+    if (query.len > sc->query_cap) {
+        c8 *grown = sp_realloc(sc->query, query.len);
+        if (!grown) return false;
+        sc->query = grown;
+        sc->query_cap = query.len;
+    }
+    memcpy(sc->query, query.data, query.len);
+    sc->query_len = query.len;
+    sc->case_sensitive = E.search.case_sensitive;
+    sc->version = E.buffer.version;
+    return true;
+}
+
+// Narrow the recorded matches of the previous query down to those where
+// query (an extension of it) also matches. Only positions the scan has
+// already passed are filtered; a pending scan resumes with the new query.
+static bool search_count_narrow(search_count_t *sc, const search_needle_t *nd, sp_str_t query) {
+    if (!nd || sc->overflow || sc->query_len == 0 || query.len < sc->query_len) return false;
+    if (sc->case_sensitive != E.search.case_sensitive || sc->version != E.buffer.version) return false;
+    if (memcmp(sc->query, query.data, sc->query_len) != 0) return false;
+
+    u32 kept = 0;
+    sc->count = 0;
+    sc->last_end.row = UINT32_MAX;
+    sc->last_end.col = 0;
+    for (u32 i = 0; i < sc->hit_count; i++) {
+        search_pos_t hit = sc->hits[i];
+        if (!search_match_at(nd, buffer_get_line(&E.buffer, hit.row), hit.col)) continue;
+        if (hit.row != sc->last_end.row || hit.col >= sc->last_end.col) {
+            sc->count++;
+            sc->last_end.row = hit.row;
+            sc->last_end.col = hit.col + query.len;
+        }
+        sc->hits[kept++] = hit;
+    }
+    sc->hit_count = kept;
+    return true;
+}
+
+// Count matches for a slice of time, resuming where the last slice ended.
+static void search_count_step(u64 budget_ns) {
+    search_count_t *sc = &G_count;
+    search_matcher_t m = search_matcher(E.search.query);
+    if (!search_matcher_ok(&m)) sc->pending = false;
+
+    sp_tm_timer_t timer = sp_tm_start_timer();
+    u32 row = sc->next.row;
+    u32 col = sc->next.col;
+    for (u32 n = 1; sc->pending; row++, col = 0, n++) {
+        if (row >= E.buffer.line_count) {
+            buffer_ensure_rows(&E.buffer, row + SEARCH_MAP_STEP);
+            if (row >= E.buffer.line_count) {
+                sc->pending = false;
+                break;
+            }
+        }
+
+        // Literal matches are recorded overlapping for narrowing; regex
+        // matches are taken one after another
+        sp_str_t line = buffer_get_line(&E.buffer, row);
+        u32 hit, len;
+        while (search_line_next(&m, line, col, &hit, &len, SP_NULLPTR)) {
+            search_count_hit(sc, row, hit, len);
+            col = m.re && len > 0 ? hit + len : hit + 1;
+        }
+
+        if ((n & 63) == 0 && sp_tm_read_timer(&timer) >= budget_ns) {
+            sc->next.row = row + 1;
+            sc->next.col = 0;
+            break;
+        }
+    }
+
+    E.search.match_count = sc->count;
+    E.search.counting = sc->pending;
+}
+
 void search_update_query(sp_str_t query) {
+    search_count_t *sc = &G_count;
     E.search.query = query;
+    G_match_gen++;
     E.search.current_match = 0;
-
-    // Count matches
     E.search.match_count = 0;
-    if (query.len == 0) return;
+    E.search.counting = false;
 
-    for (u32 row = 0; row < E.buffer.line_count; row++) {
-        sp_str_t line = E.buffer.lines[row].text;
-        u32 col = 0;
+    if (query.len == 0) {
+        search_count_reset(sc);
+        sc->query_len = 0;
+        return;
+    }
 
-        while (col + query.len <= line.len) {
-            if (search_match_at(line, col, query, E.search.case_sensitive)) {
-                E.search.match_count++;
-                col += query.len;
-            } else {
-                col++;
-            }
-        }
+    search_matcher_t m = search_matcher(query);
+    if (!search_matcher_ok(&m)) {
+        search_count_reset(sc);
+        sc->query_len = 0;
+        editor_set_message("Regex: %s", G_regex.error ? G_regex.error : "invalid pattern");
+        return;
+    }
+    if (!search_count_narrow(sc, m.needle, query)) {
+        search_count_reset(sc);
+        sc->pending = true;
     }
+    if (!search_count_remember(sc, query)) {
+        // Without a copy of the query the list cannot be narrowed later
+        sc->overflow = true;
+        sc->query_len = 0;
+    }
+
+    // Small files finish here; large ones continue from search_poll
+    E.search.match_count = sc->count;
+    if (sc->pending) search_count_step(SEARCH_COUNT_SLICE_NS);
 }
 
-void search_next(void) {
-    if (E.search.query.len == 0) return;
+bool search_count_pending(void) {
+    return G_count.pending && E.search.query.len > 0;
+}
 
-    u32 start_row = E.cursor.row;
-    u32 start_col = E.cursor.col + 1;
-    bool wrapped = false;
+// Continue a match count that did not finish in one slice. Called from
+// the main loop between keystrokes.
+void search_poll(void) {
+    if (!search_count_pending()) return;
+    if (G_count.version != E.buffer.version) {
+        search_update_query(E.search.query);
+        return;
+    }
+    search_count_step(SEARCH_COUNT_SLICE_NS);
+}
 
-    for (u32 pass = 0; pass < 2; pass++) {
-        u32 row_begin = (pass == 0) ? start_row : 0;
-        u32 row_end = (pass == 0) ? E.buffer.line_count : (start_row + 1);
+static void search_cache_drop(void) {
+    if (G_match_cache.slots) {
+        memset(G_match_cache.slots, 0, sizeof(search_row_hits_t) * SEARCH_CACHE_SLOTS);
+    }
+    G_match_cache.used = 0;
+    G_match_cache.span_len = 0;
+}
 
-        for (u32 row = row_begin; row < row_end; row++) {
-            sp_str_t line = E.buffer.lines[row].text;
-            u32 col = 0;
-            u32 col_limit = line.len;
+// Matches of E.search.query on row for display, as (col, len) pairs, or
+// NULL when it has none. They are kept in a bounded cache keyed by row,
+// and the whole cache is dropped when the query, the buffer's version or
+// the match generation changes, or when half its slots are taken. Empty
+// regex matches are skipped since there is nothing to paint.
+const u32 *search_line_matches(buffer_t *buf, u32 row, u32 *count) {
+    *count = 0;
+    if (E.search.query.len == 0 || row >= buf->line_count) return SP_NULLPTR;
+
+    if (!G_match_cache.slots) {
+        G_match_cache.slots = sp_alloc(sizeof(search_row_hits_t) * SEARCH_CACHE_SLOTS);
+        if (!G_match_cache.slots) return SP_NULLPTR;
+    }
+    if (G_match_cache.buf != buf || G_match_cache.version != buf->version ||
+        G_match_cache.gen != G_match_gen || G_match_cache.used >= SEARCH_CACHE_SLOTS / 2) {
+        search_cache_drop();
+        G_match_cache.buf = buf;
+        G_match_cache.version = buf->version;
+        G_match_cache.gen = G_match_gen;
+    }
 
-            if (pass == 0 && row == start_row) {
-                col = start_col;
-            } else if (pass == 1 && row == start_row) {
-                col_limit = start_col;
-            }
+    u32 slot = (row * 2654435761u) & (SEARCH_CACHE_SLOTS - 1);
+    for (; G_match_cache.slots[slot].key != 0; slot = (slot + 1) & (SEARCH_CACHE_SLOTS - 1)) {
+        search_row_hits_t *hits = &G_match_cache.slots[slot];
+        if (hits->key != row + 1) continue;
+        *count = hits->count;
+        return hits->count > 0 ? G_match_cache.spans + hits->at : SP_NULLPTR;
+    }
 
-            while (col + E.search.query.len <= col_limit) {
-                if (!search_match_at(line, col, E.search.query, E.search.case_sensitive)) {
-                    col++;
-                    continue;
-                }
-
-                E.cursor.row = row;
-                E.cursor.col = col;
-                E.cursor.render_col = buffer_row_to_render(&E.buffer, row, col);
-                E.search.current_match++;
-
-                // Adjust scroll
-                if (row < E.row_offset) {
-                    E.row_offset = row;
-                } else if (row >= E.row_offset + E.screen_rows) {
-                    E.row_offset = row - E.screen_rows / 2;
-                }
-
-                if (wrapped) {
-                    editor_set_message("Match found (wrapped)");
-                } else {
-                    editor_set_message("Match found");
-                }
-                return;
-            }
+    search_matcher_t m = search_matcher(E.search.query);
+    if (!search_matcher_ok(&m)) return SP_NULLPTR;
+
+    sp_str_t text = buffer_get_line(buf, row);
+    u32 at = G_match_cache.span_len;
+    u32 found = 0;
+    u32 col = 0;
+    u32 hit, len;
+    while (col <= text.len && search_line_next(&m, text, col, &hit, &len, SP_NULLPTR)) {
+        if (len == 0) {
+            col = hit + 1;
+            continue;
+        }
+        if (G_match_cache.span_len + 2 > G_match_cache.span_cap) {
+            u32 new_cap = G_match_cache.span_cap == 0 ? 256 : G_match_cache.span_cap * 2;
+            u32 *grown = sp_realloc(G_match_cache.spans, sizeof(u32) * new_cap);
+            if (!grown) break;
+            G_match_cache.spans = grown;
+            G_match_cache.span_cap = new_cap;
         }
+        G_match_cache.spans[G_match_cache.span_len++] = hit;
+        G_match_cache.spans[G_match_cache.span_len++] = len;
+        found++;
+        col = hit + len;
+    }
+
+    G_match_cache.slots[slot] = (search_row_hits_t){ row + 1, found, at };
+    G_match_cache.used++;
+    *count = found;
+    return found > 0 ? G_match_cache.spans + at : SP_NULLPTR;
+}
+
+static void search_jump(search_match_t hit) {
+    E.cursor.row = hit.row;
+    E.cursor.col = hit.col;
+    E.cursor.render_col = buffer_row_to_render(&E.buffer, hit.row, hit.col);
 
+    // Adjust scroll
+    if (hit.row < E.row_offset) {
+        E.row_offset = hit.row;
+    } else if (hit.row >= E.row_offset + E.screen_rows) {
+        E.row_offset = hit.row - E.screen_rows / 2;
+    }
+}
+
+void search_next(void) {
+    if (E.search.query.len == 0) return;
+
+    search_pos_t from = { E.cursor.row, E.cursor.col + 1 };
+    search_pos_t top = { 0, 0 };
+    search_match_t hit;
+    bool wrapped = false;
+
+    if (!search_find(&E.buffer, E.search.query, from, SEARCH_FORWARD, &hit)) {
+        if (!search_find(&E.buffer, E.search.query, top, SEARCH_FORWARD, &hit)) {
+            editor_set_message("Pattern not found");
+            return;
+        }
         wrapped = true;
     }
 
-    editor_set_message("Pattern not found");
+    search_jump(hit);
+    E.search.current_match++;
+    if (wrapped) {
+        editor_set_message("Match found (wrapped)");
+    } else {
+        editor_set_message("Match found");
+    }
 }
 
 void search_prev(void) {
@@ -115,56 +758,36 @@ void search_prev(void) {
 
     E.search.forward = false;
 
-    u32 start_row = E.cursor.row;
-    u32 start_col = (E.cursor.col > 0) ? E.cursor.col - 1 : 0;
+    // Matches starting before the cursor, then from the end of the file
+    search_pos_t bottom = { UINT32_MAX, UINT32_MAX };
+    search_match_t hit;
+    bool found = false;
     bool wrapped = false;
 
-    for (u32 pass = 0; pass < 2; pass++) {
-        s32 row_begin = (pass == 0) ? (s32)start_row : (s32)(E.buffer.line_count - 1);
-        s32 row_end = (pass == 0) ? 0 : (s32)start_row;
-
-        for (s32 row = row_begin; row >= row_end; row--) {
-            sp_str_t line = E.buffer.lines[row].text;
-            s32 col = (s32)(line.len - E.search.query.len);
-
-            if (pass == 0 && row == (s32)start_row) {
-                s32 max_col = (s32)start_col - (s32)E.search.query.len + 1;
-                if (max_col < col) col = max_col;
-            } else if (pass == 1 && row == (s32)start_row) {
-                col = (s32)(line.len - E.search.query.len);
-            }
-
-            if (col < 0) continue;
-
-            while (col >= 0) {
-                if (!search_match_at(line, (u32)col, E.search.query, E.search.case_sensitive)) {
-                    col--;
-                    continue;
-                }
-
-                E.cursor.row = (u32)row;
-                E.cursor.col = (u32)col;
-                E.cursor.render_col = buffer_row_to_render(&E.buffer, (u32)row, (u32)col);
-
-                if ((u32)row < E.row_offset) {
-                    E.row_offset = (u32)row;
-                } else if ((u32)row >= E.row_offset + E.screen_rows) {
-                    E.row_offset = (u32)row - E.screen_rows / 2;
-                }
-
-                if (wrapped) {
-                    editor_set_message("Previous match found (wrapped)");
-                } else {
-                    editor_set_message("Previous match found");
-                }
-                return;
-            }
+    if (E.cursor.col > 0) {
+        search_pos_t from = { E.cursor.row, E.cursor.col - 1 };
+        found = search_find(&E.buffer, E.search.query, from, SEARCH_BACKWARD, &hit);
+    } else if (E.cursor.row > 0) {
+        search_pos_t from = { E.cursor.row - 1, UINT32_MAX };
+        found = search_find(&E.buffer, E.search.query, from, SEARCH_BACKWARD, &hit);
+    }
+    if (!found) {
+        if (!search_find(&E.buffer, E.search.query, bottom, SEARCH_BACKWARD, &hit)) {
+            editor_set_message(buffer_is_partial(&E.buffer) ? "Pattern not found (still indexing)"
+                                                             : "Pattern not found");
+            return;
         }
-
         wrapped = true;
     }
 
-    editor_set_message("Pattern not found");
+    search_jump(hit);
+    if (wrapped && buffer_is_partial(&E.buffer)) {
+        editor_set_message("Previous match found (wrapped, still indexing)");
+    } else if (wrapped) {
+        editor_set_message("Previous match found (wrapped)");
+    } else {
+        editor_set_message("Previous match found");
+    }
 }
 
 void search_replace_current(sp_str_t replacement) {
@@ -176,101 +799,88 @@ void search_replace_current(sp_str_t replacement) {
 
     if (row >= E.buffer.line_count) return;
 
-    sp_str_t line = E.buffer.lines[row].text;
+    sp_str_t line = buffer_get_line(&E.buffer, row);
+    search_matcher_t m = search_matcher(E.search.query);
+    regex_match_t caps;
+    u32 hit = 0;
+    u32 len = 0;
 
-    // Verify match at this position
-    bool match = true;
-    for (u32 i = 0; i < E.search.query.len; i++) {
-        if (col + i >= line.len || line.data[col + i] != E.search.query.data[i]) {
-            match = false;
-            break;
-        }
-    }
-
-    if (!match) {
+    // Only a match starting exactly at the cursor counts
+    if (!search_matcher_ok(&m) || !search_line_next(&m, line, col, &hit, &len, &caps) || hit != col) {
         editor_set_message("No match at cursor position");
         return;
     }
 
-    // Build new line with replacement
     sp_io_writer_t writer = sp_io_writer_from_dyn_mem();
-    sp_str_builder_t builder = sp_str_builder_from_writer(&writer);
-
-    // Part before match
-    if (col > 0) {
-        sp_str_builder_append(&builder, sp_str_sub(line, 0, (s32)col));
-    }
+    sp_str_builder_t text = sp_str_builder_from_writer(&writer);
+    search_append_replacement(&text, replacement, line, &caps);
+    sp_str_t replaced = sp_str_builder_to_str(&text);
 
-    // Replacement
-    sp_str_builder_append(&builder, replacement);
-
-    // Part after match
-    if (col + E.search.query.len < line.len) {
-        sp_str_builder_append(&builder,
-            sp_str_sub(line, (s32)(col + E.search.query.len),
-                (s32)(line.len - col - E.search.query.len)));
-    }
-
-    // Update line
-    E.buffer.lines[row].text = sp_str_builder_to_str(&builder);
-    E.buffer.lines[row].hl_dirty = true;
-    E.buffer.modified = true;
+    // Splice replacement over the match
+    undo_record_splice(row, col, sp_str_sub(line, (s32)col, (s32)len), replaced);
+    buffer_delete_text(&E.buffer, row, col, row, col + len);
+    buffer_insert_text(&E.buffer, row, col, replaced, SP_NULLPTR, SP_NULLPTR);
+    sp_free((void *)replaced.data);
 
     editor_set_message("Replaced match");
 }
 
 void search_replace_all(sp_str_t replacement) {
-    if (E.search.query.len == 0) return;
+    sp_str_t query = E.search.query;
+    if (query.len == 0) return;
+    search_matcher_t m = search_matcher(query);
+    if (!search_matcher_ok(&m)) {
+        editor_set_message("Regex: %s", G_regex.error ? G_regex.error : "invalid pattern");
+        return;
+    }
 
     u32 count = 0;
-
-    for (u32 row = 0; row < E.buffer.line_count; row++) {
-        sp_str_t line = E.buffer.lines[row].text;
+    undo_begin();
+
+    // Only lines with matches are rewritten
+    search_match_t hit;
+    regex_match_t caps;
+    bool found = search_find_with(&m, &E.buffer, (search_pos_t){ 0, 0 }, SEARCH_FORWARD, &hit, &caps);
+    while (found) {
+        u32 row = hit.row;
+        sp_str_t line = buffer_get_line(&E.buffer, row);
         sp_io_writer_t writer = sp_io_writer_from_dyn_mem();
         sp_str_builder_t new_line = sp_str_builder_from_writer(&writer);
         u32 col = 0;
 
-        while (col <= line.len) {
-            // Check for match at this position
-            bool match = true;
-            if (col + E.search.query.len > line.len) {
-                match = false;
-            } else {
-                for (u32 i = 0; i < E.search.query.len; i++) {
-                    c8 lc = line.data[col + i];
-                    c8 qc = E.search.query.data[i];
-                    if (!E.search.case_sensitive) {
-                        lc = (lc >= 'A' && lc <= 'Z') ? lc + 32 : lc;
-                        qc = (qc >= 'A' && qc <= 'Z') ? qc + 32 : qc;
-                    }
-                    if (lc != qc) {
-                        match = false;
-                        break;
-                    }
-                }
-            }
-
-            if (match) {
-                sp_str_builder_append(&new_line, replacement);
-                col += E.search.query.len;
-                count++;
-            } else {
-                if (col < line.len) {
-                    sp_str_builder_append_c8(&new_line, line.data[col]);
-                }
-                col++;
+        while (found && hit.row == row) {
+            sp_str_builder_append(&new_line, sp_str_sub(line, (s32)col, (s32)(hit.col - col)));
+            search_append_replacement(&new_line, replacement, line, &caps);
+            col = hit.col + hit.len;
+            count++;
+
+            // An empty match keeps the next byte and moves past it
+            u32 next = col;
+            if (hit.len == 0) {
+                if (col < line.len) sp_str_builder_append_c8(&new_line, line.data[col++]);
+                next = hit.col + 1;
             }
+            found = search_find_with(&m, &E.buffer, (search_pos_t){ row, next }, SEARCH_FORWARD, &hit, &caps);
         }
+        sp_str_builder_append(&new_line, sp_str_sub(line, (s32)col, (s32)(line.len - col)));
 
-        E.buffer.lines[row].text = sp_str_builder_to_str(&new_line);
-        E.buffer.lines[row].hl_dirty = true;
+        sp_str_t replaced = sp_str_builder_to_str(&new_line);
+        undo_record_splice(row, 0, line, replaced);
+        buffer_set_line(&E.buffer, row, replaced);
+        sp_free((void *)replaced.data);
     }
 
-    E.buffer.modified = true;
+    undo_end();
+    if (count > 0) E.buffer.modified = true;
     editor_set_message("Replaced %u occurrences", count);
 }
 
 void search_end(void) {
     E.search.query = sp_str_lit("");
+    G_match_gen++;
+    search_cache_drop();
     E.search.match_count = 0;
+    E.search.counting = false;
+    search_count_reset(&G_count);
+    G_count.query_len = 0;
 }
@@ -61,6 +61,57 @@ static const c8 *c_types[] = {
     "int8_t", "int16_t", "int32_t", "int64_t", NULL
 };
 
+// Keyword and type names of a language compiled into a perfect hash. The
+// seed is picked so every word gets a slot of its own, which makes
+// classifying an identifier one hash and at most one compare. Word lists
+// too large for a seed search fall back to linear probing.
+typedef struct {
+    const c8 *word;
+    u32 len;
+    highlight_type_t hl;
+} syntax_word_t;
+
+typedef struct {
+    syntax_word_t *words;
+    u16 *slots;     // index into words plus one, 0 when empty
+    u32 mask;
+    u32 seed;
+    bool perfect;
+    u32 min_len;
+    u32 max_len;
+    bool ready;
+} syntax_words_t;
+
+#define SYNTAX_WORDS_MAX 65535u
+#define SYNTAX_WORDS_SEEDS 256u
+
+// Byte classes of the compiled lexer
+#define SYN_IDENT_START 0x01
+#define SYN_IDENT       0x02
+#define SYN_DIGIT       0x04
+#define SYN_NUMBER      0x08    // continues a number literal
+#define SYN_STRING      0x10    // opens a string
+#define SYN_COMMENT     0x20    // first byte of some comment token
+
+typedef struct {
+    const c8 *text;
+    u32 len;
+    s32 pair;       // block comment pair it opens, -1 for a line comment
+    u16 next;       // next token with the same first byte, plus one
+} syntax_token_t;
+
+// A syntax_def_t compiled for the table-driven lexer: one class byte per
+// input byte, and the comment openers chained by first byte in the order
+// the rules try them (block comments first, then line comments).
+typedef struct {
+    u8 cls[256];
+    u16 head[256];          // first token per leading byte, plus one
+    syntax_token_t *tokens;
+    syntax_token_t *ends;   // closing token per block comment pair
+    u32 pair_count;
+    bool ready;
+} syntax_lexer_t;
+
 typedef struct {
     sp_str_t name;
     const c8 **keywords;
@@ -72,6 +123,8 @@ typedef struct {
     const c8 *number_mode;
     c8 escape_char;
     bool multi_line_strings;
+    syntax_words_t words;   // keywords and types, built on first use
+    syntax_lexer_t lexer;   // built alongside words
 } syntax_def_t;
 
 typedef struct {
@@ -288,14 +341,113 @@ sp_str_t syntax_list_languages(void) {
     return sp_str_builder_to_str(&b);
 }
 
-static syntax_def_t *find_syntax_def(language_t *lang) {
-    if (!lang) return NULL;
+static u32 syntax_word_hash(const c8 *s, u32 len, u32 seed) {
+    u32 h = seed ^ (len * 0x9e3779b9u);
+    for (u32 i = 0; i < len; i++) {
+        h = (h ^ (u8)s[i]) * 16777619u;
+    }
+    return h ^ (h >> 15);
+}
 
-    runtime_syntax_t *rt = find_runtime_by_name(lang->name);
-    if (rt) {
-        return &rt->def;
+static void syntax_words_add(syntax_words_t *w, u32 *count, const c8 **list, highlight_type_t hl) {
+    if (!list) return;
+    for (u32 i = 0; list[i] && *count < SYNTAX_WORDS_MAX; i++) {
+        u32 len = (u32)strlen(list[i]);
+        if (len == 0) continue;
+        // The first list a word appears in wins, so keywords beat types
+        bool seen = false;
+        for (u32 j = 0; j < *count && !seen; j++) {
+            seen = w->words[j].len == len && memcmp(w->words[j].word, list[i], len) == 0;
+        }
+        if (seen) continue;
+        w->words[(*count)++] = (syntax_word_t){ list[i], len, hl };
     }
+}
+
+static void syntax_words_free(syntax_words_t *w) {
+    if (w->words) sp_free(w->words);
+    if (w->slots) sp_free(w->slots);
+    *w = (syntax_words_t){0};
+}
 
+// Search for a seed that spreads the words over distinct slots, doubling
+// the table a few times when a size runs out of seeds.
+static void syntax_words_build(syntax_words_t *w, const c8 **keywords, const c8 **types) {
+    syntax_words_free(w);
+    w->ready = true;
+
+    u32 total = 0;
+    for (u32 i = 0; keywords && keywords[i]; i++) total++;
+    for (u32 i = 0; types && types[i]; i++) total++;
+    if (total == 0) return;
+    if (total > SYNTAX_WORDS_MAX) total = SYNTAX_WORDS_MAX;
+
+    w->words = sp_alloc(sizeof(syntax_word_t) * total);
+    if (!w->words) return;
+    u32 count = 0;
+    syntax_words_add(w, &count, keywords, HL_KEYWORD);
+    syntax_words_add(w, &count, types, HL_TYPE);
+
+    w->min_len = UINT32_MAX;
+    for (u32 i = 0; i < count; i++) {
+        if (w->words[i].len < w->min_len) w->min_len = w->words[i].len;
+        if (w->words[i].len > w->max_len) w->max_len = w->words[i].len;
+    }
+
+    u32 size = 16;
+    while (size < count * 4) size <<= 1;
+    for (u32 tries = 0; tries < 4; tries++, size <<= 1) {
+        u16 *slots = sp_alloc(sizeof(u16) * size);
+        if (!slots) return;
+        for (u32 seed = 1; seed <= SYNTAX_WORDS_SEEDS; seed++) {
+            memset(slots, 0, sizeof(u16) * size);
+            bool perfect = true;
+            for (u32 i = 0; i < count && perfect; i++) {
+                u32 at = syntax_word_hash(w->words[i].word, w->words[i].len, seed) & (size - 1);
+                perfect = slots[at] == 0;
+                slots[at] = (u16)(i + 1);
+            }
+            if (perfect) {
+                w->slots = slots;
+                w->mask = size - 1;
+                w->seed = seed;
+                w->perfect = true;
+                return;
+            }
+        }
+        sp_free(slots);
+    }
+
+    size = 16;
+    while (size < count * 2) size <<= 1;
+    w->slots = sp_alloc(sizeof(u16) * size);
+    if (!w->slots) return;
+    w->mask = size - 1;
+    w->seed = 1;
+    for (u32 i = 0; i < count; i++) {
+        u32 at = syntax_word_hash(w->words[i].word, w->words[i].len, w->seed) & w->mask;
+        while (w->slots[at]) at = (at + 1) & w->mask;
+        w->slots[at] = (u16)(i + 1);
+    }
+}
+
+// HL_KEYWORD or HL_TYPE for a listed word, HL_NORMAL otherwise
+static highlight_type_t syntax_words_find(const syntax_words_t *w, const c8 *s, u32 len) {
+    if (!w->slots || len < w->min_len || len > w->max_len) return HL_NORMAL;
+    u32 at = syntax_word_hash(s, len, w->seed) & w->mask;
+    for (;;) {
+        u16 index = w->slots[at];
+        if (index == 0) return HL_NORMAL;
+        const syntax_word_t *e = &w->words[index - 1];
+        if (e->len == len && memcmp(e->word, s, len) == 0) return e->hl;
+        if (w->perfect) return HL_NORMAL;
+        at = (at + 1) & w->mask;
+    }
+}
+
+static void syntax_lexer_build(syntax_def_t *def);
+
+static syntax_def_t *find_builtin_def(language_t *lang) {
     for (u32 i = 0; i < sizeof(syntax_defs) / sizeof(syntax_defs[0]); i++) {
         if (sp_str_equal(syntax_defs[i].name, lang->name) ||
             (lang->name.len > 0 && syntax_defs[i].name.len > 0 &&
@@ -308,16 +460,20 @@ static syntax_def_t *find_syntax_def(language_t *lang) {
     return &syntax_defs[4];
 }
 
-static bool is_keyword(const c8 **keywords, sp_str_t word) {
-    if (!keywords) return false;
-    for (u32 i = 0; keywords[i]; i++) {
-        u32 kw_len = (u32)strlen(keywords[i]);
-        // FIXED: was != 0, should be == 0
-        if (word.len == kw_len && strncmp(word.data, keywords[i], kw_len) == 0) {
-            return true;
-        }
+static syntax_def_t *find_syntax_def(language_t *lang) {
+    if (!lang) return NULL;
+
+    runtime_syntax_t *rt = find_runtime_by_name(lang->name);
+    if (rt) {
+        if (!rt->def.lexer.ready) syntax_lexer_build(&rt->def);
+        return &rt->def;
     }
-    return false;
+
+    // Builtin word tables are built the first time the language is used
+    syntax_def_t *def = find_builtin_def(lang);
+    if (!def->words.ready) syntax_words_build(&def->words, def->keywords, def->types);
+    if (!def->lexer.ready) syntax_lexer_build(def);
+    return def;
 }
 
 void syntax_init(void) {
@@ -352,6 +508,10 @@ bool syntax_register_language(sp_str_t name,
     }
     if (!slot) return false;
 
+    // A background pass reads the old tables through its job, so it has to
+    // let go of them before they are replaced.
+    if (slot->used) syntax_cancel();
+
     slot->used = true;
     slot->lang.name = sp_str_copy(name);
     slot->lang.extensions = sp_str_copy(extensions);
@@ -365,6 +525,8 @@ bool syntax_register_language(sp_str_t name,
     slot->def.name = slot->lang.name;
     slot->def.keywords = (const c8 **)parse_word_list(keywords);
     slot->def.types = (const c8 **)parse_word_list(types);
+    syntax_words_build(&slot->def.words, slot->def.keywords, slot->def.types);
+    slot->def.lexer.ready = false;
     slot->def.single_comments = (const c8 **)parse_word_list(single_comments);
     slot->def.multi_comment_pairs = (const c8 **)parse_word_list(multi_comment_pairs);
     if (slot->def.multi_comment_pairs && !word_list_has_even_count(slot->def.multi_comment_pairs)) {
@@ -381,6 +543,7 @@ bool syntax_register_language(sp_str_t name,
     slot->def.number_mode = copy_cstr(number_mode);
     slot->def.escape_char = escape_char;
     slot->def.multi_line_strings = multi_line_strings;
+    syntax_lexer_build(&slot->def);
     return true;
 }
 
@@ -576,21 +739,49 @@ static const c8 *multi_end_token(const syntax_def_t *def, u32 pair_index, u32 *e
     return def->multi_comment_pairs[i];
 }
 
-typedef struct {
-    bool in_multiline_comment;
-    u32 multi_pair_index;
-    bool in_string;
-    c8 string_delim;
-    bool in_markdown_code_block;
-    c8 markdown_fence_char;
-} syntax_line_state_t;
+// Lines re-lexed by syntax_highlight_buffer, for :syntax stats
+static struct {
+    u32 last;
+    u64 total;
+} G_relex;
 
 typedef enum {
     TOKEN_STATE_NORMAL = 0,
     TOKEN_STATE_NUMBER,
 } token_state_t;
 
-static void highlight_span(line_t *line, u32 start, u32 end, highlight_type_t type) {
+// Kinds array one thread lexes into, grown to the longest line it has seen
+typedef struct {
+    highlight_type_t *hl;
+    u32 cap;
+} lex_scratch_t;
+
+// A line being lexed: its text and the kind of each byte. The kinds go to
+// the thread's scratch array and are stored as runs afterwards.
+typedef struct {
+    sp_str_t text;
+    highlight_type_t *hl;
+    lex_scratch_t *scratch;
+} lex_line_t;
+
+static lex_scratch_t G_scratch;   // the UI thread's
+
+// Point the line at its scratch array; empty lines have no kinds
+static bool syntax_hl_begin(lex_line_t *line) {
+    lex_scratch_t *scratch = line->scratch;
+    line->hl = NULL;
+    if (line->text.len == 0) return false;
+    if (line->text.len > scratch->cap) {
+        highlight_type_t *grown = sp_realloc(scratch->hl, sizeof(highlight_type_t) * line->text.len);
+        if (!grown) return false;
+        scratch->hl = grown;
+        scratch->cap = line->text.len;
+    }
+    line->hl = scratch->hl;
+    return true;
+}
+
+static void highlight_span(lex_line_t *line, u32 start, u32 end, highlight_type_t type) {
     for (u32 j = start; j < end; j++) {
         line->hl[j] = type;
     }
@@ -621,17 +812,15 @@ static bool is_number_char(const syntax_def_t *def, c8 c) {
            c == 'l' || c == 'L' || c == '+' || c == '-';
 }
 
-static u32 consume_identifier(line_t *line, const syntax_def_t *def, u32 start) {
+static u32 consume_identifier(lex_line_t *line, const syntax_def_t *def, u32 start) {
     u32 i = start;
     while (i < line->text.len && is_identifier_char(def, line->text.data[i])) {
         i++;
     }
 
-    sp_str_t word = sp_str_sub(line->text, (s32)start, (s32)(i - start));
-    if (is_keyword(def->keywords, word)) {
-        highlight_span(line, start, i, HL_KEYWORD);
-    } else if (def->types && is_keyword(def->types, word)) {
-        highlight_span(line, start, i, HL_TYPE);
+    highlight_type_t hl = syntax_words_find(&def->words, line->text.data + start, i - start);
+    if (hl != HL_NORMAL) {
+        highlight_span(line, start, i, hl);
     } else if (i < line->text.len && line->text.data[i] == '(') {
         highlight_span(line, start, i, HL_FUNCTION);
     } else {
@@ -643,11 +832,189 @@ static u32 consume_identifier(line_t *line, const syntax_def_t *def, u32 start)
 static void save_line_state(syntax_line_state_t *state, bool in_ml, u32 ml_pair_index, bool in_string, c8 string_delim) {
     if (!state) return;
     state->in_multiline_comment = in_ml;
-    state->multi_pair_index = ml_pair_index;
+    state->multi_pair_index = (u16)ml_pair_index;
     state->in_string = in_string;
     state->string_delim = string_delim;
 }
 
+static void syntax_lexer_free(syntax_lexer_t *lx) {
+    if (lx->tokens) sp_free(lx->tokens);
+    if (lx->ends) sp_free(lx->ends);
+    *lx = (syntax_lexer_t){0};
+}
+
+// Append a comment token to the chain of its first byte
+static void syntax_lexer_add(syntax_lexer_t *lx, u32 *count, u16 *tail, const c8 *text, s32 pair) {
+    u32 len = (u32)strlen(text);
+    if (len == 0) return;
+    u8 first = (u8)text[0];
+    lx->tokens[(*count)++] = (syntax_token_t){ text, len, pair, 0 };
+    if (tail[first]) lx->tokens[tail[first] - 1].next = (u16)*count;
+    else lx->head[first] = (u16)*count;
+    tail[first] = (u16)*count;
+    lx->cls[first] |= SYN_COMMENT;
+}
+
+// Fold the per-byte predicates of def into byte classes once, so the lexer
+// loop tests a table entry instead of scanning strings for every byte.
+static void syntax_lexer_build(syntax_def_t *def) {
+    syntax_lexer_t *lx = &def->lexer;
+    syntax_lexer_free(lx);
+    lx->ready = true;
+
+    for (u32 c = 0; c < 256; c++) {
+        if (is_identifier_start(def, (c8)c)) lx->cls[c] |= SYN_IDENT_START;
+        if (is_identifier_char(def, (c8)c)) lx->cls[c] |= SYN_IDENT;
+        if (c >= '0' && c <= '9') lx->cls[c] |= SYN_DIGIT;
+        if (is_number_char(def, (c8)c)) lx->cls[c] |= SYN_NUMBER;
+        if (is_string_delim_char(def, (c8)c)) lx->cls[c] |= SYN_STRING;
+    }
+
+    u32 pairs = 0;
+    u32 singles = 0;
+    if (has_multi_pairs(def)) {
+        while (def->multi_comment_pairs[pairs * 2] && def->multi_comment_pairs[pairs * 2 + 1]) pairs++;
+    }
+    if (def->single_comments) {
+        while (def->single_comments[singles]) singles++;
+    }
+    if (pairs + singles == 0 || pairs + singles > SYNTAX_WORDS_MAX) return;
+
+    lx->tokens = sp_alloc(sizeof(syntax_token_t) * (pairs + singles));
+    if (!lx->tokens) return;
+    if (pairs > 0) {
+        lx->ends = sp_alloc(sizeof(syntax_token_t) * pairs);
+        if (!lx->ends) return;
+    }
+
+    u16 tail[256] = {0};
+    u32 count = 0;
+    for (u32 p = 0; p < pairs; p++) {
+        const c8 *end = def->multi_comment_pairs[p * 2 + 1];
+        syntax_lexer_add(lx, &count, tail, def->multi_comment_pairs[p * 2], (s32)p);
+        lx->ends[p] = (syntax_token_t){ end, (u32)strlen(end), (s32)p, 0 };
+    }
+    lx->pair_count = pairs;
+    for (u32 i = 0; i < singles; i++) {
+        syntax_lexer_add(lx, &count, tail, def->single_comments[i], -1);
+    }
+}
+
+// Offset just past the first end token at or after i, or len if the
+// comment runs off the line.
+static u32 syntax_lexer_comment_end(const syntax_token_t *end, const u8 *text, u32 len, u32 i, bool *closed) {
+    if (!end || end->len == 0 || end->len > len) return len;
+    u32 last = len - end->len;
+    while (i <= last) {
+        const u8 *hit = memchr(text + i, (u8)end->text[0], last - i + 1);
+        if (!hit) break;
+        i = (u32)(hit - text);
+        if (memcmp(text + i, end->text, end->len) == 0) {
+            *closed = true;
+            return i + end->len;
+        }
+        i++;
+    }
+    return len;
+}
+
+// Lex one line with the compiled tables. Strings and block comments are
+// consumed as whole runs rather than byte by byte.
+static void syntax_lex_table(lex_line_t *line, const syntax_def_t *def, syntax_line_state_t *state) {
+    const syntax_lexer_t *lx = &def->lexer;
+    const u8 *text = (const u8 *)line->text.data;
+    const u32 len = line->text.len;
+    highlight_type_t *hl = line->hl;
+
+    bool in_ml = state ? state->in_multiline_comment : false;
+    u32 ml_pair_index = state ? state->multi_pair_index : 0;
+    bool in_string = state ? state->in_string : false;
+    c8 string_delim = state ? state->string_delim : 0;
+
+    u32 i = 0;
+    while (i < len) {
+        if (in_string) {
+            u32 start = i;
+            while (i < len) {
+                c8 prev = (i > 0) ? (c8)text[i - 1] : ' ';
+                if ((c8)text[i++] == string_delim && prev != def->escape_char) {
+                    in_string = false;
+                    string_delim = 0;
+                    break;
+                }
+            }
+            highlight_span(line, start, i, HL_STRING);
+            continue;
+        }
+
+        if (in_ml) {
+            const syntax_token_t *end = ml_pair_index < lx->pair_count ? &lx->ends[ml_pair_index] : NULL;
+            bool closed = false;
+            u32 stop = syntax_lexer_comment_end(end, text, len, i, &closed);
+            highlight_span(line, i, stop, HL_COMMENT);
+            i = stop;
+            in_ml = !closed;
+            continue;
+        }
+
+        u8 c = text[i];
+        u8 cls = lx->cls[c];
+
+        if (cls & SYN_COMMENT) {
+            const syntax_token_t *tok = NULL;
+            for (u16 k = lx->head[c]; k && !tok; k = lx->tokens[k - 1].next) {
+                const syntax_token_t *t = &lx->tokens[k - 1];
+                if (i + t->len <= len && memcmp(text + i, t->text, t->len) == 0) tok = t;
+            }
+            if (tok && tok->pair >= 0) {
+                highlight_span(line, i, i + tok->len, HL_COMMENT);
+                i += tok->len;
+                in_ml = true;
+                ml_pair_index = (u32)tok->pair;
+                continue;
+            }
+            if (tok) {
+                highlight_span(line, i, len, HL_COMMENT);
+                save_line_state(state, in_ml, ml_pair_index, in_string, string_delim);
+                return;
+            }
+        }
+
+        if (cls & SYN_STRING) {
+            hl[i++] = HL_STRING;
+            string_delim = (c8)c;
+            in_string = true;
+            continue;
+        }
+
+        u8 prev = (i > 0) ? text[i - 1] : ' ';
+        if (!(lx->cls[prev] & SYN_IDENT) &&
+            ((cls & SYN_DIGIT) || (c == '.' && i + 1 < len && (lx->cls[text[i + 1]] & SYN_DIGIT)))) {
+            hl[i++] = HL_NUMBER;
+            while (i < len && (lx->cls[text[i]] & SYN_NUMBER)) hl[i++] = HL_NUMBER;
+            continue;
+        }
+
+        if (cls & SYN_IDENT_START) {
+            u32 start = i;
+            while (i < len && (lx->cls[text[i]] & SYN_IDENT)) i++;
+            highlight_type_t kind = syntax_words_find(&def->words, line->text.data + start, i - start);
+            if (kind == HL_NORMAL && i < len && text[i] == '(') kind = HL_FUNCTION;
+            highlight_span(line, start, i, kind);
+            continue;
+        }
+
+        hl[i++] = HL_NORMAL;
+    }
+
+    if (!def->multi_line_strings && in_string) {
+        in_string = false;
+        string_delim = 0;
+    }
+
+    save_line_state(state, in_ml, ml_pair_index, in_string, string_delim);
+}
+
 static bool markdown_is_language(language_t *lang) {
     if (!lang || !lang->name.data) return false;
     return str_eq_cstr_ci(lang->name.data, "Markdown");
@@ -687,7 +1054,7 @@ static bool markdown_is_hr(sp_str_t text, u32 start) {
     return count >= 3;
 }
 
-static void markdown_highlight_inline(line_t *line, u32 start) {
+static void markdown_highlight_inline(lex_line_t *line, u32 start) {
     bool in_code = false;
     bool in_link_text = false;
     bool in_link_url = false;
@@ -746,21 +1113,8 @@ static void markdown_highlight_inline(line_t *line, u32 start) {
     }
 }
 
-static void syntax_highlight_markdown_line(line_t *line, syntax_line_state_t *state) {
-    if (line->text.len == 0) {
-        if (line->hl) {
-            sp_free(line->hl);
-            line->hl = NULL;
-        }
-        return;
-    }
-
-    if (line->hl) {
-        sp_free(line->hl);
-        line->hl = NULL;
-    }
-    line->hl = sp_alloc(sizeof(highlight_type_t) * line->text.len);
-    if (!line->hl) return;
+static void syntax_highlight_markdown_line(lex_line_t *line, syntax_line_state_t *state) {
+    if (!syntax_hl_begin(line)) return;
     for (u32 i = 0; i < line->text.len; i++) line->hl[i] = HL_NORMAL;
 
     u32 start = markdown_leading_spaces(line->text);
@@ -841,45 +1195,14 @@ static void syntax_highlight_markdown_line(line_t *line, syntax_line_state_t *st
     markdown_highlight_inline(line, 0);
 }
 
-static void syntax_highlight_line_impl(line_t *line, language_t *lang, syntax_line_state_t *state) {
-    if (!line || !lang) return;
-    if (!line->text.data && line->text.len > 0) return;
-
-    if (markdown_is_language(lang)) {
-        syntax_highlight_markdown_line(line, state);
-        if (state) {
-            state->in_multiline_comment = false;
-            state->multi_pair_index = 0;
-            state->in_string = false;
-            state->string_delim = 0;
-        }
-        return;
-    }
-
-    // Free old highlight
-    if (line->hl) {
-        sp_free(line->hl);
-        line->hl = NULL;
-    }
-    
-    // Return early for empty lines
-    if (line->text.len == 0) {
-        line->hl = NULL;
-        return;
-    }
-
-    // Allocate highlight array
-    line->hl = sp_alloc(sizeof(highlight_type_t) * line->text.len);
-    if (!line->hl) {
-        return; // Allocation failed
-    }
-
+// The rules applied one predicate at a time, as the lexer read before it
+// was compiled to tables. syntax_check_buffer holds the tables to it.
+static void syntax_lex_reference(lex_line_t *line, const syntax_def_t *def, syntax_line_state_t *state) {
     // Initialize all to normal
     for (u32 i = 0; i < line->text.len; i++) {
         line->hl[i] = HL_NORMAL;
     }
 
-    syntax_def_t *def = find_syntax_def(lang);
     bool in_ml = state ? state->in_multiline_comment : false;
     u32 ml_pair_index = state ? state->multi_pair_index : 0;
     bool in_string = state ? state->in_string : false;
@@ -978,21 +1301,349 @@ static void syntax_highlight_line_impl(line_t *line, language_t *lang, syntax_li
     save_line_state(state, in_ml, ml_pair_index, in_string, string_delim);
 }
 
-void syntax_highlight_line(line_t *line, language_t *lang) {
-    syntax_line_state_t state = {0};
-    syntax_highlight_line_impl(line, lang, &state);
+// Lex one line from state, leaving the state at its end there. line->hl
+// holds the kinds afterwards, or NULL for an empty line.
+static void syntax_lex_any(lex_line_t *line, language_t *lang, const syntax_def_t *def,
+                           syntax_line_state_t *state) {
+    if (markdown_is_language(lang)) {
+        syntax_highlight_markdown_line(line, state);
+        if (state) {
+            state->in_multiline_comment = false;
+            state->multi_pair_index = 0;
+            state->in_string = false;
+            state->string_delim = 0;
+        }
+    } else if (syntax_hl_begin(line)) {
+        syntax_lex_table(line, def, state);
+    }
+}
+
+// Lex row of buf from state. Rows outside the window are lexed for their
+// end state alone and lose their runs.
+static void syntax_highlight_line_impl(buffer_t *buf, u32 row, language_t *lang,
+                                       syntax_line_state_t *state, bool keep_hl) {
+    line_t *src = buffer_line(buf, row);
+    if (!lang) return;
+    if (!src->text.data && src->text.len > 0) return;
+
+    lex_line_t line = { src->text, NULL, &G_scratch };
+    src->highlighted = false;
+    src->hl_count = 0;
+    syntax_lex_any(&line, lang, find_syntax_def(lang), state);
+    if (keep_hl && line.hl) buffer_set_highlight(buf, row, line.hl, line.text.len);
+}
+
+bool syntax_state_equal(const syntax_line_state_t *a, const syntax_line_state_t *b) {
+    return a->multi_pair_index == b->multi_pair_index &&
+           a->in_multiline_comment == b->in_multiline_comment &&
+           a->in_string == b->in_string &&
+           a->string_delim == b->string_delim &&
+           a->in_markdown_code_block == b->in_markdown_code_block &&
+           a->markdown_fence_char == b->markdown_fence_char;
 }
 
-void syntax_highlight_buffer(buffer_t *buf) {
+static bool syntax_check_line(const lex_line_t *a, const lex_line_t *b,
+                              const syntax_line_state_t *sa, const syntax_line_state_t *sb) {
+    if (!syntax_state_equal(sa, sb)) return false;
+    return memcmp(a->hl, b->hl, sizeof(highlight_type_t) * a->text.len) == 0;
+}
+
+// Lex every line of buf with both the compiled tables and the reference
+// rules, each carrying its own state from line to line. Returns the number
+// of lines whose highlight or end state differ.
+u32 syntax_check_buffer(buffer_t *buf, u64 *reference_ns, u64 *table_ns) {
+    language_t *lang = syntax_detect_language(buf->filename);
+    syntax_def_t *def = find_syntax_def(lang);
+    syntax_line_state_t ref_state = {0};
+    syntax_line_state_t table_state = {0};
+    lex_line_t ref = {0};
+    lex_line_t table = {0};
+    u32 cap = 0;
+    u32 mismatches = 0;
+    u64 ref_ns = 0;
+    u64 tab_ns = 0;
+
+    for (u32 row = 0; row < buf->line_count; row++) {
+        sp_str_t text = buffer_get_line(buf, row);
+        if (text.len == 0) continue;
+        if (text.len > cap) {
+            highlight_type_t *a = sp_realloc(ref.hl, sizeof(highlight_type_t) * text.len);
+            if (a) ref.hl = a;
+            highlight_type_t *b = sp_realloc(table.hl, sizeof(highlight_type_t) * text.len);
+            if (b) table.hl = b;
+            if (!a || !b) break;
+            cap = text.len;
+        }
+        ref.text = text;
+        table.text = text;
+
+        sp_tm_timer_t timer = sp_tm_start_timer();
+        syntax_lex_reference(&ref, def, &ref_state);
+        ref_ns += sp_tm_read_timer(&timer);
+        timer = sp_tm_start_timer();
+        syntax_lex_table(&table, def, &table_state);
+        tab_ns += sp_tm_read_timer(&timer);
+
+        if (!syntax_check_line(&ref, &table, &ref_state, &table_state)) mismatches++;
+    }
+
+    if (ref.hl) sp_free(ref.hl);
+    if (table.hl) sp_free(table.hl);
+    if (reference_ns) *reference_ns = ref_ns;
+    if (table_ns) *table_ns = tab_ns;
+    return mismatches;
+}
+
+// Rows the UI thread lexes for their end state alone in one frame before
+// handing the rest to the background pass
+#define SYNTAX_SYNC_ROWS 50000u
+// Rows per task of the background pass
+#define SYNTAX_CHUNK_ROWS 16384u
+
+// Background pass computing the end state of every row from `from` on,
+// over a snapshot of the buffer. Chunks are lexed in parallel, all but the
+// first from the default state; a fix-up pass then re-lexes the chunks
+// whose real entry state differed, up to the first line that ends in the
+// state the speculative run gave it.
+typedef struct {
+    buffer_t *buf;
+    buffer_snapshot_t snap;
+    language_t *lang;
+    const syntax_def_t *def;
+    u32 from;
+    u32 to;
+    syntax_line_state_t entry;
+    syntax_line_state_t *states;    // end state of each row in [from, to)
+    u32 chunk_count;
+    u32 fixed;
+    sp_thread_t thread;
+    sp_tm_timer_t timer;
+    sp_atomic_s32 cancel;
+    sp_atomic_s32 done;
+    bool active;
+} syntax_job_t;
+
+static syntax_job_t G_job;
+
+// The last pass that landed, for :syntax stats
+static struct {
+    u32 rows;
+    u32 chunks;
+    u32 fixed;
+    u64 ns;
+} G_job_last;
+
+// Lex snapshot rows [start, end) from state into job->states. With
+// converge, stop at the first row that already ends in the same state.
+static void syntax_job_lex(syntax_job_t *job, u32 start, u32 end, syntax_line_state_t *state,
+                           lex_scratch_t *scratch, bool converge) {
+    for (u32 row = start; row < end; row++) {
+        if ((row & 1023) == 0 && sp_atomic_s32_get(&job->cancel)) return;
+        lex_line_t line = { job->snap.lines[row], NULL, scratch };
+        if (line.text.data || line.text.len == 0) {
+            syntax_lex_any(&line, job->lang, job->def, state);
+        }
+        syntax_line_state_t *slot = &job->states[row - job->from];
+        if (converge && syntax_state_equal(slot, state)) return;
+        *slot = *state;
+    }
+}
+
+static void syntax_job_chunk(void *ctx, u32 index) {
+    syntax_job_t *job = ctx;
+    u32 start = job->from + index * SYNTAX_CHUNK_ROWS;
+    u32 end = job->to - start > SYNTAX_CHUNK_ROWS ? start + SYNTAX_CHUNK_ROWS : job->to;
+    syntax_line_state_t state = index == 0 ? job->entry : (syntax_line_state_t){0};
+    lex_scratch_t scratch = {0};
+    syntax_job_lex(job, start, end, &state, &scratch, false);
+    if (scratch.hl) sp_free(scratch.hl);
+}
+
+static s32 syntax_job_main(void *userdata) {
+    syntax_job_t *job = userdata;
+    pool_run(job->chunk_count, syntax_job_chunk, job);
+
+    // Chunks only need another look where the previous one, now exact,
+    // did not end in the default state
+    static const syntax_line_state_t assumed = {0};
+    lex_scratch_t scratch = {0};
+    for (u32 c = 1; c < job->chunk_count && !sp_atomic_s32_get(&job->cancel); c++) {
+        u32 start = job->from + c * SYNTAX_CHUNK_ROWS;
+        u32 end = job->to - start > SYNTAX_CHUNK_ROWS ? start + SYNTAX_CHUNK_ROWS : job->to;
+        syntax_line_state_t state = job->states[start - 1 - job->from];
+        if (syntax_state_equal(&state, &assumed)) continue;
+        syntax_job_lex(job, start, end, &state, &scratch, true);
+        job->fixed++;
+    }
+    if (scratch.hl) sp_free(scratch.hl);
+
+    sp_atomic_s32_set(&job->done, 1);
+    return 0;
+}
+
+// Start lexing rows [from, line_count) for their end states in the
+// background. The UI thread finds them in place once syntax_poll lands
+// the pass.
+static void syntax_job_start(buffer_t *buf, language_t *lang, u32 from) {
+    syntax_job_t *job = &G_job;
+    if (job->active || from >= buf->line_count) return;
+
+    u32 rows = buf->line_count - from;
+    job->states = sp_alloc(sizeof(syntax_line_state_t) * rows);
+    if (!job->states) return;
+    if (!buffer_snapshot_begin(buf, &job->snap)) {
+        sp_free(job->states);
+        job->states = SP_NULLPTR;
+        return;
+    }
+
+    // Tables are built here, so the workers only ever read them
+    job->def = find_syntax_def(lang);
+    job->buf = buf;
+    job->lang = lang;
+    job->from = from;
+    job->to = buf->line_count;
+    job->entry = from > 0 ? buffer_line(buf, from - 1)->hl_state : (syntax_line_state_t){0};
+    job->chunk_count = (rows + SYNTAX_CHUNK_ROWS - 1) / SYNTAX_CHUNK_ROWS;
+    job->fixed = 0;
+    sp_atomic_s32_set(&job->cancel, 0);
+    sp_atomic_s32_set(&job->done, 0);
+    job->timer = sp_tm_start_timer();
+    job->active = true;
+    sp_thread_init(&job->thread, syntax_job_main, job);
+}
+
+static void syntax_job_finish(syntax_job_t *job) {
+    sp_thread_join(&job->thread);
+    buffer_t *buf = job->buf;
+
+    // Any edit since the snapshot may have moved rows or changed states
+    bool current = !sp_atomic_s32_get(&job->cancel) && buf->version == job->snap.version &&
+                   buf->hl_lang == job->lang && job->to <= buf->line_count;
+    if (current) {
+        for (u32 row = job->from; row < job->to; row++) {
+            line_t *line = buffer_line(buf, row);
+            // Runs of a stale row were lexed from the wrong state
+            if (line->hl_dirty) {
+                line->highlighted = false;
+                line->hl_count = 0;
+            }
+            line->hl_state = job->states[row - job->from];
+            line->hl_dirty = false;
+        }
+        if (buf->hl_from < job->to) buf->hl_from = job->to;
+
+        G_job_last.rows = job->to - job->from;
+        G_job_last.chunks = job->chunk_count;
+        G_job_last.fixed = job->fixed;
+        G_job_last.ns = sp_tm_read_timer(&job->timer);
+    }
+
+    buffer_snapshot_end(buf, &job->snap);
+    sp_free(job->states);
+    job->states = SP_NULLPTR;
+    job->active = false;
+}
+
+// Land a finished background pass, and cancel one the buffer has moved
+// on from. Called from the main loop.
+void syntax_poll(void) {
+    syntax_job_t *job = &G_job;
+    if (!job->active) return;
+    if (job->buf->version != job->snap.version) sp_atomic_s32_set(&job->cancel, 1);
+    if (sp_atomic_s32_get(&job->done)) syntax_job_finish(job);
+}
+
+// Stop the background pass, if any, and wait for it to let go of the
+// buffer
+void syntax_cancel(void) {
+    syntax_job_t *job = &G_job;
+    if (!job->active) return;
+    sp_atomic_s32_set(&job->cancel, 1);
+    syntax_job_finish(job);
+}
+
+// Rows, chunks and fixed-up chunks of the last background pass to land
+bool syntax_background_stats(u32 *rows, u32 *chunks, u32 *fixed, f64 *ms) {
+    if (G_job_last.rows == 0) return false;
+    if (rows) *rows = G_job_last.rows;
+    if (chunks) *chunks = G_job_last.chunks;
+    if (fixed) *fixed = G_job_last.fixed;
+    if (ms) *ms = (f64)G_job_last.ns / 1e6;
+    return true;
+}
+
+// Highlight rows [first, last). Each line keeps the state it ended in, so
+// work starts at the first stale row, and once a re-lexed line ends where
+// it did before only later edited lines need another look. Rows above the
+// window are lexed for their end state alone, so a jump still starts from
+// the right state without keeping runs for everything it passed.
+void syntax_highlight_buffer(buffer_t *buf, u32 first, u32 last) {
     if (!buf) return;
+    if (last > buf->line_count) last = buf->line_count;
+    if (first > last) first = last;
 
     language_t *lang = syntax_detect_language(buf->filename);
-    syntax_line_state_t state = {0};
+    if (buf->hl_lang != lang) {
+        // End states from another lexer say nothing about this one
+        buffer_mark_dirty(buf);
+        buf->hl_lang = lang;
+    }
+    G_relex.last = 0;
+    if (!lang) {
+        buffer_keep_highlight(buf, 0, 0);
+        return;
+    }
+
+    // Every stale row is marked dirty; hl_from is the first of them
+    u32 relexed = 0;
+    u32 budget = G_job.active ? 0 : SYNTAX_SYNC_ROWS;
+    bool carry = false; // the state entering row has changed
+    u32 row = buf->hl_from < first ? buf->hl_from : first;
+    for (; row < last; row++) {
+        line_t *line = buffer_line(buf, row);
+        bool in_window = row >= first;
+        if (!carry && !line->hl_dirty && !(in_window && !line->highlighted && line->text.len > 0)) continue;
+        if (!in_window) {
+            if (budget == 0) break;
+            budget--;
+        }
 
-    for (u32 i = 0; i < buf->line_count; i++) {
-        syntax_highlight_line_impl(&buf->lines[i], lang, &state);
-        buf->lines[i].hl_dirty = false;
+        syntax_line_state_t state = {0};
+        if (row > 0) state = buffer_line(buf, row - 1)->hl_state;
+        syntax_line_state_t before = line->hl_state;
+        syntax_highlight_line_impl(buf, row, lang, &state, in_window);
+        line->hl_state = state;
+        line->hl_dirty = false;
+        relexed++;
+        carry = !syntax_state_equal(&before, &state);
     }
+
+    if (row < first) {
+        // Too far behind to catch up in one frame. The background pass
+        // takes over from here, and the window keeps what it has until
+        // the states land.
+        if (carry) buffer_line(buf, row)->hl_dirty = true;
+        buf->hl_from = row;
+        syntax_job_start(buf, lang, row);
+        buffer_keep_highlight(buf, first, last);
+        G_relex.last = relexed;
+        G_relex.total += relexed;
+        return;
+    }
+
+    // The first row past the window now starts from a different state
+    if (carry && last < buf->line_count) buffer_line(buf, last)->hl_dirty = true;
+    if (buf->hl_from < last) buf->hl_from = last;
+    buffer_keep_highlight(buf, first, last);
+    G_relex.last = relexed;
+    G_relex.total += relexed;
+}
+
+// Lines re-lexed by the most recent rehighlight and since startup
+void syntax_relex_stats(u32 *last, u64 *total) {
+    if (last) *last = G_relex.last;
+    if (total) *total = G_relex.total;
 }
 
 c8* syntax_color_to_ansi(highlight_type_t type) {
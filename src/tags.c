@@ -0,0 +1,797 @@
+/**
+ * tags.c - Project-wide definition index for :tag
+ *
+ * A background job walks the source tree, parses every file a built-in
+ * tree-sitter grammar covers on the worker pool and writes the
+ * definitions it finds to .ted-tags, sorted by name. The editor maps that
+ * file and answers lookups with a binary search, so the index costs no
+ * heap and is there at once on the next start.
+ *
+ * The index remembers each file's mtime, size and content hash. A refresh
+ * copies the entries of files whose mtime and size still match without
+ * opening them, and of files whose bytes hash the same without parsing
+ * them, so a warm start reparses only what actually changed.
+ */
+
+#include "ted.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define TAGS_INDEX_NAME ".ted-tags"
+#define TAGS_MAGIC "TEDTAGS1"
+// Larger files are generated tables rather than code anyone jumps into.
+#define TAGS_MAX_FILE (8u << 20)
+#define TAGS_NONE UINT32_MAX
+
+// On-disk layout: header, files sorted by path, tags sorted by name, then
+// the strings both point into. Offsets and counts are host-endian; the
+// index is a cache of the machine that wrote it.
+typedef struct {
+    c8 magic[8];
+    u32 file_count;
+    u32 tag_count;
+    u32 strings_len;
+    u32 reserved;
+} tags_header_t;
+
+typedef struct {
+    u32 path;
+    u32 path_len;
+    u64 mtime_ns;
+    u64 size;
+    u64 hash;
+} tags_file_t;
+
+typedef struct {
+    u32 name;
+    u32 name_len;
+    u32 file;
+    u32 row;
+    u32 col;
+    u32 kind;
+} tags_entry_t;
+
+typedef struct {
+    void *map;
+    u64 map_len;
+    const tags_header_t *header;
+    const tags_file_t *files;
+    const tags_entry_t *tags;
+    const c8 *strings;
+} tags_index_t;
+
+// A definition parsed out of a file; name points into the file's names
+typedef struct {
+    u32 name;
+    u32 name_len;
+    u32 row;
+    u32 col;
+    outline_kind_t kind;
+} tags_found_t;
+
+typedef struct {
+    c8 *path;  // relative to the root
+    u32 path_len;
+    u64 mtime_ns;
+    u64 size;
+    u64 hash;
+    // Entry in the previous index, or TAGS_NONE
+    u32 old;
+    // Filled in by the worker that reads the file
+    bool parsed;
+    bool failed;
+    tags_found_t *found;
+    u32 found_count;
+    u32 found_cap;
+    c8 *names;
+    u32 names_len;
+    u32 names_cap;
+} tags_source_t;
+
+// Sort record for the entries being written
+typedef struct {
+    const c8 *name;
+    u32 name_len;
+    u32 index;
+} tags_order_t;
+
+typedef struct {
+    c8 root[PATH_MAX];
+    c8 path[PATH_MAX];
+    c8 tmp_path[PATH_MAX];
+    // The mapped index when the job started; the main thread keeps it
+    // until the job has been reaped.
+    const tags_index_t *old;
+    tags_source_t *sources;
+    u32 source_count;
+    u32 source_cap;
+    u32 *pending;
+    u32 pending_count;
+    // One parser per pool worker, claimed by flipping busy from 0 to 1
+    treesitter_extractor_t **extractors;
+    sp_atomic_s32 *busy;
+    u32 extractor_count;
+    sp_thread_t thread;
+    sp_tm_timer_t timer;
+    bool active;
+    sp_atomic_s32 cancel;
+    sp_atomic_s32 done;
+
+    // Read by the main thread once done is set
+    bool ok;
+    u32 parsed;
+    u32 unchanged;
+    u32 tag_count;
+    c8 error[96];
+} tags_job_t;
+
+static tags_job_t G_tags_job;
+static tags_index_t G_tags;
+static c8 G_tags_root[PATH_MAX];
+static c8 G_tags_status[160] = "no index";
+static bool G_tags_exit_ready = false;
+
+static void tags_fail(tags_job_t *job, const c8 *what) {
+    snprintf(job->error, sizeof(job->error), "%s: %s", what, strerror(errno));
+}
+
+static u64 tags_hash(const c8 *data, u64 len) {
+    // FNV-1a
+    u64 h = 14695981039346656037ull;
+    for (u64 i = 0; i < len; i++) {
+        h ^= (u8)data[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+static s32 tags_compare_bytes(const c8 *a, u32 a_len, const c8 *b, u32 b_len) {
+    s32 c = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    if (c != 0) return c;
+    return a_len < b_len ? -1 : a_len > b_len ? 1 : 0;
+}
+
+// ---------------------------------------------------------------------------
+// Mapped index
+// ---------------------------------------------------------------------------
+
+static void tags_index_close(tags_index_t *ix) {
+    if (ix->map) munmap(ix->map, (size_t)ix->map_len);
+    *ix = (tags_index_t){0};
+}
+
+// Map path and check that its tables fit the file. Entries are checked
+// again as they are read, so a damaged index cannot send a lookup out of
+// the mapping.
+static bool tags_index_open(tags_index_t *ix, const c8 *path) {
+    *ix = (tags_index_t){0};
+    s32 fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (u64)st.st_size < sizeof(tags_header_t)) {
+        close(fd);
+        return false;
+    }
+    void *map = mmap(SP_NULLPTR, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return false;
+
+    const tags_header_t *h = map;
+    u64 expect = sizeof(tags_header_t) + (u64)h->file_count * sizeof(tags_file_t) +
+                 (u64)h->tag_count * sizeof(tags_entry_t) + h->strings_len;
+    if (memcmp(h->magic, TAGS_MAGIC, sizeof(h->magic)) != 0 || expect != (u64)st.st_size) {
+        munmap(map, (size_t)st.st_size);
+        return false;
+    }
+
+    ix->map = map;
+    ix->map_len = (u64)st.st_size;
+    ix->header = h;
+    ix->files = (const tags_file_t *)(h + 1);
+    ix->tags = (const tags_entry_t *)(ix->files + h->file_count);
+    ix->strings = (const c8 *)(ix->tags + h->tag_count);
+    return true;
+}
+
+static bool tags_string(const tags_index_t *ix, u32 off, u32 len, sp_str_t *out) {
+    if ((u64)off + len > ix->header->strings_len) return false;
+    *out = (sp_str_t){ .data = ix->strings + off, .len = len };
+    return true;
+}
+
+static s32 tags_compare_entry(const tags_index_t *ix, const tags_entry_t *e, sp_str_t name, bool prefix) {
+    sp_str_t s;
+    if (!tags_string(ix, e->name, e->name_len, &s)) return -1;
+    if (prefix && s.len > name.len) s.len = name.len;
+    return tags_compare_bytes(s.data, s.len, name.data, name.len);
+}
+
+// First entry not below name, or with upper the first above it. prefix
+// compares entries cut to name's length.
+static u32 tags_bound(const tags_index_t *ix, sp_str_t name, bool prefix, bool upper) {
+    u32 lo = 0;
+    u32 hi = ix->header->tag_count;
+    while (lo < hi) {
+        u32 mid = lo + (hi - lo) / 2;
+        s32 c = tags_compare_entry(ix, &ix->tags[mid], name, prefix);
+        if (c < 0 || (upper && c == 0)) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// ---------------------------------------------------------------------------
+// Background job
+// ---------------------------------------------------------------------------
+
+// Files a built-in grammar can parse
+static bool tags_wanted(const c8 *name) {
+    return treesitter_has_grammar(sp_cstr_as_str(name));
+}
+
+static bool tags_add_source(tags_job_t *job, const c8 *rel, const struct stat *st) {
+    if (job->source_count == job->source_cap) {
+        u32 cap = job->source_cap ? job->source_cap * 2 : 256;
+        tags_source_t *grown = sp_realloc(job->sources, cap * sizeof(tags_source_t));
+        if (!grown) return false;
+        job->sources = grown;
+        job->source_cap = cap;
+    }
+    u32 len = (u32)strlen(rel);
+    c8 *path = sp_alloc(len + 1);
+    if (!path) return false;
+    memcpy(path, rel, len + 1);
+
+    tags_source_t *s = &job->sources[job->source_count++];
+    *s = (tags_source_t){0};
+    s->path = path;
+    s->path_len = len;
+    s->mtime_ns = (u64)st->st_mtim.tv_sec * 1000000000ull + (u64)st->st_mtim.tv_nsec;
+    s->size = (u64)st->st_size;
+    s->old = TAGS_NONE;
+    return true;
+}
+
+// Collect the sources under the root, rel being the directory relative
+// to it. Hidden entries and symlinks are skipped, so the walk cannot loop.
+static bool tags_walk(tags_job_t *job, const c8 *rel, u32 depth) {
+    c8 dir_path[PATH_MAX];
+    if (snprintf(dir_path, sizeof(dir_path), "%s%s%s", job->root, rel[0] ? "/" : "", rel) >= PATH_MAX) {
+        return true;
+    }
+    DIR *dir = opendir(dir_path);
+    if (!dir) {
+        if (depth > 0) return true;
+        tags_fail(job, "opendir");
+        return false;
+    }
+
+    bool ok = true;
+    struct dirent *ent;
+    while (ok && (ent = readdir(dir)) != SP_NULLPTR) {
+        if (sp_atomic_s32_get(&job->cancel)) {
+            ok = false;
+            break;
+        }
+        if (ent->d_name[0] == '.') continue;
+
+        c8 child[PATH_MAX];
+        c8 full[PATH_MAX];
+        if (snprintf(child, sizeof(child), "%s%s%s", rel, rel[0] ? "/" : "", ent->d_name) >= PATH_MAX) continue;
+        if (snprintf(full, sizeof(full), "%s/%s", job->root, child) >= PATH_MAX) continue;
+
+        struct stat st;
+        if (lstat(full, &st) != 0) continue;
+        if (S_ISDIR(st.st_mode)) {
+            if (depth < 64) ok = tags_walk(job, child, depth + 1);
+        } else if (S_ISREG(st.st_mode) && tags_wanted(ent->d_name) && (u64)st.st_size <= TAGS_MAX_FILE) {
+            if (!tags_add_source(job, child, &st)) {
+                errno = ENOMEM;
+                tags_fail(job, "walk");
+                ok = false;
+            }
+        }
+    }
+    closedir(dir);
+    return ok;
+}
+
+static s32 tags_compare_source(const void *a, const void *b) {
+    const tags_source_t *x = a;
+    const tags_source_t *y = b;
+    return tags_compare_bytes(x->path, x->path_len, y->path, y->path_len);
+}
+
+// Pair each source with its entry in the previous index. Both lists are
+// sorted by path. Sources whose mtime and size match are reused as they
+// are; the rest are read by the workers.
+static bool tags_match_old(tags_job_t *job) {
+    job->pending = sp_alloc((job->source_count + 1) * sizeof(u32));
+    if (!job->pending) return false;
+
+    const tags_index_t *old = job->old;
+    u32 old_count = old ? old->header->file_count : 0;
+    u32 j = 0;
+    for (u32 i = 0; i < job->source_count; i++) {
+        tags_source_t *s = &job->sources[i];
+        while (j < old_count) {
+            sp_str_t path;
+            const tags_file_t *f = &old->files[j];
+            s32 c = tags_string(old, f->path, f->path_len, &path)
+                        ? tags_compare_bytes(path.data, path.len, s->path, s->path_len)
+                        : -1;
+            if (c > 0) break;
+            j++;
+            if (c == 0) {
+                s->old = j - 1;
+                break;
+            }
+        }
+
+        if (s->old != TAGS_NONE) {
+            const tags_file_t *f = &old->files[s->old];
+            if (f->mtime_ns == s->mtime_ns && f->size == s->size) {
+                s->hash = f->hash;
+                continue;
+            }
+        }
+        job->pending[job->pending_count++] = i;
+    }
+    return true;
+}
+
+static void tags_source_found(void *ctx, const outline_symbol_t *sym) {
+    tags_source_t *s = ctx;
+    if (s->failed) return;
+    if (s->found_count == s->found_cap) {
+        u32 cap = s->found_cap ? s->found_cap * 2 : 64;
+        tags_found_t *grown = sp_realloc(s->found, cap * sizeof(tags_found_t));
+        if (!grown) {
+            s->failed = true;
+            return;
+        }
+        s->found = grown;
+        s->found_cap = cap;
+    }
+    if (s->names_len + sym->name.len > s->names_cap) {
+        u32 cap = s->names_cap ? s->names_cap : 1024;
+        while (cap < s->names_len + sym->name.len) cap *= 2;
+        c8 *grown = sp_realloc(s->names, cap);
+        if (!grown) {
+            s->failed = true;
+            return;
+        }
+        s->names = grown;
+        s->names_cap = cap;
+    }
+
+    memcpy(s->names + s->names_len, sym->name.data, sym->name.len);
+    s->found[s->found_count++] = (tags_found_t){
+        .name = s->names_len,
+        .name_len = sym->name.len,
+        .row = sym->row,
+        .col = sym->col,
+        .kind = sym->kind,
+    };
+    s->names_len += sym->name.len;
+}
+
+static c8 *tags_read_file(const c8 *path, u64 size, u32 *len) {
+    s32 fd = open(path, O_RDONLY);
+    if (fd < 0) return SP_NULLPTR;
+    c8 *data = sp_alloc((u32)size + 1);
+    u64 got = 0;
+    while (data && got < size) {
+        ssize_t n = read(fd, data + got, (size_t)(size - got));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        got += (u64)n;
+    }
+    close(fd);
+    *len = (u32)got;
+    return data;
+}
+
+static void tags_read_task(void *ctx, u32 index) {
+    tags_job_t *job = ctx;
+    if (sp_atomic_s32_get(&job->cancel)) return;
+    tags_source_t *s = &job->sources[job->pending[index]];
+
+    c8 full[PATH_MAX];
+    u32 len = 0;
+    c8 *text = SP_NULLPTR;
+    if (snprintf(full, sizeof(full), "%s/%s", job->root, s->path) < PATH_MAX) {
+        text = tags_read_file(full, s->size, &len);
+    }
+    if (!text) {
+        s->failed = true;
+        return;
+    }
+    s->size = len;
+    s->hash = tags_hash(text, len);
+
+    // Same bytes under a new mtime, as after a checkout or touch
+    if (s->old != TAGS_NONE && job->old->files[s->old].hash == s->hash &&
+        job->old->files[s->old].size == s->size) {
+        sp_free(text);
+        return;
+    }
+    s->old = TAGS_NONE;
+
+    // At most pool_threads() tasks run at once, so a parser is always free.
+    u32 slot = 0;
+    while (!sp_atomic_s32_cmp_and_swap(&job->busy[slot], 0, 1)) {
+        slot = (slot + 1) % job->extractor_count;
+    }
+    s->parsed = true;
+    sp_str_t path = { .data = s->path, .len = s->path_len };
+    if (!treesitter_extract_definitions(job->extractors[slot], path, (sp_str_t){ .data = text, .len = len },
+                                        &job->cancel, tags_source_found, s)) {
+        s->failed = true;
+    }
+    sp_atomic_s32_set(&job->busy[slot], 0);
+    sp_free(text);
+}
+
+static s32 tags_compare_order(const void *a, const void *b) {
+    const tags_order_t *x = a;
+    const tags_order_t *y = b;
+    s32 c = tags_compare_bytes(x->name, x->name_len, y->name, y->name_len);
+    if (c != 0) return c;
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+static bool tags_write_all(s32 fd, const void *data, u64 len) {
+    const c8 *p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len > (1u << 30) ? (1u << 30) : (size_t)len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        len -= (u64)n;
+    }
+    return true;
+}
+
+// Lay out the new index from reused and parsed entries and rename it over
+// the old one. Entries go in file order first, so sorting by name with
+// that position as the tie-break keeps each name's matches by path and row.
+static bool tags_write_index(tags_job_t *job) {
+    const tags_index_t *old = job->old;
+
+    // The previous index's entries grouped by file
+    u32 old_files = old ? old->header->file_count : 0;
+    u32 old_tags = old ? old->header->tag_count : 0;
+    u32 *old_first = sp_alloc((old_files + 1) * sizeof(u32));
+    u32 *old_order = sp_alloc((old_tags + 1) * sizeof(u32));
+    if (!old_first || !old_order) {
+        if (old_first) sp_free(old_first);
+        if (old_order) sp_free(old_order);
+        errno = ENOMEM;
+        tags_fail(job, "write");
+        return false;
+    }
+    for (u32 i = 0; i < old_tags; i++) {
+        if (old->tags[i].file < old_files) old_first[old->tags[i].file + 1]++;
+    }
+    for (u32 f = 0; f < old_files; f++) old_first[f + 1] += old_first[f];
+    for (u32 i = 0; i < old_tags; i++) {
+        if (old->tags[i].file < old_files) old_order[old_first[old->tags[i].file]++] = i;
+    }
+    for (u32 f = old_files; f > 0; f--) old_first[f] = old_first[f - 1];
+    old_first[0] = 0;
+
+    u64 tag_count = 0;
+    u64 strings_len = 0;
+    for (u32 i = 0; i < job->source_count; i++) {
+        tags_source_t *s = &job->sources[i];
+        strings_len += s->path_len;
+        // A file that went missing or unreadable keeps none of its entries.
+        if (s->failed) continue;
+        if (s->old != TAGS_NONE) {
+            tag_count += old_first[s->old + 1] - old_first[s->old];
+            for (u32 k = old_first[s->old]; k < old_first[s->old + 1]; k++) {
+                strings_len += old->tags[old_order[k]].name_len;
+            }
+        } else {
+            tag_count += s->found_count;
+            strings_len += s->names_len;
+        }
+    }
+
+    bool ok = tag_count < (1u << 26) && strings_len < (1u << 31);
+    tags_file_t *files = ok ? sp_alloc((job->source_count + 1) * sizeof(tags_file_t)) : SP_NULLPTR;
+    tags_entry_t *tags = ok ? sp_alloc((u32)(tag_count + 1) * sizeof(tags_entry_t)) : SP_NULLPTR;
+    tags_entry_t *sorted = ok ? sp_alloc((u32)(tag_count + 1) * sizeof(tags_entry_t)) : SP_NULLPTR;
+    tags_order_t *order = ok ? sp_alloc((u32)(tag_count + 1) * sizeof(tags_order_t)) : SP_NULLPTR;
+    c8 *strings = ok ? sp_alloc((u32)strings_len + 1) : SP_NULLPTR;
+    ok = files && tags && sorted && order && strings;
+
+    u32 n = 0;
+    u32 at = 0;
+    for (u32 i = 0; ok && i < job->source_count; i++) {
+        tags_source_t *s = &job->sources[i];
+        files[i] = (tags_file_t){
+            .path = at,
+            .path_len = s->path_len,
+            .mtime_ns = s->mtime_ns,
+            .size = s->size,
+            // A file that could not be read is retried next time.
+            .hash = s->failed ? 0 : s->hash,
+        };
+        if (s->failed) files[i].mtime_ns = 0;
+        memcpy(strings + at, s->path, s->path_len);
+        at += s->path_len;
+
+        if (s->failed) continue;
+        if (s->old != TAGS_NONE) {
+            for (u32 k = old_first[s->old]; k < old_first[s->old + 1]; k++) {
+                const tags_entry_t *e = &old->tags[old_order[k]];
+                sp_str_t name;
+                if (!tags_string(old, e->name, e->name_len, &name)) continue;
+                memcpy(strings + at, name.data, name.len);
+                tags[n] = (tags_entry_t){ at, name.len, i, e->row, e->col, e->kind };
+                order[n] = (tags_order_t){ strings + at, name.len, n };
+                at += name.len;
+                n++;
+            }
+        } else {
+            for (u32 k = 0; k < s->found_count; k++) {
+                const tags_found_t *found = &s->found[k];
+                memcpy(strings + at, s->names + found->name, found->name_len);
+                tags[n] = (tags_entry_t){ at, found->name_len, i, found->row, found->col, found->kind };
+                order[n] = (tags_order_t){ strings + at, found->name_len, n };
+                at += found->name_len;
+                n++;
+            }
+        }
+    }
+    if (ok) {
+        qsort(order, n, sizeof(tags_order_t), tags_compare_order);
+        for (u32 k = 0; k < n; k++) sorted[k] = tags[order[k].index];
+    }
+
+    tags_header_t header = {0};
+    memcpy(header.magic, TAGS_MAGIC, sizeof(header.magic));
+    header.file_count = job->source_count;
+    header.tag_count = n;
+    header.strings_len = at;
+
+    // A fresh temp name each time: a fixed one would follow a planted
+    // symlink, and two editors indexing the same tree would share it
+    s32 fd = ok ? mkstemp(job->tmp_path) : -1;
+    if (!ok) {
+        errno = ENOMEM;
+        tags_fail(job, "write");
+    } else if (fd < 0) {
+        tags_fail(job, "write");
+        ok = false;
+    } else {
+        ok = tags_write_all(fd, &header, sizeof(header)) &&
+             tags_write_all(fd, files, (u64)job->source_count * sizeof(tags_file_t)) &&
+             tags_write_all(fd, sorted, (u64)n * sizeof(tags_entry_t)) &&
+             tags_write_all(fd, strings, at);
+        if (!ok) tags_fail(job, "write");
+        if (close(fd) != 0 && ok) {
+            tags_fail(job, "close");
+            ok = false;
+        }
+        if (ok && rename(job->tmp_path, job->path) != 0) {
+            tags_fail(job, "rename");
+            ok = false;
+        }
+        if (!ok) unlink(job->tmp_path);
+    }
+    job->tag_count = n;
+
+    sp_free(old_first);
+    sp_free(old_order);
+    if (files) sp_free(files);
+    if (tags) sp_free(tags);
+    if (sorted) sp_free(sorted);
+    if (order) sp_free(order);
+    if (strings) sp_free(strings);
+    return ok;
+}
+
+static s32 tags_thread_main(void *userdata) {
+    tags_job_t *job = userdata;
+    bool ok = tags_walk(job, "", 0);
+    if (ok) {
+        qsort(job->sources, job->source_count, sizeof(tags_source_t), tags_compare_source);
+        ok = tags_match_old(job);
+        if (!ok) {
+            errno = ENOMEM;
+            tags_fail(job, "index");
+        }
+    }
+    if (ok) {
+        pool_run(job->pending_count, tags_read_task, job);
+        ok = !sp_atomic_s32_get(&job->cancel) && tags_write_index(job);
+    }
+
+    for (u32 i = 0; i < job->source_count; i++) {
+        if (job->sources[i].parsed) job->parsed++;
+        else job->unchanged++;
+    }
+    job->ok = ok;
+    sp_atomic_s32_set(&job->done, 1);
+    return 0;
+}
+
+static void tags_job_free(tags_job_t *job) {
+    for (u32 i = 0; i < job->source_count; i++) {
+        tags_source_t *s = &job->sources[i];
+        sp_free(s->path);
+        if (s->found) sp_free(s->found);
+        if (s->names) sp_free(s->names);
+    }
+    if (job->sources) sp_free(job->sources);
+    if (job->pending) sp_free(job->pending);
+    for (u32 i = 0; i < job->extractor_count; i++) {
+        treesitter_extractor_free(job->extractors[i]);
+    }
+    if (job->extractors) sp_free(job->extractors);
+    if (job->busy) sp_free(job->busy);
+    job->sources = SP_NULLPTR;
+    job->pending = SP_NULLPTR;
+    job->extractors = SP_NULLPTR;
+    job->busy = SP_NULLPTR;
+    job->source_count = 0;
+    job->source_cap = 0;
+    job->pending_count = 0;
+    job->extractor_count = 0;
+}
+
+static void tags_finish(tags_job_t *job) {
+    sp_thread_join(&job->thread);
+    f64 ms = (f64)sp_tm_read_timer(&job->timer) / 1e6;
+
+    if (job->ok) {
+        tags_index_close(&G_tags);
+        tags_index_open(&G_tags, job->path);
+        snprintf(G_tags_status, sizeof(G_tags_status),
+                 "Tagged %u definitions in %u files (%u parsed, %u unchanged) in %.0f ms",
+                 job->tag_count, job->source_count, job->parsed, job->unchanged, ms);
+    } else if (sp_atomic_s32_get(&job->cancel)) {
+        snprintf(G_tags_status, sizeof(G_tags_status), "Tag index cancelled");
+    } else {
+        snprintf(G_tags_status, sizeof(G_tags_status), "Tag index failed: %s", job->error);
+    }
+
+    tags_job_free(job);
+    job->active = false;
+}
+
+static void tags_shutdown(void) {
+    tags_cancel();
+    tags_index_close(&G_tags);
+}
+
+// Start indexing the tree under root in the background, first mapping the
+// index a previous run left there so lookups work while it runs. Returns
+// false if the job could not be started; the reason is in tags_status().
+bool tags_refresh(const c8 *root) {
+    tags_job_t *job = &G_tags_job;
+    if (job->active) return true;
+
+    if (!G_tags_exit_ready) {
+        atexit(tags_shutdown);
+        G_tags_exit_ready = true;
+    }
+
+    if (snprintf(job->path, sizeof(job->path), "%s/" TAGS_INDEX_NAME, root) >= PATH_MAX ||
+        snprintf(job->tmp_path, sizeof(job->tmp_path), "%s/" TAGS_INDEX_NAME ".XXXXXX", root) >= PATH_MAX) {
+        snprintf(G_tags_status, sizeof(G_tags_status), "Tag index failed: path too long");
+        return false;
+    }
+    if (!G_tags.map || strcmp(G_tags_root, root) != 0) {
+        tags_index_close(&G_tags);
+        tags_index_open(&G_tags, job->path);
+        snprintf(G_tags_root, sizeof(G_tags_root), "%s", root);
+    }
+    snprintf(job->root, sizeof(job->root), "%s", root);
+
+    // One parser per pool worker; each takes on a file's grammar as it
+    // reaches it.
+    u32 threads = pool_threads();
+    job->extractors = sp_alloc(threads * sizeof(treesitter_extractor_t *));
+    job->busy = sp_alloc(threads * sizeof(sp_atomic_s32));
+    bool ok = job->extractors && job->busy;
+    for (u32 i = 0; ok && i < threads; i++) {
+        job->extractors[i] = treesitter_extractor_new();
+        ok = job->extractors[i] != SP_NULLPTR;
+        if (ok) job->extractor_count++;
+    }
+    if (!ok) {
+        tags_job_free(job);
+        snprintf(G_tags_status, sizeof(G_tags_status), "Tag index failed: tree-sitter unavailable");
+        return false;
+    }
+
+    job->old = G_tags.map ? &G_tags : SP_NULLPTR;
+    job->parsed = 0;
+    job->unchanged = 0;
+    job->tag_count = 0;
+    job->ok = false;
+    job->error[0] = '\0';
+    sp_atomic_s32_set(&job->cancel, 0);
+    sp_atomic_s32_set(&job->done, 0);
+    job->timer = sp_tm_start_timer();
+    job->active = true;
+    snprintf(G_tags_status, sizeof(G_tags_status), "Indexing tags under %s...", root);
+    sp_thread_init(&job->thread, tags_thread_main, job);
+    return true;
+}
+
+bool tags_busy(void) {
+    return G_tags_job.active;
+}
+
+const c8 *tags_status(void) {
+    return G_tags_status;
+}
+
+// Reap a finished index job. Returns true when one finished, so the
+// caller can report tags_status(). Called from the main loop.
+bool tags_poll(void) {
+    tags_job_t *job = &G_tags_job;
+    if (!job->active || !sp_atomic_s32_get(&job->done)) return false;
+    tags_finish(job);
+    return true;
+}
+
+// Block until the running job, if any, has finished. Returns false if it
+// failed.
+bool tags_wait(void) {
+    tags_job_t *job = &G_tags_job;
+    if (!job->active) return true;
+    tags_finish(job);
+    return job->ok;
+}
+
+void tags_cancel(void) {
+    tags_job_t *job = &G_tags_job;
+    if (!job->active) return;
+    sp_atomic_s32_set(&job->cancel, 1);
+    tags_finish(job);
+}
+
+// Look name up in the mapped index. Exact matches win; failing those,
+// names that start with it. Fills match with the nth match (wrapping) and
+// returns how many there are.
+u32 tags_find(sp_str_t name, u32 nth, tag_match_t *match) {
+    const tags_index_t *ix = &G_tags;
+    if (!ix->map || name.len == 0) return 0;
+
+    u32 first = tags_bound(ix, name, false, false);
+    u32 last = tags_bound(ix, name, false, true);
+    if (first == last) {
+        first = tags_bound(ix, name, true, false);
+        last = tags_bound(ix, name, true, true);
+    }
+    for (u32 count = last - first, i = 0; i < count; i++) {
+        const tags_entry_t *e = &ix->tags[first + (nth + i) % count];
+        if (e->file >= ix->header->file_count || e->kind > OUTLINE_MACRO) continue;
+        const tags_file_t *f = &ix->files[e->file];
+        if (!tags_string(ix, e->name, e->name_len, &match->name) ||
+            !tags_string(ix, f->path, f->path_len, &match->path)) {
+            continue;
+        }
+        match->kind = (outline_kind_t)e->kind;
+        match->row = e->row;
+        match->col = e->col;
+        return count;
+    }
+    return 0;
+}
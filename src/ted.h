@@ -11,6 +11,8 @@
 // Version info
 #define TED_VERSION "0.1.0"
 #define TAB_WIDTH_DEFAULT 4
+#define UNDO_LIMIT_DEFAULT (32u << 20)
+#define HL_LOOKAHEAD_DEFAULT 100
 #define MAX_LINE_LENGTH 4096
 
 // Special key codes (start at 0x1000 to avoid conflict with ASCII)
@@ -54,6 +56,28 @@ typedef enum {
     HL_TYPE,
 } highlight_type_t;
 
+// Language definition for syntax highlighting
+typedef struct {
+    sp_str_t name;
+    sp_str_t extensions;
+    sp_str_t *keywords;
+    u32 keyword_count;
+    sp_str_t single_comment;
+    sp_str_t multi_comment_start;
+    sp_str_t multi_comment_end;
+    c8 string_delim;
+} language_t;
+
+// Lexer state carried from the end of one line into the next
+typedef struct {
+    u16 multi_pair_index;
+    bool in_multiline_comment;
+    bool in_string;
+    c8 string_delim;
+    bool in_markdown_code_block;
+    c8 markdown_fence_char;
+} syntax_line_state_t;
+
 // Cursor position
 typedef struct {
     u32 row;
@@ -61,47 +85,127 @@ typedef struct {
     u32 render_col;
 } cursor_t;
 
-// Text line with highlight info
+// One run of highlighted bytes. skip counts the HL_NORMAL bytes between
+// the end of the previous run and this one, so a run costs three bytes;
+// longer gaps and runs are split. Normal text gets no runs at all.
+typedef struct {
+    u8 skip;
+    u8 len;
+    u8 kind;
+} hl_span_t;
+
+// Text line with highlight info.
+// text either views shared backing storage (cap == 0) or owns a growable
+// allocation of cap bytes that edits splice in place. shared marks owned
+// storage a save snapshot is still reading. A highlighted line owns
+// hl_count runs from hl_at in its buffer's span arena. hl_state is the lexer state at the
+// end of the line as of its last highlight.
 typedef struct {
     sp_str_t text;
-    highlight_type_t *hl;
+    u32 hl_at;
+    u32 hl_count;
+    u32 cap;
+    bool shared;
     bool hl_dirty;
+    bool highlighted;
+    syntax_line_state_t hl_state;
 } line_t;
 
-// Text buffer
+// Timings recorded by the last buffer_load_file
+typedef struct {
+    u64 bytes;
+    u32 lines;
+    u64 read_ns;
+    u64 index_ns;
+} buffer_load_stats_t;
+
+// Lazily materialized memory mapping for large files (buffer.c)
+typedef struct buffer_map_t buffer_map_t;
+
+// Lines are stored in blocks of at most a few hundred entries, so an
+// insert or delete only moves the rest of one block. Fenwick trees over the
+// blocks' line and byte counts (each line plus its newline) find the block
+// holding a row or a byte offset in O(log n). A block without lines is a
+// span: `count` lines of a mapped file not read in yet, starting at byte
+// `source` of the mapping.
 typedef struct {
     line_t *lines;
+    u32 count;
+    u64 bytes;
+    u64 source;
+} line_block_t;
+
+typedef struct {
+    line_block_t *blocks;
+    u32 block_count;
+    u32 block_cap;
+    u32 *rows;   // 1-based
+    u64 *bytes;  // 1-based
+    // Block of the last lookup and its first row, for walks over the rows
+    u32 hint;
+    u32 hint_row;
+} line_table_t;
+
+// A change of the text as tree-sitter's incremental parse wants it:
+// [start, old_end) was replaced by [start, new_end). Bytes count one per
+// line break, like buffer_point_to_offset.
+typedef struct {
+    u64 start_byte;
+    u64 old_end_byte;
+    u64 new_end_byte;
+    u32 start_row, start_col;
+    u32 old_end_row, old_end_col;
+    u32 new_end_row, new_end_col;
+} buffer_edit_t;
+
+// Text buffer
+typedef struct {
+    line_table_t table;
     u32 line_count;
-    u32 line_capacity;
+    sp_str_t backing;
     sp_str_t filename;
     bool modified;
     sp_str_t lang;
+    buffer_load_stats_t load_stats;
+    buffer_map_t *map;
+    u32 version;
+    // Stale rows are marked hl_dirty and none sits before hl_from. End
+    // states came from the lexer for hl_lang, and only rows in
+    // [hl_lo, hl_hi) may be highlighted.
+    u32 hl_from;
+    language_t *hl_lang;
+    u32 hl_lo;
+    u32 hl_hi;
+    // Runs of every highlighted row. Rehighlighting appends; the runs a
+    // row left behind are reclaimed by buffer_keep_highlight.
+    hl_span_t *hl_spans;
+    u32 hl_used;
+    u32 hl_cap;
+    // Tree-sitter parse of the text (treesitter.c). Edits are applied to
+    // it as they happen and ts_stale asks for an incremental reparse.
+    struct TSTree *ts_tree;
+    bool ts_stale;
+    // Definitions found in ts_tree, for :outline and :sym
+    struct ts_outline *ts_outline;
 } buffer_t;
 
-// Undo/Redo action types
-typedef enum {
-    ACTION_INSERT,
-    ACTION_DELETE,
-    ACTION_DELETE_LINE,
-    ACTION_INSERT_LINE,
-} action_type_t;
-
-// Undo/Redo record
+// Immutable copy of the buffer's line views, read by the background saver
+// and the background highlight pass
 typedef struct {
-    action_type_t type;
-    u32 row;
-    u32 col;
-    c8 ch;
-    sp_str_t text;
-    sp_str_t old_text;
-} action_t;
+    sp_str_t *lines;
+    u32 line_count;
+    const c8 *tail;   // unmaterialized bytes of a mapped file
+    u64 tail_len;
+    u64 bytes;
+    u32 version;
+} buffer_snapshot_t;
 
-// Undo stack
+// Undo log: encoded transactions, oldest first (see undo.c)
 typedef struct {
-    action_t *actions;
+    u8 *data;
+    u32 len;
+    u32 cap;
     u32 count;
-    u32 capacity;
-    u32 current;
 } undo_stack_t;
 
 // Search state
@@ -109,10 +213,39 @@ typedef struct {
     sp_str_t query;
     u32 current_match;
     u32 match_count;
+    bool counting;      // match_count is a lower bound until the count finishes
     bool case_sensitive;
+    bool regex;
     bool forward;
 } search_state_t;
 
+typedef enum {
+    SEARCH_FORWARD,
+    SEARCH_BACKWARD
+} search_dir_t;
+
+typedef struct {
+    u32 row;
+    u32 col;
+} search_pos_t;
+
+typedef struct {
+    u32 row;
+    u32 col;
+    u32 len;
+} search_match_t;
+
+// Compiled regular expression (regex.c)
+typedef struct regex_prog_t regex_prog_t;
+
+#define REGEX_MAX_GROUPS 10
+
+// Byte ranges of a match; index 0 is the whole match
+typedef struct {
+    u32 start[REGEX_MAX_GROUPS];
+    u32 end[REGEX_MAX_GROUPS];
+} regex_match_t;
+
 // Editor configuration
 typedef struct {
     bool show_line_numbers;
@@ -120,6 +253,8 @@ typedef struct {
     bool auto_wrap;
     bool show_whitespace;
     u32 tab_width;
+    u32 undo_limit;        // bytes per undo/redo log, 0 = unlimited
+    u32 hl_lookahead;      // rows highlighted beyond each edge of the screen
 } config_t;
 
 typedef enum {
@@ -152,6 +287,10 @@ typedef struct {
     u32 pending_origin_col;
     c8 pending_motion[8];
     u32 pending_motion_len;
+    // G on a file still being indexed stops at the last row counted so
+    // far; the jump is finished from there once the count is done
+    bool end_pending;
+    u32 end_pending_row;
     sp_str_t command_buffer;
     sp_str_t command_hint;
     sp_str_t message;
@@ -168,18 +307,6 @@ typedef struct {
     u32 screen_cols;
 } editor_t;
 
-// Language definition for syntax highlighting
-typedef struct {
-    sp_str_t name;
-    sp_str_t extensions;
-    sp_str_t *keywords;
-    u32 keyword_count;
-    sp_str_t single_comment;
-    sp_str_t multi_comment_start;
-    sp_str_t multi_comment_end;
-    c8 string_delim;
-} language_t;
-
 typedef enum {
     SYNTAX_CONFLICT_OVERRIDE = 0,
     SYNTAX_CONFLICT_SKIP,
@@ -192,6 +319,38 @@ typedef enum {
     TREE_NAV_NEXT_SIBLING,
 } treesitter_nav_kind_t;
 
+typedef enum {
+    OUTLINE_FUNCTION = 0,
+    OUTLINE_STRUCT,
+    OUTLINE_UNION,
+    OUTLINE_ENUM,
+    OUTLINE_TYPEDEF,
+    OUTLINE_MACRO,
+} outline_kind_t;
+
+// A definition in a buffer's outline. name points into the outline and
+// is valid until the next outline update.
+typedef struct {
+    sp_str_t name;
+    outline_kind_t kind;
+    u32 row;
+    u32 col;
+} outline_symbol_t;
+
+// Parser for pulling definitions out of files on a worker thread
+typedef struct treesitter_extractor treesitter_extractor_t;
+typedef void (*treesitter_definition_fn)(void *ctx, const outline_symbol_t *sym);
+
+// A definition found by the project tag index (tags.c). path and name
+// point into the mapped index.
+typedef struct {
+    sp_str_t name;
+    sp_str_t path;
+    outline_kind_t kind;
+    u32 row;
+    u32 col;
+} tag_match_t;
+
 // Global editor instance
 extern editor_t E;
 
@@ -215,20 +374,65 @@ void editor_cut_line(void);
 void editor_paste(void);
 void editor_move_cursor(u32 key);
 void editor_goto_line(u32 line);
+void editor_goto_end(void);
 void editor_set_message(const c8 *fmt, ...);
+void editor_poll_background(void);
+bool editor_background_busy(void);
 
 // buffer.c
 void buffer_init(buffer_t *buf);
 void buffer_free(buffer_t *buf);
 void buffer_load_file(buffer_t *buf, sp_str_t filename);
-bool buffer_save_file(buffer_t *buf);
 void buffer_insert_line(buffer_t *buf, u32 at, sp_str_t text);
+void buffer_insert_lines(buffer_t *buf, u32 at, const sp_str_t *texts, u32 count);
 void buffer_delete_line(buffer_t *buf, u32 at);
+void buffer_delete_lines(buffer_t *buf, u32 at, u32 count);
+void buffer_set_line(buffer_t *buf, u32 row, sp_str_t text);
 void buffer_insert_char_at(buffer_t *buf, u32 row, u32 col, c8 c);
 void buffer_delete_char_at(buffer_t *buf, u32 row, u32 col);
+void buffer_insert_text(buffer_t *buf, u32 row, u32 col, sp_str_t text, u32 *end_row, u32 *end_col);
+void buffer_delete_text(buffer_t *buf, u32 row, u32 col, u32 end_row, u32 end_col);
+line_t *buffer_line(buffer_t *buf, u32 row);
 sp_str_t buffer_get_line(buffer_t *buf, u32 row);
 u32 buffer_row_to_render(buffer_t *buf, u32 row, u32 col);
 u32 buffer_render_to_row(buffer_t *buf, u32 row, u32 render_col);
+void buffer_set_highlight(buffer_t *buf, u32 row, const highlight_type_t *kinds, u32 len);
+const hl_span_t *buffer_line_spans(buffer_t *buf, u32 row, u32 *count);
+void buffer_keep_highlight(buffer_t *buf, u32 first, u32 last);
+void buffer_highlight_stats(buffer_t *buf, u32 *spans, u64 *bytes);
+void buffer_ensure_rows(buffer_t *buf, u32 rows);
+void buffer_ensure_all_rows(buffer_t *buf);
+bool buffer_ensure_counted_rows(buffer_t *buf);
+void buffer_mark_dirty(buffer_t *buf);
+bool buffer_is_partial(buffer_t *buf);
+u32 buffer_total_lines(buffer_t *buf, bool *exact);
+s32 buffer_index_progress(buffer_t *buf);
+u64 buffer_point_to_offset(buffer_t *buf, u32 row, u32 col);
+bool buffer_offset_to_point(buffer_t *buf, u64 offset, u32 *row, u32 *col);
+u64 buffer_byte_count(buffer_t *buf);
+sp_str_t buffer_get_range(buffer_t *buf, u64 start, u64 end);
+bool buffer_snapshot_begin(buffer_t *buf, buffer_snapshot_t *snap);
+void buffer_snapshot_end(buffer_t *buf, buffer_snapshot_t *snap);
+
+// pool.c
+typedef void (*pool_task_fn_t)(void *ctx, u32 index);
+u32 pool_threads(void);
+void pool_run(u32 count, pool_task_fn_t fn, void *ctx);
+
+// save.c
+bool save_start(buffer_t *buf);
+void save_wait(void);
+void save_poll(void);
+bool save_in_progress(void);
+bool save_progress(u32 *percent, f64 *mb_per_s);
+
+// scan.c
+u32 scan_count_byte(const c8 *data, u32 len, c8 byte);
+u32 scan_find_byte(const c8 *data, u32 len, c8 byte);
+u32 scan_rfind_byte(const c8 *data, u32 len, c8 byte);
+u32 scan_find_byte2(const c8 *data, u32 len, c8 a, c8 b);
+u32 scan_rfind_byte2(const c8 *data, u32 len, c8 a, c8 b);
+const c8 *scan_kernel_name(void);
 
 // display.c
 void display_init(void);
@@ -291,8 +495,13 @@ bool syntax_register_language(sp_str_t name,
                               syntax_conflict_policy_t policy);
 bool syntax_has_language(sp_str_t name);
 sp_str_t syntax_list_languages(void);
-void syntax_highlight_line(line_t *line, language_t *lang);
-void syntax_highlight_buffer(buffer_t *buf);
+void syntax_highlight_buffer(buffer_t *buf, u32 first, u32 last);
+void syntax_relex_stats(u32 *last, u64 *total);
+bool syntax_state_equal(const syntax_line_state_t *a, const syntax_line_state_t *b);
+void syntax_poll(void);
+void syntax_cancel(void);
+bool syntax_background_stats(u32 *rows, u32 *chunks, u32 *fixed, f64 *ms);
+u32 syntax_check_buffer(buffer_t *buf, u64 *reference_ns, u64 *table_ns);
 c8* syntax_color_to_ansi(highlight_type_t type);
 
 // treesitter.c
@@ -301,16 +510,43 @@ bool treesitter_set_enabled(bool enable, sp_str_t *reason);
 bool treesitter_is_enabled(void);
 bool treesitter_is_available(void);
 sp_str_t treesitter_status(void);
-bool treesitter_highlight_buffer(buffer_t *buf);
+void treesitter_buffer_edit(buffer_t *buf, const buffer_edit_t *edit);
+void treesitter_buffer_release(buffer_t *buf);
+void treesitter_poll(void);
+void treesitter_cancel(void);
+bool treesitter_highlight_buffer(buffer_t *buf, u32 first, u32 last);
 sp_str_t treesitter_describe_cursor(buffer_t *buf, u32 row, u32 col);
 bool treesitter_node_range_at_cursor(buffer_t *buf, u32 row, u32 col,
                                      u32 *start_row, u32 *start_col,
                                      u32 *end_row, u32 *end_col,
                                      sp_str_t *summary);
+bool treesitter_resize_selection(buffer_t *buf, u32 row, u32 col, bool expand,
+                                 u32 *start_row, u32 *start_col,
+                                 u32 *end_row, u32 *end_col,
+                                 sp_str_t *summary);
 bool treesitter_nav_at_cursor(buffer_t *buf, u32 row, u32 col,
                               treesitter_nav_kind_t kind,
                               u32 *target_row, u32 *target_col,
                               sp_str_t *summary);
+bool treesitter_outline_update(buffer_t *buf, u32 *count, sp_str_t *summary);
+u32 treesitter_outline_list(buffer_t *buf, u32 row, outline_symbol_t *out, u32 max);
+u32 treesitter_outline_find(buffer_t *buf, sp_str_t name, u32 row, outline_symbol_t *out);
+const c8 *treesitter_outline_kind_name(outline_kind_t kind);
+bool treesitter_has_grammar(sp_str_t path);
+bool treesitter_check_reparse(buffer_t *buf, u32 *changed);
+treesitter_extractor_t *treesitter_extractor_new(void);
+void treesitter_extractor_free(treesitter_extractor_t *x);
+bool treesitter_extract_definitions(treesitter_extractor_t *x, sp_str_t path, sp_str_t text,
+                                    sp_atomic_s32 *cancel, treesitter_definition_fn fn, void *ctx);
+
+// tags.c
+bool tags_refresh(const c8 *root);
+bool tags_poll(void);
+bool tags_wait(void);
+void tags_cancel(void);
+bool tags_busy(void);
+const c8 *tags_status(void);
+u32 tags_find(sp_str_t name, u32 nth, tag_match_t *match);
 
 // search.c
 void search_init(void);
@@ -318,10 +554,21 @@ void search_start(bool forward);
 void search_next(void);
 void search_prev(void);
 void search_update_query(sp_str_t query);
+bool search_find(buffer_t *buf, sp_str_t query, search_pos_t from, search_dir_t dir, search_match_t *match);
+void search_poll(void);
+bool search_count_pending(void);
+const u32 *search_line_matches(buffer_t *buf, u32 row, u32 *count);
 void search_replace_current(sp_str_t replacement);
 void search_replace_all(sp_str_t replacement);
 void search_end(void);
 
+// regex.c
+regex_prog_t *regex_compile(sp_str_t pattern, bool case_sensitive, const c8 **error);
+void regex_free(regex_prog_t *re);
+u32 regex_group_count(regex_prog_t *re);
+bool regex_find(regex_prog_t *re, sp_str_t line, u32 from, regex_match_t *match);
+bool regex_find_reference(regex_prog_t *re, sp_str_t line, u32 from, regex_match_t *match);
+
 // command.c
 void command_init(void);
 void command_handle_input(c8 c);
@@ -349,16 +596,25 @@ sp_str_t llm_status(void);
 
 // undo.c
 void undo_init(undo_stack_t *stack);
-void undo_push(undo_stack_t *stack, action_t *action);
-action_t* undo_pop(undo_stack_t *stack);
 void undo_clear(undo_stack_t *stack);
-void undo_record_insert(u32 row, u32 col, c8 c);
-void undo_record_delete(u32 row, u32 col, c8 c);
-void undo_record_insert_line(u32 row, sp_str_t text);
-void undo_record_delete_line(u32 row, sp_str_t text);
+void undo_begin(void);
+void undo_end(void);
+void undo_break(void);
+void undo_record_splice(u32 row, u32 col, sp_str_t del, sp_str_t ins);
+void undo_record_delete_text(u32 row, u32 col, u32 end_row, u32 end_col);
+bool undo_record_insert(u32 row, u32 col, c8 c);
+bool undo_record_delete(u32 row, u32 col, c8 c);
+u32 undo_memory_used(void);
 void undo_perform(void);
 void redo_perform(void);
 
+// check.c
+u32 check_offsets(buffer_t *buf, u32 edits);
+u32 check_undo(u32 edits);
+u32 check_regex(regex_prog_t *re, sp_str_t replacement, u32 *matches);
+u32 check_relex(buffer_t *buf, u32 edits, u64 *relexed);
+u32 check_reparse(buffer_t *buf, u32 edits, u64 *redone);
+
 // input.c
 int input_read_key(void);
 bool input_read_escape_sequence(c8 *seq, u32 *len);
@@ -3,7 +3,8 @@
  *
  * Native integration:
  * - tree-sitter runtime is linked at build time.
- * - tree-sitter-c grammar is linked at build time.
+ * - grammars (tree-sitter-c for now) are linked at build time and listed
+ *   in a registry by name and file extension.
  * - no dlopen/grammar .so lookup at runtime.
  */
 
@@ -19,26 +20,299 @@
 // Provided by vendor/tree-sitter-c/src/parser.c
 const TSLanguage *tree_sitter_c(void);
 
+// Longest a parse may hold up the UI thread. One that runs over, such as
+// the first parse of a large file, is redone on a worker thread.
+#define TS_SYNC_BUDGET_NS 8000000ull
+
+// A grammar's highlight query for nodes whose kind depends on their
+// parent, with the highlight kind of each capture resolved once when the
+// query is compiled
+typedef struct {
+    const c8 *source;
+    TSQuery *query;
+    highlight_type_t *capture_kinds;
+    u32 capture_count;
+    bool failed;
+} ts_highlights_t;
+
+typedef struct {
+    u32 start_byte;
+    u32 end_byte;
+    TSPoint start;
+    TSPoint end;
+    u32 order;  // symbol rule, or query pattern then capture within it
+    highlight_type_t kind;
+} ts_capture_t;
+
+// A node kind and the highlight it gets wherever it appears
+typedef struct {
+    const c8 *name;
+    bool named;
+    highlight_type_t kind;
+} ts_symbol_rule_t;
+
+// A node kind the outline lists, or looks inside for definitions
+typedef struct {
+    const c8 *name;
+    bool listed;
+    outline_kind_t kind;
+    bool needs_body;
+    bool inside;
+} ts_outline_rule_t;
+
+// outline[s] flags
+#define TS_OUTLINE_LISTED 0x1
+#define TS_OUTLINE_BODY 0x2
+#define TS_OUTLINE_INSIDE 0x4
+
+// A grammar's symbol and outline rules resolved to dense tables indexed
+// by TSSymbol: the highlight of each symbol in kinds, the TS_OUTLINE_*
+// flags of each in outline, and the kind of a listed one in
+// outline_kinds. rule_of[s] ranks the symbol rule behind kinds[s].
+typedef struct {
+    const ts_symbol_rule_t *rules;
+    u32 rule_count;
+    const ts_outline_rule_t *outline_rules;
+    u32 outline_rule_count;
+    const TSLanguage *lang;
+    highlight_type_t *kinds;
+    u16 *rule_of;
+    u8 *outline;
+    outline_kind_t *outline_kinds;
+    TSFieldId name_field;
+    TSFieldId declarator_field;
+    TSFieldId body_field;
+    u32 symbol_count;
+} ts_symbol_table_t;
+
+// A definition in a buffer's outline. Its points follow edits until the
+// rows around it are extracted again.
+typedef struct {
+    c8 *name;
+    u32 name_len;
+    outline_kind_t kind;
+    TSPoint start;
+    TSPoint end;
+    TSPoint at;
+} ts_outline_entry_t;
+
+// A buffer's definitions, sorted by name and then position. Those that
+// overlap rows [dirty_lo, dirty_hi) may be out of date and are extracted
+// again before the next lookup.
+typedef struct ts_outline {
+    ts_outline_entry_t *entries;
+    u32 count;
+    u32 cap;
+    u32 dirty_lo;
+    u32 dirty_hi;
+} ts_outline_t;
+
+// A grammar linked into the binary, found by name or file extension. Its
+// parsers are made with the language already set, its highlight query
+// compiled and its symbol tables resolved, the first time a buffer needs
+// them; they are reused from then on, so grammars that are never used
+// cost nothing.
 typedef struct {
+    const c8 *name;
+    const c8 *extensions;
+    const TSLanguage *(*language)(void);
+    ts_highlights_t highlights;
+    ts_symbol_table_t symbols;
+    const TSLanguage *lang;
+    // One for parses on the UI thread, one for the background job
     TSParser *parser;
+    TSParser *job_parser;
+} ts_grammar_t;
+
+typedef struct {
     bool available;
     bool enabled;
-    const TSLanguage *active_lang;
-    c8 active_grammar[32];
+    // Grammar selected for the buffer at hand
+    ts_grammar_t *active;
     sp_str_t last_status;
+    // Last parse, for the status line
+    u64 parse_ns;
+    bool parse_incremental;
+    bool parse_background;
+    // Rows being highlighted
+    u32 hl_first;
+    u32 hl_last;
+    // Kinds of the window's bytes, row after row, until they are stored
+    // as runs. row_at[i] is where row hl_first + i starts.
+    highlight_type_t *kinds;
+    u32 kinds_cap;
+    u32 *row_at;
+    u32 rows_cap;
+    // Captures of the rows being highlighted, in marking order
+    ts_capture_t *captures;
+    u32 captures_cap;
+    TSQueryCursor *query_cursor;
+    // Walk over the rows the outline extracts
+    TSTreeCursor walk;
+    bool walk_ready;
+    // Node the last structural command stopped at. It stays current while
+    // nav_buf keeps the tree it was found in and the editor cursor stays
+    // at nav_row/nav_col, where that command left it. nav_selected says
+    // the node is the selection, grown from nav_origin.
+    TSTreeCursor nav;
+    TSTreeCursor nav_probe;
+    bool nav_ready;
+    buffer_t *nav_buf;
+    u32 nav_row;
+    u32 nav_col;
+    bool nav_selected;
+    TSPoint nav_origin;
 } treesitter_runtime_t;
 
 static treesitter_runtime_t G_ts = {0};
 
-static const c8 *TS_C_KEYWORDS[] = {
-    "if", "else", "switch", "case", "default", "while", "do", "for",
-    "return", "break", "continue", "goto", "typedef", "extern", "static",
-    "const", "volatile", "restrict", "sizeof", "enum", "struct", "union",
-    "inline", "register", "auto", "signed", "unsigned", "short", "long",
-    "void", "int", "char", "float", "double", "_Atomic", "_Alignas",
-    "_Alignof", "_Generic", "_Noreturn", "_Static_assert", NULL
+// Grammars are set up lazily by the UI thread and by tag workers alike
+static sp_mutex_t G_ts_grammar_lock;
+static bool G_ts_grammar_lock_ready = false;
+
+// Parse of a buffer snapshot on a worker thread. The worker owns parser
+// and old, a copy of the buffer's edited tree, until done is set.
+typedef struct {
+    buffer_t *buf;
+    buffer_snapshot_t snap;
+    u64 bytes;
+    u32 last_col;
+    TSParser *parser;
+    TSTree *old;
+    TSTree *tree;
+    sp_thread_t thread;
+    sp_tm_timer_t timer;
+    u64 parse_ns;
+    sp_atomic_s32 cancel;
+    sp_atomic_s32 done;
+    bool active;
+} ts_job_t;
+
+static ts_job_t G_ts_job;
+
+// Highlight rules for C. Where nodes nest, the inner one is marked over
+// the outer one, except that comments and strings keep their bytes;
+// whole preprocessor constructs are keywords so directives and macro
+// bodies read as keywords.
+static const ts_symbol_rule_t TS_C_SYMBOLS[] = {
+    { "comment", true, HL_COMMENT },
+    { "string_literal", true, HL_STRING },
+    { "system_lib_string", true, HL_STRING },
+    { "char_literal", true, HL_STRING },
+    { "number_literal", true, HL_NUMBER },
+    { "primitive_type", true, HL_TYPE },
+    { "type_identifier", true, HL_TYPE },
+    { "sized_type_specifier", true, HL_TYPE },
+    { "preproc_include", true, HL_KEYWORD },
+    { "preproc_def", true, HL_KEYWORD },
+    { "preproc_function_def", true, HL_KEYWORD },
+    { "preproc_call", true, HL_KEYWORD },
+    { "preproc_if", true, HL_KEYWORD },
+    { "preproc_ifdef", true, HL_KEYWORD },
+    { "preproc_else", true, HL_KEYWORD },
+    { "preproc_elif", true, HL_KEYWORD },
+    { "preproc_elifdef", true, HL_KEYWORD },
+    { "preproc_params", true, HL_KEYWORD },
+    { "preproc_arg", true, HL_KEYWORD },
+    { "preproc_directive", true, HL_KEYWORD },
+    { "preproc_defined", true, HL_KEYWORD },
+    { "attribute_specifier", true, HL_KEYWORD },
+    { "if", false, HL_KEYWORD },
+    { "else", false, HL_KEYWORD },
+    { "switch", false, HL_KEYWORD },
+    { "case", false, HL_KEYWORD },
+    { "default", false, HL_KEYWORD },
+    { "while", false, HL_KEYWORD },
+    { "do", false, HL_KEYWORD },
+    { "for", false, HL_KEYWORD },
+    { "return", false, HL_KEYWORD },
+    { "break", false, HL_KEYWORD },
+    { "continue", false, HL_KEYWORD },
+    { "goto", false, HL_KEYWORD },
+    { "typedef", false, HL_KEYWORD },
+    { "extern", false, HL_KEYWORD },
+    { "static", false, HL_KEYWORD },
+    { "const", false, HL_KEYWORD },
+    { "volatile", false, HL_KEYWORD },
+    { "restrict", false, HL_KEYWORD },
+    { "sizeof", false, HL_KEYWORD },
+    { "enum", false, HL_KEYWORD },
+    { "struct", false, HL_KEYWORD },
+    { "union", false, HL_KEYWORD },
+    { "inline", false, HL_KEYWORD },
+    { "register", false, HL_KEYWORD },
+    { "auto", false, HL_KEYWORD },
+    { "signed", false, HL_KEYWORD },
+    { "unsigned", false, HL_KEYWORD },
+    { "short", false, HL_KEYWORD },
+    { "long", false, HL_KEYWORD },
+    { "_Atomic", false, HL_KEYWORD },
+    { "_Alignas", false, HL_KEYWORD },
+    { "_Alignof", false, HL_KEYWORD },
+    { "_Generic", false, HL_KEYWORD },
+    { "_Noreturn", false, HL_KEYWORD },
+    { "field_identifier", true, HL_FUNCTION },
+};
+
+// Identifiers that name a function only under these parents. A match
+// here wins over the symbol rules for the same node.
+static const c8 TS_C_HIGHLIGHTS[] =
+    "(call_expression (identifier) @function)\n"
+    "(function_declarator (identifier) @function)\n"
+    "(preproc_function_def (identifier) @function)\n";
+
+// Capture names and the kinds they are drawn as
+static const struct {
+    const c8 *name;
+    highlight_type_t kind;
+} TS_CAPTURE_KINDS[] = {
+    { "comment", HL_COMMENT },
+    { "string", HL_STRING },
+    { "number", HL_NUMBER },
+    { "type", HL_TYPE },
+    { "keyword", HL_KEYWORD },
+    { "function", HL_FUNCTION },
+};
+
+// Definitions the outline lists for C, and the nodes it looks for them
+// in. Nothing inside a function body or a struct is listed, and ERROR
+// nodes are looked inside so a half-typed line hides no more than itself.
+static const ts_outline_rule_t TS_C_OUTLINE[] = {
+    { "function_definition", true, OUTLINE_FUNCTION, true, false },
+    { "struct_specifier", true, OUTLINE_STRUCT, true, false },
+    { "union_specifier", true, OUTLINE_UNION, true, false },
+    { "enum_specifier", true, OUTLINE_ENUM, true, false },
+    { "type_definition", true, OUTLINE_TYPEDEF, false, true },
+    { "preproc_def", true, OUTLINE_MACRO, false, false },
+    { "preproc_function_def", true, OUTLINE_MACRO, false, false },
+    { "translation_unit", false, 0, false, true },
+    { "declaration", false, 0, false, true },
+    { "preproc_if", false, 0, false, true },
+    { "preproc_ifdef", false, 0, false, true },
+    { "preproc_else", false, 0, false, true },
+    { "preproc_elif", false, 0, false, true },
+    { "preproc_elifdef", false, 0, false, true },
+    { "linkage_specification", false, 0, false, true },
+    { "declaration_list", false, 0, false, true },
+};
+
+static ts_grammar_t TS_GRAMMARS[] = {
+    {
+        .name = "c",
+        .extensions = ".c .h",
+        .language = tree_sitter_c,
+        .highlights = { .source = TS_C_HIGHLIGHTS },
+        .symbols = {
+            .rules = TS_C_SYMBOLS,
+            .rule_count = sizeof(TS_C_SYMBOLS) / sizeof(TS_C_SYMBOLS[0]),
+            .outline_rules = TS_C_OUTLINE,
+            .outline_rule_count = sizeof(TS_C_OUTLINE) / sizeof(TS_C_OUTLINE[0]),
+        },
+    },
 };
 
+#define TS_GRAMMAR_COUNT (sizeof(TS_GRAMMARS) / sizeof(TS_GRAMMARS[0]))
+
 static void ts_set_status(const c8 *fmt, ...) {
     c8 buf[256];
     va_list args;
@@ -48,80 +322,142 @@ static void ts_set_status(const c8 *fmt, ...) {
     G_ts.last_status = sp_str_from_cstr(buf);
 }
 
-static void ts_shutdown(void) {
-    if (G_ts.parser) {
-        ts_parser_delete(G_ts.parser);
-        G_ts.parser = SP_NULLPTR;
-    }
+static void ts_highlights_free(ts_highlights_t *hl) {
+    if (hl->query) ts_query_delete(hl->query);
+    if (hl->capture_kinds) sp_free(hl->capture_kinds);
+    hl->query = SP_NULLPTR;
+    hl->capture_kinds = SP_NULLPTR;
+    hl->capture_count = 0;
 }
 
-static bool ts_select_language_for_buffer(buffer_t *buf) {
-    G_ts.active_lang = SP_NULLPTR;
-    G_ts.active_grammar[0] = '\0';
+static void ts_symbols_free(ts_symbol_table_t *t) {
+    if (t->kinds) sp_free(t->kinds);
+    if (t->rule_of) sp_free(t->rule_of);
+    if (t->outline) sp_free(t->outline);
+    if (t->outline_kinds) sp_free(t->outline_kinds);
+    t->kinds = SP_NULLPTR;
+    t->rule_of = SP_NULLPTR;
+    t->outline = SP_NULLPTR;
+    t->outline_kinds = SP_NULLPTR;
+    t->symbol_count = 0;
+    t->lang = SP_NULLPTR;
+}
 
-    if (!buf || buf->lang.len == 0) {
-        ts_set_status("no buffer language");
-        return false;
+static void ts_shutdown(void) {
+    treesitter_cancel();
+    for (u32 i = 0; i < TS_GRAMMAR_COUNT; i++) {
+        ts_grammar_t *g = &TS_GRAMMARS[i];
+        if (g->parser) ts_parser_delete(g->parser);
+        if (g->job_parser) ts_parser_delete(g->job_parser);
+        g->parser = SP_NULLPTR;
+        g->job_parser = SP_NULLPTR;
+        ts_highlights_free(&g->highlights);
+        ts_symbols_free(&g->symbols);
     }
+    G_ts.active = SP_NULLPTR;
+    G_ts_job.parser = SP_NULLPTR;
+    if (G_ts.kinds) sp_free(G_ts.kinds);
+    if (G_ts.row_at) sp_free(G_ts.row_at);
+    if (G_ts.captures) sp_free(G_ts.captures);
+    if (G_ts.query_cursor) ts_query_cursor_delete(G_ts.query_cursor);
+    if (G_ts.walk_ready) ts_tree_cursor_delete(&G_ts.walk);
+    if (G_ts.nav_ready) {
+        ts_tree_cursor_delete(&G_ts.nav);
+        ts_tree_cursor_delete(&G_ts.nav_probe);
+    }
+    G_ts.kinds = SP_NULLPTR;
+    G_ts.row_at = SP_NULLPTR;
+    G_ts.captures = SP_NULLPTR;
+    G_ts.captures_cap = 0;
+    G_ts.query_cursor = SP_NULLPTR;
+    G_ts.walk_ready = false;
+    G_ts.nav_ready = false;
+    G_ts.nav_buf = SP_NULLPTR;
+    G_ts.kinds_cap = 0;
+    G_ts.rows_cap = 0;
+}
 
-    // Native support in current phase: C only.
-    if (sp_str_equal(buf->lang, sp_str_lit("c"))) {
-        G_ts.active_lang = tree_sitter_c();
-        if (!G_ts.active_lang) {
-            ts_set_status("built-in c grammar missing");
-            return false;
-        }
-        snprintf(G_ts.active_grammar, sizeof(G_ts.active_grammar), "c");
-        return true;
+static bool ts_name_equal(const c8 *a, sp_str_t b) {
+    u32 i = 0;
+    for (; i < b.len && a[i]; i++) {
+        c8 x = a[i] >= 'A' && a[i] <= 'Z' ? a[i] + 32 : a[i];
+        c8 y = b.data[i] >= 'A' && b.data[i] <= 'Z' ? b.data[i] + 32 : b.data[i];
+        if (x != y) return false;
     }
+    return i == b.len && a[i] == '\0';
+}
 
-    ts_set_status("no built-in grammar for %.*s", (int)buf->lang.len, buf->lang.data);
+// Whether ext is one of the words of a space-separated list
+static bool ts_extension_listed(const c8 *list, sp_str_t ext) {
+    while (*list) {
+        while (*list == ' ') list++;
+        u32 len = 0;
+        while (list[len] && list[len] != ' ') len++;
+        if (len > 0 && len == ext.len && memcmp(list, ext.data, len) == 0) return true;
+        list += len;
+    }
     return false;
 }
 
-static bool ts_is_c_keyword(const c8 *type) {
-    for (u32 i = 0; TS_C_KEYWORDS[i]; i++) {
-        if (strcmp(type, TS_C_KEYWORDS[i]) == 0) return true;
+// The registered grammar for a language name, in any case, as the syntax
+// module names it ("C"), or failing that for the extension of filename
+static ts_grammar_t *ts_grammar_find(sp_str_t name, sp_str_t filename) {
+    for (u32 i = 0; i < TS_GRAMMAR_COUNT; i++) {
+        if (ts_name_equal(TS_GRAMMARS[i].name, name)) return &TS_GRAMMARS[i];
     }
-    return false;
+
+    u32 dot = filename.len;
+    while (dot > 0 && filename.data[dot - 1] != '.' && filename.data[dot - 1] != '/') dot--;
+    if (dot == 0 || filename.data[dot - 1] != '.') return SP_NULLPTR;
+    sp_str_t ext = { .data = filename.data + dot - 1, .len = filename.len - dot + 1 };
+    for (u32 i = 0; i < TS_GRAMMAR_COUNT; i++) {
+        if (ts_extension_listed(TS_GRAMMARS[i].extensions, ext)) return &TS_GRAMMARS[i];
+    }
+    return SP_NULLPTR;
 }
 
-static bool ts_type_starts_with(const c8 *type, const c8 *prefix) {
-    if (!type || !prefix) return false;
-    size_t n = strlen(prefix);
-    return strncmp(type, prefix, n) == 0;
+// The grammar's language, fetched once
+static const TSLanguage *ts_grammar_language(ts_grammar_t *g) {
+    sp_mutex_lock(&G_ts_grammar_lock);
+    if (!g->lang) g->lang = g->language();
+    const TSLanguage *lang = g->lang;
+    sp_mutex_unlock(&G_ts_grammar_lock);
+    return lang;
 }
 
-static highlight_type_t ts_map_c_node(TSNode node) {
-    const c8 *type = ts_node_type(node);
-    if (!type) return HL_NORMAL;
-
-    if (strcmp(type, "comment") == 0) return HL_COMMENT;
-    if (strcmp(type, "string_literal") == 0 ||
-        strcmp(type, "system_lib_string") == 0 ||
-        strcmp(type, "char_literal") == 0) return HL_STRING;
-    if (strcmp(type, "number_literal") == 0) return HL_NUMBER;
-    if (strcmp(type, "primitive_type") == 0 ||
-        strcmp(type, "type_identifier") == 0 ||
-        strcmp(type, "sized_type_specifier") == 0) return HL_TYPE;
-    if (ts_type_starts_with(type, "preproc_")) return HL_KEYWORD;
-    if (strcmp(type, "attribute_specifier") == 0) return HL_KEYWORD;
-    if (strcmp(type, "field_identifier") == 0) return HL_FUNCTION;
-    if (ts_is_c_keyword(type)) return HL_KEYWORD;
-
-    if (strcmp(type, "identifier") == 0) {
-        TSNode p = ts_node_parent(node);
-        if (!ts_node_is_null(p)) {
-            const c8 *pt = ts_node_type(p);
-            if (pt && (strcmp(pt, "call_expression") == 0 ||
-                       strcmp(pt, "function_declarator") == 0 ||
-                       strcmp(pt, "preproc_function_def") == 0)) {
-                return HL_FUNCTION;
-            }
-        }
+// A parser of g's, made with its language set on first use. *slot is
+// either g->parser or g->job_parser.
+static TSParser *ts_grammar_parser(ts_grammar_t *g, TSParser **slot) {
+    if (*slot) return *slot;
+    const TSLanguage *lang = ts_grammar_language(g);
+    TSParser *parser = lang ? ts_parser_new() : SP_NULLPTR;
+    if (parser && !ts_parser_set_language(parser, lang)) {
+        ts_parser_delete(parser);
+        parser = SP_NULLPTR;
     }
+    *slot = parser;
+    return parser;
+}
+
+static bool ts_select_language_for_buffer(buffer_t *buf) {
+    G_ts.active = SP_NULLPTR;
 
-    return HL_NORMAL;
+    if (!buf || buf->lang.len == 0) {
+        ts_set_status("no buffer language");
+        return false;
+    }
+
+    ts_grammar_t *g = ts_grammar_find(buf->lang, buf->filename);
+    if (!g) {
+        ts_set_status("no built-in grammar for %.*s", (int)buf->lang.len, buf->lang.data);
+        return false;
+    }
+    if (!ts_grammar_language(g)) {
+        ts_set_status("built-in %s grammar missing", g->name);
+        return false;
+    }
+    G_ts.active = g;
+    return true;
 }
 
 static void ts_mark_span(buffer_t *buf, TSPoint start, TSPoint end, highlight_type_t hl) {
@@ -131,8 +467,9 @@ static void ts_mark_span(buffer_t *buf, TSPoint start, TSPoint end, highlight_ty
     if (start.row > end.row) return;
 
     for (u32 row = start.row; row <= end.row; row++) {
-        line_t *line = &buf->lines[row];
-        if (!line->hl || line->text.len == 0) continue;
+        line_t *line = buffer_line(buf, row);
+        if (row < G_ts.hl_first || row >= G_ts.hl_last || line->text.len == 0) continue;
+        highlight_type_t *kinds = G_ts.kinds + G_ts.row_at[row - G_ts.hl_first];
 
         u32 from = 0;
         u32 to = line->text.len;
@@ -144,70 +481,690 @@ static void ts_mark_span(buffer_t *buf, TSPoint start, TSPoint end, highlight_ty
 
         for (u32 col = from; col < to; col++) {
             // Keep comments/strings strongest if already set.
-            if (line->hl[col] == HL_COMMENT || line->hl[col] == HL_STRING) continue;
-            line->hl[col] = hl;
+            if (kinds[col] == HL_COMMENT || kinds[col] == HL_STRING) continue;
+            kinds[col] = hl;
+        }
+    }
+}
+
+// Resolve t's rules against every symbol of lang by name, once, so nodes
+// are classified without looking at their type strings.
+static ts_symbol_table_t *ts_symbols_for(ts_symbol_table_t *t, const TSLanguage *lang) {
+    if (t->lang == lang) return t;
+    ts_symbols_free(t);
+
+    u32 count = ts_language_symbol_count(lang);
+    t->kinds = sp_alloc(sizeof(highlight_type_t) * (count > 0 ? count : 1));
+    t->rule_of = sp_alloc(sizeof(u16) * (count > 0 ? count : 1));
+    t->outline = sp_alloc(sizeof(u8) * (count > 0 ? count : 1));
+    t->outline_kinds = sp_alloc(sizeof(outline_kind_t) * (count > 0 ? count : 1));
+    if (!t->kinds || !t->rule_of || !t->outline || !t->outline_kinds) {
+        ts_symbols_free(t);
+        return SP_NULLPTR;
+    }
+
+    for (u32 sym = 0; sym < count; sym++) {
+        const c8 *name = ts_language_symbol_name(lang, (TSSymbol)sym);
+        if (!name) continue;
+        TSSymbolType type = ts_language_symbol_type(lang, (TSSymbol)sym);
+        for (u32 i = 0; i < t->rule_count; i++) {
+            const ts_symbol_rule_t *rule = &t->rules[i];
+            if (rule->named != (type == TSSymbolTypeRegular)) continue;
+            if (strcmp(rule->name, name) != 0) continue;
+            t->kinds[sym] = rule->kind;
+            t->rule_of[sym] = (u16)i;
+            break;
+        }
+        if (type != TSSymbolTypeRegular) continue;
+        for (u32 i = 0; i < t->outline_rule_count; i++) {
+            const ts_outline_rule_t *rule = &t->outline_rules[i];
+            if (strcmp(rule->name, name) != 0) continue;
+            t->outline[sym] = (rule->listed ? TS_OUTLINE_LISTED : 0) |
+                              (rule->needs_body ? TS_OUTLINE_BODY : 0) |
+                              (rule->inside ? TS_OUTLINE_INSIDE : 0);
+            t->outline_kinds[sym] = rule->kind;
+            break;
+        }
+    }
+    t->name_field = ts_language_field_id_for_name(lang, "name", 4);
+    t->declarator_field = ts_language_field_id_for_name(lang, "declarator", 10);
+    t->body_field = ts_language_field_id_for_name(lang, "body", 4);
+    t->symbol_count = count;
+    t->lang = lang;
+    return t;
+}
+
+// g's symbol tables, resolved on first use. They do not change after
+// that, so callers read them without the lock.
+static const ts_symbol_table_t *ts_grammar_symbols(ts_grammar_t *g) {
+    const TSLanguage *lang = ts_grammar_language(g);
+    if (!lang) return SP_NULLPTR;
+    sp_mutex_lock(&G_ts_grammar_lock);
+    const ts_symbol_table_t *t = ts_symbols_for(&g->symbols, lang);
+    sp_mutex_unlock(&G_ts_grammar_lock);
+    return t;
+}
+
+// Rules of the grammar selected for the buffer at hand
+static const ts_symbol_table_t *ts_active_symbols(void) {
+    if (!G_ts.active) return SP_NULLPTR;
+    return ts_grammar_symbols(G_ts.active);
+}
+
+// The cursor for walks over a range of rows, reset to root
+static TSTreeCursor *ts_walk_cursor(TSNode root) {
+    if (!G_ts.walk_ready) {
+        G_ts.walk = ts_tree_cursor_new(root);
+        G_ts.walk_ready = true;
+    } else {
+        ts_tree_cursor_reset(&G_ts.walk, root);
+    }
+    return &G_ts.walk;
+}
+
+// Compile the grammar's highlight query on first use and resolve each
+// capture name to its kind, so matches only index a table.
+static ts_highlights_t *ts_highlights_for(ts_highlights_t *hl, const TSLanguage *lang) {
+    if (hl->query) return hl;
+    if (hl->failed) return SP_NULLPTR;
+
+    u32 error_offset = 0;
+    TSQueryError error = TSQueryErrorNone;
+    hl->query = ts_query_new(lang, hl->source, (u32)strlen(hl->source), &error_offset, &error);
+    if (!hl->query) {
+        ts_set_status("highlight query error %d at %u", (int)error, error_offset);
+        hl->failed = true;
+        return SP_NULLPTR;
+    }
+
+    hl->capture_count = ts_query_capture_count(hl->query);
+    hl->capture_kinds = sp_alloc(sizeof(highlight_type_t) * (hl->capture_count > 0 ? hl->capture_count : 1));
+    if (!hl->capture_kinds) {
+        ts_highlights_free(hl);
+        hl->failed = true;
+        return SP_NULLPTR;
+    }
+    for (u32 i = 0; i < hl->capture_count; i++) {
+        u32 len = 0;
+        const c8 *name = ts_query_capture_name_for_id(hl->query, i, &len);
+        hl->capture_kinds[i] = HL_NORMAL;
+        for (u32 k = 0; k < sizeof(TS_CAPTURE_KINDS) / sizeof(TS_CAPTURE_KINDS[0]); k++) {
+            if (strlen(TS_CAPTURE_KINDS[k].name) == len && memcmp(TS_CAPTURE_KINDS[k].name, name, len) == 0) {
+                hl->capture_kinds[i] = TS_CAPTURE_KINDS[k].kind;
+                break;
+            }
+        }
+    }
+    return hl;
+}
+
+// Outer nodes first: they start no later and, at the same start, end no
+// earlier than the nodes inside them. Ties go by symbol rule, then by the
+// query's pattern order, never by the order the nodes were found in,
+// which depends on the rows the search was limited to.
+static int ts_capture_cmp(const void *a, const void *b) {
+    const ts_capture_t *x = a;
+    const ts_capture_t *y = b;
+    if (x->start_byte != y->start_byte) return x->start_byte < y->start_byte ? -1 : 1;
+    if (x->end_byte != y->end_byte) return x->end_byte > y->end_byte ? -1 : 1;
+    return x->order < y->order ? -1 : x->order > y->order;
+}
+
+static bool ts_push_capture(u32 *count, TSNode node, u32 order, highlight_type_t kind) {
+    if (*count == G_ts.captures_cap) {
+        u32 cap = G_ts.captures_cap ? G_ts.captures_cap * 2 : 256;
+        ts_capture_t *grown = sp_realloc(G_ts.captures, sizeof(ts_capture_t) * cap);
+        if (!grown) return false;
+        G_ts.captures = grown;
+        G_ts.captures_cap = cap;
+    }
+    G_ts.captures[(*count)++] = (ts_capture_t){
+        .start_byte = ts_node_start_byte(node),
+        .end_byte = ts_node_end_byte(node),
+        .start = ts_node_start_point(node),
+        .end = ts_node_end_point(node),
+        .order = order,
+        .kind = kind,
+    };
+    return true;
+}
+
+// Collect the nodes that overlap rows [first, last) and have a kind in
+// t's dense table. Subtrees that end before the rows are stepped over and
+// the walk stops at the first node past them.
+static bool ts_walk_symbols(const ts_symbol_table_t *t, TSNode root, u32 first, u32 last, u32 *count) {
+    TSTreeCursor *cursor = ts_walk_cursor(root);
+    TSPoint from = { first, 0 };
+    u32 depth = 0;
+    for (;;) {
+        TSNode node = ts_tree_cursor_current_node(cursor);
+        if (ts_node_start_point(node).row >= last) {
+            // So do the siblings after it
+            if (depth == 0) return true;
+            ts_tree_cursor_goto_parent(cursor);
+            depth--;
+        } else {
+            TSSymbol sym = ts_node_symbol(node);
+            // ERROR nodes carry a symbol past the grammar's own
+            if (sym < t->symbol_count && t->kinds[sym] != HL_NORMAL &&
+                !ts_push_capture(count, node, t->rule_of[sym], t->kinds[sym])) {
+                return false;
+            }
+            if (ts_tree_cursor_goto_first_child_for_point(cursor, from) >= 0) {
+                depth++;
+                continue;
+            }
+        }
+
+        while (!ts_tree_cursor_goto_next_sibling(cursor)) {
+            if (depth == 0) return true;
+            ts_tree_cursor_goto_parent(cursor);
+            depth--;
+        }
+    }
+}
+
+// Mark the nodes that overlap rows [first, last): those t classifies by
+// symbol alone, and the captures of hl's query, which rank above them.
+// Both are limited to those rows, so nodes elsewhere are never visited.
+static bool ts_query_highlight(buffer_t *buf, const ts_symbol_table_t *t, ts_highlights_t *hl, TSNode root,
+                               u32 first, u32 last) {
+    if (!G_ts.query_cursor) {
+        G_ts.query_cursor = ts_query_cursor_new();
+        if (!G_ts.query_cursor) return false;
+    }
+
+    u32 count = 0;
+    if (!ts_walk_symbols(t, root, first, last, &count)) return false;
+
+    TSQueryCursor *cursor = G_ts.query_cursor;
+    ts_query_cursor_set_point_range(cursor, (TSPoint){ first, 0 }, (TSPoint){ last, 0 });
+    ts_query_cursor_exec(cursor, hl->query, root);
+
+    TSQueryMatch match;
+    while (ts_query_cursor_next_match(cursor, &match)) {
+        for (u16 i = 0; i < match.capture_count; i++) {
+            highlight_type_t kind = hl->capture_kinds[match.captures[i].index];
+            if (kind == HL_NORMAL) continue;
+            u32 order = ((u32)(match.pattern_index + 1) << 16) | i;
+            if (!ts_push_capture(&count, match.captures[i].node, order, kind)) return false;
         }
     }
+
+    qsort(G_ts.captures, count, sizeof(ts_capture_t), ts_capture_cmp);
+    for (u32 i = 0; i < count; i++) {
+        ts_mark_span(buf, G_ts.captures[i].start, G_ts.captures[i].end, G_ts.captures[i].kind);
+    }
+    return true;
 }
 
-static void ts_walk_and_highlight_c(buffer_t *buf, TSNode node) {
-    if (ts_node_is_null(node)) return;
+// Lay out NORMAL kinds for every byte of rows [first, last)
+static bool ts_prepare_highlight_kinds(buffer_t *buf, u32 first, u32 last) {
+    u32 rows = last - first;
+    if (rows > G_ts.rows_cap) {
+        u32 *grown = sp_realloc(G_ts.row_at, sizeof(u32) * rows);
+        if (!grown) return false;
+        G_ts.row_at = grown;
+        G_ts.rows_cap = rows;
+    }
 
-    highlight_type_t hl = ts_map_c_node(node);
-    if (hl != HL_NORMAL) {
-        TSPoint s = ts_node_start_point(node);
-        TSPoint e = ts_node_end_point(node);
-        ts_mark_span(buf, s, e, hl);
+    u64 total = 0;
+    for (u32 i = first; i < last; i++) {
+        G_ts.row_at[i - first] = (u32)total;
+        total += buffer_get_line(buf, i).len;
     }
+    if (total > UINT32_MAX) return false;
+    if (total > G_ts.kinds_cap) {
+        highlight_type_t *grown = sp_realloc(G_ts.kinds, sizeof(highlight_type_t) * (u32)total);
+        if (!grown) return false;
+        G_ts.kinds = grown;
+        G_ts.kinds_cap = (u32)total;
+    }
+    if (total > 0) memset(G_ts.kinds, 0, sizeof(highlight_type_t) * (size_t)total);
+    return true;
+}
 
-    u32 child_count = ts_node_child_count(node);
-    for (u32 i = 0; i < child_count; i++) {
-        ts_walk_and_highlight_c(buf, ts_node_child(node, i));
+// Store the kinds of rows [first, last) as each row's runs. Rows drawn
+// from a tree the text has moved on from stay hl_dirty.
+static void ts_store_highlight(buffer_t *buf, u32 first, u32 last, bool settled) {
+    for (u32 i = first; i < last; i++) {
+        line_t *line = buffer_line(buf, i);
+        buffer_set_highlight(buf, i, G_ts.kinds + G_ts.row_at[i - first], line->text.len);
+        line->hl_dirty = !settled;
     }
 }
 
-static void ts_prepare_highlight_arrays(buffer_t *buf) {
-    for (u32 i = 0; i < buf->line_count; i++) {
-        line_t *line = &buf->lines[i];
-        if (line->hl) {
-            sp_free(line->hl);
-            line->hl = SP_NULLPTR;
+// Highlighted rows whose syntax changed in a reparse are marked hl_dirty
+// so the next highlight redoes them. Other rows were never highlighted.
+static void ts_mark_changed(buffer_t *buf, const TSRange *ranges, u32 count) {
+    u32 hi = buf->hl_hi < buf->line_count ? buf->hl_hi : buf->line_count;
+    for (u32 i = 0; i < count; i++) {
+        u32 from = ranges[i].start_point.row;
+        u32 to = ranges[i].end_point.row + 1;
+        if (from < buf->hl_lo) from = buf->hl_lo;
+        if (to > hi) to = hi;
+        for (u32 row = from; row < to; row++) {
+            buffer_line(buf, row)->hl_dirty = true;
         }
-        if (line->text.len > 0) {
-            line->hl = sp_alloc(sizeof(highlight_type_t) * line->text.len);
-            if (line->hl) {
-                for (u32 j = 0; j < line->text.len; j++) line->hl[j] = HL_NORMAL;
+    }
+}
+
+// Mark the highlighted rows node spans as needing a redo
+static void ts_mark_node(buffer_t *buf, TSNode node) {
+    u32 hi = buf->hl_hi < buf->line_count ? buf->hl_hi : buf->line_count;
+    u32 from = ts_node_start_point(node).row;
+    u32 to = ts_node_end_point(node).row + 1;
+    if (from < buf->hl_lo) from = buf->hl_lo;
+    if (to > hi) to = hi;
+    for (u32 row = from; row < to; row++) {
+        buffer_line(buf, row)->hl_dirty = true;
+    }
+}
+
+// Highlighted rows holding tokens that error recovery placed straight
+// inside an ERROR node, or MISSING ones, are redone as well. Recovery can
+// read such a token differently after an edit far away, say a type
+// keyword as a plain identifier, and the changed ranges do not report it.
+// Only subtrees holding an error are walked.
+static void ts_mark_errors(buffer_t *buf, TSTree *tree) {
+    TSNode root = ts_tree_root_node(tree);
+    if (!ts_node_has_error(root)) return;
+
+    u32 hi = buf->hl_hi < buf->line_count ? buf->hl_hi : buf->line_count;
+    TSTreeCursor *cursor = ts_walk_cursor(root);
+    for (;;) {
+        TSNode node = ts_tree_cursor_current_node(cursor);
+        bool visible = ts_node_start_point(node).row < hi && ts_node_end_point(node).row >= buf->hl_lo;
+        if (visible && ts_node_has_error(node)) {
+            if (ts_node_child_count(node) == 0) {
+                ts_mark_node(buf, node);
+            } else if (ts_tree_cursor_goto_first_child(cursor)) {
+                if (ts_node_is_error(node)) {
+                    // Its tokens here; the nodes it holds are walked below
+                    do {
+                        TSNode child = ts_tree_cursor_current_node(cursor);
+                        if (ts_node_child_count(child) == 0) ts_mark_node(buf, child);
+                    } while (ts_tree_cursor_goto_next_sibling(cursor));
+                    ts_tree_cursor_goto_parent(cursor);
+                    ts_tree_cursor_goto_first_child(cursor);
+                }
+                continue;
             }
         }
-        line->hl_dirty = false;
+        while (!ts_tree_cursor_goto_next_sibling(cursor)) {
+            if (!ts_tree_cursor_goto_parent(cursor)) return;
+        }
+    }
+}
+
+// The nav cursor points into buf's tree, so it is dropped whenever that
+// tree is edited or replaced
+static void ts_nav_forget(buffer_t *buf) {
+    if (G_ts.nav_buf == buf) G_ts.nav_buf = SP_NULLPTR;
+}
+
+static bool ts_point_before(TSPoint a, TSPoint b) {
+    return a.row < b.row || (a.row == b.row && a.column < b.column);
+}
+
+static void ts_outline_free(buffer_t *buf) {
+    ts_outline_t *o = buf->ts_outline;
+    if (!o) return;
+    for (u32 i = 0; i < o->count; i++) {
+        sp_free(o->entries[i].name);
     }
+    if (o->entries) sp_free(o->entries);
+    sp_free(o);
+    buf->ts_outline = SP_NULLPTR;
 }
 
-static sp_str_t ts_buffer_text(buffer_t *buf) {
-    sp_io_writer_t writer = sp_io_writer_from_dyn_mem();
-    sp_str_builder_t b = sp_str_builder_from_writer(&writer);
-    for (u32 i = 0; i < buf->line_count; i++) {
-        sp_str_builder_append(&b, buf->lines[i].text);
-        if (i + 1 < buf->line_count) sp_str_builder_append_c8(&b, '\n');
+// Add rows [from, to) to the ones the outline must extract again
+static void ts_outline_dirty(buffer_t *buf, u32 from, u32 to) {
+    ts_outline_t *o = buf->ts_outline;
+    if (!o || from >= to) return;
+    if (o->dirty_lo >= o->dirty_hi) {
+        o->dirty_lo = from;
+        o->dirty_hi = to;
+        return;
     }
-    return sp_str_builder_to_str(&b);
+    if (from < o->dirty_lo) o->dirty_lo = from;
+    if (to > o->dirty_hi) o->dirty_hi = to;
+}
+
+// Where a point ends up after edit: points past the replaced text move
+// with it and points inside it collapse to its start
+static TSPoint ts_edit_point(TSPoint p, const buffer_edit_t *edit) {
+    TSPoint start = { edit->start_row, edit->start_col };
+    TSPoint old_end = { edit->old_end_row, edit->old_end_col };
+    if (ts_point_before(p, start)) return p;
+    if (ts_point_before(p, old_end)) return start;
+    if (p.row == old_end.row) p.column = edit->new_end_col + (p.column - old_end.column);
+    p.row = p.row - old_end.row + edit->new_end_row;
+    return p;
+}
+
+// Keep the outline's positions in step with an edit, and have the rows
+// it touched extracted again
+static void ts_outline_edit(buffer_t *buf, const buffer_edit_t *edit) {
+    ts_outline_t *o = buf->ts_outline;
+    if (!o) return;
+    for (u32 i = 0; i < o->count; i++) {
+        ts_outline_entry_t *e = &o->entries[i];
+        e->start = ts_edit_point(e->start, edit);
+        e->end = ts_edit_point(e->end, edit);
+        e->at = ts_edit_point(e->at, edit);
+    }
+    // Dirty rows move the same way; the edited rows are dirty anyway
+    if (o->dirty_lo < o->dirty_hi) {
+        if (o->dirty_lo > edit->old_end_row) {
+            o->dirty_lo = o->dirty_lo - edit->old_end_row + edit->new_end_row;
+        } else if (o->dirty_lo > edit->start_row) {
+            o->dirty_lo = edit->start_row;
+        }
+        if (o->dirty_hi > edit->old_end_row) {
+            if (o->dirty_hi != UINT32_MAX) o->dirty_hi = o->dirty_hi - edit->old_end_row + edit->new_end_row;
+        } else if (o->dirty_hi > edit->start_row) {
+            o->dirty_hi = edit->start_row + 1;
+        }
+    }
+    ts_outline_dirty(buf, edit->start_row, edit->new_end_row + 1);
+}
+
+// A reparse turned old into tree: rows whose syntax changed are redone
+// by the highlighter and the outline
+static void ts_note_changes(buffer_t *buf, TSTree *old, TSTree *tree) {
+    u32 count = 0;
+    TSRange *ranges = ts_tree_get_changed_ranges(old, tree, &count);
+    ts_mark_changed(buf, ranges, count);
+    ts_mark_errors(buf, old);
+    ts_mark_errors(buf, tree);
+    for (u32 i = 0; i < count; i++) {
+        ts_outline_dirty(buf, ranges[i].start_point.row, ranges[i].end_point.row + 1);
+    }
+    if (ranges) free(ranges);
+}
+
+// The rest of a line's text from column, or the line break that follows
+// it when more lines come after
+static const c8 *ts_read_line(sp_str_t text, bool more, u32 column, u32 *bytes_read) {
+    static const c8 newline = '\n';
+    if (column < text.len) {
+        *bytes_read = text.len - column;
+        return text.data + column;
+    }
+    *bytes_read = more ? 1 : 0;
+    return &newline;
+}
+
+// TSInput reader over the buffer's lines. The parser asks for text by
+// position, so each call hands back the rest of one line straight from
+// its storage, or the line break that follows it; nothing is copied.
+static const c8 *ts_read_lines(void *payload, u32 byte_index, TSPoint position, u32 *bytes_read) {
+    buffer_t *buf = payload;
+    (void)byte_index;
+
+    *bytes_read = 0;
+    if (position.row >= buf->line_count) return "";
+    return ts_read_line(buffer_get_line(buf, position.row), position.row + 1 < buf->line_count,
+                        position.column, bytes_read);
+}
+
+// The same over a snapshot's line views, for the worker thread
+static const c8 *ts_read_snapshot(void *payload, u32 byte_index, TSPoint position, u32 *bytes_read) {
+    const buffer_snapshot_t *snap = payload;
+    (void)byte_index;
+
+    *bytes_read = 0;
+    if (position.row >= snap->line_count) return "";
+    return ts_read_line(snap->lines[position.row], position.row + 1 < snap->line_count,
+                        position.column, bytes_read);
+}
+
+static bool ts_over_budget(TSParseState *state) {
+    return sp_tm_read_timer(state->payload) > TS_SYNC_BUDGET_NS;
+}
+
+static bool ts_job_cancelled(TSParseState *state) {
+    ts_job_t *job = state->payload;
+    return sp_atomic_s32_get(&job->cancel) != 0;
+}
+
+static s32 ts_job_main(void *userdata) {
+    ts_job_t *job = userdata;
+    TSInput input = {
+        .payload = &job->snap,
+        .read = ts_read_snapshot,
+        .encoding = TSInputEncodingUTF8,
+    };
+    TSParseOptions options = { .payload = job, .progress_callback = ts_job_cancelled };
+    job->tree = ts_parser_parse_with_options(job->parser, job->old, input, options);
+    // A cancelled parser would pick up where it stopped on the next job
+    if (!job->tree) ts_parser_reset(job->parser);
+    job->parse_ns = sp_tm_read_timer(&job->timer);
+
+    sp_atomic_s32_set(&job->done, 1);
+    return 0;
+}
+
+// Parse a snapshot of buf in the background, starting from a copy of its
+// edited tree. treesitter_poll installs the result if buf has not moved on.
+static bool ts_job_start(buffer_t *buf) {
+    ts_job_t *job = &G_ts_job;
+    job->parser = ts_grammar_parser(G_ts.active, &G_ts.active->job_parser);
+    if (!job->parser) return false;
+    if (!buffer_snapshot_begin(buf, &job->snap)) return false;
+
+    job->buf = buf;
+    job->bytes = buffer_byte_count(buf);
+    job->last_col = buf->line_count > 0 ? buffer_get_line(buf, buf->line_count - 1).len : 0;
+    job->old = buf->ts_tree ? ts_tree_copy(buf->ts_tree) : SP_NULLPTR;
+    job->tree = SP_NULLPTR;
+    sp_atomic_s32_set(&job->cancel, 0);
+    sp_atomic_s32_set(&job->done, 0);
+    job->timer = sp_tm_start_timer();
+    job->active = true;
+    sp_thread_init(&job->thread, ts_job_main, job);
+    return true;
+}
+
+static void ts_job_finish(ts_job_t *job) {
+    sp_thread_join(&job->thread);
+    buffer_t *buf = job->buf;
+    TSTree *tree = job->tree;
+
+    // Rows materialized since the snapshot leave the text it parsed
+    // untouched, so the tree only needs them appended
+    bool current = tree && !sp_atomic_s32_get(&job->cancel) &&
+                   buf->version == job->snap.version && buf->line_count >= job->snap.line_count;
+    if (current) {
+        // The outline only has to follow what changed, unless this was a
+        // parse from scratch
+        if (job->old && buf->ts_tree) {
+            ts_note_changes(buf, job->old, tree);
+            ts_nav_forget(buf);
+            ts_tree_delete(buf->ts_tree);
+        } else {
+            treesitter_buffer_release(buf);
+        }
+        buf->ts_tree = tree;
+        buf->ts_stale = false;
+
+        u32 n = buf->line_count;
+        if (n > job->snap.line_count) {
+            buffer_edit_t edit = {
+                .start_byte = job->bytes,
+                .old_end_byte = job->bytes,
+                .new_end_byte = buffer_byte_count(buf),
+                .start_row = job->snap.line_count > 0 ? job->snap.line_count - 1 : 0,
+                .start_col = job->last_col,
+                .new_end_row = n - 1,
+                .new_end_col = buffer_get_line(buf, n - 1).len,
+            };
+            edit.old_end_row = edit.start_row;
+            edit.old_end_col = edit.start_col;
+            treesitter_buffer_edit(buf, &edit);
+        }
+
+        G_ts.parse_ns = job->parse_ns;
+        G_ts.parse_incremental = job->old != SP_NULLPTR;
+        G_ts.parse_background = true;
+        ts_set_status("parsed %s in background (%.1f ms)", G_ts.active->name, (f64)job->parse_ns / 1e6);
+    } else if (tree) {
+        ts_tree_delete(tree);
+    }
+
+    if (job->old) ts_tree_delete(job->old);
+    job->old = SP_NULLPTR;
+    job->tree = SP_NULLPTR;
+    buffer_snapshot_end(buf, &job->snap);
+    job->active = false;
+}
+
+// Land a finished background parse, and cancel one the buffer has moved
+// on from. Called from the main loop.
+void treesitter_poll(void) {
+    ts_job_t *job = &G_ts_job;
+    if (!job->active) return;
+    if (job->buf->version != job->snap.version) sp_atomic_s32_set(&job->cancel, 1);
+    if (sp_atomic_s32_get(&job->done)) ts_job_finish(job);
+}
+
+// Stop the background parse, if any, and wait for it to let go of the
+// buffer
+void treesitter_cancel(void) {
+    ts_job_t *job = &G_ts_job;
+    if (!job->active) return;
+    sp_atomic_s32_set(&job->cancel, 1);
+    ts_job_finish(job);
+}
+
+static bool ts_parse_pending(const buffer_t *buf) {
+    return G_ts_job.active && G_ts_job.buf == buf;
+}
+
+// Bring buf's tree up to date with its text. A tree that edits have been
+// applied to is reparsed incrementally, so only the edited region is
+// lexed again. Unless told to wait, a parse that overruns its budget is
+// handed to the background and buf keeps its old tree meanwhile.
+static bool ts_sync_tree(buffer_t *buf, bool wait) {
+    ts_job_t *job = &G_ts_job;
+    bool overran = false;
+    if (job->active) {
+        if (job->buf != buf || job->buf->version != job->snap.version) sp_atomic_s32_set(&job->cancel, 1);
+        bool settled = sp_atomic_s32_get(&job->done) || sp_atomic_s32_get(&job->cancel);
+        if (!wait && !settled) return false;
+        overran = job->buf == buf;
+        ts_job_finish(job);
+    }
+
+    ts_grammar_t *g = G_ts.active;
+    if (buf->ts_tree && ts_tree_language(buf->ts_tree) != g->lang) {
+        treesitter_buffer_release(buf);
+    }
+    if (buf->ts_tree && !buf->ts_stale) return true;
+
+    TSParser *parser = ts_grammar_parser(g, &g->parser);
+    if (!parser) {
+        ts_set_status("failed to set %s grammar", g->name);
+        return false;
+    }
+
+    // The runtime counts bytes in 32 bits
+    if (buffer_byte_count(buf) >= UINT32_MAX) {
+        ts_set_status("buffer too large for %s parser", g->name);
+        return false;
+    }
+
+    sp_tm_timer_t timer = sp_tm_start_timer();
+    TSInput input = {
+        .payload = buf,
+        .read = ts_read_lines,
+        .encoding = TSInputEncodingUTF8,
+    };
+    TSTree *old = buf->ts_tree;
+    // Without a tree to reuse, a parse that overran before will again
+    if (!wait && !old && overran && ts_job_start(buf)) {
+        ts_set_status("parsing %s in background", g->name);
+        return false;
+    }
+    TSParseOptions options = { .payload = &timer, .progress_callback = wait ? SP_NULLPTR : ts_over_budget };
+    TSTree *tree = ts_parser_parse_with_options(parser, old, input, options);
+    if (!tree && !wait) {
+        ts_parser_reset(parser);
+        if (ts_job_start(buf)) {
+            ts_set_status("parsing %s in background", g->name);
+            return false;
+        }
+    }
+    if (!tree) {
+        ts_set_status("parse failed (%s)", g->name);
+        return false;
+    }
+
+    if (old) {
+        ts_note_changes(buf, old, tree);
+        ts_tree_delete(old);
+    }
+    ts_nav_forget(buf);
+    buf->ts_tree = tree;
+    buf->ts_stale = false;
+    G_ts.parse_ns = sp_tm_read_timer(&timer);
+    G_ts.parse_incremental = old != SP_NULLPTR;
+    G_ts.parse_background = false;
+    return true;
+}
+
+// Apply an edit of buf's text to its tree, so the next parse can reuse
+// everything the edit did not touch.
+void treesitter_buffer_edit(buffer_t *buf, const buffer_edit_t *edit) {
+    if (!buf->ts_tree) return;
+
+    // The runtime counts bytes in 32 bits
+    if (edit->old_end_byte > UINT32_MAX || edit->new_end_byte > UINT32_MAX) {
+        treesitter_buffer_release(buf);
+        return;
+    }
+
+    TSInputEdit input = {
+        .start_byte = (u32)edit->start_byte,
+        .old_end_byte = (u32)edit->old_end_byte,
+        .new_end_byte = (u32)edit->new_end_byte,
+        .start_point = { edit->start_row, edit->start_col },
+        .old_end_point = { edit->old_end_row, edit->old_end_col },
+        .new_end_point = { edit->new_end_row, edit->new_end_col },
+    };
+    ts_tree_edit(buf->ts_tree, &input);
+    buf->ts_stale = true;
+    ts_nav_forget(buf);
+    ts_outline_edit(buf, edit);
+}
+
+void treesitter_buffer_release(buffer_t *buf) {
+    ts_nav_forget(buf);
+    ts_outline_free(buf);
+    if (buf->ts_tree) ts_tree_delete(buf->ts_tree);
+    buf->ts_tree = SP_NULLPTR;
+    buf->ts_stale = false;
 }
 
 void treesitter_init(void) {
     G_ts.enabled = false;
     G_ts.available = false;
     G_ts.last_status = sp_str_lit("not initialized");
-    G_ts.active_lang = SP_NULLPTR;
-    G_ts.active_grammar[0] = '\0';
+    G_ts.active = SP_NULLPTR;
 
-    G_ts.parser = ts_parser_new();
-    if (!G_ts.parser) {
-        ts_set_status("failed to create parser");
-        return;
+    if (!G_ts_grammar_lock_ready) {
+        sp_mutex_init(&G_ts_grammar_lock, SP_MUTEX_PLAIN);
+        G_ts_grammar_lock_ready = true;
     }
 
-    G_ts.available = true;
-    ts_set_status("built-in runtime ready (c grammar)");
+    // Parsers are made per grammar on first use
+    G_ts.available = TS_GRAMMAR_COUNT > 0;
+    if (!G_ts.available) {
+        ts_set_status("no built-in grammars");
+        return;
+    }
+    ts_set_status("built-in runtime ready (%u grammar%s)", (u32)TS_GRAMMAR_COUNT, TS_GRAMMAR_COUNT == 1 ? "" : "s");
     atexit(ts_shutdown);
 }
 
@@ -242,72 +1199,257 @@ sp_str_t treesitter_status(void) {
     if (!G_ts.enabled) {
         return sp_format("available, disabled ({})", SP_FMT_STR(G_ts.last_status));
     }
-    if (G_ts.active_grammar[0] == '\0') {
+    if (!G_ts.active) {
         return sp_format("enabled, no grammar ({})", SP_FMT_STR(G_ts.last_status));
     }
-    return sp_format("enabled [{}] ({})", SP_FMT_CSTR(G_ts.active_grammar), SP_FMT_STR(G_ts.last_status));
+    return sp_format("enabled [{}] ({})", SP_FMT_CSTR(G_ts.active->name), SP_FMT_STR(G_ts.last_status));
 }
 
-bool treesitter_highlight_buffer(buffer_t *buf) {
+static bool ts_row_needs_highlight(const line_t *line) {
+    return line->hl_dirty || !line->highlighted;
+}
+
+// Highlight rows [first, last). Edits reparse incrementally; only rows
+// that were edited, whose syntax changed or that just came into view are
+// walked again.
+bool treesitter_highlight_buffer(buffer_t *buf, u32 first, u32 last) {
     if (!buf || !treesitter_is_enabled()) return false;
     if (!ts_select_language_for_buffer(buf)) return false;
+    if (last > buf->line_count) last = buf->line_count;
+    if (first > last) first = last;
 
-    if (!ts_parser_set_language(G_ts.parser, G_ts.active_lang)) {
-        ts_set_status("failed to set %s grammar", G_ts.active_grammar);
-        return false;
+    // hl_lang is cleared while tree-sitter owns the highlight, so runs the
+    // lexer left behind are redone along with everything a new tree covers
+    bool full = !buf->ts_tree || ts_tree_language(buf->ts_tree) != G_ts.active->lang || buf->hl_lang;
+    bool stale = buf->ts_stale;
+    // While a parse runs in the background, the edited tree stands in for
+    // the new one; without a tree the lexer highlights instead
+    bool settled = ts_sync_tree(buf, false);
+    if (!settled && !(ts_parse_pending(buf) && buf->ts_tree)) return false;
+    // These runs carry no lexer end states
+    buf->hl_from = UINT32_MAX;
+    buf->hl_lang = SP_NULLPTR;
+
+    ts_highlights_t *hl = ts_highlights_for(&G_ts.active->highlights, G_ts.active->lang);
+    const ts_symbol_table_t *symbols = ts_active_symbols();
+    if (!hl || !symbols) return false;
+
+    TSNode root = ts_tree_root_node(buf->ts_tree);
+    u32 redone = 0;
+    for (u32 row = first; row < last;) {
+        if (!full && !ts_row_needs_highlight(buffer_line(buf, row))) {
+            row++;
+            continue;
+        }
+        u32 end = row + 1;
+        while (end < last && (full || ts_row_needs_highlight(buffer_line(buf, end)))) end++;
+
+        if (!ts_prepare_highlight_kinds(buf, row, end)) {
+            ts_set_status("out of memory");
+            return false;
+        }
+        G_ts.hl_first = row;
+        G_ts.hl_last = end;
+        if (!ts_query_highlight(buf, symbols, hl, root, row, end)) {
+            ts_set_status("out of memory");
+            return false;
+        }
+        ts_store_highlight(buf, row, end, settled);
+        redone += end - row;
+        row = end;
     }
+    buffer_keep_highlight(buf, first, last);
 
-    sp_str_t text = ts_buffer_text(buf);
-    TSTree *tree = ts_parser_parse_string(G_ts.parser, SP_NULLPTR, text.data, text.len);
-    if (!tree) {
-        ts_set_status("parse failed (%s)", G_ts.active_grammar);
-        return false;
+    if (settled && (stale || full)) {
+        ts_set_status("highlighted %s (rows %u-%u of %u, %u redone, %s parse %.0f us%s)",
+                      G_ts.active->name, first + 1, last, buf->line_count, redone,
+                      G_ts.parse_incremental ? "incremental" : "full",
+                      (f64)G_ts.parse_ns / 1e3, G_ts.parse_background ? " in background" : "");
     }
+    return true;
+}
 
-    ts_prepare_highlight_arrays(buf);
 
-    if (strcmp(G_ts.active_grammar, "c") == 0) {
-        TSNode root = ts_tree_root_node(tree);
-        ts_walk_and_highlight_c(buf, root);
+// Bring buf's tree up to date for a command, waiting for the parse
+static bool ts_tree_ready(buffer_t *buf, sp_str_t *summary) {
+    if (!buf || !treesitter_is_enabled()) {
+        if (summary) *summary = sp_str_lit("tree-sitter disabled");
+        return false;
+    }
+    if (!ts_select_language_for_buffer(buf)) {
+        if (summary) *summary = sp_format("no grammar ({})", SP_FMT_STR(G_ts.last_status));
+        return false;
+    }
+    if (!ts_sync_tree(buf, true)) {
+        if (summary) *summary = sp_format("no tree ({})", SP_FMT_STR(G_ts.last_status));
+        return false;
     }
-
-    ts_tree_delete(tree);
-    ts_set_status("highlighted %s (%u lines)", G_ts.active_grammar, buf->line_count);
     return true;
 }
 
-sp_str_t treesitter_describe_cursor(buffer_t *buf, u32 row, u32 col) {
-    if (!buf) return sp_str_lit("no buffer");
-    if (!treesitter_is_enabled()) return sp_str_lit("tree-sitter disabled");
-    if (!ts_select_language_for_buffer(buf)) return sp_format("no grammar ({})", SP_FMT_STR(G_ts.last_status));
+// Whether two trees have the same nodes over the same text. Error
+// recovery may settle the children of a node that holds an error
+// differently when it starts from an edited tree, so where the trees part
+// under such a node on both sides, the rest of that node is let go.
+static bool ts_same_tree(TSNode a, TSNode b) {
+    TSTreeCursor ca = ts_tree_cursor_new(a);
+    TSTreeCursor cb = ts_tree_cursor_new(b);
+    bool same = true;
+    while (same) {
+        TSNode x = ts_tree_cursor_current_node(&ca);
+        TSNode y = ts_tree_cursor_current_node(&cb);
+        TSPoint xs = ts_node_start_point(x), ys = ts_node_start_point(y);
+        TSPoint xe = ts_node_end_point(x), ye = ts_node_end_point(y);
+        bool match = ts_node_symbol(x) == ts_node_symbol(y) && ts_node_start_byte(x) == ts_node_start_byte(y) &&
+                     ts_node_end_byte(x) == ts_node_end_byte(y) && xs.row == ys.row && xs.column == ys.column &&
+                     xe.row == ye.row && xe.column == ye.column;
+        if (match) {
+            bool down_a = ts_tree_cursor_goto_first_child(&ca);
+            bool down_b = ts_tree_cursor_goto_first_child(&cb);
+            if (down_a && down_b) continue;
+            if (down_a) ts_tree_cursor_goto_parent(&ca);
+            if (down_b) ts_tree_cursor_goto_parent(&cb);
+            match = down_a == down_b;
+        }
+        if (!match) {
+            bool up_a = ts_tree_cursor_goto_parent(&ca);
+            bool up_b = ts_tree_cursor_goto_parent(&cb);
+            same = up_a && up_b && ts_node_has_error(ts_tree_cursor_current_node(&ca)) &&
+                   ts_node_has_error(ts_tree_cursor_current_node(&cb));
+        }
+        // Next sibling, climbing until there is one; done at the root
+        bool up = true;
+        while (same) {
+            bool next_a = ts_tree_cursor_goto_next_sibling(&ca);
+            bool next_b = ts_tree_cursor_goto_next_sibling(&cb);
+            if (next_a != next_b) same = false;
+            if (next_a || !same) break;
+            up = ts_tree_cursor_goto_parent(&ca) && ts_tree_cursor_goto_parent(&cb);
+            if (!up) break;
+        }
+        if (!up) break;
+    }
+    ts_tree_cursor_delete(&ca);
+    ts_tree_cursor_delete(&cb);
+    return same;
+}
 
-    if (!ts_parser_set_language(G_ts.parser, G_ts.active_lang)) {
-        return sp_format("grammar error ({})", SP_FMT_CSTR(G_ts.active_grammar));
+// For --reparse-check: bring buf's tree up to date the way the display
+// does after an edit, waiting for the parse, and tell whether the tree is
+// the one a parse of the text from scratch gives. *changed gets the rows
+// the reparse left for the highlighter to redo.
+bool treesitter_check_reparse(buffer_t *buf, u32 *changed) {
+    if (!ts_tree_ready(buf, SP_NULLPTR)) return false;
+    if (changed) {
+        *changed = 0;
+        for (u32 row = 0; row < buf->line_count; row++) {
+            if (ts_row_needs_highlight(buffer_line(buf, row))) (*changed)++;
+        }
     }
 
-    sp_str_t text = ts_buffer_text(buf);
-    TSTree *tree = ts_parser_parse_string(G_ts.parser, SP_NULLPTR, text.data, text.len);
-    if (!tree) {
-        return sp_format("parse failed ({})", SP_FMT_CSTR(G_ts.active_grammar));
+    TSParser *parser = ts_grammar_parser(G_ts.active, &G_ts.active->parser);
+    if (!parser) return false;
+    TSInput input = {
+        .payload = buf,
+        .read = ts_read_lines,
+        .encoding = TSInputEncodingUTF8,
+    };
+    TSTree *fresh = ts_parser_parse(parser, SP_NULLPTR, input);
+    if (!fresh) return false;
+
+    bool same = ts_same_tree(ts_tree_root_node(buf->ts_tree), ts_tree_root_node(fresh));
+    ts_tree_delete(fresh);
+    return same;
+}
+
+// Walk the nav cursor from the root down to the smallest node that holds
+// point, the smallest named one when named is set. Only the nodes on the
+// way down are visited.
+static void ts_nav_descend(TSTreeCursor *cursor, TSPoint point, bool named) {
+    while (ts_tree_cursor_goto_first_child_for_point(cursor, point) >= 0) {
+        // The first child ending after point may also start after it
+        if (ts_point_before(point, ts_node_start_point(ts_tree_cursor_current_node(cursor)))) {
+            ts_tree_cursor_goto_parent(cursor);
+            break;
+        }
+    }
+    while (named && !ts_node_is_named(ts_tree_cursor_current_node(cursor))) {
+        if (!ts_tree_cursor_goto_parent(cursor)) break;
     }
+}
 
-    TSPoint point = { .row = row, .column = col };
-    TSNode root = ts_tree_root_node(tree);
-    TSNode node = ts_node_descendant_for_point_range(root, point, point);
-    if (ts_node_is_null(node)) {
-        ts_tree_delete(tree);
-        return sp_str_lit("no node at cursor");
+// Bring buf's tree up to date and put the nav cursor on the node at
+// (row, col). If the editor cursor is where the last structural command
+// left it, the cursor stays on that command's node instead, so chains of
+// moves never search the tree again; resumed tells which happened.
+static bool ts_nav_locate(buffer_t *buf, u32 row, u32 col, bool named, bool *resumed, sp_str_t *summary) {
+    if (resumed) *resumed = false;
+    if (!ts_tree_ready(buf, summary)) return false;
+
+    if (G_ts.nav_buf == buf && G_ts.nav_row == row && G_ts.nav_col == col) {
+        if (resumed) *resumed = true;
+        return true;
     }
 
+    TSNode root = ts_tree_root_node(buf->ts_tree);
+    if (!G_ts.nav_ready) {
+        G_ts.nav = ts_tree_cursor_new(root);
+        G_ts.nav_probe = ts_tree_cursor_new(root);
+        G_ts.nav_ready = true;
+    } else {
+        ts_tree_cursor_reset(&G_ts.nav, root);
+    }
+    TSPoint point = { .row = row, .column = col };
+    ts_nav_descend(&G_ts.nav, point, named);
+    G_ts.nav_buf = buf;
+    G_ts.nav_row = row;
+    G_ts.nav_col = col;
+    G_ts.nav_selected = false;
+    G_ts.nav_origin = point;
+    return true;
+}
+
+// The editor cursor was left at (row, col) on the nav cursor's node,
+// which is now selected or not
+static void ts_nav_leave(u32 row, u32 col, bool selected) {
+    G_ts.nav_row = row;
+    G_ts.nav_col = col;
+    G_ts.nav_selected = selected;
+}
+
+static sp_str_t ts_node_summary(const c8 *action, TSNode node) {
     const c8 *type = ts_node_type(node);
     TSPoint start = ts_node_start_point(node);
     TSPoint end = ts_node_end_point(node);
-    TSNode parent = ts_node_parent(node);
-    const c8 *parent_type = ts_node_is_null(parent) ? "root" : ts_node_type(parent);
+    return sp_format("{}{}{} [{}:{}-{}:{}]",
+                     SP_FMT_CSTR(action ? action : ""),
+                     SP_FMT_CSTR(action ? " " : ""),
+                     SP_FMT_CSTR(type ? type : "unknown"),
+                     SP_FMT_U32(start.row + 1),
+                     SP_FMT_U32(start.column + 1),
+                     SP_FMT_U32(end.row + 1),
+                     SP_FMT_U32(end.column + 1));
+}
+
+sp_str_t treesitter_describe_cursor(buffer_t *buf, u32 row, u32 col) {
+    sp_str_t summary = sp_str_lit("no buffer");
+    if (!buf) return summary;
+    if (!ts_nav_locate(buf, row, col, false, SP_NULLPTR, &summary)) return summary;
+
+    TSNode node = ts_tree_cursor_current_node(&G_ts.nav);
+    TSPoint start = ts_node_start_point(node);
+    TSPoint end = ts_node_end_point(node);
+    const c8 *type = ts_node_type(node);
+
+    ts_tree_cursor_reset_to(&G_ts.nav_probe, &G_ts.nav);
+    const c8 *parent_type = "root";
+    if (ts_tree_cursor_goto_parent(&G_ts.nav_probe)) {
+        parent_type = ts_node_type(ts_tree_cursor_current_node(&G_ts.nav_probe));
+    }
 
     sp_str_t out = sp_format(
         "{}:{}:{} {} [{}:{}-{}:{}] parent:{}",
-        SP_FMT_CSTR(G_ts.active_grammar),
+        SP_FMT_CSTR(G_ts.active->name),
         SP_FMT_U32(row + 1),
         SP_FMT_U32(col + 1),
         SP_FMT_CSTR(type ? type : "unknown"),
@@ -316,61 +1458,81 @@ sp_str_t treesitter_describe_cursor(buffer_t *buf, u32 row, u32 col) {
         SP_FMT_U32(end.row + 1),
         SP_FMT_U32(end.column + 1),
         SP_FMT_CSTR(parent_type ? parent_type : "root"));
-
-    ts_tree_delete(tree);
     return out;
 }
 
+static void ts_report_range(TSNode node, u32 *start_row, u32 *start_col, u32 *end_row, u32 *end_col) {
+    TSPoint start = ts_node_start_point(node);
+    TSPoint end = ts_node_end_point(node);
+    if (start_row) *start_row = start.row;
+    if (start_col) *start_col = start.column;
+    if (end_row) *end_row = end.row;
+    if (end_col) *end_col = end.column;
+    // Selections leave the editor cursor on the end of the node
+    ts_nav_leave(end.row, end.column, true);
+}
+
 bool treesitter_node_range_at_cursor(buffer_t *buf, u32 row, u32 col,
                                      u32 *start_row, u32 *start_col,
                                      u32 *end_row, u32 *end_col,
                                      sp_str_t *summary) {
-    if (!buf || !treesitter_is_enabled()) {
-        if (summary) *summary = sp_str_lit("tree-sitter disabled");
-        return false;
-    }
-    if (!ts_select_language_for_buffer(buf)) {
-        if (summary) *summary = sp_format("no grammar ({})", SP_FMT_STR(G_ts.last_status));
-        return false;
-    }
-    if (!ts_parser_set_language(G_ts.parser, G_ts.active_lang)) {
-        if (summary) *summary = sp_format("grammar error ({})", SP_FMT_CSTR(G_ts.active_grammar));
-        return false;
-    }
+    if (!ts_nav_locate(buf, row, col, false, SP_NULLPTR, summary)) return false;
 
-    sp_str_t text = ts_buffer_text(buf);
-    TSTree *tree = ts_parser_parse_string(G_ts.parser, SP_NULLPTR, text.data, text.len);
-    if (!tree) {
-        if (summary) *summary = sp_format("parse failed ({})", SP_FMT_CSTR(G_ts.active_grammar));
-        return false;
-    }
+    TSNode node = ts_tree_cursor_current_node(&G_ts.nav);
+    ts_report_range(node, start_row, start_col, end_row, end_col);
+    if (summary) *summary = ts_node_summary(SP_NULLPTR, node);
+    return true;
+}
 
-    TSPoint point = { .row = row, .column = col };
-    TSNode root = ts_tree_root_node(tree);
-    TSNode node = ts_node_descendant_for_point_range(root, point, point);
-    if (ts_node_is_null(node)) {
-        ts_tree_delete(tree);
-        if (summary) *summary = sp_str_lit("no node at cursor");
-        return false;
-    }
+static bool ts_same_range(TSNode a, TSNode b) {
+    return ts_node_start_byte(a) == ts_node_start_byte(b) && ts_node_end_byte(a) == ts_node_end_byte(b);
+}
 
-    TSPoint start = ts_node_start_point(node);
-    TSPoint end = ts_node_end_point(node);
-    if (start_row) *start_row = start.row;
-    if (start_col) *start_col = start.column;
-    if (end_row) *end_row = end.row;
-    if (end_col) *end_col = end.column;
-    if (summary) {
-        const c8 *type = ts_node_type(node);
-        *summary = sp_format("{} [{}:{}-{}:{}]",
-                             SP_FMT_CSTR(type ? type : "unknown"),
-                             SP_FMT_U32(start.row + 1),
-                             SP_FMT_U32(start.column + 1),
-                             SP_FMT_U32(end.row + 1),
-                             SP_FMT_U32(end.column + 1));
+// Grow the selection to the nearest enclosing node that covers more text,
+// or shrink it back to the child holding the point it grew from. The first
+// call selects the named node at the cursor.
+bool treesitter_resize_selection(buffer_t *buf, u32 row, u32 col, bool expand,
+                                 u32 *start_row, u32 *start_col,
+                                 u32 *end_row, u32 *end_col,
+                                 sp_str_t *summary) {
+    bool resume = false;
+    if (!ts_nav_locate(buf, row, col, true, &resume, summary)) return false;
+    resume = resume && G_ts.nav_selected;
+
+    TSTreeCursor *cursor = &G_ts.nav;
+    TSNode node = ts_tree_cursor_current_node(cursor);
+    const c8 *action = "select";
+    if (resume && expand) {
+        TSNode from = node;
+        while (ts_same_range(node, from) && ts_tree_cursor_goto_parent(cursor)) {
+            node = ts_tree_cursor_current_node(cursor);
+        }
+        if (ts_same_range(node, from)) {
+            if (summary) *summary = sp_format("no node around {}", SP_FMT_CSTR(ts_node_type(from)));
+            return false;
+        }
+        action = "expand";
+    } else if (resume) {
+        TSNode from = node;
+        ts_tree_cursor_reset_to(&G_ts.nav_probe, cursor);
+        while (ts_tree_cursor_goto_first_child_for_point(&G_ts.nav_probe, G_ts.nav_origin) >= 0) {
+            TSNode child = ts_tree_cursor_current_node(&G_ts.nav_probe);
+            if (ts_point_before(G_ts.nav_origin, ts_node_start_point(child))) break;
+            if (ts_node_is_named(child) && !ts_same_range(child, from)) {
+                ts_tree_cursor_reset_to(cursor, &G_ts.nav_probe);
+                node = child;
+                break;
+            }
+        }
+        if (ts_same_range(node, from)) {
+            if (summary) *summary = sp_format("no node inside {}", SP_FMT_CSTR(ts_node_type(from)));
+            return false;
+        }
+        action = "shrink";
     }
 
-    ts_tree_delete(tree);
+    ts_report_range(node, start_row, start_col, end_row, end_col);
+    if (summary) *summary = ts_node_summary(action, node);
     return true;
 }
 
@@ -378,63 +1540,40 @@ bool treesitter_nav_at_cursor(buffer_t *buf, u32 row, u32 col,
                               treesitter_nav_kind_t kind,
                               u32 *target_row, u32 *target_col,
                               sp_str_t *summary) {
-    if (!buf || !treesitter_is_enabled()) {
-        if (summary) *summary = sp_str_lit("tree-sitter disabled");
-        return false;
-    }
-    if (!ts_select_language_for_buffer(buf)) {
-        if (summary) *summary = sp_format("no grammar ({})", SP_FMT_STR(G_ts.last_status));
-        return false;
-    }
-    if (!ts_parser_set_language(G_ts.parser, G_ts.active_lang)) {
-        if (summary) *summary = sp_format("grammar error ({})", SP_FMT_CSTR(G_ts.active_grammar));
-        return false;
-    }
+    if (!ts_nav_locate(buf, row, col, true, SP_NULLPTR, summary)) return false;
 
-    sp_str_t text = ts_buffer_text(buf);
-    TSTree *tree = ts_parser_parse_string(G_ts.parser, SP_NULLPTR, text.data, text.len);
-    if (!tree) {
-        if (summary) *summary = sp_format("parse failed ({})", SP_FMT_CSTR(G_ts.active_grammar));
-        return false;
-    }
-
-    TSPoint point = { .row = row, .column = col };
-    TSNode root = ts_tree_root_node(tree);
-    TSNode node = ts_node_named_descendant_for_point_range(root, point, point);
-    if (ts_node_is_null(node)) {
-        node = ts_node_descendant_for_point_range(root, point, point);
-    }
-    if (ts_node_is_null(node)) {
-        ts_tree_delete(tree);
-        if (summary) *summary = sp_str_lit("no node at cursor");
-        return false;
-    }
-
-    TSNode target = node;
+    TSTreeCursor *cursor = &G_ts.nav;
+    TSTreeCursor *probe = &G_ts.nav_probe;
+    TSNode node = ts_tree_cursor_current_node(cursor);
     const c8 *action = "node";
+    bool moved = false;
     switch (kind) {
         case TREE_NAV_PARENT:
-            target = ts_node_parent(node);
             action = "parent";
+            moved = ts_tree_cursor_goto_parent(cursor);
             break;
         case TREE_NAV_PREV_SIBLING:
-            target = ts_node_prev_named_sibling(node);
-            action = "prev";
-            if (ts_node_is_null(target)) {
-                target = ts_node_prev_sibling(node);
+        case TREE_NAV_NEXT_SIBLING: {
+            // The nearest named sibling, else the nearest sibling at all
+            bool next = kind == TREE_NAV_NEXT_SIBLING;
+            action = next ? "next" : "prev";
+            ts_tree_cursor_reset_to(probe, cursor);
+            while (next ? ts_tree_cursor_goto_next_sibling(probe) : ts_tree_cursor_goto_previous_sibling(probe)) {
+                if (ts_node_is_named(ts_tree_cursor_current_node(probe))) {
+                    moved = true;
+                    break;
+                }
             }
-            break;
-        case TREE_NAV_NEXT_SIBLING:
-            target = ts_node_next_named_sibling(node);
-            action = "next";
-            if (ts_node_is_null(target)) {
-                target = ts_node_next_sibling(node);
+            if (moved) {
+                ts_tree_cursor_reset_to(cursor, probe);
+            } else {
+                moved = next ? ts_tree_cursor_goto_next_sibling(cursor) : ts_tree_cursor_goto_previous_sibling(cursor);
             }
             break;
+        }
     }
 
-    if (ts_node_is_null(target)) {
-        ts_tree_delete(tree);
+    if (!moved) {
         if (summary) {
             *summary = sp_format("no {} from {}", SP_FMT_CSTR(action),
                                  SP_FMT_CSTR(ts_node_type(node) ? ts_node_type(node) : "node"));
@@ -442,21 +1581,404 @@ bool treesitter_nav_at_cursor(buffer_t *buf, u32 row, u32 col,
         return false;
     }
 
+    TSNode target = ts_tree_cursor_current_node(cursor);
     TSPoint start = ts_node_start_point(target);
-    TSPoint end = ts_node_end_point(target);
     if (target_row) *target_row = start.row;
     if (target_col) *target_col = start.column;
+    ts_nav_leave(start.row, start.column, false);
+    G_ts.nav_origin = start;
+    if (summary) *summary = ts_node_summary(action, target);
+    return true;
+}
+
+// The identifier a definition is known by: its name field, or else the
+// innermost declarator, as in the function_declarator and
+// pointer_declarator around a function's or typedef's name
+static bool ts_outline_name(const ts_symbol_table_t *t, TSNode node, u8 flags, TSNode *name) {
+    if (flags & TS_OUTLINE_BODY) {
+        if (!t->body_field || ts_node_is_null(ts_node_child_by_field_id(node, t->body_field))) return false;
+    }
+    TSNode n = t->name_field ? ts_node_child_by_field_id(node, t->name_field) : (TSNode){0};
+    if (ts_node_is_null(n) && t->declarator_field) {
+        n = ts_node_child_by_field_id(node, t->declarator_field);
+        while (!ts_node_is_null(n) && ts_node_named_child_count(n) > 0) {
+            TSNode inner = ts_node_child_by_field_id(n, t->declarator_field);
+            n = ts_node_is_null(inner) ? ts_node_named_child(n, 0) : inner;
+        }
+    }
+    if (ts_node_is_null(n) || ts_node_is_missing(n)) return false;
+    *name = n;
+    return true;
+}
+
+// Definitions are handed to an emit callback as they are found
+typedef bool (*ts_outline_emit_fn)(void *ctx, outline_kind_t kind, TSNode node, TSNode name);
+
+// Copy a definition found in a buffer's tree into its outline
+static bool ts_outline_add(void *ctx, outline_kind_t kind, TSNode node, TSNode name) {
+    buffer_t *buf = ctx;
+    ts_outline_t *o = buf->ts_outline;
+    TSPoint at = ts_node_start_point(name);
+    TSPoint end = ts_node_end_point(name);
+    if (at.row != end.row || at.row >= buf->line_count) return true;
+    sp_str_t text = buffer_get_line(buf, at.row);
+    if (end.column > text.len || at.column >= end.column) return true;
+
+    if (o->count == o->cap) {
+        u32 cap = o->cap ? o->cap * 2 : 256;
+        ts_outline_entry_t *grown = sp_realloc(o->entries, sizeof(ts_outline_entry_t) * cap);
+        if (!grown) return false;
+        o->entries = grown;
+        o->cap = cap;
+    }
+    u32 len = end.column - at.column;
+    c8 *copy = sp_alloc(len + 1);
+    if (!copy) return false;
+    memcpy(copy, text.data + at.column, len);
+
+    o->entries[o->count++] = (ts_outline_entry_t){
+        .name = copy,
+        .name_len = len,
+        .kind = kind,
+        .start = ts_node_start_point(node),
+        .end = ts_node_end_point(node),
+        .at = at,
+    };
+    return true;
+}
+
+// Emit the definitions that overlap rows [first, last), walking cursor
+// from root. Only the nodes definitions can sit in are entered, from
+// their first child that reaches the rows to the last that starts in them.
+static bool ts_outline_collect(TSTreeCursor *cursor, const ts_symbol_table_t *t, u32 first, u32 last,
+                               ts_outline_emit_fn emit, void *ctx) {
+    // Children that end on row first or later
+    TSPoint from = { first > 0 ? first - 1 : 0, first > 0 ? UINT32_MAX : 0 };
+    u32 depth = 0;
+    for (;;) {
+        TSNode node = ts_tree_cursor_current_node(cursor);
+        if (ts_node_start_point(node).row >= last) {
+            if (depth == 0) return true;
+            ts_tree_cursor_goto_parent(cursor);
+            depth--;
+        } else {
+            TSSymbol sym = ts_node_symbol(node);
+            u8 flags = sym < t->symbol_count ? t->outline[sym] : TS_OUTLINE_INSIDE;
+            TSNode name;
+            if ((flags & TS_OUTLINE_LISTED) && ts_outline_name(t, node, flags, &name)) {
+                if (!emit(ctx, t->outline_kinds[sym], node, name)) return false;
+            }
+            if ((flags & TS_OUTLINE_INSIDE) && ts_tree_cursor_goto_first_child_for_point(cursor, from) >= 0) {
+                depth++;
+                continue;
+            }
+        }
+
+        while (!ts_tree_cursor_goto_next_sibling(cursor)) {
+            if (depth == 0) return true;
+            ts_tree_cursor_goto_parent(cursor);
+            depth--;
+        }
+    }
+}
+
+static s32 ts_outline_compare(const ts_outline_entry_t *a, const ts_outline_entry_t *b) {
+    u32 len = a->name_len < b->name_len ? a->name_len : b->name_len;
+    s32 c = memcmp(a->name, b->name, len);
+    if (c != 0) return c;
+    if (a->name_len != b->name_len) return a->name_len < b->name_len ? -1 : 1;
+    if (ts_point_before(a->start, b->start)) return -1;
+    return ts_point_before(b->start, a->start) ? 1 : 0;
+}
+
+static int ts_outline_qsort(const void *a, const void *b) {
+    return ts_outline_compare(a, b);
+}
+
+// Extract the dirty rows again: drop the definitions that overlap them,
+// collect the ones the tree has there now, and merge those in sorted.
+static bool ts_outline_refresh(buffer_t *buf, const ts_symbol_table_t *t, u32 *extracted) {
+    ts_outline_t *o = buf->ts_outline;
+    if (!o) {
+        o = sp_alloc(sizeof(ts_outline_t));
+        if (!o) return false;
+        o->dirty_hi = UINT32_MAX;
+        buf->ts_outline = o;
+    }
+    *extracted = 0;
+    if (o->dirty_lo >= o->dirty_hi) return true;
+    u32 first = o->dirty_lo;
+    u32 last = o->dirty_hi;
+
+    u32 kept = 0;
+    for (u32 i = 0; i < o->count; i++) {
+        ts_outline_entry_t *e = &o->entries[i];
+        if (e->start.row < last && e->end.row >= first) {
+            sp_free(e->name);
+        } else {
+            o->entries[kept++] = *e;
+        }
+    }
+    o->count = kept;
+
+    TSTreeCursor *cursor = ts_walk_cursor(ts_tree_root_node(buf->ts_tree));
+    if (!ts_outline_collect(cursor, t, first, last, ts_outline_add, buf)) {
+        ts_outline_free(buf);
+        return false;
+    }
+    u32 added = o->count - kept;
+    if (added > 1) qsort(o->entries + kept, added, sizeof(ts_outline_entry_t), ts_outline_qsort);
+    if (added > 0 && kept > 0) {
+        // Merge from the back, so only the few new entries are copied out
+        ts_outline_entry_t *fresh = sp_alloc(sizeof(ts_outline_entry_t) * added);
+        if (!fresh) {
+            ts_outline_free(buf);
+            return false;
+        }
+        memcpy(fresh, o->entries + kept, sizeof(ts_outline_entry_t) * added);
+        u32 a = kept;
+        u32 b = added;
+        u32 n = o->count;
+        while (b > 0) {
+            if (a > 0 && ts_outline_compare(&fresh[b - 1], &o->entries[a - 1]) < 0) {
+                o->entries[--n] = o->entries[--a];
+            } else {
+                o->entries[--n] = fresh[--b];
+            }
+        }
+        sp_free(fresh);
+    }
+
+    o->dirty_lo = 0;
+    o->dirty_hi = 0;
+    *extracted = added;
+    return true;
+}
+
+// Bring buf's outline up to date with its text. The whole file is loaded
+// and parsed the first time; after that only rows that edits or reparses
+// touched are looked at again.
+bool treesitter_outline_update(buffer_t *buf, u32 *count, sp_str_t *summary) {
+    if (count) *count = 0;
+    if (!buf) return false;
+    buffer_ensure_all_rows(buf);
+    if (!ts_tree_ready(buf, summary)) return false;
+    const ts_symbol_table_t *symbols = ts_active_symbols();
+    if (!symbols) {
+        if (summary) *summary = sp_str_lit("no outline rules");
+        return false;
+    }
+
+    sp_tm_timer_t timer = sp_tm_start_timer();
+    u32 extracted = 0;
+    if (!ts_outline_refresh(buf, symbols, &extracted)) {
+        if (summary) *summary = sp_str_lit("out of memory");
+        return false;
+    }
+    u32 total = buf->ts_outline->count;
+    if (count) *count = total;
     if (summary) {
-        const c8 *type = ts_node_type(target);
-        *summary = sp_format("{} {} [{}:{}-{}:{}]",
-                             SP_FMT_CSTR(action),
-                             SP_FMT_CSTR(type ? type : "unknown"),
-                             SP_FMT_U32(start.row + 1),
-                             SP_FMT_U32(start.column + 1),
-                             SP_FMT_U32(end.row + 1),
-                             SP_FMT_U32(end.column + 1));
+        *summary = sp_format("{} definitions, {} extracted in {} us",
+                             SP_FMT_U32(total), SP_FMT_U32(extracted),
+                             SP_FMT_U32((u32)(sp_tm_read_timer(&timer) / 1000)));
     }
+    return true;
+}
 
-    ts_tree_delete(tree);
+static outline_symbol_t ts_outline_symbol(const ts_outline_entry_t *e) {
+    return (outline_symbol_t){
+        .name = { .data = e->name, .len = e->name_len },
+        .kind = e->kind,
+        .row = e->at.row,
+        .col = e->at.column,
+    };
+}
+
+// Up to max definitions in document order, from the one row is in or the
+// first after it
+u32 treesitter_outline_list(buffer_t *buf, u32 row, outline_symbol_t *out, u32 max) {
+    ts_outline_t *o = buf ? buf->ts_outline : SP_NULLPTR;
+    if (!o || max == 0) return 0;
+
+    // Insertion into the few kept so far, so the table is scanned once
+    const ts_outline_entry_t *pick[64];
+    if (max > 64) max = 64;
+    u32 n = 0;
+    for (u32 i = 0; i < o->count; i++) {
+        const ts_outline_entry_t *e = &o->entries[i];
+        if (e->end.row < row) continue;
+        if (n == max && !ts_point_before(e->start, pick[n - 1]->start)) continue;
+        u32 j = n < max ? n++ : n - 1;
+        while (j > 0 && ts_point_before(e->start, pick[j - 1]->start)) {
+            pick[j] = pick[j - 1];
+            j--;
+        }
+        pick[j] = e;
+    }
+    for (u32 i = 0; i < n; i++) out[i] = ts_outline_symbol(pick[i]);
+    return n;
+}
+
+// First entry whose name sorts at or after name, or past it when upper is
+// set. With prefix set, names that start with name count as equal to it.
+static u32 ts_outline_bound(const ts_outline_t *o, sp_str_t name, bool prefix, bool upper) {
+    u32 lo = 0;
+    u32 hi = o->count;
+    while (lo < hi) {
+        u32 mid = lo + (hi - lo) / 2;
+        const ts_outline_entry_t *e = &o->entries[mid];
+        u32 len = e->name_len < name.len ? e->name_len : name.len;
+        s32 c = memcmp(e->name, name.data, len);
+        if (c == 0 && !(prefix && e->name_len >= name.len)) {
+            c = e->name_len < name.len ? -1 : e->name_len > name.len ? 1 : 0;
+        }
+        if (c < 0 || (upper && c == 0)) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// Definitions named name, or failing that starting with it, found by
+// binary search. out gets the first of them below row, wrapping around
+// to the top, so repeated lookups visit each in turn.
+u32 treesitter_outline_find(buffer_t *buf, sp_str_t name, u32 row, outline_symbol_t *out) {
+    ts_outline_t *o = buf ? buf->ts_outline : SP_NULLPTR;
+    if (!o || name.len == 0) return 0;
+
+    u32 first = ts_outline_bound(o, name, false, false);
+    u32 last = ts_outline_bound(o, name, false, true);
+    if (first == last) last = ts_outline_bound(o, name, true, true);
+    if (first == last) return 0;
+
+    const ts_outline_entry_t *next = SP_NULLPTR;
+    const ts_outline_entry_t *top = SP_NULLPTR;
+    for (u32 i = first; i < last; i++) {
+        const ts_outline_entry_t *e = &o->entries[i];
+        if (!top || ts_point_before(e->at, top->at)) top = e;
+        if (e->at.row > row && (!next || ts_point_before(e->at, next->at))) next = e;
+    }
+    if (out) *out = ts_outline_symbol(next ? next : top);
+    return last - first;
+}
+
+// A parser of its own, so a worker thread can pull the definitions out
+// of a file's text while the editor parses its buffer
+struct treesitter_extractor {
+    TSParser *parser;
+    // Grammar the parser is set up for, and its tables
+    ts_grammar_t *grammar;
+    const ts_symbol_table_t *symbols;
+    // The text being read and where its definitions go
+    sp_str_t text;
+    treesitter_definition_fn fn;
+    void *ctx;
+};
+
+// Whether a built-in grammar covers path, going by its extension
+bool treesitter_has_grammar(sp_str_t path) {
+    return ts_grammar_find(sp_str_lit(""), path) != SP_NULLPTR;
+}
+
+// A parser for extracting definitions on any thread. It switches to the
+// grammar of each file it is given.
+treesitter_extractor_t *treesitter_extractor_new(void) {
+    if (!G_ts.available) return SP_NULLPTR;
+    treesitter_extractor_t *x = sp_alloc(sizeof(treesitter_extractor_t));
+    if (!x) return SP_NULLPTR;
+    x->parser = ts_parser_new();
+    if (!x->parser) {
+        treesitter_extractor_free(x);
+        return SP_NULLPTR;
+    }
+    return x;
+}
+
+void treesitter_extractor_free(treesitter_extractor_t *x) {
+    if (!x) return;
+    if (x->parser) ts_parser_delete(x->parser);
+    sp_free(x);
+}
+
+static const c8 *ts_read_text(void *payload, u32 byte_index, TSPoint position, u32 *bytes_read) {
+    const sp_str_t *text = payload;
+    (void)position;
+    if (byte_index >= text->len) {
+        *bytes_read = 0;
+        return "";
+    }
+    *bytes_read = text->len - byte_index;
+    return text->data + byte_index;
+}
+
+static bool ts_extract_cancelled(TSParseState *state) {
+    return sp_atomic_s32_get(state->payload) != 0;
+}
+
+static bool ts_extract_emit(void *ctx, outline_kind_t kind, TSNode node, TSNode name) {
+    treesitter_extractor_t *x = ctx;
+    (void)node;
+    u32 from = ts_node_start_byte(name);
+    u32 to = ts_node_end_byte(name);
+    TSPoint at = ts_node_start_point(name);
+    if (to <= from || to > x->text.len || at.row != ts_node_end_point(name).row) return true;
+
+    outline_symbol_t sym = {
+        .name = { .data = x->text.data + from, .len = to - from },
+        .kind = kind,
+        .row = at.row,
+        .col = at.column,
+    };
+    x->fn(x->ctx, &sym);
     return true;
 }
+
+// Parse text, the contents of path, with the grammar for path and hand
+// each definition in it to fn; names point into text. Setting cancel
+// stops the parse early.
+bool treesitter_extract_definitions(treesitter_extractor_t *x, sp_str_t path, sp_str_t text,
+                                    sp_atomic_s32 *cancel, treesitter_definition_fn fn, void *ctx) {
+    if (!x || text.len >= UINT32_MAX) return false;
+
+    ts_grammar_t *g = ts_grammar_find(sp_str_lit(""), path);
+    if (!g) return false;
+    if (x->grammar != g) {
+        const ts_symbol_table_t *symbols = ts_grammar_symbols(g);
+        x->grammar = SP_NULLPTR;
+        if (!symbols || !ts_parser_set_language(x->parser, symbols->lang)) return false;
+        x->grammar = g;
+        x->symbols = symbols;
+    }
+
+    TSInput input = {
+        .payload = &text,
+        .read = ts_read_text,
+        .encoding = TSInputEncodingUTF8,
+    };
+    TSParseOptions options = { .payload = cancel, .progress_callback = cancel ? ts_extract_cancelled : SP_NULLPTR };
+    TSTree *tree = ts_parser_parse_with_options(x->parser, SP_NULLPTR, input, options);
+    if (!tree) {
+        ts_parser_reset(x->parser);
+        return false;
+    }
+
+    TSTreeCursor cursor = ts_tree_cursor_new(ts_tree_root_node(tree));
+    x->text = text;
+    x->fn = fn;
+    x->ctx = ctx;
+    bool ok = ts_outline_collect(&cursor, x->symbols, 0, UINT32_MAX, ts_extract_emit, x);
+    ts_tree_cursor_delete(&cursor);
+    ts_tree_delete(tree);
+    return ok;
+}
+
+const c8 *treesitter_outline_kind_name(outline_kind_t kind) {
+    switch (kind) {
+        case OUTLINE_FUNCTION: return "function";
+        case OUTLINE_STRUCT: return "struct";
+        case OUTLINE_UNION: return "union";
+        case OUTLINE_ENUM: return "enum";
+        case OUTLINE_TYPEDEF: return "typedef";
+        case OUTLINE_MACRO: return "macro";
+    }
+    return "definition";
+}
@@ -1,239 +1,522 @@
 /**
- * undo.c - Undo/Redo stack implementation
+ * undo.c - Undo/Redo log
+ *
+ * Edits are recorded as splices: at (row, col), `del` was removed and `ins`
+ * put in its place. Splices are grouped into transactions, one undo step
+ * each, and packed into a byte arena per stack:
+ *
+ *   u32 size | cursor row, col | splice count |
+ *   { row delta (zigzag), col, del len, del bytes, ins len, ins bytes }... |
+ *   u32 size
+ *
+ * Numbers are varints and rows are stored relative to the previous splice,
+ * so a typed run costs a few header bytes plus its text. The size at both
+ * ends lets the log be walked backwards for undo and forwards when the
+ * oldest transactions are evicted to stay under the memory cap.
  */
 
 #include "ted.h"
 
+#include <string.h>
+
+// Splices decoded from one transaction
+typedef struct {
+    u32 row;
+    u32 col;
+    sp_str_t del;
+    sp_str_t ins;
+} undo_splice_t;
+
+// Growable byte buffer
+typedef struct {
+    u8 *data;
+    u32 len;
+    u32 cap;
+} undo_bytes_t;
+
+// Transaction being assembled between undo_begin and undo_end
+static struct {
+    undo_bytes_t body;
+    u32 depth;
+    u32 count;
+    u32 last_row;
+    u32 cursor_row;
+    u32 cursor_col;
+    bool lost;  // a splice failed to record; drop the transaction
+} G_txn;
+
+// Run of typed or deleted characters that is still being extended. Chars
+// erased with backspace are kept reversed in `back`, chars removed at the
+// run start (forward delete) in order in `text`.
+static struct {
+    bool active;
+    bool deleting;
+    u32 row;
+    u32 col;
+    u32 end_row;
+    u32 end_col;
+    undo_bytes_t text;
+    undo_bytes_t back;
+    u32 cursor_row;
+    u32 cursor_col;
+} G_run;
+
+static bool bytes_reserve(undo_bytes_t *b, u32 extra) {
+    if (b->len + extra <= b->cap) return true;
+    if (b->len + extra < b->len) return false;
+
+    u32 new_cap = b->cap == 0 ? 64 : b->cap;
+    while (new_cap < b->len + extra) {
+        new_cap = new_cap > UINT32_MAX / 2 ? b->len + extra : new_cap * 2;
+    }
+    u8 *data = sp_realloc(b->data, new_cap);
+    if (!data) return false;
+    b->data = data;
+    b->cap = new_cap;
+    return true;
+}
+
+static bool bytes_append(undo_bytes_t *b, const void *data, u32 len) {
+    if (!bytes_reserve(b, len)) return false;
+    if (len > 0) memcpy(b->data + b->len, data, len);
+    b->len += len;
+    return true;
+}
+
+static bool bytes_put_varint(undo_bytes_t *b, u32 v) {
+    u8 tmp[5];
+    u32 n = 0;
+    do {
+        tmp[n] = (u8)(v & 0x7f);
+        v >>= 7;
+        if (v) tmp[n] |= 0x80;
+        n++;
+    } while (v);
+    return bytes_append(b, tmp, n);
+}
+
+static u32 get_varint(const u8 **p) {
+    u32 v = 0;
+    u32 shift = 0;
+    u8 byte;
+    do {
+        byte = *(*p)++;
+        v |= (u32)(byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    return v;
+}
+
+static u32 read_u32(const u8 *p) {
+    u32 v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static void bytes_free(undo_bytes_t *b) {
+    if (b->data) sp_free(b->data);
+    *b = (undo_bytes_t){0};
+}
+
 void undo_init(undo_stack_t *stack) {
-    stack->actions = SP_NULLPTR;
+    stack->data = SP_NULLPTR;
+    stack->len = 0;
+    stack->cap = 0;
     stack->count = 0;
-    stack->capacity = 0;
-    stack->current = 0;
 }
 
-static void ensure_capacity(undo_stack_t *stack) {
-    if (stack->count >= stack->capacity) {
-        u32 new_cap = stack->capacity == 0 ? 16 : stack->capacity * 2;
-        action_t *new_actions = sp_alloc(sizeof(action_t) * new_cap);
+void undo_clear(undo_stack_t *stack) {
+    if (stack->data) sp_free(stack->data);
+    undo_init(stack);
+}
 
-        for (u32 i = 0; i < stack->count; i++) {
-            new_actions[i] = stack->actions[i];
-        }
+static bool stack_reserve(undo_stack_t *stack, u32 extra) {
+    undo_bytes_t b = { stack->data, stack->len, stack->cap };
+    if (!bytes_reserve(&b, extra)) return false;
+    stack->data = b.data;
+    stack->cap = b.cap;
+    return true;
+}
 
-        if (stack->actions) {
-            sp_free(stack->actions);
-        }
-        stack->actions = new_actions;
-        stack->capacity = new_cap;
+// Drop the oldest transactions until the log fits the configured cap.
+// Evicting down to 3/4 of it keeps the memmove amortized.
+static void stack_enforce_limit(undo_stack_t *stack) {
+    u32 limit = E.config.undo_limit;
+    if (limit == 0 || stack->len <= limit) return;
+
+    u32 target = limit - limit / 4;
+    u32 drop = 0;
+    u32 dropped = 0;
+    // Always keep the newest transaction, however large.
+    while (stack->count - dropped > 1 && stack->len - drop > target) {
+        drop += read_u32(stack->data + drop);
+        dropped++;
     }
+    if (drop == 0) return;
+
+    memmove(stack->data, stack->data + drop, stack->len - drop);
+    stack->len -= drop;
+    stack->count -= dropped;
+}
+
+// Append an encoded transaction (header and trailer included).
+static bool stack_push_blob(undo_stack_t *stack, const u8 *blob, u32 size) {
+    if (!stack_reserve(stack, size)) return false;
+    memcpy(stack->data + stack->len, blob, size);
+    stack->len += size;
+    stack->count++;
+    return true;
 }
 
-void undo_push(undo_stack_t *stack, action_t *action) {
-    ensure_capacity(stack);
+// An edit that cannot be recorded leaves older steps unable to apply, so
+// both logs go, and the open transaction with them.
+static void history_lost(void) {
+    undo_clear(&E.undo);
+    undo_clear(&E.redo);
+    G_txn.lost = true;
+    G_txn.body.len = 0;
+    G_txn.count = 0;
+    editor_set_message("Undo history cleared: out of memory");
+}
 
-    // If we're not at the end, truncate the stack
-    if (stack->current < stack->count) {
-        // Free actions that will be overwritten
-        for (u32 i = stack->current; i < stack->count; i++) {
-            if (stack->actions[i].type == ACTION_INSERT_LINE ||
-                stack->actions[i].type == ACTION_DELETE_LINE) {
-                if (stack->actions[i].text.data) {
-                    sp_free((void*)stack->actions[i].text.data);
-                }
-            }
-        }
-        stack->count = stack->current;
+// Add one splice to the open transaction.
+static bool txn_add(u32 row, u32 col, sp_str_t del, sp_str_t ins) {
+    if (G_txn.lost) return false;
+    undo_bytes_t *b = &G_txn.body;
+    s32 delta = (s32)(row - G_txn.last_row);
+    u32 zigzag = ((u32)delta << 1) ^ (u32)(delta >> 31);
+    u32 start = b->len;
+
+    bool ok = bytes_put_varint(b, zigzag) &&
+              bytes_put_varint(b, col) &&
+              bytes_put_varint(b, del.len) &&
+              bytes_append(b, del.data, del.len) &&
+              bytes_put_varint(b, ins.len) &&
+              bytes_append(b, ins.data, ins.len);
+    if (!ok) {
+        // Drop the partial record so the body still decodes.
+        b->len = start;
+        history_lost();
+        return false;
     }
 
-    stack->actions[stack->count] = *action;
-    stack->count++;
-    stack->current = stack->count;
+    G_txn.last_row = row;
+    G_txn.count++;
+    return true;
 }
 
-action_t* undo_pop(undo_stack_t *stack) {
-    if (stack->current == 0) return SP_NULLPTR;
-    stack->current--;
-    return &stack->actions[stack->current];
+static void txn_open(u32 cursor_row, u32 cursor_col) {
+    G_txn.body.len = 0;
+    G_txn.count = 0;
+    G_txn.last_row = cursor_row;
+    G_txn.cursor_row = cursor_row;
+    G_txn.cursor_col = cursor_col;
+    G_txn.lost = false;
 }
 
-void undo_clear(undo_stack_t *stack) {
-    // Free text data for line operations
-    for (u32 i = 0; i < stack->count; i++) {
-        if (stack->actions[i].type == ACTION_INSERT_LINE ||
-            stack->actions[i].type == ACTION_DELETE_LINE) {
-            if (stack->actions[i].text.data) {
-                sp_free((void*)stack->actions[i].text.data);
-            }
-        }
+// Seal the open transaction onto the undo log. A new edit invalidates
+// everything that could have been redone.
+static void txn_commit(void) {
+    if (G_txn.count == 0) return;
+
+    undo_bytes_t head = {0};
+    u32 size = 0;
+    bool ok = bytes_append(&head, &size, sizeof(size)) &&
+              bytes_put_varint(&head, G_txn.cursor_row) &&
+              bytes_put_varint(&head, G_txn.cursor_col) &&
+              bytes_put_varint(&head, G_txn.count);
+    if (ok) {
+        size = head.len + G_txn.body.len + (u32)sizeof(size);
+        memcpy(head.data, &size, sizeof(size));
+        ok = bytes_append(&head, G_txn.body.data, G_txn.body.len) &&
+             bytes_append(&head, &size, sizeof(size));
     }
-    if (stack->actions) {
-        sp_free(stack->actions);
+    if (ok) ok = stack_push_blob(&E.undo, head.data, head.len);
+    if (ok) {
+        stack_enforce_limit(&E.undo);
+        undo_clear(&E.redo);
+    } else {
+        history_lost();
     }
-    stack->actions = SP_NULLPTR;
-    stack->count = 0;
-    stack->capacity = 0;
-    stack->current = 0;
-}
-
-void undo_record_insert(u32 row, u32 col, c8 c) {
-    action_t action = {
-        .type = ACTION_INSERT,
-        .row = row,
-        .col = col,
-        .ch = c,
-        .text = sp_str_lit(""),
-        .old_text = sp_str_lit("")
-    };
-    undo_push(&E.undo, &action);
-    undo_clear(&E.redo);
+    bytes_free(&head);
+    G_txn.count = 0;
 }
 
-void undo_record_delete(u32 row, u32 col, c8 c) {
-    action_t action = {
-        .type = ACTION_DELETE,
-        .row = row,
-        .col = col,
-        .ch = c,
-        .text = sp_str_lit(""),
-        .old_text = sp_str_lit("")
-    };
-    undo_push(&E.undo, &action);
-    undo_clear(&E.redo);
+// Close the pending typing/deleting run. Outside a transaction it becomes
+// its own undo step.
+static void run_flush(void) {
+    if (!G_run.active) return;
+    G_run.active = false;
+
+    undo_bytes_t del = {0};
+    sp_str_t none = sp_str_lit("");
+    sp_str_t text = { .data = (const c8 *)G_run.text.data, .len = G_run.text.len };
+    if (G_run.deleting) {
+        // Deleted text is the reversed backspace chars, then the rest.
+        if (!bytes_reserve(&del, G_run.back.len + G_run.text.len)) {
+            history_lost();
+            G_run.text.len = 0;
+            G_run.back.len = 0;
+            return;
+        }
+        for (u32 i = G_run.back.len; i > 0; i--) {
+            del.data[del.len++] = G_run.back.data[i - 1];
+        }
+        memcpy(del.data + del.len, G_run.text.data, G_run.text.len);
+        del.len += G_run.text.len;
+        text = (sp_str_t){ .data = (const c8 *)del.data, .len = del.len };
+    }
+
+    bool standalone = G_txn.depth == 0;
+    if (standalone) txn_open(G_run.cursor_row, G_run.cursor_col);
+    if (G_run.deleting) txn_add(G_run.row, G_run.col, text, none);
+    else txn_add(G_run.row, G_run.col, none, text);
+    if (standalone) txn_commit();
+
+    bytes_free(&del);
+    G_run.text.len = 0;
+    G_run.back.len = 0;
 }
 
-void undo_record_insert_line(u32 row, sp_str_t text) {
-    action_t action = {
-        .type = ACTION_INSERT_LINE,
-        .row = row,
-        .col = 0,
-        .ch = '\0',
-        .text = sp_str_copy(text),
-        .old_text = sp_str_lit("")
-    };
-    undo_push(&E.undo, &action);
-    undo_clear(&E.redo);
+// End the current run so the next keystroke starts a new undo step.
+void undo_break(void) {
+    run_flush();
 }
 
-void undo_record_delete_line(u32 row, sp_str_t text) {
-    action_t action = {
-        .type = ACTION_DELETE_LINE,
-        .row = row,
-        .col = 0,
-        .ch = '\0',
-        .text = sp_str_copy(text),
-        .old_text = sp_str_lit("")
-    };
-    undo_push(&E.undo, &action);
-    undo_clear(&E.redo);
+// Group every splice recorded until the matching undo_end into one step.
+void undo_begin(void) {
+    run_flush();
+    if (G_txn.depth++ == 0) txn_open(E.cursor.row, E.cursor.col);
 }
 
-void undo_perform(void) {
-    action_t *action = undo_pop(&E.undo);
-    if (!action) {
-        editor_set_message("Nothing to undo");
-        return;
+void undo_end(void) {
+    if (G_txn.depth == 0) return;
+    run_flush();
+    if (--G_txn.depth == 0) txn_commit();
+}
+
+// Record that `del` at (row, col) is about to be replaced by `ins`.
+void undo_record_splice(u32 row, u32 col, sp_str_t del, sp_str_t ins) {
+    if (del.len == 0 && ins.len == 0) return;
+    undo_begin();
+    txn_add(row, col, del, ins);
+    undo_end();
+}
+
+// Record that the text between (row, col) and (end_row, end_col) is about
+// to be removed with buffer_delete_text.
+void undo_record_delete_text(u32 row, u32 col, u32 end_row, u32 end_col) {
+    u64 start = buffer_point_to_offset(&E.buffer, row, col);
+    u64 end = buffer_point_to_offset(&E.buffer, end_row, end_col);
+    sp_str_t del = buffer_get_range(&E.buffer, start, end);
+    undo_record_splice(row, col, del, sp_str_lit(""));
+    if (del.len > 0) sp_free((void *)del.data);
+}
+
+// Add c to one of the run's texts. A char that cannot be kept ends the
+// run along with the history it would have joined.
+static bool run_append(undo_bytes_t *b, c8 c) {
+    if (bytes_append(b, &c, 1)) return true;
+    G_run.active = false;
+    G_run.text.len = 0;
+    G_run.back.len = 0;
+    history_lost();
+    return false;
+}
+
+static void run_start(bool deleting, u32 row, u32 col) {
+    run_flush();
+    G_run.active = true;
+    G_run.deleting = deleting;
+    G_run.row = row;
+    G_run.col = col;
+    G_run.end_row = row;
+    G_run.end_col = col;
+    G_run.cursor_row = E.cursor.row;
+    G_run.cursor_col = E.cursor.col;
+}
+
+// Record a char about to be inserted at (row, col). Chars typed one after
+// another extend the same run, newlines included. False when the char
+// could not be kept and the history was cleared instead.
+bool undo_record_insert(u32 row, u32 col, c8 c) {
+    if (!G_run.active || G_run.deleting || row != G_run.end_row || col != G_run.end_col) {
+        run_start(false, row, col);
     }
+    if (!run_append(&G_run.text, c)) return false;
 
-    // Create redo action
-    action_t redo_action = *action;
+    if (c == '\n') {
+        G_run.end_row++;
+        G_run.end_col = 0;
+    } else {
+        G_run.end_col++;
+    }
+    return true;
+}
 
-    switch (action->type) {
-        case ACTION_INSERT: {
-            // Undo insert = delete the char
-            buffer_delete_char_at(&E.buffer, action->row, action->col);
-            E.cursor.row = action->row;
-            E.cursor.col = action->col;
-            redo_action.type = ACTION_DELETE;
-            break;
-        }
-        case ACTION_DELETE: {
-            // Undo delete = insert the char back
-            c8 c = action->ch;
-            buffer_insert_char_at(&E.buffer, action->row, action->col, c);
-            E.cursor.row = action->row;
-            E.cursor.col = action->col + 1;
-            redo_action.type = ACTION_INSERT;
-            break;
-        }
-        case ACTION_INSERT_LINE: {
-            // Undo insert line = delete the line
-            buffer_delete_line(&E.buffer, action->row);
-            E.cursor.row = action->row > 0 ? action->row - 1 : 0;
-            E.cursor.col = 0;
-            redo_action.type = ACTION_DELETE_LINE;
-            break;
+// Record a char about to be deleted at (row, col); a '\n' stands for the
+// break at the end of the row. Backspacing over the char before the run
+// or deleting again at its start extends the run. False as for
+// undo_record_insert.
+bool undo_record_delete(u32 row, u32 col, c8 c) {
+    if (G_run.active && G_run.deleting) {
+        bool before = c == '\n' ? (row + 1 == G_run.row && G_run.col == 0)
+                                : (row == G_run.row && col + 1 == G_run.col);
+        if (before) {
+            if (!run_append(&G_run.back, c)) return false;
+            G_run.row = row;
+            G_run.col = col;
+            return true;
         }
-        case ACTION_DELETE_LINE: {
-            // Undo delete line = insert the line back
-            buffer_insert_line(&E.buffer, action->row, action->text);
-            E.cursor.row = action->row;
-            E.cursor.col = 0;
-            redo_action.type = ACTION_INSERT_LINE;
-            break;
+        if (row == G_run.row && col == G_run.col) return run_append(&G_run.text, c);
+    }
+
+    run_start(true, row, col);
+    return run_append(&G_run.text, c);
+}
+
+// Position just past `text` inserted at (row, col).
+static void splice_end(u32 row, u32 col, sp_str_t text, u32 *end_row, u32 *end_col) {
+    u32 last = 0;
+    bool multi = false;
+    for (u32 i = 0; i < text.len; i++) {
+        if (text.data[i] == '\n') {
+            row++;
+            last = i + 1;
+            multi = true;
         }
     }
+    *end_row = row;
+    *end_col = multi ? text.len - last : col + text.len;
+}
+
+// Replace `from` at (row, col) with `to`: at most one delete and one insert.
+static void splice_apply(u32 row, u32 col, sp_str_t from, sp_str_t to) {
+    if (from.len > 0) {
+        u32 end_row = row;
+        u32 end_col = col;
+        splice_end(row, col, from, &end_row, &end_col);
+        buffer_delete_text(&E.buffer, row, col, end_row, end_col);
+    }
+    if (to.len > 0) {
+        buffer_insert_text(&E.buffer, row, col, to, SP_NULLPTR, SP_NULLPTR);
+    }
+}
+
+// Decode the newest transaction of `stack`. The returned array and the
+// texts it points at stay valid until the stack is modified.
+static undo_splice_t *stack_peek(undo_stack_t *stack, u32 *count, u32 *size,
+                                 u32 *cursor_row, u32 *cursor_col) {
+    if (stack->count == 0) return SP_NULLPTR;
 
-    // Push to redo stack
-    ensure_capacity(&E.redo);
-    E.redo.actions[E.redo.count] = redo_action;
-    E.redo.count++;
-    E.redo.current = E.redo.count;
+    u32 blob_size = read_u32(stack->data + stack->len - sizeof(u32));
+    const u8 *p = stack->data + stack->len - blob_size + sizeof(u32);
+    *cursor_row = get_varint(&p);
+    *cursor_col = get_varint(&p);
+    u32 n = get_varint(&p);
 
+    undo_splice_t *splices = sp_alloc(sizeof(undo_splice_t) * (n > 0 ? n : 1));
+    if (!splices) return SP_NULLPTR;
+
+    u32 row = *cursor_row;
+    for (u32 i = 0; i < n; i++) {
+        u32 zigzag = get_varint(&p);
+        row += (u32)((s32)(zigzag >> 1) ^ -(s32)(zigzag & 1));
+        splices[i].row = row;
+        splices[i].col = get_varint(&p);
+        splices[i].del.len = get_varint(&p);
+        splices[i].del.data = (const c8 *)p;
+        p += splices[i].del.len;
+        splices[i].ins.len = get_varint(&p);
+        splices[i].ins.data = (const c8 *)p;
+        p += splices[i].ins.len;
+    }
+
+    *count = n;
+    *size = blob_size;
+    return splices;
+}
+
+// Move the newest transaction of `from` onto `to`. It stays on `from`
+// when `to` cannot take it.
+static bool stack_transfer(undo_stack_t *from, undo_stack_t *to, u32 size) {
+    if (!stack_push_blob(to, from->data + from->len - size, size)) return false;
+    stack_enforce_limit(to);
+    from->len -= size;
+    from->count--;
+    return true;
+}
+
+static void undo_sync_cursor(u32 row, u32 col) {
+    if (E.buffer.line_count == 0) row = 0;
+    else if (row >= E.buffer.line_count) row = E.buffer.line_count - 1;
+    E.cursor.row = row;
+    E.cursor.col = col;
+    if (row < E.buffer.line_count && col > buffer_get_line(&E.buffer, row).len) {
+        E.cursor.col = buffer_get_line(&E.buffer, row).len;
+    }
     E.cursor.render_col = buffer_row_to_render(&E.buffer, E.cursor.row, E.cursor.col);
+    E.has_selection = false;
+}
+
+void undo_perform(void) {
+    run_flush();
+
+    u32 count = 0, size = 0, cursor_row = 0, cursor_col = 0;
+    undo_splice_t *splices = stack_peek(&E.undo, &count, &size, &cursor_row, &cursor_col);
+    if (!splices) {
+        editor_set_message("Nothing to undo");
+        return;
+    }
+    // Room on the redo log first: a step applied but not moved would be
+    // undone twice
+    if (!stack_reserve(&E.redo, size)) {
+        sp_free(splices);
+        editor_set_message("Undo failed: out of memory");
+        return;
+    }
+
+    for (u32 i = count; i > 0; i--) {
+        undo_splice_t *s = &splices[i - 1];
+        splice_apply(s->row, s->col, s->ins, s->del);
+    }
+    sp_free(splices);
+
+    stack_transfer(&E.undo, &E.redo, size);
+    undo_sync_cursor(cursor_row, cursor_col);
     editor_set_message("Undo");
 }
 
 void redo_perform(void) {
-    action_t *action = undo_pop(&E.redo);
-    if (!action) {
+    run_flush();
+
+    u32 count = 0, size = 0, cursor_row = 0, cursor_col = 0;
+    undo_splice_t *splices = stack_peek(&E.redo, &count, &size, &cursor_row, &cursor_col);
+    if (!splices) {
         editor_set_message("Nothing to redo");
         return;
     }
-
-    // Create undo action
-    action_t undo_action = *action;
-
-    switch (action->type) {
-        case ACTION_INSERT: {
-            // Redo insert = insert the char
-            buffer_insert_char_at(&E.buffer, action->row, action->col, action->ch);
-            E.cursor.row = action->row;
-            E.cursor.col = action->col + 1;
-            undo_action.type = ACTION_DELETE;
-            break;
-        }
-        case ACTION_DELETE: {
-            // Redo delete = delete the char
-            buffer_delete_char_at(&E.buffer, action->row, action->col);
-            E.cursor.row = action->row;
-            E.cursor.col = action->col;
-            undo_action.type = ACTION_INSERT;
-            break;
-        }
-        case ACTION_INSERT_LINE: {
-            // Redo insert line = insert the line
-            buffer_insert_line(&E.buffer, action->row, action->text);
-            E.cursor.row = action->row;
-            E.cursor.col = 0;
-            undo_action.type = ACTION_DELETE_LINE;
-            break;
-        }
-        case ACTION_DELETE_LINE: {
-            // Redo delete line = delete the line
-            buffer_delete_line(&E.buffer, action->row);
-            E.cursor.row = action->row > 0 ? action->row - 1 : 0;
-            E.cursor.col = 0;
-            undo_action.type = ACTION_INSERT_LINE;
-            break;
-        }
+    if (!stack_reserve(&E.undo, size)) {
+        sp_free(splices);
+        editor_set_message("Redo failed: out of memory");
+        return;
     }
 
-    // Push to undo stack
-    ensure_capacity(&E.undo);
-    E.undo.actions[E.undo.count] = undo_action;
-    E.undo.count++;
-    E.undo.current = E.undo.count;
+    u32 row = cursor_row;
+    u32 col = cursor_col;
+    for (u32 i = 0; i < count; i++) {
+        undo_splice_t *s = &splices[i];
+        splice_apply(s->row, s->col, s->del, s->ins);
+        splice_end(s->row, s->col, s->ins, &row, &col);
+    }
+    sp_free(splices);
 
-    E.cursor.render_col = buffer_row_to_render(&E.buffer, E.cursor.row, E.cursor.col);
+    stack_transfer(&E.redo, &E.undo, size);
+    undo_sync_cursor(row, col);
     editor_set_message("Redo");
 }
+
+// Bytes held by both logs, for :undo status.
+u32 undo_memory_used(void) {
+    return E.undo.len + E.redo.len;
+}